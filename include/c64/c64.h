@@ -29,6 +29,18 @@
 #include <c64/sid.h>
 #include <c64/io.h>
 #include <c64/monitor.h>
+#include <c64/jit.h>
+#include <c64/iec.h>
+#include <c64/snapshot.h>
+#include <c64/profiler.h>
+#include <c64/framestats.h>
+#include <c64/rewind.h>
+#include <c64/inputlog.h>
+#include <c64/reu.h>
+#include <c64/cartridge.h>
+#include <c64/debugger.h>
+#include <c64/trace.h>
+#include <c64/natives.h>
 
 /**
  * @brief Commodore 64
@@ -40,6 +52,19 @@ class C64
 {
   private:
     bool isRunning = true;
+    unsigned int batch_cycles();
+    /**
+     * every chip and buffer of this machine, released in one go
+     * when the machine is destroyed on reset
+     */
+    myos::MemoryArena arena_;
+    /* save states */
+    uint8_t *snapshot_base_;
+    uint32_t snapshot_chain_;
+    uint16_t snapshot_seq_;
+    void snapshot(Snapshot *s, bool delta);
+    void chips_snapshot(Snapshot *s);
+    void rewind_capture();
 
   public: 
     C64();
@@ -52,15 +77,39 @@ class C64
     Sid *sid_;
     Vic *vic_;
     Monitor *mon_;
+    Jit *jit_;
+    Iec *iec_;
+    Profiler *profiler_;
+    FrameStats *stats_;
+    Rewind *rewind_;
+    InputLog *input_;
+    Reu *reu_;
+    Cartridge *cart_;
+    Debugger *debugger_;
+    Trace *trace_;
+    Natives *natives_;
     bool reset = false;
+    /* set by the hotkey, serviced between two batches */
+    bool rewind_request = false;
+    /* constants */
+    static const size_t kArenaBlockSize = 1024 * 1024;
+    bool emulate();
     void start();
     void stop();
+    inline bool stopped(){return !isRunning;};
    
     Cpu * cpu(){return cpu_;};
     Memory * memory(){return mem_;};
     IO * io(){return io_;};
     
     struct cpuState* getCpuState();
+    int save_snapshot(Fat32 *fs, uint8_t *filename, bool delta);
+    int load_snapshot(Fat32 *fs, uint8_t *filename);
+    unsigned int rewind(unsigned int steps);
+    int record_input(Fat32 *fs, uint8_t *filename);
+    int save_input(Fat32 *fs, uint8_t *filename);
+    int replay_input(Fat32 *fs, uint8_t *filename);
+    void cartridge(CartridgeImage *image);
 
 };
 
@@ -0,0 +1,133 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef EMUDORE_CARTRIDGE_H
+#define EMUDORE_CARTRIDGE_H
+
+#include <lib/stdint.h>
+#include <filesystem/fat.h>
+#include <c64/cpu.h>
+#include <c64/memory.h>
+
+/**
+ * @brief a CRT file split into 8KB ROML and ROMH banks
+ *
+ * CHIP packets loaded at $8000 go to ROML (a 16KB one continues in
+ * ROMH), those at $A000 or $E000 to ROMH. Chips smaller than 8KB
+ * are mirrored over the bank. The image lives on the heap so it
+ * can be carried over to the machine built on reset.
+ */
+class CartridgeImage
+{
+  public:
+    /* hardware types, CRT header $16 */
+    enum kType
+    {
+      kNormal = 0,
+      kSimonsBasic = 4,
+      kOcean = 5,
+      kEpyxFastload = 10,
+      kSystem3 = 15,
+      kDinamic = 17,
+      kMagicDesk = 19,
+    };
+    static const unsigned int kMaxBanks = 64;
+    static const uint32_t kBankSize = 0x2000;
+    static const uint32_t kHeaderSize = 0x40;
+    static const uint32_t kChipHeaderSize = 0x10;
+    static const int kBadFormat = 0x10;
+    static const int kUnsupported = 0x12;
+  private:
+    uint16_t type_;
+    bool exrom_;
+    bool game_;
+    char name_[33];
+    unsigned int banks_;
+    uint8_t *roml_[kMaxBanks];
+    uint8_t *romh_[kMaxBanks];
+    CartridgeImage();
+    bool parse(const uint8_t *buf, uint32_t size);
+  public:
+    ~CartridgeImage();
+    static CartridgeImage *load(myos::filesystem::Fat32 *fs, uint8_t *filename, int *status);
+    static bool supported(uint16_t type);
+    inline uint16_t type(){return type_;};
+    inline const char *name(){return name_;};
+    inline unsigned int banks(){return banks_;};
+    /* cartridge port lines, true when pulled low */
+    inline bool exrom(){return exrom_;};
+    inline bool game(){return game_;};
+    inline uint8_t *roml(unsigned int bank){return roml_[bank];};
+    inline uint8_t *romh(unsigned int bank){return romh_[bank];};
+};
+
+/**
+ * @brief the expansion port with the bank switching logic
+ *
+ * - Memory area : $8000-$9FFF (ROML), $A000-$BFFF or $E000-$FFFF
+ *                 (ROMH), $DE00-$DEFF (IO1), $DF00-$DFFF (IO2)
+ * - Tasks       : EXROM/GAME memory configuration, cartridge banks
+ *
+ * Memory maps the current ROML and ROMH banks straight into its
+ * page tables, a bank switch rebuilds the tables with the new
+ * pointers. A bank without a chip, or ROML of an Epyx FastLoad
+ * whose accesses must be seen, gets null entries and is served by
+ * read_roml()/read_romh().
+ */
+class Cartridge
+{
+  public:
+    enum kMode
+    {
+      kOff,
+      k8K,       /* EXROM low, ROML at $8000 */
+      k16K,      /* EXROM and GAME low, ROMH at $A000 */
+      kUltimax,  /* GAME low, ROMH at $E000 */
+    };
+    /* Epyx FastLoad capacitor, the ROM goes away without accesses */
+    static const unsigned int kEpyxCycles = 512;
+  private:
+    Cpu *cpu_;
+    Memory *mem_;
+    CartridgeImage *image_;
+    kMode mode_;
+    unsigned int bank_;
+    unsigned int charged_at_;
+    void switch_mode(kMode m);
+    void switch_bank(unsigned int b);
+    bool epyx_charged();
+  public:
+    Cartridge();
+    ~Cartridge();
+    void cpu(Cpu *v){cpu_ = v;};
+    void memory(Memory *v){mem_ = v;};
+    void insert(CartridgeImage *image);
+    CartridgeImage *remove();
+    inline bool inserted(){return image_ != 0;};
+    inline kMode mode(){return mode_;};
+    uint8_t *roml();
+    uint8_t *romh();
+    uint8_t read_roml(uint16_t addr);
+    uint8_t read_romh(uint16_t addr);
+    uint8_t read_io1(uint16_t addr);
+    void write_io1(uint16_t addr, uint8_t v);
+    uint8_t read_io2(uint16_t addr);
+    void write_io2(uint16_t addr, uint8_t v);
+};
+
+#endif
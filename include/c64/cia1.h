@@ -20,6 +20,7 @@
 #include <lib/stdint.h>
 #include <c64/io.h>
 #include <c64/cpu.h>
+#include <c64/tod.h>
 
 /**
  * @brief MOS 6526 Complex Interface Adapter #1
@@ -32,10 +33,13 @@ class Cia1
   private:
     Cpu *cpu_;
     IO *io_;
-    int16_t timer_a_latch_;
-    int16_t timer_b_latch_;
-    int16_t timer_a_counter_;
-    int16_t timer_b_counter_;
+    uint16_t timer_a_latch_;
+    uint16_t timer_b_latch_;
+    /* counter values while stopped, cycle of the next underflow while counting */
+    uint16_t timer_a_counter_;
+    uint16_t timer_b_counter_;
+    unsigned int timer_a_underflow_;
+    unsigned int timer_b_underflow_;
     bool timer_a_enabled_;
     bool timer_b_enabled_;
     bool timer_a_irq_enabled_;
@@ -46,7 +50,23 @@ class Cia1
     uint8_t timer_b_run_mode_;
     uint8_t timer_a_input_mode_;
     uint8_t timer_b_input_mode_;
-    unsigned int prev_cpu_cycles_;
+    uint8_t cra_, crb_;
+    /* time of day clock and its alarm interrupt */
+    Tod tod_;
+    bool tod_irq_enabled_;
+    bool tod_irq_triggered_;
+    /* earliest underflow, emulate() returns right away before it */
+    unsigned int next_event_;
+    bool event_pending_;
+    inline bool timer_b_cascaded(){return timer_b_enabled_ && timer_b_input_mode_ >= kModeTimerA;};
+    bool interrupt_pending();
+    void timer_b_count();
+    inline bool timer_a_counting(){return timer_a_enabled_ && timer_a_input_mode_ == kModeProcessor;};
+    inline bool timer_b_counting(){return timer_b_enabled_ && timer_b_input_mode_ == kModeProcessor;};
+    uint16_t timer_a_value();
+    uint16_t timer_b_value();
+    void schedule();
+    void update_irq_line();
     uint8_t pra_, prb_;
     uint8_t ddra_, ddrb_;
   public:
@@ -58,6 +78,8 @@ class Cia1
     void reset_timer_a();
     void reset_timer_b();
     bool emulate();
+    unsigned int cycles_to_next_event();
+    void snapshot(Snapshot *s);
     /* constants */
     enum kInputMode
     {
@@ -71,6 +93,7 @@ class Cia1
       kModeRestart,
       kModeOneTime
     };
+    static const int kNoEvent = 0xffff;
 };
 
 #endif
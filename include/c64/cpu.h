@@ -22,6 +22,17 @@
 #include <lib/stdint.h>
 #include <c64/memory.h>
 
+/* GCC computed-goto interpreter, comment out to use the switch decoder */
+#define CPU_THREADED_DISPATCH
+
+class Jit;
+class IO;
+class Profiler;
+class Debugger;
+class Trace;
+class Natives;
+class Snapshot;
+
 struct cpuState {
 
   uint16_t pc;
@@ -37,15 +48,62 @@ struct cpuState {
  */
 class Cpu
 {
+  public:
+    typedef bool (*JitHandler)(Cpu *cpu);
   private:
     /* registers */
     uint16_t pc_;
     uint8_t sp_, a_, x_, y_;
-    /* flags (p/status reg) */
-    bool cf_,zf_,idf_,dmf_,bcf_,of_,nf_;
+    /**
+     * flags (p/status reg)
+     *
+     * C, I, D, B and V are kept packed in p_, N and Z are evaluated
+     * lazily from nz_, the last result: Z is set when its low byte
+     * is zero, N when bit 7 or bit 8 is set. Bit 8 lets PLP/BIT set
+     * N and Z at the same time.
+     */
+    uint8_t p_;
+    uint16_t nz_;
+    inline void pflag(uint8_t f, bool v) {p_ = (p_ & ~f) | (-(uint8_t)v & f);};
+    inline void nz(bool n, bool z) {nz_ = (n ? 0x100 : 0) | (z ? 0 : 1);};
     /* memory and clock */
     Memory *mem_;
     unsigned int cycles_;
+    /* batch scheduling */
+    unsigned int deadline_;
+    /**
+     * accelerator: speed_ cpu cycles to one cycle of the chips,
+     * which stay at 1MHz. While a fast batch runs cycles_ counts
+     * cpu cycles from cpu_base_, the chip clock bus_base_ then.
+     */
+    unsigned int speed_;
+    unsigned int batch_speed_;
+    unsigned int speed_rest_;
+    unsigned int bus_base_;
+    unsigned int cpu_base_;
+    unsigned int accelerator_;
+    bool run_fast(unsigned int deadline);
+    uint8_t irq_lines_;
+    /* block recompiler */
+    Jit *jit_;
+    bool jit_enabled_;
+    bool run_jit();
+    /* profiler, see Profiler */
+    Profiler *profiler_;
+    bool run_profiled();
+    /* breakpoints and watchpoints, see Debugger */
+    Debugger *debugger_;
+    bool run_debug();
+    /* instruction trace, see Trace */
+    Trace *trace_;
+    bool run_traced();
+    inline void trace_record();
+    /* kernal traps */
+    IO *io_;
+    /* host ROM routines, see Natives */
+    Natives *natives_;
+    template<int op> inline void exec();
+    template<int op> static bool jit_handler(Cpu *cpu);
     /* helpers */
     inline uint8_t load_byte(uint16_t addr);
     inline void push(uint8_t);
@@ -57,9 +115,14 @@ class Cpu
     inline uint16_t addr_zeroy();
     inline uint16_t addr_abs();
     inline uint16_t addr_absy();
+    inline uint16_t addr_absy_w();
     inline uint16_t addr_absx();
+    inline uint16_t addr_absx_w();
     inline uint16_t addr_indx();
     inline uint16_t addr_indy();
+    inline uint16_t addr_indy_w();
+    inline void page_penalty(uint16_t base, uint16_t addr);
+    inline void branch(bool cond);
     inline uint8_t rol(uint8_t v);
     inline uint8_t ror(uint8_t v);
     inline uint8_t lsr(uint8_t v);
@@ -68,12 +131,12 @@ class Cpu
     inline uint8_t flags();
     inline void flags(uint8_t v);
     /* instructions : data handling and memory operations */
-    inline void sta(uint16_t addr, uint8_t cycles);
-    inline void stx(uint16_t addr, uint8_t cycles);
-    inline void sty(uint16_t addr, uint8_t cycles);
-    inline void lda(uint8_t v, uint8_t cycles);
-    inline void ldx(uint8_t v, uint8_t cycles);
-    inline void ldy(uint8_t v, uint8_t cycles);
+    inline void sta(uint16_t addr);
+    inline void stx(uint16_t addr);
+    inline void sty(uint16_t addr);
+    inline void lda(uint8_t v);
+    inline void ldx(uint8_t v);
+    inline void ldy(uint8_t v);
     inline void txs();
     inline void tsx();
     inline void tax();
@@ -83,27 +146,27 @@ class Cpu
     inline void pha();
     inline void pla();
     /* instructions: logic operations */
-    inline void ora(uint8_t v, uint8_t cycles);
-    inline void _and(uint8_t v, uint8_t cycles);
-    inline void bit(uint16_t addr, uint8_t cycles);
+    inline void ora(uint8_t v);
+    inline void _and(uint8_t v);
+    inline void bit(uint16_t addr);
     inline void rol_a();
-    inline void rol_mem(uint16_t addr, uint8_t cycles);
+    inline void rol_mem(uint16_t addr);
     inline void ror_a();
-    inline void ror_mem(uint16_t addr, uint8_t cycles);
+    inline void ror_mem(uint16_t addr);
     inline void asl_a();
-    inline void asl_mem(uint16_t addr, uint8_t cycles);
+    inline void asl_mem(uint16_t addr);
     inline void lsr_a();
-    inline void lsr_mem(uint16_t addr, uint8_t cycles);
-    inline void eor(uint8_t v, uint8_t cycles);
+    inline void lsr_mem(uint16_t addr);
+    inline void eor(uint8_t v);
     /* instructions: arithmetic operations */
-    inline void inc(uint16_t addr, uint8_t cycles);
-    inline void dec(uint16_t addr, uint8_t cycles);
+    inline void inc(uint16_t addr);
+    inline void dec(uint16_t addr);
     inline void inx();
     inline void iny();
     inline void dex();
     inline void dey();
-    inline void adc(uint8_t v, uint8_t cycles);
-    inline void sbc(uint8_t v, uint8_t cycles);
+    inline void adc(uint8_t v);
+    inline void sbc(uint8_t v);
     /* instructions: flag access */
     inline void sei();
     inline void cli();
@@ -115,9 +178,9 @@ class Cpu
     inline void php();
     inline void plp();
     /* instructions: control flow */
-    inline void cmp(uint8_t v, uint8_t cycles);
-    inline void cpx(uint8_t v, uint8_t cycles);
-    inline void cpy(uint8_t v, uint8_t cycles);
+    inline void cmp(uint8_t v);
+    inline void cpx(uint8_t v);
+    inline void cpy(uint8_t v);
     inline void rts();
     inline void jsr();
     inline void bne();
@@ -134,18 +197,39 @@ class Cpu
     inline void nop();
     inline void brk();
     inline void rti();
+    inline void trap();
     
     void displayRegs();
     uint8_t bytetoscreencode(uint8_t b);
+    inline bool execute();
 
   public:
+    Cpu();
     void getCpuState(struct cpuState* currentCpuState);
     /* cpu state */
     void reset();
     bool emulate(bool step);
+    bool run(unsigned int deadline);
+    inline void end_batch(){deadline_ = cycles_;};
+    void snapshot(Snapshot *s);
     /* memory */
     void memory(Memory *v){mem_ = v;};
     Memory* memory(){return mem_;};
+    /* block recompiler */
+    void jit(Jit *v){jit_ = v;};
+    void jit_enabled(bool v);
+    bool jit_enabled(){return jit_enabled_;};
+    static void jit_handlers(JitHandler *table);
+    void code_written(uint16_t addr);
+    void profiler(Profiler *v){profiler_ = v;};
+    Profiler *profiler(){return profiler_;};
+    void debugger(Debugger *v){debugger_ = v;};
+    void trace(Trace *v){trace_ = v;};
+    inline void memory_layout_changed(){if(jit_enabled_) end_batch();};
+    /* kernal traps */
+    void io(IO *v){io_ = v;};
+    void natives(Natives *v){natives_ = v;};
+    static const uint8_t kOpTrap = 0x02;
     /* register access */
     inline uint16_t pc() {return pc_;};
     inline void pc(uint16_t v) {pc_=v;};
@@ -158,31 +242,61 @@ class Cpu
     inline uint8_t y() {return y_;};
     inline void y(uint8_t v) {y_=v;};
     /* flags */
-    inline bool cf() {return cf_;};
-    inline void cf(bool v) { cf_=v;};
-    inline bool zf() {return zf_;};
-    inline void zf(bool v) {zf_=v;};
-    inline bool idf() {return idf_;};
-    inline void idf(bool v) { idf_=v;};
-    inline bool dmf() {return dmf_;};
-    inline void dmf(bool v) { dmf_=v;};
-    inline bool bcf() {return bcf_;};
-    inline void bcf(bool v) { bcf_=v;};
-    inline bool of() {return of_;};
-    inline void of(bool v) { of_=v;};
-    inline bool nf() {return nf_;};
-    inline void nf(bool v) {nf_=v;};
+    inline bool cf() {return (p_ & kFlagC) != 0;};
+    inline void cf(bool v) {pflag(kFlagC,v);};
+    inline bool zf() {return (nz_ & 0xff) == 0;};
+    inline void zf(bool v) {nz(nf(),v);};
+    inline bool idf() {return (p_ & kFlagI) != 0;};
+    inline void idf(bool v) {pflag(kFlagI,v);};
+    inline bool dmf() {return (p_ & kFlagD) != 0;};
+    inline void dmf(bool v) {pflag(kFlagD,v);};
+    inline bool bcf() {return (p_ & kFlagB) != 0;};
+    inline void bcf(bool v) {pflag(kFlagB,v);};
+    inline bool of() {return (p_ & kFlagV) != 0;};
+    inline void of(bool v) {pflag(kFlagV,v);};
+    inline bool nf() {return (nz_ & 0x180) != 0;};
+    inline void nf(bool v) {nz(v,zf());};
+    /* p register bits */
+    static const uint8_t kFlagC = 1 << 0;
+    static const uint8_t kFlagZ = 1 << 1;
+    static const uint8_t kFlagI = 1 << 2;
+    static const uint8_t kFlagD = 1 << 3;
+    static const uint8_t kFlagB = 1 << 4;
+    static const uint8_t kFlagU = 1 << 5;
+    static const uint8_t kFlagV = 1 << 6;
+    static const uint8_t kFlagN = 1 << 7;
     /* clock */
-    inline unsigned int cycles(){return cycles_;};
-    inline void cycles(unsigned int v){cycles_=v;};
+    inline unsigned int cycles()
+    {
+      if(batch_speed_ == 1)
+        return cycles_;
+      return bus_base_ + (cycles_ - cpu_base_) / batch_speed_;
+    };
+    inline void cycles(unsigned int v){cycles_=v; speed_rest_=0;};
+    /* cycles taken by DMA, the cpu is halted meanwhile */
+    inline void stall(unsigned int v){cycles_+=v*batch_speed_;};
+    /* cycles the cpu took itself, at its own speed */
+    inline void spend(unsigned int v){cycles_+=v;};
+    /* accelerator, 1 runs at the speed of the chips */
+    void speed(unsigned int v);
+    unsigned int speed(){return speed_;};
+    /* the speed the turbo register selects, 0 if none is fitted */
+    void accelerator(unsigned int v){accelerator_ = v;};
+    unsigned int accelerator(){return accelerator_;};
+    static const unsigned int kMaxSpeed = 64;
     /* interrupts */
     void nmi();
     void irq();
+    inline void irq_line(uint8_t src, bool v)
+      {if(v) irq_lines_ |= src; else irq_lines_ &= ~src;};
+    /* irq sources (level triggered) */
+    static const uint8_t kIrqSourceVic = 1 << 0;
+    static const uint8_t kIrqSourceCia1 = 1 << 1;
+    static const uint8_t kIrqSourceReu = 1 << 2;
 };
 
 /* macro helpers */
 
-#define SET_ZF(val)     (zf(!(uint8_t)(val)))
-#define SET_NF(val)     (nf(((uint8_t)(val)&0x80)!=0))
+#define SET_NZ(val)     (nz_ = (uint8_t)(val))
 
 #endif
@@ -1,6 +1,10 @@
 #ifndef __MYOS__CUSTOM_C64ROM
 #define __MYOS__CUSTOM_C64ROM
 
+// Not compiled any more, Memory::patch_ram() reads these from the disk.
+// micromon is MICROMON.PRG and paku_prg is PAKU.PRG, both start with
+// their load address.
+
 
 static unsigned char micromon[4225] = 
 {
@@ -0,0 +1,116 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef EMUDORE_DEBUGGER_H
+#define EMUDORE_DEBUGGER_H
+
+#include <lib/stdint.h>
+
+class Cpu;
+class Memory;
+
+/**
+ * @brief breakpoints and watchpoints for the monitor
+ *
+ * Execute breakpoints are one bit per address, only looked at from
+ * Cpu::run_debug(), the loop the cpu switches to while anything is
+ * set. Watchpoints null the pages they cover in a second set of
+ * page tables so the accesses fall into the I/O dispatch, which
+ * reports them here and then does the real access. With nothing
+ * set the normal loops and tables are used and nothing is checked.
+ *
+ * A hit ends the cpu batch after the current instruction and the
+ * machine stops in the monitor.
+ */
+class Debugger
+{
+  public:
+    enum kHit
+    {
+      kNone,
+      kExec,
+      kRead,
+      kWrite
+    };
+    static const int kMaxWatches = 16;
+    static const uint8_t kWatchRead  = 1 << 0;
+    static const uint8_t kWatchWrite = 1 << 1;
+  private:
+    Cpu *cpu_;
+    Memory *mem_;
+    /* execute breakpoints, a bit per address */
+    uint32_t exec_[0x10000 / 32];
+    unsigned int breakpoints_;
+    /* watched ranges, inclusive */
+    struct Watch
+    {
+      uint16_t first;
+      uint16_t last;
+      uint8_t kind;
+    };
+    Watch watches_[kMaxWatches];
+    int watch_count_;
+    /* the last hit, kept until resume() */
+    int hit_;
+    uint16_t hit_pc_;
+    uint16_t hit_addr_;
+    /* skip the breakpoint the machine stopped on */
+    bool resume_;
+    uint16_t resume_pc_;
+    void update_pages();
+  public:
+    Debugger();
+    ~Debugger();
+    void cpu(Cpu *v){cpu_ = v;};
+    void memory(Memory *v){mem_ = v;};
+    inline bool active(){return breakpoints_ != 0 || watch_count_ != 0;};
+    /* breakpoints */
+    inline bool breakpoint(uint16_t addr)
+    {
+      return (exec_[addr >> 5] >> (addr & 31)) & 1;
+    };
+    bool toggle_breakpoint(uint16_t addr);
+    void clear_breakpoints();
+    /* watchpoints */
+    bool watch(uint16_t first, uint16_t last, uint8_t kind);
+    void clear_watches();
+    /* called from the cpu and memory */
+    inline bool stop_at(uint16_t pc)
+    {
+      if(resume_)
+      {
+        resume_ = false;
+        if(pc == resume_pc_)
+          return false;
+      }
+      if(!breakpoint(pc))
+        return false;
+      hit(kExec,pc,pc);
+      return true;
+    };
+    void access(uint16_t addr, bool write);
+    void hit(int kind, uint16_t pc, uint16_t addr);
+    inline int hit(){return hit_;};
+    inline void hit_pc(uint16_t pc){hit_pc_ = pc;};
+    void resume();
+    /* monitor */
+    void report_hit();
+    void report();
+};
+
+#endif
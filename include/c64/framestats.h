@@ -0,0 +1,95 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EMUDORE_FRAMESTATS_H
+#define EMUDORE_FRAMESTATS_H
+
+#include <lib/stdint.h>
+
+/**
+ * @brief where the host time of each emulated frame goes
+ *
+ * The main loop and IO mark the start of each phase with mark(),
+ * which stamps the TSC once and charges the time since the last
+ * mark to the phase that was running. frame() closes a frame at
+ * each vic frame end and keeps the last kHistory frames, so the
+ * numbers are always about the recent past.
+ *
+ * Only the low 32 bits of the TSC are used, frames are far shorter
+ * than the wrap-around.
+ */
+class FrameStats
+{
+  public:
+    enum kPhase
+    {
+      kCpu,       /* 6510 interpreter or recompiled code */
+      kChips,     /* cia, sid and io catch up */
+      kVic,       /* raster lines */
+      kPresent,   /* copy to the framebuffer */
+      kIdle,      /* waiting for the frame deadline */
+      kPhases
+    };
+    static const unsigned int kHistory = 128;
+    static const unsigned int kBuckets = 7;
+    /* one PAL frame, 312 lines of 63 cycles at 985248Hz, in us */
+    static const uint32_t kFrameMicros = 19950;
+  private:
+    uint32_t last_;
+    kPhase phase_;
+    uint32_t acc_[kPhases];
+    /* per frame history in tsc ticks */
+    uint32_t history_[kHistory][kPhases];
+    unsigned int head_;
+    unsigned int frames_;
+    /* one second window for speed and fps */
+    uint32_t window_milli_;
+    unsigned int window_frames_;
+    unsigned int window_presents_;
+    unsigned int speed_;
+    unsigned int fps_;
+    bool overlay_;
+    static uint32_t ticks();
+    uint32_t micros(uint32_t t);
+  public:
+    FrameStats();
+    /**
+     * @brief charges the time since the last mark, returns the
+     * phase that was running so nested phases can restore it
+     */
+    inline kPhase mark(kPhase p)
+    {
+      uint32_t now = ticks();
+      kPhase prev = phase_;
+      acc_[prev] += now - last_;
+      last_ = now;
+      phase_ = p;
+      return prev;
+    };
+    void frame(bool presented);
+    void resync();
+    void clear();
+    void report();
+    int text(char *buf);
+    /* percent of emulated speed and presented frames per second */
+    unsigned int speed(){return speed_;};
+    unsigned int fps(){return fps_;};
+    bool overlay(){return overlay_;};
+    void overlay(bool v){overlay_ = v;};
+};
+
+#endif
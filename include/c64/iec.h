@@ -0,0 +1,114 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EMUDORE_IEC_H
+#define EMUDORE_IEC_H
+
+#include <lib/stdint.h>
+#include <c64/cpu.h>
+#include <c64/io.h>
+
+/**
+ * @brief serial (IEC) bus with drive 8 attached at the line level
+ *
+ * The KERNAL serial routines are trapped (see IO::trap), this is
+ * for programs driving ATN, CLK and DATA through CIA2 port A
+ * themselves. The drive side speaks the standard serial protocol
+ * and is evaluated lazily whenever the port is accessed, timeouts
+ * (EOI) are measured in cpu cycles. Bytes end up in the same
+ * IO::bus_ calls as the trapped routines.
+ *
+ * Once IO recognized a fast loader in the drive code started by
+ * M-E the drive serves whole sectors instead. For the ATN clocked
+ * 2-bit loader every ATN edge moves two bits, a 1 pulls the line:
+ *
+ *  - request: the c64 puts bits 0/1, 2/3.. of track and sector on
+ *    CLK/DATA, 8 edges. Track 0 ends the loader.
+ *  - reply: the drive puts a status byte (0 ok, 1 no such sector)
+ *    and the 256 bytes of the sector on CLK/DATA, the first pair is
+ *    there after the last request edge, each edge shows the next.
+ *    After the last pair's edge the lines are released.
+ */
+class Iec
+{
+  private:
+    Cpu *cpu_;
+    IO *io_;
+    /* lines pulled low by the c64 and by the drive */
+    bool atn_, clk_, data_;
+    bool drive_clk_, drive_data_;
+    /* drive state */
+    enum kState
+    {
+      kIdle,
+      kListenWait,      /* holding DATA, waiting for the talker */
+      kListenReady,     /* DATA released, EOI after a timeout */
+      kListenEoi,       /* acknowledging EOI */
+      kListenBits,
+      kTurnaround,
+      kTalkReady,       /* waiting to release CLK for the next byte */
+      kTalkWait,        /* CLK released, waiting for the listener */
+      kTalkEoi,         /* waiting for the listener to ack EOI */
+      kTalkEoiRelease,
+      kTalkBits,
+      kTalkAck,
+      kFastRequest,     /* fast loader, clocking in track and sector */
+      kFastReply,
+    };
+    kState state_;
+    unsigned int since_;
+    uint8_t byte_;
+    uint8_t bits_;
+    bool eoi_;
+    bool last_clk_;
+    /* role picked by the commands sent under ATN */
+    enum kRole
+    {
+      kNone,
+      kListener,
+      kTalker
+    };
+    kRole role_;
+    bool under_atn_;
+    /* fast loader */
+    bool fast_;
+    uint16_t fast_request_;
+    uint16_t fast_pos_;			// bit pair being shown
+    uint8_t fast_status_;
+    uint8_t fast_sector_[256];
+    void fast_edge(bool clk, bool data);
+    void fast_show();
+    void received(uint8_t b);
+    void next_byte();
+    void step();
+    inline unsigned int elapsed(){return cpu_->cycles() - since_;};
+    inline bool clk_line(){return clk_ || drive_clk_;};
+    inline bool data_line(){return data_ || drive_data_;};
+  public:
+    Iec();
+    void cpu(Cpu *v){cpu_ = v;};
+    void io(IO *v){io_ = v;};
+    void write(uint8_t pra);
+    uint8_t read();
+    /* timing (cpu cycles) */
+    static const unsigned int kEoiTimeout = 200;
+    static const unsigned int kEoiHold = 60;
+    static const unsigned int kBitHalf = 40;
+    static const unsigned int kByteGap = 80;
+};
+
+#endif
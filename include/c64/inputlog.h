@@ -0,0 +1,81 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EMUDORE_INPUTLOG_H
+#define EMUDORE_INPUTLOG_H
+
+#include <lib/stdint.h>
+#include <memorymanagement.h>
+#include <filesystem/fat.h>
+
+/**
+ * @brief host key events against emulated time
+ *
+ * IO applies queued keys to the matrix and the joystick bits at
+ * the end of a frame. While recording every key applied there is
+ * logged with the cpu cycle it was applied at. Replaying ignores
+ * the keyboard and applies the logged keys at the same cycles, so
+ * a run started from the same snapshot goes exactly the same way.
+ *
+ * The file is an 8 byte magic, a version, the event count and one
+ * event after the other: the cycles since the previous event as a
+ * 7 bits per byte varint, then the key with bit 7 of a flag byte
+ * set for a press.
+ */
+class InputLog
+{
+  public:
+    enum kMode
+    {
+      kOff,
+      kRecord,
+      kReplay
+    };
+    static const unsigned int kMaxEvents = 16384;
+    static const uint16_t kVersion = 1;
+    static const char kMagic[8];
+    /* load error, next to the FILE_STATUS_ codes */
+    static const int kBadFormat = 0x10;
+  private:
+    struct Event
+    {
+      uint32_t cycle;
+      uint8_t key;
+      bool down;
+    };
+    myos::MemoryArena *arena_;
+    Event *events_;
+    unsigned int count_;
+    unsigned int next_;
+    kMode mode_;
+    bool allocate();
+  public:
+    InputLog();
+    void arena(myos::MemoryArena *a){arena_ = a;};
+    void record();
+    bool replay();
+    void stop(){mode_ = kOff;};
+    inline bool recording(){return mode_ == kRecord;};
+    inline bool replaying(){return mode_ == kReplay;};
+    void log(uint32_t cycle, uint8_t key, bool down);
+    bool next(uint32_t now, uint8_t *key, bool *down);
+    int save(myos::filesystem::Fat32 *fs, uint8_t *filename);
+    int load(myos::filesystem::Fat32 *fs, uint8_t *filename);
+    void report();
+};
+
+#endif
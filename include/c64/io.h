@@ -3,14 +3,22 @@
 
 #include <lib/stdint.h>
 #include <lib/vga.h>
+#include <lib/string.h>
 #include <c64/cpu.h>
 #include <c64/memory.h>
+#include <c64/framestats.h>
+#include <c64/inputlog.h>
 
 #include <drivers/keyscancodes.h>
 #include <drivers/ata.h>
 #include <filesystem/fat.h>
+#include <filesystem/d64.h>
 #include <drivers/serial.h>
 #include <drivers/rtc.h>
+#include <drivers/bga.h>
+#include <hardwarecommunication/smp.h>
+#include <multitasking.h>
+#include <syscalls.h>
 
 //#define _NO_BORDER_
 
@@ -40,7 +48,7 @@ class IO
   private:
     Cpu *cpu_;
     Memory *mem_;
-    uint32_t *frame_;
+    myos::MemoryArena *arena_;
     size_t cols_;
     size_t rows_;
     
@@ -57,6 +65,26 @@ class IO
     uint8_t joy1, joy2;
 
     static const uint8_t kbd[8][8];
+    /**
+     * key events from the keyboard IRQ
+     *
+     * OnKeyDown() and OnKeyUp() run in interrupt context and only
+     * queue the key, process_events() applies the queue to the
+     * matrix once per frame. Producer and consumer each only write
+     * their own index, so the ring needs no lock.
+     */
+    struct KeyEvent
+    {
+      uint8_t key;
+      bool down;
+    };
+    static const uint32_t kKeyRingSize = 64;
+    KeyEvent key_ring_[kKeyRingSize];
+    volatile uint32_t key_head_;
+    volatile uint32_t key_tail_;
+    void queue_key(uint8_t c, bool down);
+    void key_down(uint8_t c);
+    void key_up(uint8_t c);
   
     unsigned int next_key_event_at_;
     static const int kWait = 18000;
@@ -64,28 +92,144 @@ class IO
     void vsync();
         
     Fat32 *fat32_;
+    D64 *d64_;				// mounted image, 0 for the FAT32 root
     void file_load();
+    bool listing_load(uint8_t *filename, uint16_t start);
     void file_save();
-    void file_open();
-    void file_close();
-    void file_get();
+    /* per machine, with c64=N another machine's task can preempt a transfer */
+    static const uint32_t kFileChunkSize = 4096;
+    uint8_t file_chunk_[kFileChunkSize];
+    /* drive 8, FAT32 root files or a D64 image served on the patched serial routines */
+    static const uint8_t kDriveDevice = 8;
+    static const uint8_t kDriveCommandChannel = 15;
+    static const uint8_t kDriveChannels = 16;
+    static const uint8_t kDriveNameLength = 40;
+    uint8_t bus_device_;			// addressed by the last TALK/LISTEN, 0 if none
+    uint8_t bus_secondary_;			// $60/$E0/$F0 | channel
+    uint8_t bus_name_[kDriveNameLength];	// filename or drive command being sent
+    uint8_t bus_name_length_;
+    uint8_t channel_mode_[kDriveChannels];
+    int16_t channel_next_[kDriveChannels];	// read ahead so EOI goes out with the last byte
+    const char *drive_status_;
+    char drive_scratched_[26];		// "01, FILES SCRATCHED,nn,00" with this machine's count
+    uint8_t drive_status_ptr_;
+    /* 1541 RAM as written by M-W, there's no drive cpu to run it */
+    static const uint16_t kDriveRamSize = 0x800;
+    uint8_t drive_ram_[kDriveRamSize];
+    uint8_t drive_memory_[kDriveNameLength];	// M-R reply, read before the status
+    uint8_t drive_memory_length_;
+    uint8_t drive_memory_ptr_;
+    uint8_t drive_loader_;			// fast loader started by M-E, kLoaderNone if none
+    void bus_status(uint8_t v);
+    bool drive_filename(const uint8_t *src, uint8_t length, uint8_t *name, char type);
+    void drive_command();
+    void drive_memory(const uint8_t *cmd, uint8_t length);
+    void drive_execute(uint16_t address);
+    void drive_mount(const uint8_t *src, uint8_t length);
+    bool drive_read(uint8_t channel, uint8_t *b);
+    void file_open(uint8_t channel);
+    void file_close(uint8_t channel);
+    uint8_t file_get(uint8_t channel, uint8_t *status);
+    uint8_t file_put(uint8_t channel, uint8_t b);
     
     SerialDriver *serial_;
     RTCDriver *rtc_;
 
     uint16_t *vscreen_; 		// pointer to the offset of virtual screen.
-    uint16_t *pscreen_;
-    double scaleWidth;
-    double scaleHeight;
+    uint16_t *fscreen_;			// lines as last presented, for change detection
+    uint16_t *pscreen_;			// the worker's copy of the frame it presents
+    const uint16_t *present_src_;	// frame the present reads, vscreen_ or pscreen_
+    uint32_t dirty_lines_[(VIRT_HEIGHT + 31) / 32];
+    uint8_t border_lines_[VIRT_HEIGHT];	// 1 + color of lines that are only border, 0 otherwise
+    uint16_t *col_src_;			// virtual screen column for each host column
+    uint16_t *row_src_;			// virtual screen line for each host row
+    uint32_t scale_;			// integer scale factor of the mode, 0 if it is not one
+    inline bool scanline(uint32_t cy);
+    /* framebuffer output, specialized for the pixel size in bytes */
+    template<int BPP> inline void scale_row(uint8_t *dst, uint32_t cy, const uint16_t *src);
+    template<int BPP> void present_dirty_lines();
+    template<int BPP> void present_flip();
+    /* page flipping, two screens stacked in video memory */
+    BGADriver *flip_;
+    uint8_t back_page_;
+    uint32_t prev_dirty_lines_[(VIRT_HEIGHT + 31) / 32];	// changed in the frame on the other page
+    void (IO::*present_)();
+    uint32_t present_lines_[(VIRT_HEIGHT + 31) / 32];	// lines the present in progress redraws
+    inline bool present_line(int y) {
+      return (present_lines_[y >> 5] & (1 << (y & 31))) != 0;
+    };
+    static const uint32_t kPalette[16];
+    /* host frame timing, drawn in the top border when enabled */
+    FrameStats *stats_;
+    /* recorded or replayed keys, applied in process_events() */
+    InputLog *input_;
+    void draw_overlay();
+    /**
+     * With a worker processor the frame is scaled and presented there
+     * while this one goes on emulating. The lines it redraws are copied
+     * to pscreen_ first, the vic goes on with the next frame in vscreen_
+     * and the mailbox hands the copy over, so no frame shows half of
+     * the next one.
+     */
+    MultiprocessorController *worker_;
+    static void present_job(void *io);
+    inline void present_wait()
+    {
+      if(worker_ != 0)
+	worker_->Wait();
+    }
+    /* other machines draw their tiles again once the console is gone */
+    static volatile uint32_t console_epoch_;
+    uint32_t console_seen_;
+    inline void present()
+    {
+      present_wait();
+      if(console_seen_ != console_epoch_)
+      {
+	console_seen_ = console_epoch_;
+	screen_invalidate();
+      }
+      if(stats_->overlay())
+	draw_overlay();
+      for(int i=0; i < (VIRT_HEIGHT + 31) / 32 ; i++)
+      {
+	present_lines_[i] = dirty_lines_[i];
+	dirty_lines_[i] = 0;
+      }
+      if(worker_ == 0)
+      {
+	present_src_ = vscreen_;
+	(this->*present_)();
+	return;
+      }
+      /* a page flip also redraws what changed in the frame before */
+      for(int y=0; y < VIRT_HEIGHT; y++)
+	if(present_line(y) || (flip_ != 0 && (prev_dirty_lines_[y >> 5] & (1 << (y & 31)))))
+	  memcpy(pscreen_ + y * VIRT_WIDTH, vscreen_ + y * VIRT_WIDTH, VIRT_WIDTH * sizeof(uint16_t));
+      present_src_ = pscreen_;
+      if(!worker_->Submit(&IO::present_job, this))
+	(this->*present_)();
+    }
     
     uint8_t *vgaMem_;
+    uint8_t *backbuf_;			// frame composed in RAM, blitted to vgaMem_
     uint32_t screen_width_;
     uint32_t screen_height_;
     uint32_t screen_pitch_;
     uint8_t screen_bpp_;
     uint8_t pixel_width_;
     
-    uint32_t prev_frame_milli;
+    /* frame pacing: PAL runs at 50.125Hz, 19 + 381/401 ms per frame */
+    static const uint32_t kFrameMillis = 19;
+    static const uint32_t kFrameRemainder = 381;
+    static const uint32_t kFrameDivisor = 401;
+    uint8_t skip_ctr_;
+    static const int32_t kMaxFrameLag = 100;
+    uint32_t next_frame_milli_;
+    uint32_t next_frame_rem_;
+    /* warp: unpaced, one frame presented per kWarpPresentMillis */
+    static const uint32_t kWarpPresentMillis = 20;
+    uint32_t warp_present_milli_;
 
 public:
     IO();
@@ -94,15 +238,55 @@ public:
 
     bool emulate();
     void process_events();
+    void trap(uint8_t n);
+    /* drive 8 on the serial bus, from the KERNAL traps or Iec */
+    uint8_t bus_address(uint8_t device);
+    void bus_secondary(uint8_t v);
+    uint8_t bus_put(uint8_t b);
+    uint8_t bus_get(uint8_t *status);
+    void bus_release();
+    /**
+     * Fast loaders recognized in the drive code started by M-E, Iec
+     * serves them with whole sectors from the mounted D64 until the
+     * c64 asks for track 0.
+     */
+    static const uint8_t kLoaderNone    = 0;
+    static const uint8_t kLoaderAtn2Bit = 1;
+    inline uint8_t drive_loader(){return drive_loader_;};
+    inline void drive_loader_exit(){drive_loader_ = kLoaderNone;};
+    bool drive_sector(uint8_t track, uint8_t sector, uint8_t *data);
+    /* trap numbers, the byte after Cpu::kOpTrap in the patched KERNAL */
+    static const uint8_t kTrapLoad   = 0x04;
+    static const uint8_t kTrapSave   = 0x05;
+    static const uint8_t kTrapTalk   = 0x06;
+    static const uint8_t kTrapListen = 0x07;
+    static const uint8_t kTrapSecond = 0x08;
+    static const uint8_t kTrapTksa   = 0x09;
+    static const uint8_t kTrapCiout  = 0x0a;
+    static const uint8_t kTrapUntlk  = 0x0b;
+    static const uint8_t kTrapUnlsn  = 0x0c;
+    static const uint8_t kTrapAcptr  = 0x0d;
     void cpu(Cpu *v){cpu_=v;};
     void memory(Memory *m) {mem_ = m;};
+    void arena(myos::MemoryArena *v) {arena_ = v;};
     void fat32(Fat32 *m) { fat32_ = m; };
     void serial(SerialDriver *m) { serial_ = m; };
     void rtc(RTCDriver *m) { rtc_ = m; };
+    void page_flip(BGADriver *v);
+    void worker(MultiprocessorController *v) {
+      if(v != 0 && pscreen_ == 0)
+	pscreen_ = new(arena_) uint16_t[VIRT_WIDTH  * VIRT_HEIGHT];
+      worker_ = v;
+    };
+    void show_console();
+    void stats(FrameStats *v) { stats_ = v; };
+    void input(InputLog *v) { input_ = v; };
     
     uint8_t SkipFrames = 0;
+    bool HaltPacing = true;		// idle with hlt instead of spinning
+    bool Warp = false;			// run as fast as the host allows
     bool step = false;
-    uint16_t color_palette[16];
+    uint32_t color_palette[16];		// framebuffer native format
     
     void init_color_palette();
     void init_keyboard();
@@ -114,16 +298,42 @@ public:
     void type_character(char c);
     inline uint8_t keyboard_matrix_row(int col){return keyboard_matrix_[col];};
     
-    inline void put_pixel(int x,int y, int color) {
-      uint8_t *pixel = vgaMem_ + y*screen_pitch_ + x*pixel_width_;     
-      *pixel = color_palette[color] & 255;              
-      *(pixel + 1) = (color_palette[color] >> 8) & 255;
-    };
+    void put_pixel(int x,int y, int color);
     
     inline void screen_update_pixel(int x, int y, int color) { 
       *(vscreen_ + y * VIRT_WIDTH  + x) = color;
     };
     
+    inline uint16_t *screen_line(int y) {
+      return vscreen_ + y * VIRT_WIDTH;
+    };
+    
+    /* called by the vic once line y is complete, flags it if it changed */
+    inline void screen_line_done(int y) {
+      uint16_t *src = vscreen_ + y * VIRT_WIDTH;
+      uint16_t *prev = fscreen_ + y * VIRT_WIDTH;
+      for(int i=0; i < VIRT_WIDTH ; i++)
+      {
+	if(src[i] != prev[i])
+	{
+	  memcpy(prev + i, src + i, VIRT_WIDTH - i);
+	  dirty_lines_[y >> 5] |= 1 << (y & 31);
+	  return;
+	}
+      }
+    };
+    
+    inline bool screen_line_dirty(int y) {
+      return (dirty_lines_[y >> 5] & (1 << (y & 31))) != 0;
+    };
+    
+    /* forces a full repaint, e.g. after the monitor used the screen */
+    inline void screen_invalidate() {
+      present_wait();
+      for(int i=0; i < (VIRT_HEIGHT + 31) / 32 ; i++)
+	dirty_lines_[i] = prev_dirty_lines_[i] = 0xffffffff;
+    };
+    
     inline void screen_draw_rect(int x, int y, int n, int color) {
       for(int i=1; i <= n ; i++)
 	*(vscreen_ + y * VIRT_WIDTH + x + i) = color;
@@ -132,39 +342,55 @@ public:
     inline void screen_draw_border(int y, int color) {
       for(int i=0; i < cols_ ; i++)
 	*(vscreen_ + y * VIRT_WIDTH  + i) = color;
+      border_lines_[y] = 0;
+    };
+    
+    /**
+     * Fills a line that shows nothing but border with one string 
+     * store. Returns false, without touching it, if the line already
+     * is exactly that.
+     */
+    inline bool screen_border_line(int y, int color) {
+      if(border_lines_[y] == color + 1)
+	return false;
+      uint16_t *dst = vscreen_ + y * VIRT_WIDTH;
+      uint32_t n = cols_;
+      __asm__ volatile("cld; rep stosw"
+		       : "+D" (dst), "+c" (n) : "a" (color) : "memory");
+      border_lines_[y] = color + 1;
+      return true;
+    };
+    
+    /* line y was drawn over, it is not known to be plain border */
+    inline void screen_line_changed(int y) {
+      border_lines_[y] = 0;
     };
     
     inline void screen_refresh() {
 
-      static uint8_t skipCtr = 0;
+      FrameStats::kPhase prev = stats_->mark(FrameStats::kPresent);
+      bool presented = false;
       
-      if(SkipFrames == 0 || skipCtr == SkipFrames)
+      if(Warp)
+	presented = warp_refresh();
+      else
       {
-	for(uint16_t cy = 0; cy < screen_height_; cy++)
-	  for(uint16_t cx = 0; cx < screen_pitch_; cx++)
-	  {
-	    if(cy % 2 == 0) // Scanlines
-	    {
-	      uint32_t nearestMatch =  (((uint16_t)(cy / scaleHeight) * VIRT_WIDTH) + ((uint16_t)(cx / scaleWidth)));
-	      pscreen_[cy * screen_pitch_ + cx] = vscreen_[nearestMatch];
-	    }
-	  }
-	  
-	  for(uint32_t x=0;x<screen_pitch_*screen_height_;x+=pixel_width_)
-	  {
-	    uint16_t color = color_palette[*(pscreen_+x)];
-	    *(vgaMem_+x) = color & 255;
-	    *(vgaMem_+x+1) = (color >> 8) & 255;
-	  }
+	if(SkipFrames == 0 || skip_ctr_ == SkipFrames)
+	{
+	  present();
+	  stats_->mark(FrameStats::kIdle);
+	  sync();
+	  skip_ctr_ = 0;
+	  presented = true;
+	}
 	
-	sync();
-	skipCtr = 0;
-      }     
-      
-      	if(SkipFrames > 0)
-	  skipCtr++;
+	if(SkipFrames > 0)
+	  skip_ctr_++;
 	else
-	  skipCtr = 0;
+	  skip_ctr_ = 0;
+      }
+      stats_->mark(prev);
+      stats_->frame(presented);
       
       // no scaling
       /*
@@ -173,20 +399,73 @@ public:
 	  put_pixel(x,y,vscreen_[y*403+x]);*/
     };
     
+    /**
+     * In warp mode nothing is paced, a frame is only presented once
+     * kWarpPresentMillis of wall-clock time passed since the last one.
+     * The pacing deadline is kept at "now" so leaving warp resumes at
+     * normal speed instead of catching up.
+     */
+    inline bool warp_refresh()
+    {
+      bool presented = false;
+      if(current_milli - warp_present_milli_ >= kWarpPresentMillis)
+      {
+	present();
+	warp_present_milli_ = current_milli;
+	presented = true;
+      }
+      next_frame_milli_ = current_milli;
+      next_frame_rem_ = 0;
+      return presented;
+    }
+    
+    /**
+     * The frame deadline advances by exactly one PAL frame each call,
+     * the fractional part is carried in next_frame_rem_ so it does not
+     * drift. If we fall too far behind (e.g. after the monitor ran) the
+     * deadline is reset instead of racing to catch up.
+     */
     inline void sync()
     {
-      uint32_t current = current_milli;
-      uint32_t t = current - prev_frame_milli;
-      uint32_t ttw = 19 - t; //(Vic::kRefreshRate*1000) - t;
+      next_frame_milli_ += kFrameMillis;
+      next_frame_rem_ += kFrameRemainder;
+      if(next_frame_rem_ >= kFrameDivisor)
+      {
+	next_frame_rem_ -= kFrameDivisor;
+	next_frame_milli_++;
+      }
       
-      delay(current_milli - current+ttw);
-      prev_frame_milli = current_milli;
+      if((int32_t)(next_frame_milli_ - current_milli) < -kMaxFrameLag)
+      {
+	next_frame_milli_ = current_milli;
+	next_frame_rem_ = 0;
+	return;
+      }
+      wait_until(next_frame_milli_);
     }
 
     inline void delay(uint32_t milliseconds)
     {
-      uint32_t startmilli = current_milli;
-      while(current_milli < startmilli + milliseconds)  {};
+      wait_until(current_milli + milliseconds);
+    }
+    
+    /**
+     * the timer interrupt wakes us up from hlt, the 1kHz PIT tick or
+     * the tickless timer armed for milli by the syscall. Running as one of
+     * several tasks the wait is a sleep instead, the next frame is due
+     * one frame period after it.
+     */
+    inline void wait_until(uint32_t milli)
+    {
+      while((int32_t)(current_milli - milli) < 0)
+      {
+	if(myos::SyscallHandler::SleepUntil(milli, milli + kFrameMillis))
+	  continue;
+	if(HaltPacing)
+	  __asm__ volatile("hlt" : : : "memory");
+	else
+	  __asm__ volatile("pause" : : : "memory");
+      }
     }
     
     
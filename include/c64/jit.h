@@ -0,0 +1,85 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EMUDORE_JIT_H
+#define EMUDORE_JIT_H
+
+#include <lib/stdint.h>
+#include <c64/cpu.h>
+#include <c64/memory.h>
+
+/**
+ * @brief translated basic block
+ *
+ * The native code follows the header, it's a plain cdecl
+ * function taking no arguments.
+ */
+struct JitBlock
+{
+  uint16_t pc;
+  uint16_t last;
+  /* page mappings the block was translated from */
+  uint8_t *first_base;
+  uint8_t *last_base;
+  uint8_t code[];
+};
+
+/**
+ * @brief block caching recompiler for the 6510
+ *
+ * Basic blocks are translated into i386 code that calls the
+ * per-opcode handlers of the Cpu back to back (subroutine 
+ * threading), which removes the opcode fetch and the dispatch
+ * from the hot path. Handlers still fetch their operands and 
+ * tick the clock themselves so self-modifying operands and 
+ * cycle counts behave exactly like in the interpreter.
+ *
+ * Pages holding translated code are watched by Memory, a write
+ * that hits the first byte of a translated instruction drops 
+ * the blocks of that page.
+ */
+class Jit
+{
+  private:
+    Cpu *cpu_;
+    Memory *mem_;
+    myos::MemoryArena *arena_;
+    Cpu::JitHandler handlers_[256];
+    JitBlock **blocks_;
+    uint8_t *opcode_map_;
+    uint8_t *code_;
+    uint32_t code_used_;
+    JitBlock *translate(uint16_t pc);
+    inline void emit8(uint8_t v){code_[code_used_++] = v;};
+    inline void emit32(uint32_t v);
+    inline bool is_opcode(uint16_t addr);
+  public:
+    Jit();
+    ~Jit();
+    void cpu(Cpu *v){cpu_ = v;};
+    void memory(Memory *v){mem_ = v;};
+    void arena(myos::MemoryArena *v){arena_ = v;};
+    bool execute();
+    void invalidate(uint16_t addr);
+    void flush();
+    /* constants */
+    static const uint32_t kCodeSize = 1024 * 1024;
+    static const int kMaxBlockInsns = 32;
+    static const int kMaxBlockSize = 64 + kMaxBlockInsns * 24;
+};
+
+#endif
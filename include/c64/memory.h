@@ -19,6 +19,7 @@
 #define EMUDORE_MEMORY_H 
 
 #include <lib/stdint.h>
+#include <memorymanagement.h>
 
 /* forward declarations */
 
@@ -26,6 +27,12 @@ class Vic;
 class Cia1;
 class Cia2;
 class Sid;
+class Cpu;
+class Snapshot;
+class RomSet;
+class Reu;
+class Cartridge;
+class Debugger;
 
 /**
  * @brief DRAM
@@ -43,54 +50,108 @@ class Sid;
  * - @c $D800-$DBFF  Page 216-219  
  * - @c $DC00-$DCFF  Page 220  
  * - @c $DD00-$DDFF  Page 221  
- * - @c $DE00-$DFFF  Page 222-223  Reserved for interface extensions
+ * - @c $DE00-$DFFF  Page 222-223  Reserved for interface extensions (REU at $DF00)
  * - @c $E000-$FFFF  Page 224-255  Free machine language program storage area (when switched-out with ROM)
  */
 class Memory
 {
   private:
     uint8_t *mem_ram_;
-    uint8_t *mem_rom_;
+    RomSet *roms_;
     uint8_t banks_[7];
+    /* per-page access tables, null means read_io()/write_io() */
+    static const int kLayouts = 8;
+    uint8_t *read_pages_[kLayouts][256];
+    uint8_t *write_pages_[kLayouts][256];
+    uint8_t **read_page_;
+    uint8_t **write_page_;
+    uint8_t layout_;
+    /* pages holding recompiled code */
+    bool code_pages_[256];
+    /* REU command waiting for a write to $FF00 */
+    bool reu_trigger_;
+    /**
+     * debugger watchpoints: copies of the tables with the watched
+     * pages nulled, selected instead of the plain ones while any
+     * page is watched
+     */
+    uint8_t watch_pages_[256];
+    bool watching_;
+    uint8_t *trap_read_pages_[kLayouts][256];
+    uint8_t *trap_write_pages_[kLayouts][256];
+    void update_traps();
+    void select_tables();
+    void setup_banks(uint8_t v);
+    void setup_page_tables(uint8_t **read_page, uint8_t **write_page);
+    uint8_t read_io(uint16_t addr);
+    void write_io(uint16_t addr, uint8_t v);
     Vic *vic_;
     Cia1 *cia1_;
     Cia2 *cia2_;
     Sid *sid_;
+    Cpu *cpu_;
+    Reu *reu_;
+    Cartridge *cart_;
+    Debugger *debugger_;
   public:
-    Memory();
+    Memory(myos::MemoryArena *arena);
     ~Memory();
     void vic(Vic *v){vic_ = v;};
     void cia1(Cia1 *v){cia1_ = v;};
     void cia2(Cia2 *v){cia2_ = v;};
     void sid(Sid *v) {sid_ = v;};
+    void cpu(Cpu *v) {cpu_ = v;};
+    void reu(Reu *v) {reu_ = v;};
+    void cartridge(Cartridge *v) {cart_ = v;};
+    void debugger(Debugger *v) {debugger_ = v;};
     /* bank switching */
     enum kBankCfg
     {
       kROM,
       kRAM,
-      kIO
+      kIO,
+      kCart
     };
     enum Banks
     {
+      kBankRoml = 2,
       kBankBasic =  3,
       kBankCharen = 5,
       kBankKernal =  6,
     };
     void setup_memory_banks(uint8_t v);
+    inline uint8_t *page_base(uint8_t page){return read_page_[page];};
+    inline uint8_t *write_base(uint8_t page){return write_page_[page];};
+    void watch_code_page(uint8_t page);
+    void unwatch_code_pages();
+    void watch_reu_trigger(bool v);
+    void cartridge_changed();
+    void watch_pages(const uint8_t *kinds);
     /* read/write memory */
-    uint8_t read_byte(uint16_t addr);
+    inline uint8_t read_byte(uint16_t addr)
+    {
+      uint8_t *p = read_page_[addr >> 8];
+      return p ? p[addr] : read_io(addr);
+    };
     uint8_t read_byte_no_io(uint16_t addr);
-    void write_byte(uint16_t addr, uint8_t v);
+    inline void write_byte(uint16_t addr, uint8_t v)
+    {
+      uint8_t *p = write_page_[addr >> 8];
+      if(p) p[addr] = v; else write_io(addr,v);
+    };
     void write_byte_no_io(uint16_t addr, uint8_t v);
     uint16_t read_word(uint16_t addr);
     uint16_t read_word_no_io(uint16_t);
     void write_word(uint16_t addr, uint16_t v);
     void write_word_no_io(uint16_t addr, uint16_t v);
+    void write_block_no_io(uint16_t addr, const uint8_t *src, uint32_t len);
+    /* save states */
+    void snapshot(Snapshot *s, uint8_t *base, bool delta);
+    void rewind(Snapshot *s, uint8_t *base, bool undo);
+    void restore_ram(const uint8_t *base);
     /* vic memory access */
     uint8_t vic_read_byte(uint16_t addr);
-    uint8_t read_byte_rom(uint16_t addr);
     
-    void patch_roms();
     void patch_ram();
     
     /* load external binaries */
@@ -115,6 +176,9 @@ class Memory
     static const uint16_t kAddrDataDirection = 0x0000;
     static const uint16_t kAddrMemoryLayout  = 0x0001;
     static const uint16_t kAddrColorRAM = 0xd800;
+    /* SuperCPU style speed switch, see Cpu::accelerator() */
+    static const uint16_t kAddrTurboOff = 0xd07a;
+    static const uint16_t kAddrTurboOn  = 0xd07b;
     /* memory layout */
     static const uint16_t kAddrZeroPage     = 0x0000;
     static const uint16_t kAddrVicFirstPage = 0xd000;
@@ -122,10 +186,14 @@ class Memory
     static const uint16_t kAddrSIDPage = 0xd400;
     static const uint16_t kAddrCIA1Page = 0xdc00;
     static const uint16_t kAddrCIA2Page = 0xdd00;
+    static const uint16_t kAddrIO1Page = 0xde00;
+    static const uint16_t kAddrREUPage = 0xdf00;
     static const uint16_t kAddrBasicFirstPage = 0xa000; 
     static const uint16_t kAddrBasicLastPage  = 0xbf00;
     static const uint16_t kAddrKernalFirstPage = 0xe000;
     static const uint16_t kAddrKernalLastPage = 0xff00;
+    static const uint16_t kAddrRomlFirstPage = 0x8000;
+    static const uint16_t kAddrRomlLastPage = 0x9f00;
     /* bank switching */
     static const uint8_t kLORAM  = 1 << 0;
     static const uint8_t kHIRAM  = 1 << 1;
@@ -24,6 +24,7 @@ class Cia2;
 class Sid;
 class Memory;
 class IO;
+class C64;
 
 class Monitor
 {
@@ -35,6 +36,7 @@ class Monitor
     Sid *sid_;
     IO *io_;
     Memory *mem_;
+    C64 *c64_;
     char buf[80];
     uint8_t bufPtr;
     void prompt();
@@ -53,6 +55,7 @@ class Monitor
     void cia1(Cia1 *v){cia1_ = v;};
     void cia2(Cia2 *v){cia2_ = v;};
     void io(IO *v){io_ = v;};
+    void c64(C64 *v){c64_ = v;};
     void fat32(Fat32 *m) { fat32_ = m; };
     void Start();
     void Stop();
@@ -0,0 +1,89 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef EMUDORE_NATIVES_H
+#define EMUDORE_NATIVES_H
+
+#include <lib/stdint.h>
+
+class Cpu;
+class Memory;
+
+/**
+ * @brief host versions of hot BASIC and KERNAL ROM routines
+ *
+ * RomSet::install_natives() puts a TRAP at the entry of each routine
+ * whose code matches the stock ROM, the TRAP then lands here. Every
+ * routine is a literal transliteration of the 6502 code: registers,
+ * flags, zero page, stack bytes and FAC/ARG come out as the ROM
+ * leaves them. The cycles the ROM would have taken are counted as
+ * well and charged scaled by cost(), 100 keeps the timing.
+ *
+ * Off, or with the decimal flag set, the TRAP only does what the
+ * instruction it replaced did and the ROM code runs.
+ */
+class Natives
+{
+  private:
+    Cpu *cpu_;
+    Memory *mem_;
+    bool enabled_;
+    unsigned int cost_;
+    /* the cpu state a routine works on */
+    struct State
+    {
+      uint8_t a, x, y, sp;
+      bool n, v, z, c;
+      unsigned int cycles;
+    };
+    void fmult(State &s);
+    void mltply(State &s, bool check);
+    void mulshf(State &s);
+    void fdiv(State &s);
+    void conupk(State &s);
+    void movfm(State &s);
+    void movlin(State &s);
+    uint16_t rts(State &s);
+    uint8_t stack_flags(State &s);
+  public:
+    Natives();
+    ~Natives();
+    void cpu(Cpu *v){cpu_ = v;};
+    void memory(Memory *v){mem_ = v;};
+    void enabled(bool v){enabled_ = v;};
+    bool enabled(){return enabled_;};
+    void cost(unsigned int percent){cost_ = percent;};
+    unsigned int cost(){return cost_;};
+    void trap(uint8_t n);
+    /* trap numbers, after the IO ones */
+    static const uint8_t kFirstTrap  = 0x10;
+    static const uint8_t kTrapFmult  = 0x10;
+    static const uint8_t kTrapFdiv   = 0x11;
+    static const uint8_t kTrapConupk = 0x12;
+    static const uint8_t kTrapMovfm  = 0x13;
+    static const uint8_t kTrapMovlin = 0x14;
+    /* entry points in the stock ROMs */
+    static const uint16_t kAddrFmult  = 0xba33;
+    static const uint16_t kAddrFdiv   = 0xbb25;
+    static const uint16_t kAddrConupk = 0xba8c;
+    static const uint16_t kAddrMovfm  = 0xbba2;
+    static const uint16_t kAddrMovlin = 0xe9d2;
+    static const uint16_t kAddrMovfr  = 0xbb8f;
+};
+
+#endif
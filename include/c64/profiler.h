@@ -0,0 +1,115 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EMUDORE_PROFILER_H
+#define EMUDORE_PROFILER_H
+
+#include <lib/stdint.h>
+#include <memorymanagement.h>
+#include <filesystem/fat.h>
+
+/**
+ * @brief where the emulated cycles go
+ *
+ * Two modes, both off by default:
+ *
+ * - kSample: the pc is recorded each time the cpu starts a batch
+ *   (about every raster line) and the cycles since the previous
+ *   sample are charged to it. Nothing is added per instruction.
+ * - kExact: Cpu::run() switches to a separate interpreter loop that
+ *   reports every instruction, the recompiler is bypassed. This
+ *   gives exact per-pc cycles and counts, a JSR/RTS call graph
+ *   with inclusive cycles per caller/callee pair, and the share of
+ *   cycles spent in IRQ and NMI handlers.
+ *
+ * Call frames are matched by stack pointer, so code dropping its
+ * return address (PLA PLA, stack resets) unwinds the frames above.
+ * All cycles are chip cycles from Cpu::cycles(), with the
+ * accelerator on an instruction may be charged less than one.
+ */
+class Profiler
+{
+  public:
+    enum kMode
+    {
+      kOff,
+      kSample,
+      kExact
+    };
+  private:
+    myos::MemoryArena *arena_;
+    kMode mode_;
+    /* per pc histogram */
+    uint32_t *pc_cycles_;
+    uint32_t *pc_count_;
+    /* call graph */
+    enum kFrameKind
+    {
+      kCall,
+      kIrq,
+      kNmi
+    };
+    struct Frame
+    {
+      uint16_t caller;
+      uint16_t callee;
+      uint8_t sp;
+      uint8_t kind;
+      unsigned int start;
+    };
+    struct Edge
+    {
+      uint16_t caller;
+      uint16_t callee;
+      uint32_t calls;
+      uint32_t cycles;
+    };
+    Frame *stack_;
+    unsigned int depth_;
+    Edge *edges_;
+    unsigned int edge_count_;
+    unsigned int irq_frames_;
+    unsigned int nmi_frames_;
+    /* totals */
+    uint32_t total_;
+    uint32_t irq_cycles_;
+    uint32_t nmi_cycles_;
+    unsigned int last_sample_;
+    void push(uint16_t callee, uint8_t sp, kFrameKind kind, unsigned int now);
+    void unwind(uint8_t sp, unsigned int now);
+    Edge *edge(uint16_t caller, uint16_t callee);
+    inline uint16_t function(){return depth_ ? stack_[depth_-1].callee : 0;};
+  public:
+    Profiler();
+    void arena(myos::MemoryArena *v){arena_ = v;};
+    void mode(kMode m, unsigned int now);
+    kMode mode(){return mode_;};
+    inline bool exact(){return mode_ == kExact;};
+    void clear();
+    void sample(uint16_t pc, unsigned int now);
+    void instruction(uint16_t pc, uint8_t op, unsigned int cycles,
+                     uint8_t sp, uint16_t next_pc, unsigned int now);
+    void interrupt(uint16_t handler, uint8_t sp, bool nmi,
+                   unsigned int cycles, unsigned int now);
+    void report(unsigned int lines);
+    int save(myos::filesystem::Fat32 *fs, uint8_t *filename);
+    /* constants */
+    static const unsigned int kMaxDepth = 64;
+    static const unsigned int kMaxEdges = 1024;
+};
+
+#endif
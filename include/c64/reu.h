@@ -0,0 +1,111 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef EMUDORE_REU_H
+#define EMUDORE_REU_H
+
+#include <lib/stdint.h>
+#include <memorymanagement.h>
+#include <c64/cpu.h>
+#include <c64/memory.h>
+
+/**
+ * @brief Commodore 1700/1764/1750 RAM Expansion Unit
+ *
+ * - Memory area : $DF00-$DFFF (registers repeat every 32 bytes)
+ * - Tasks       : DMA between the c64 and up to 16MB of REU RAM
+ *
+ * A transfer runs all at once as host copies, a page at a time when
+ * the c64 side is plain memory and a byte at a time through the I/O
+ * dispatch otherwise. The cpu is then halted for the cycles the real
+ * controller takes, one per byte (two for a swap). Execution starts
+ * right after the command write, or on the next write to $FF00 when
+ * the FF00 decode is left on.
+ */
+class Reu
+{
+  private:
+    Cpu *cpu_;
+    Memory *mem_;
+    myos::MemoryArena *arena_;
+    uint8_t *ram_;
+    uint32_t size_;
+    /* registers, writes set both the working and the autoload copy */
+    uint8_t status_;
+    uint8_t command_;
+    uint16_t c64_addr_, c64_shadow_;
+    uint32_t reu_addr_, reu_shadow_;
+    uint16_t length_, length_shadow_;
+    uint8_t imr_;
+    uint8_t acr_;
+    bool busy_;
+    void execute();
+    void update_irq_line();
+  public:
+    Reu();
+    ~Reu();
+    void cpu(Cpu *v){cpu_ = v;};
+    void memory(Memory *v){mem_ = v;};
+    void arena(myos::MemoryArena *v){arena_ = v;};
+    bool attach(unsigned int banks);
+    inline bool attached(){return size_ != 0;};
+    inline uint32_t size(){return size_;};
+    uint8_t read_register(uint8_t r);
+    void write_register(uint8_t r, uint8_t v);
+    void trigger();
+    /* registers */
+    enum kRegister
+    {
+      kStatus,
+      kCommand,
+      kC64AddrLo,
+      kC64AddrHi,
+      kReuAddrLo,
+      kReuAddrHi,
+      kReuBank,
+      kLengthLo,
+      kLengthHi,
+      kInterruptMask,
+      kAddrControl,
+      kRegisters
+    };
+    /* transfer types, command bits 0-1 */
+    enum kTransfer
+    {
+      kStash,   /* c64 to REU */
+      kFetch,   /* REU to c64 */
+      kSwap,
+      kVerify
+    };
+    static const uint8_t kStatusIrq = 1 << 7;
+    static const uint8_t kStatusEndOfBlock = 1 << 6;
+    static const uint8_t kStatusFault = 1 << 5;
+    static const uint8_t kStatusSize = 1 << 4;
+    static const uint8_t kCommandExecute = 1 << 7;
+    static const uint8_t kCommandAutoload = 1 << 5;
+    static const uint8_t kCommandNoFF00 = 1 << 4;
+    static const uint8_t kCommandType = 0x03;
+    static const uint8_t kImrEnable = 1 << 7;
+    static const uint8_t kAcrFixC64 = 1 << 7;
+    static const uint8_t kAcrFixReu = 1 << 6;
+    static const uint8_t kRegisterMask = 0x1f;
+    static const uint16_t kAddrTrigger = 0xff00;
+    static const unsigned int kMaxBanks = 256;
+};
+
+#endif
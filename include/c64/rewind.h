@@ -0,0 +1,79 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EMUDORE_REWIND_H
+#define EMUDORE_REWIND_H
+
+#include <lib/stdint.h>
+#include <memorymanagement.h>
+#include <c64/snapshot.h>
+
+/**
+ * @brief rolling in-RAM history for stepping the machine back
+ *
+ * Every kInterval frames the machine appends a record holding the
+ * chip state and the previous contents of the RAM pages written
+ * since the record before. base() is RAM as of the newest record,
+ * so returning to it only needs base, and each older record is
+ * reached by writing the pages of the newer one back into base.
+ *
+ * Records are laid out one after another in a fixed buffer that
+ * wraps around, the oldest ones go when a new one would not fit or
+ * kMaxEntries are kept. Buffer and base are allocated on the first
+ * capture, rewinding stays off if that fails.
+ */
+class Rewind
+{
+  public:
+    /* 5 records a second at 50 frames */
+    static const unsigned int kInterval = 10;
+    static const unsigned int kPerSecond = 50 / kInterval;
+    static const unsigned int kMaxEntries = 60 * kPerSecond;
+    static const uint32_t kBufferSize = 4 * 1024 * 1024;
+    static const uint32_t kMaxRecord = Snapshot::kMaxSize;
+  private:
+    struct Entry
+    {
+      uint32_t offset;
+      uint32_t length;
+      unsigned int frame;
+    };
+    myos::MemoryArena *arena_;
+    uint8_t *buf_;
+    uint8_t *base_;
+    bool failed_;
+    Entry entries_[kMaxEntries];
+    unsigned int first_;
+    unsigned int count_;
+    uint32_t write_;
+    unsigned int last_frame_;
+    void drop_oldest();
+  public:
+    Rewind();
+    void arena(myos::MemoryArena *a){arena_ = a;};
+    inline bool due(unsigned int frame){return frame - last_frame_ >= kInterval;};
+    void resync(unsigned int frame){last_frame_ = frame;};
+    uint8_t *reserve();
+    void commit(uint32_t length, unsigned int frame);
+    uint8_t *newest(uint32_t *length);
+    void drop_newest();
+    uint8_t *base(){return base_;};
+    unsigned int count(){return count_;};
+    void report();
+};
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef EMUDORE_ROMSET_H
+#define EMUDORE_ROMSET_H
+
+#include <lib/stdint.h>
+#include <filesystem/fat.h>
+
+/**
+ * @brief the ROM images shared by every machine
+ *
+ * BASIC, KERNAL and the character generator are read once at boot
+ * from BASIC.ROM, KERNAL.ROM and CHAR.ROM in the root directory of
+ * drive 8, an image that is missing or has the wrong size keeps the
+ * built-in one. Every machine maps the images when it is built, so
+ * this mounts the volume and builds its directory index at boot. Memory maps each image as its own bank, nothing is
+ * copied per machine. The KERNAL is patched for the DOS and serial
+ * bus traps whichever image it came from, a patch whose bytes are
+ * not the stock ones there is skipped and counted.
+ *
+ * install_natives() optionally adds the traps of Natives to the
+ * routines that still match the stock images.
+ *
+ * Optional programs are only read the first time they are asked
+ * for, see Memory::patch_ram().
+ */
+class RomSet
+{
+  public:
+    enum kRom
+    {
+      kBasic,
+      kKernal,
+      kChars,
+      kRoms
+    };
+    enum kOptional
+    {
+      kMicromon,  /* machine language monitor, takes the BRK vector */
+      kPaku,      /* BASIC program to save to disk */
+      kOptionals
+    };
+  private:
+    uint8_t *roms_[kRoms];
+    bool disk_[kRoms];
+    myos::filesystem::Fat32 *fs_;
+    uint8_t *optionals_[kOptionals];
+    uint32_t optional_sizes_[kOptionals];
+    bool optional_tried_[kOptionals];
+    int kernal_skipped_;
+    static RomSet *shared_;
+    RomSet();
+    uint8_t *read_file(const char *name, uint32_t size);
+    bool kernal_stock(uint16_t first, uint16_t last);
+    void patch_kernal();
+  public:
+    static RomSet *shared();
+    int load(myos::filesystem::Fat32 *fs);
+    inline uint8_t *rom(kRom r){return roms_[r];};
+    inline bool from_disk(kRom r){return disk_[r];};
+    inline int kernal_skipped(){return kernal_skipped_;};
+    const uint8_t *optional(kOptional o, uint32_t *size);
+    int install_natives();
+    static const char *file_name(kRom r);
+    /* image sizes */
+    static const uint32_t kBasicSize  = 0x2000;
+    static const uint32_t kKernalSize = 0x2000;
+    static const uint32_t kCharsSize  = 0x1000;
+};
+
+#endif
@@ -7,25 +7,87 @@
 #include <c64/cpu.h>
 #include <c64/memory.h>
 #include <drivers/speaker.h>
+#include <drivers/ac97.h>
 
+/**
+ * @brief MOS 6581 Sound Interface Device
+ *
+ * - Memory area : $D400-$D7FF
+ * - Tasks       : 3 voices, ADSR envelopes, multimode filter
+ *
+ * Register writes only latch the value, the voices are rendered
+ * in emulate() for the cycles elapsed since the last call, one
+ * output sample every kSampleCycles, and handed to the audio
+ * driver a block of kBlockSamples at a time. Without an audio
+ * driver the frequency of the last written voice is played on
+ * the PC speaker as before.
+ */
 class Sid
 {
   private:
 
   myos::drivers::SpeakerDriver *speaker_;
+  myos::drivers::AC97Driver *audio_;
+  Cpu *cpu_;
   uint8_t volume;
   uint8_t freqLo;
   uint8_t freqHi;
   uint32_t frequency;
-    
+  /* register file, $1B-$1C are updated as voice 3 runs */
+  uint8_t regs_[0x20];
+  /* voices */
+  struct Voice
+  {
+    uint32_t acc;           /* 24-bit phase accumulator << 8 */
+    uint32_t noise;         /* 23-bit noise shift register */
+    uint32_t rate_counter;  /* envelope cycles << 8 */
+    uint8_t env;
+    uint8_t env_state;
+    uint8_t exp_counter;
+    bool gate;
+    bool msb_rose;          /* for hard sync of the next voice */
+  };
+  Voice voices_[3];
+  enum kEnvState
+  {
+    kAttack,
+    kDecaySustain,
+    kRelease
+  };
+  /* filter state */
+  int32_t low_;
+  int32_t band_;
+  /* rendering */
+  unsigned int prev_cpu_cycles_;
+  uint32_t sample_cycles_;
+  unsigned int block_len_;
+  void clock_voice(int n);
+  void clock_envelope(int n);
+  uint16_t waveform(int n);
+  int16_t render_sample();
+
   public:
     Sid();
     ~Sid();
     void speaker(myos::drivers::SpeakerDriver *m) { speaker_ = m; };
-    
+    void audio(myos::drivers::AC97Driver *v) { audio_ = v; };
+    void cpu(Cpu *v) { cpu_ = v; };
+
     void write_register(uint8_t r, uint8_t v);
+    uint8_t read_register(uint8_t r);
+    bool emulate();
     uint32_t getFrequency(uint8_t hi, uint8_t lo);
     void play();
+    void snapshot(Snapshot *s);
+    /* constants */
+    static const uint32_t kSampleRate = 48000;
+    static const uint32_t kSampleCycles = 5255;   /* 985248 / 48000 << 8 */
+    static const unsigned int kBlockSamples = 480;
+    static const unsigned int kMaxCatchUp = 20000; /* about one frame */
+    static const int32_t kMixerDc = 0x40000;
+    static const uint16_t kRatePeriods[16];
+  private:
+    int16_t block_[kBlockSamples];
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,80 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EMUDORE_SNAPSHOT_H
+#define EMUDORE_SNAPSHOT_H
+
+#include <lib/stdint.h>
+
+/**
+ * @brief snapshot file header
+ */
+struct SnapshotHeader
+{
+  char magic[8];
+  uint16_t version;
+  uint16_t flags;
+  uint32_t length;
+  uint32_t chain;
+  uint16_t sequence;
+} __attribute__((packed));
+
+/**
+ * @brief machine state stream
+ *
+ * Every chip describes its state once in a snapshot() method, the
+ * same code saves (copies fields into the buffer) and restores
+ * (copies them back) depending on the direction of the stream.
+ * Reading past the end of the data marks the stream as failed
+ * instead of touching memory beyond it.
+ *
+ * A file is a SnapshotHeader followed by the cpu, memory, vic,
+ * cia1, cia2 and sid state. length is the size of the whole file,
+ * chain identifies the full snapshot a delta builds on and
+ * sequence counts the deltas taken since (0 for the full one), a
+ * delta only restores on top of its predecessor.
+ *
+ * Memory is stored as a 256-bit page map followed by the 256-byte
+ * pages present in the map, all of them in a full snapshot and only
+ * the changed ones in a delta.
+ */
+class Snapshot
+{
+  private:
+    uint8_t *buf_;
+    uint32_t size_;
+    uint32_t pos_;
+    bool saving_;
+    bool ok_;
+  public:
+    Snapshot(uint8_t *buf, uint32_t size, bool saving);
+    void bytes(void *p, uint32_t n);
+    template<typename T> inline void value(T &v){bytes(&v,sizeof(T));};
+    bool saving(){return saving_;};
+    bool ok(){return ok_;};
+    uint32_t used(){return pos_;};
+    /* constants */
+    static const char kMagic[8];
+    static const uint16_t kVersion = 5;
+    static const uint16_t kDelta = 0x0001;
+    static const uint32_t kMaxSize = 0x11000;
+    /* load errors, next to the FILE_STATUS_ codes */
+    static const int kBadFormat = 0x10;
+    static const int kWrongBase = 0x11;
+};
+
+#endif
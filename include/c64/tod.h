@@ -0,0 +1,61 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef EMUDORE_TOD_H
+#define EMUDORE_TOD_H
+
+#include <lib/stdint.h>
+
+class Snapshot;
+
+/**
+ * @brief 6526 time of day clock
+ *
+ * - Registers : 1/10s, seconds, minutes, hours (BCD, bit 7 PM)
+ *
+ * The time is kept as tenths of a second since midnight at a host
+ * millisecond, so the clock follows the host timebase and is only
+ * computed when read. Reading the hours latches the time until
+ * the tenths are read, writing the hours stops the clock until the
+ * tenths are written, as on the chip.
+ */
+class Tod
+{
+  private:
+    uint32_t base_;          /* tenths at base_milli_ */
+    uint32_t base_milli_;
+    bool running_;
+    uint32_t latch_;
+    bool latched_;
+    uint32_t alarm_;
+    uint32_t last_;          /* time seen by the last alarm check */
+    uint32_t now();
+    static uint8_t field(uint32_t t, uint8_t r);
+    static uint32_t set_field(uint32_t t, uint8_t r, uint8_t v);
+  public:
+    Tod();
+    uint8_t read(uint8_t r);
+    void write(uint8_t r, uint8_t v, bool alarm);
+    bool alarm();
+    unsigned int cycles_to_alarm();
+    void snapshot(Snapshot *s);
+    /* constants */
+    static const uint32_t kDay = 24 * 60 * 60 * 10;
+    static const unsigned int kCyclesPerTenth = 98525;
+};
+
+#endif
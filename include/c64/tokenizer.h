@@ -0,0 +1,65 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef EMUDORE_TOKENIZER_H
+#define EMUDORE_TOKENIZER_H
+
+#include <lib/stdint.h>
+
+class Memory;
+
+/**
+ * @brief BASIC V2 listing text to a program in RAM
+ *
+ * Lines are crunched the way the ROM tokenizer does it and stored
+ * linked, straight into RAM, instead of being typed in. Text can
+ * be fed in pieces of any size, a line ends at CR or LF. Lowercase
+ * letters are taken as uppercase, as they are typed on a PC.
+ *
+ * The lines have to come in ascending order, the first one that
+ * does not, or does not fit below BASIC's end of RAM, stops the
+ * listing there.
+ */
+class Tokenizer
+{
+  private:
+    Memory *mem_;
+    uint16_t start_;
+    uint16_t addr_;
+    int lines_;
+    int last_;
+    bool ok_;
+    /* the line being received */
+    uint8_t text_[256];
+    unsigned int length_;
+    void line();
+    unsigned int crunch(const uint8_t *text, unsigned int length, uint8_t *out);
+  public:
+    Tokenizer(Memory *mem, uint16_t start);
+    void text(const uint8_t *text, uint32_t length);
+    uint16_t finish();
+    void set_pointers();
+    inline int lines(){return lines_;};
+    inline bool ok(){return ok_;};
+    /* constants */
+    static const uint16_t kAddrBasicStart = 0x0801;
+    static const uint16_t kAddrBasicEnd  = 0xa000;
+    static const unsigned int kMaxLineNumber = 63999;
+};
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef EMUDORE_TRACE_H
+#define EMUDORE_TRACE_H
+
+#include <lib/stdint.h>
+#include <memorymanagement.h>
+#include <filesystem/fat.h>
+
+/**
+ * @brief instruction trace ring
+ *
+ * Each instruction is stored as it is about to run: a header byte,
+ * the opcode, the pc as a delta from the previous one and only the
+ * registers that changed since. The header holds the changed ones
+ * in bits 0-4 (A X Y SP P) and the pc delta in bits 5-7, 0-6 as is
+ * or 7 when a zigzag varint follows. Most instructions take 2-3
+ * bytes, so the 1MB ring holds a few hundred thousand of them.
+ *
+ * The ring is split in segments that start over from zero registers
+ * and pc 0, when it wraps the oldest segment is dropped whole and
+ * every segment left can be decoded on its own.
+ *
+ * Cpu::run() switches to a separate interpreter loop while the
+ * trace records, the other loops pay nothing.
+ */
+class Trace
+{
+  public:
+    /* receives one decoded line at a time */
+    typedef void (*Sink)(const char *line, void *arg);
+    static const int kRegs = 5;
+  private:
+    myos::MemoryArena *arena_;
+    uint8_t *ring_;
+    bool recording_;
+    /* per segment */
+    uint32_t *seg_cycles_;
+    uint32_t *seg_records_;
+    uint16_t *seg_length_;
+    unsigned int head_;
+    unsigned int filled_;
+    unsigned int pos_;
+    /* what the next record is a delta from */
+    uint16_t last_pc_;
+    uint8_t last_[kRegs];
+    void next_segment(unsigned int now);
+    unsigned int oldest();
+    void decode(unsigned int seg, uint32_t skip, Sink sink, void *arg);
+  public:
+    Trace();
+    void arena(myos::MemoryArena *v){arena_ = v;};
+    bool start(unsigned int now);
+    inline void stop(){recording_ = false;};
+    inline bool recording(){return recording_;};
+    inline void record(uint16_t pc, uint8_t op, const uint8_t *regs, unsigned int now)
+    {
+      if(pos_ > kSegmentSize - kMaxRecord)
+        next_segment(now);
+      uint8_t *out = ring_ + head_ * kSegmentSize + pos_;
+      uint8_t *p = out + 2;
+      uint16_t delta = pc - last_pc_;
+      uint8_t header;
+      if(delta <= kMaxShortDelta)
+        header = delta << kDeltaShift;
+      else
+      {
+        header = kLongDelta << kDeltaShift;
+        int16_t d = (int16_t)delta;
+        uint16_t z = (uint16_t)((d << 1) ^ (d >> 15));
+        while(z >= 0x80)
+        {
+          *p++ = z | 0x80;
+          z >>= 7;
+        }
+        *p++ = z;
+      }
+      for(int i=0 ; i < kRegs ; i++)
+      {
+        if(regs[i] != last_[i])
+        {
+          header |= 1 << i;
+          *p++ = regs[i];
+          last_[i] = regs[i];
+        }
+      }
+      out[0] = header;
+      out[1] = op;
+      last_pc_ = pc;
+      pos_ += p - out;
+      seg_records_[head_]++;
+    };
+    uint32_t records();
+    void report(uint32_t lines, Sink sink, void *arg);
+    int save(myos::filesystem::Fat32 *fs, uint8_t *filename);
+    /* constants */
+    static const unsigned int kSegmentSize = 4096;
+    static const unsigned int kSegments = 256;
+    static const unsigned int kMaxRecord = 2 + 3 + kRegs;
+    static const unsigned int kDeltaShift = 5;
+    static const uint16_t kMaxShortDelta = 6;
+    static const uint8_t kLongDelta = 7;
+};
+
+#endif
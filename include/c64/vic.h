@@ -32,6 +32,14 @@
  * MOS 6569 PAL
  *
  * This class implements the PAL version of the chip
+ *
+ * Two engines share the renderer. The default one draws a whole
+ * raster line once the cpu reached its end and models badlines by
+ * shortening them. The cycle exact one, picked at boot, keeps
+ * every line 63 cycles long and halts the cpu for the badline and
+ * sprite DMA. A register write in the middle of a line first
+ * finishes the pixels the beam has passed with the old values,
+ * so raster splits and color bars land where the write happened.
  */
 class Vic
 {
@@ -50,6 +58,9 @@ class Vic
     uint8_t sprite_double_height_;
     uint8_t sprite_shared_colors_[2];
     uint8_t sprite_colors_[8];
+    /* collisions, latched until read */
+    uint8_t sprite_sprite_collision_;
+    uint8_t sprite_bg_collision_;
     /* background and border colors */
     uint8_t border_color_;
     uint8_t bgcolor_[4];
@@ -86,32 +97,42 @@ class Vic
     inline bool is_double_height_sprite(int n);
     inline bool is_multicolor_sprite(int n);
     inline int sprite_x(int n);
+    inline void update_irq_line();
     /* graphics */ 
     inline void draw_raster_char_mode();
     inline void draw_raster_bitmap_mode();
     inline void draw_raster_sprites();
-    inline void draw_sprite(int x, int y, int sprite, int row);
-    inline void draw_mcsprite(int x, int y, int sprite, int row);
-    inline void draw_char(int x, int y, uint8_t data, uint8_t color);
-    inline void draw_ext_backcolor_char(int x, int y, uint8_t data, uint8_t color, uint8_t c);
-    inline void draw_mcchar(int x, int y, uint8_t data, uint8_t color);
-    inline void draw_bitmap(int x, int y, uint8_t data, uint8_t color);
-    inline void draw_mcbitmap(int x, int y, uint8_t data, uint8_t scolor, uint8_t rcolor);
     inline uint8_t get_screen_char(int column, int row);
     inline uint8_t get_char_color(int column, int row);
     inline uint8_t get_char_data(int chr, int line);
     inline uint8_t get_bitmap_data(int column, int row, int line);
     inline uint16_t get_sprite_ptr(int n);
     inline void set_graphic_mode();
+    bool draw_line(int rstr);
+    inline bool is_border_line(int rstr);
+    void next_line();
+    /* cycle exact engine */
+    bool cycle_exact_;
+    bool dma_done_;
+    bool collisions_;
+    int drawn_x_;
+    bool emulate_cycles();
+    void start_line();
+    void catch_up();
+    bool render_line(int x);
   public:
     Vic();
     bool emulate();
+    unsigned int cycles_to_next_event();
+    void snapshot(Snapshot *s);
     void memory(Memory *v){mem_ = v;};
     void cpu(Cpu *v){cpu_ = v;};
     void io(IO *v){io_ = v;};
     void write_register(uint8_t r, uint8_t v);
     uint8_t read_register(uint8_t r);
     unsigned int frames(){return frame_c_;};
+    void cycle_exact(bool v){cycle_exact_ = v;};
+    bool cycle_exact(){return cycle_exact_;};
     /* constants */
     static const int kScreenLines = 312;
     //static const int kScreenCols  = 504;
@@ -124,6 +145,7 @@ class Vic
     static const int kLastVisibleLine = 200;
     static const int kLineCycles = 63;
     static const int kBadLineCycles = 23;
+    static const int kCyclePixelOffset = -124;
 #else
     static const int kVisibleScreenWidth  = 403;
     static const int kVisibleScreenHeight = 284;
@@ -131,8 +153,20 @@ class Vic
     static const int kLastVisibleLine = 298;
     static const int kLineCycles = 63;
     static const int kBadLineCycles = 23;
+    static const int kCyclePixelOffset = -81;
 #endif
 
+    /**
+     * cycle exact timing, cycles from the start of the line: BA goes
+     * low on a badline at kBaCycle and the cpu runs again at
+     * kDmaEndCycle. The beam is at screen column 8 * cycle plus
+     * kCyclePixelOffset.
+     */
+    static const int kBaCycle = 12;
+    static const int kDmaEndCycle = 55;
+    static const int kSpriteDmaCycles = 2;
+    static const int kSpriteBaCycles = 3;
+
     static const int kSpritePtrsOffset = 0x3f8;
     /* graphic modes */
     enum kGraphicMode
@@ -172,6 +206,81 @@ class Vic
     static const int kSpritesFirstLine = 6;
     static const int kSpritesFirstCol = 18;
 #endif
+  private:
+    /**
+     * scanline renderer
+     *
+     * Every 8 pixel character or bitmap row is described by two bit 
+     * masks that select one of four colors per pixel (hi:lo, like
+     * multicolor mode, hires rows use the same mask twice). A whole
+     * line of cells is expanded at once through a lookup table.
+     */
+    struct RasterCell
+    {
+      uint8_t hi, lo;
+      uint16_t color[4];
+    };
+    RasterCell cells_[kGCols];
+    uint16_t line_[kGResX];
+    bool simd_;
+    /**
+     * badline cache
+     *
+     * Screen codes and color RAM of the current character row are 
+     * fetched once, when the row starts, and reused for its 8 lines.
+     */
+    uint8_t vm_codes_[kGCols];
+    uint8_t vm_colors_[kGCols];
+    int vm_row_;
+    inline void fetch_video_matrix(int row);
+    inline void hires_cell(int column, uint8_t data, uint8_t fg, uint8_t bg);
+    inline void mc_cell(int column, uint8_t data, uint8_t c0, uint8_t c1, uint8_t c2, uint8_t c3);
+    void draw_raster_cells(int y);
+    static void init_expand_lut();
+    static void expand_cells(uint16_t *dst, const RasterCell *cell, int n);
+    static void expand_cells_sse2(uint16_t *dst, const RasterCell *cell, int n);
+    /**
+     * sprite pipeline
+     *
+     * Position, size, mode and colors of each sprite are folded into
+     * a descriptor when one of their registers is written. Each line
+     * only tests the descriptors for the sprites it crosses, fetches
+     * their row and turns it into 64-bit pixel masks (pixel 0 in the
+     * top bit): opaque pixels, and the two color select bits. Masks
+     * are painted 8 pixels at a time through expand_lut.
+     *
+     * Background priority and collisions need the foreground pixels
+     * of the line, they are collected from the raster cells as a
+     * bitmap in screen columns on lines crossed by a sprite. The
+     * collision registers are a few ANDs of these masks per line.
+     */
+    struct SpriteDesc
+    {
+      int x;                  /* screen column of the first pixel */
+      int y;                  /* first line, from kSpritesFirstLine */
+      int width;
+      int height;
+      bool multicolor;
+      bool double_width;
+      bool double_height;
+      bool behind;
+      uint16_t color[4];      /* 1,3 shared colors, 2 sprite color */
+    };
+    SpriteDesc sprites_[8];
+    bool sprites_dirty_;
+    uint8_t sprite_line_;     /* sprites crossing the current line */
+    static const int kFgWords = (kVisibleScreenWidth + 31) / 32 + 2;
+    uint32_t fg_mask_[kFgWords];
+    uint16_t line_save_[kVisibleScreenWidth];
+    bool fg_valid_;
+    void update_sprites();
+    inline uint8_t sprites_on_line(int rstr);
+    inline void build_fg_mask();
+    inline uint64_t fg_bits(int x);
+    inline uint64_t sprite_row(int n, int sp_y, uint64_t *hi, uint64_t *lo);
+    inline void paint_sprite(uint16_t *dst, const SpriteDesc *s,
+                             uint64_t vis, uint64_t hi, uint64_t lo);
+    inline void sprite_collisions(const uint64_t *opaque);
 };
 
 #endif
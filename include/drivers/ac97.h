@@ -0,0 +1,80 @@
+#ifndef __MYOS__DRIVERS__AC97_H
+#define __MYOS__DRIVERS__AC97_H
+
+#include <lib/stdint.h>
+#include <hardwarecommunication/port.h>
+#include <hardwarecommunication/pci.h>
+
+// mixer registers (offsets from BAR0)
+#define AC97_NAM_RESET			0x00
+#define AC97_NAM_MASTER_VOLUME		0x02
+#define AC97_NAM_PCM_VOLUME		0x18
+
+// bus master registers (offsets from BAR1), PCM out box
+#define AC97_PO_BDBAR			0x10
+#define AC97_PO_CIV			0x14
+#define AC97_PO_LVI			0x15
+#define AC97_PO_SR			0x16
+#define AC97_PO_PICB			0x18
+#define AC97_PO_CR			0x1B
+#define AC97_GLOBAL_CONTROL		0x2C
+#define AC97_GLOBAL_STATUS		0x30
+
+#define AC97_CR_RUN			0x01
+#define AC97_CR_RESET			0x02
+#define AC97_SR_HALTED			0x01
+#define AC97_SR_CLEAR			0x1C	// LVBCI, BCIS and FIFOE are write one to clear
+#define AC97_GC_COLD_RESET		0x02	// deasserts the AC_RESET# line
+#define AC97_GS_CODEC_READY		0x100
+
+#define AC97_SAMPLE_RATE		48000
+#define AC97_BUFFERS			32	// fixed by the hardware
+#define AC97_BUFFER_FRAMES		1024	// stereo frames per descriptor
+#define AC97_LEAD_BUFFERS		2	// kept queued ahead of the DMA
+#define AC97_MAX_LEAD_BUFFERS		8	// anything further ahead is dropped
+#define AC97_RING_FRAMES		(AC97_BUFFERS * AC97_BUFFER_FRAMES)
+
+namespace myos
+{
+    namespace drivers
+    {
+
+        // buffer descriptor list entry, the length counts 16-bit samples
+        struct AC97BufferDescriptor
+        {
+            uint32_t address;
+            uint16_t samples;
+            uint16_t flags;
+        } __attribute__((packed));
+
+        // Intel ICH AC'97 controller (PCI class 04, subclass 01). The
+        // PCM out DMA loops forever over a ring of AC97_BUFFERS
+        // descriptors, Write() copies 16-bit mono samples into the ring
+        // a little ahead of the play position and zeroes what has been
+        // played so an underrun plays silence instead of old audio.
+        class AC97Driver
+        {
+        private:
+            uint32_t mixerBase;
+            uint32_t busMasterBase;
+            bool active;
+            uint32_t writeFrame;	// next stereo frame to fill
+            uint32_t clearFrame;	// played frames are zeroed up to here
+            static AC97BufferDescriptor descriptors[AC97_BUFFERS];
+            static int16_t ring[AC97_RING_FRAMES * 2];
+
+            uint32_t PlayFrame();
+            void Start();
+
+        public:
+            AC97Driver();
+            ~AC97Driver();
+
+            bool Initialize(hardwarecommunication::PeripheralComponentInterconnectController* pci);
+            bool Active() { return active; }
+            void Write(const int16_t* samples, uint32_t count);
+        };
+    }
+}
+
+#endif
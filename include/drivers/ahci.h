@@ -0,0 +1,151 @@
+#ifndef __MYOS__DRIVERS__AHCI_H
+#define __MYOS__DRIVERS__AHCI_H
+
+#include <lib/stdint.h>
+#include <hardwarecommunication/pci.h>
+#include <drivers/blockdevice.h>
+
+// HBA registers (offsets from BAR5)
+#define AHCI_CAP			0x00
+#define AHCI_GHC			0x04
+#define AHCI_IS				0x08
+#define AHCI_PI				0x0C
+#define AHCI_PORT_BASE			0x100
+#define AHCI_PORT_SIZE			0x80
+
+#define AHCI_CAP_NCS_SHIFT		8	// command slots - 1, 5 bits
+#define AHCI_CAP_SNCQ			0x40000000
+#define AHCI_GHC_AE			0x80000000
+
+// port registers (offsets from the port base)
+#define AHCI_PX_CLB			0x00
+#define AHCI_PX_CLBU			0x04
+#define AHCI_PX_FB			0x08
+#define AHCI_PX_FBU			0x0C
+#define AHCI_PX_IS			0x10
+#define AHCI_PX_IE			0x14
+#define AHCI_PX_CMD			0x18
+#define AHCI_PX_TFD			0x20
+#define AHCI_PX_SIG			0x24
+#define AHCI_PX_SSTS			0x28
+#define AHCI_PX_SERR			0x30
+#define AHCI_PX_SACT			0x34
+#define AHCI_PX_CI			0x38
+
+#define AHCI_PX_CMD_ST			0x0001
+#define AHCI_PX_CMD_SUD			0x0002
+#define AHCI_PX_CMD_POD			0x0004
+#define AHCI_PX_CMD_FRE			0x0010
+#define AHCI_PX_CMD_FR			0x4000
+#define AHCI_PX_CMD_CR			0x8000
+#define AHCI_PX_IS_TFES			0x40000000	// task file error
+#define AHCI_PX_SSTS_DET		0x0F
+#define AHCI_PX_SSTS_DET_PRESENT	0x03	// device present, phy up
+#define AHCI_SIG_ATA			0x00000101
+
+#define AHCI_TFD_ERR			0x01
+#define AHCI_TFD_DRQ			0x08
+#define AHCI_TFD_BSY			0x80
+
+#define AHCI_FIS_REG_H2D		0x27
+#define AHCI_FIS_COMMAND		0x80	// C bit, the register holds a command
+
+#define AHCI_CMD_READ_DMA_EXT		0x25
+#define AHCI_CMD_WRITE_DMA_EXT		0x35
+#define AHCI_CMD_READ_FPDMA		0x60	// NCQ
+#define AHCI_CMD_WRITE_FPDMA		0x61
+#define AHCI_CMD_FLUSH_EXT		0xEA
+#define AHCI_CMD_IDENTIFY		0xEC
+
+#define AHCI_MAX_SLOTS			32
+#define AHCI_MAX_PRDS			8	// per command
+#define AHCI_PRD_BYTES			0x10000	// 64KB per descriptor
+#define AHCI_MAX_SECTORS_PER_COMMAND	(AHCI_MAX_PRDS * AHCI_PRD_BYTES / 512)
+#define AHCI_BOUNCE_SECTORS		128	// odd addresses go through here
+#define AHCI_TIMEOUT			5000000	// microseconds for any command
+
+namespace myos
+{
+    namespace drivers
+    {
+
+        struct AHCICommandHeader
+        {
+            uint16_t flags;		// FIS length in dwords, bit 6 write
+            uint16_t prdtLength;
+            volatile uint32_t prdByteCount;
+            uint32_t tableAddress;	// 128 byte aligned
+            uint32_t tableAddressHigh;
+            uint32_t reserved[4];
+        } __attribute__((packed));
+
+        struct AHCIPhysicalRegion
+        {
+            uint32_t address;		// word aligned
+            uint32_t addressHigh;
+            uint32_t reserved;
+            uint32_t byteCount;		// bytes - 1, bit 31 interrupt
+        } __attribute__((packed));
+
+        struct AHCICommandTable
+        {
+            uint8_t fis[64];
+            uint8_t atapi[16];
+            uint8_t reserved[48];
+            AHCIPhysicalRegion prd[AHCI_MAX_PRDS];
+        } __attribute__((packed));
+
+        // AHCI SATA controller (PCI class 01, subclass 06), drives the
+        // first port with a disk attached. Commands are polled like the
+        // ATA bus master transfers. A request larger than one command is
+        // spread over several slots that are all issued before waiting,
+        // with NCQ when both controller and drive support it. Queued
+        // writes only take a slot and return, Sync() waits for them and
+        // flushes the drive cache.
+        class AHCIDriver : public BlockDevice
+        {
+        private:
+            volatile uint32_t* hba;
+            volatile uint32_t* port;
+            int portNumber;
+            int slots;			// usable command slots
+            bool ncq;
+            uint32_t issued;		// slots not completed yet
+            uint32_t pendingWrites;	// sectors queued since the last Sync()
+            uint32_t sizeSectors;
+            uint8_t model[41];
+
+            static AHCICommandHeader commandList[AHCI_MAX_SLOTS];
+            static uint8_t receivedFis[256];
+            static AHCICommandTable commandTables[AHCI_MAX_SLOTS];
+            static uint8_t bounce[AHCI_BOUNCE_SECTORS * 512];
+
+            uint32_t Read(uint32_t reg) { return port[reg / 4]; }
+            void Write(uint32_t reg, uint32_t value) { port[reg / 4] = value; }
+
+            bool StartPort();
+            void StopPort();
+            int Recover();
+            int FreeSlot();
+            int Issue(uint8_t command, uint32_t sectorNum, uint8_t* buffer, uint32_t sectors, bool write);
+            int Complete(uint32_t mask);
+            int Transfer(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors, bool write);
+            int Identify();
+
+        public:
+            AHCIDriver();
+            ~AHCIDriver();
+
+            bool Initialize(hardwarecommunication::PeripheralComponentInterconnectController* pci);
+            void PrintIdentify();
+
+            virtual int ReadSectors(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors);
+            virtual int WriteSectors(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors);
+            virtual int QueueWrite(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors);
+            virtual int Sync();
+        };
+
+    }
+}
+
+#endif
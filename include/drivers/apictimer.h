@@ -0,0 +1,77 @@
+#ifndef __MYOS__DRIVERS__APICTIMER_H
+#define __MYOS__DRIVERS__APICTIMER_H
+
+#include <lib/stdint.h>
+#include <hardwarecommunication/interrupts.h>
+#include <multitasking.h>
+
+#define IA32_APIC_BASE			0x1B
+#define IA32_APIC_BASE_ENABLE		0x00000800
+#define IA32_TSC_DEADLINE		0x6E0
+
+// Local APIC registers, offsets in bytes from the base in IA32_APIC_BASE
+#define LAPIC_EOI			0x0B0
+#define LAPIC_SVR			0x0F0
+#define LAPIC_LVT_TIMER			0x320
+#define LAPIC_LVT_LINT0			0x350
+#define LAPIC_LVT_LINT1			0x360
+#define LAPIC_TIMER_INITIAL		0x380
+#define LAPIC_TIMER_CURRENT		0x390
+#define LAPIC_TIMER_DIVIDE		0x3E0
+
+#define LAPIC_SVR_ENABLE		0x00000100
+#define LAPIC_SPURIOUS_VECTOR		0xFF	// an iret only, no EOI
+#define LAPIC_LVT_MASKED		0x00010000
+#define LAPIC_LVT_TSC_DEADLINE		0x00040000
+#define LAPIC_LVT_EXTINT		0x00000700
+#define LAPIC_LVT_NMI			0x00000400
+#define LAPIC_DIVIDE_BY_1		0x0B
+
+#define APIC_TIMER_INTERRUPT		0x10	// after the PIC's 16, vector 0x30
+#define APIC_TIMER_CALIBRATION_SHIFT	24	// 2^24 TSC cycles, a few milliseconds
+#define APIC_TIMER_MAX_IDLE		10	// ms, bounds how stale current_milli gets
+
+namespace myos
+{
+    namespace drivers
+    {
+
+        // Tickless timer on the bootstrap processor's local APIC. Instead
+        // of the 1kHz PIT tick there is one interrupt for the next thing
+        // that is due: a sleeping machine's next frame, a waiting caller's
+        // deadline or the end of a slice while another task can run.
+        // current_milli then follows the TSC. TSC-deadline mode is used
+        // when the cpu has it, the one-shot count calibrated against the
+        // TSC otherwise. The 8259 keeps delivering the other IRQs through
+        // LINT0 as in virtual wire mode.
+        class APICTimerDriver : public hardwarecommunication::InterruptHandler,
+                                public hardwarecommunication::EventTimer
+        {
+        private:
+            volatile uint32_t* localApic;
+            bool deadlineMode;
+            uint32_t countPerWindow;	// timer counts in 2^APIC_TIMER_CALIBRATION_SHIFT TSC cycles
+            bool armed;
+            uint32_t armedMilli;
+
+            uint32_t Read(uint32_t reg) { return localApic[reg / 4]; }
+            void Write(uint32_t reg, uint32_t value) { localApic[reg / 4] = value; }
+
+            void Calibrate();
+
+        public:
+            APICTimerDriver(hardwarecommunication::InterruptManager* manager);
+            ~APICTimerDriver();
+
+            bool Initialize();
+            bool DeadlineMode() { return deadlineMode; }
+
+            virtual uint32_t HandleInterrupt(uint32_t esp);
+            virtual void Update();
+            virtual void Program(TaskManager* taskManager);
+        };
+
+    }
+}
+
+#endif
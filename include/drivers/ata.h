@@ -6,6 +6,8 @@
 #include <lib/stdio.h>
 #include <hardwarecommunication/interrupts.h>
 #include <hardwarecommunication/port.h>
+#include <hardwarecommunication/pci.h>
+#include <drivers/blockdevice.h>
 
 #define IDE_ATA        0x00
 #define IDE_ATAPI      0x01
@@ -50,13 +52,42 @@
 #define ATA_IDENT_COMMANDSETS  		0xA4
 #define ATA_IDENT_MAX_LBA_EXT  		0xC8
 
+// IDENTIFY answers within this, absent drives must not hold up the boot
+#define ATA_IDENTIFY_TIMEOUT		100000	// microseconds
+
+#define ATA_PROBE_IDLE			0
+#define ATA_PROBE_PENDING		1
+#define ATA_PROBE_DONE			2
+
+#define ATA_SECTOR_SIZE			512
+#define ATA_MAX_SECTORS_PER_COMMAND	128	// 64KB, one or two PRDs
+
+// PCI bus master IDE registers (offsets from BAR4, +8 for the secondary channel)
+#define ATA_BM_COMMAND			0x00
+#define ATA_BM_STATUS			0x02
+#define ATA_BM_PRDT			0x04
+
+#define ATA_BM_CMD_START		0x01
+#define ATA_BM_CMD_READ			0x08	// bus master writes to memory
+#define ATA_BM_SR_ACTIVE		0x01
+#define ATA_BM_SR_ERR			0x02
+#define ATA_BM_SR_IRQ			0x04
+
 
 namespace myos
 {
     namespace drivers
     {
         
-        class AdvancedTechnologyAttachment
+        // bus master IDE scatter/gather entry, must not cross a 64KB boundary
+        struct PhysicalRegionDescriptor
+        {
+            uint32_t address;
+            uint16_t byteCount;		// 0 means 64KB
+            uint16_t flags;		// bit 15: last entry
+        } __attribute__((packed));
+        
+        class AdvancedTechnologyAttachment : public BlockDevice
         {
         protected:
             bool master;
@@ -80,14 +111,46 @@ namespace myos
 	    
             hardwarecommunication::Port8Bit controlPort;
 	    uint8_t lastError;
+	    
+	    uint16_t portBase;
+	    uint16_t busMasterBase;		// 0 when DMA is not available
+	    static PhysicalRegionDescriptor prdTable[2][4];
+	    
+	    // filled in by the IDENTIFY probe
+	    bool present;
+	    uint8_t type;
+	    bool lba48;
+	    uint32_t sizeSectors;
+	    uint8_t serial[21];
+	    uint8_t model[41];
+	    uint8_t probeState;
+	    uint32_t probeStart;
+	    
+	    bool BeginIdentify();
+	    uint8_t PollIdentify();
+	    
+	    uint8_t WaitReady();
+	    void SelectSectors(uint32_t sectorNum, uint16_t sectors, bool lba48);
+	    int TransferPIO(uint32_t sectorNum, uint8_t* buffer, uint16_t sectors, bool write);
+	    int TransferDMA(uint32_t sectorNum, uint8_t* buffer, uint16_t sectors, bool write);
+	    int Flush(bool lba48);
+	    
         public:
             
             AdvancedTechnologyAttachment(bool master, uint16_t portBase);
             ~AdvancedTechnologyAttachment();
             
             void Identify();
+            void PrintIdentify();
+            bool Present() { return present; }
+            static void Probe(AdvancedTechnologyAttachment** drives, int count);
             void ReadSector(uint32_t sectorNum, uint8_t* sector, int count = 512);
             int WriteSector(uint32_t sectorNum, uint8_t* data, uint32_t count);           
+            virtual int ReadSectors(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors);
+            virtual int WriteSectors(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors);
+            
+            bool EnableDMA(hardwarecommunication::PeripheralComponentInterconnectController* pci);
+            bool DMAEnabled() { return busMasterBase != 0; }
             
         };
         
@@ -0,0 +1,80 @@
+#ifndef __MYOS__DRIVERS__BGA_H
+#define __MYOS__DRIVERS__BGA_H
+
+#include <lib/stdint.h>
+#include <drivers/driver.h>
+#include <hardwarecommunication/port.h>
+
+// Bochs VBE "dispi" interface, also provided by QEMU std VGA and VBoxVGA
+#define BGA_INDEX_PORT			0x01CE
+#define BGA_DATA_PORT			0x01CF
+
+#define BGA_INDEX_ID			0x00
+#define BGA_INDEX_XRES			0x01
+#define BGA_INDEX_YRES			0x02
+#define BGA_INDEX_BPP			0x03
+#define BGA_INDEX_ENABLE		0x04
+#define BGA_INDEX_VIRT_WIDTH		0x06
+#define BGA_INDEX_VIRT_HEIGHT		0x07
+#define BGA_INDEX_X_OFFSET		0x08
+#define BGA_INDEX_Y_OFFSET		0x09
+
+#define BGA_ID_MIN			0xB0C0
+#define BGA_ID_MAX			0xB0CF
+#define BGA_ENABLED			0x01
+#define BGA_GETCAPS			0x02
+#define BGA_LFB_ENABLED			0x40
+
+// PCI ids of the devices implementing it
+#define BGA_PCI_VENDOR_QEMU		0x1234
+#define BGA_PCI_DEVICE_QEMU		0x1111
+#define BGA_PCI_VENDOR_VBOX		0x80EE
+#define BGA_PCI_DEVICE_VBOX		0xBEEF
+
+namespace myos
+{
+    namespace drivers
+    {
+
+        // Found on the PCI bus, the dispi registers replace the mode
+        // GRUB set through VBE by an integer multiple of the emulated
+        // screen, make the framebuffer two screens high and pick which
+        // half is displayed.
+        class BGADriver : public Driver
+        {
+        private:
+            hardwarecommunication::Port16Bit indexPort;
+            hardwarecommunication::Port16Bit dataPort;
+            uint32_t* framebuffer;
+            uint32_t width;
+            uint32_t height;
+            uint32_t pitch;
+            uint32_t pageHeight;
+            bool pageFlip;
+
+            uint16_t ReadRegister(uint16_t index);
+            void WriteRegister(uint16_t index, uint16_t value);
+
+        public:
+            static BGADriver* activeDriver;
+
+            BGADriver(uint32_t* framebuffer);
+            ~BGADriver();
+
+            void Activate();
+            bool Detect();
+            bool SetMode(uint32_t width, uint32_t height, uint8_t bpp);
+            bool SetScaledMode(uint32_t srcWidth, uint32_t srcHeight,
+                               uint32_t minWidth, uint32_t minHeight, uint8_t bpp);
+            uint32_t* Framebuffer() { return framebuffer; }
+            uint32_t Width() { return width; }
+            uint32_t Height() { return height; }
+            uint32_t Pitch() { return pitch; }
+            bool EnablePageFlip(uint32_t width, uint32_t height);
+            bool PageFlip() { return pageFlip; }
+            void ShowPage(uint8_t page);
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef __MYOS__DRIVERS__BLOCKDEVICE_H
+#define __MYOS__DRIVERS__BLOCKDEVICE_H
+
+#include <lib/stdint.h>
+
+namespace myos
+{
+    namespace drivers
+    {
+
+        // Whole sector access as the filesystem sees a disk. Drivers
+        // without a command queue write queued sectors at once and have
+        // nothing to wait for in Sync().
+        class BlockDevice
+        {
+        public:
+            BlockDevice();
+            ~BlockDevice();
+            
+            virtual int ReadSectors(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors);
+            virtual int WriteSectors(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors);
+            
+            // buffer must stay untouched until Sync() returned
+            virtual int QueueWrite(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors);
+            virtual int Sync();
+        };
+        
+    }
+}
+
+#endif
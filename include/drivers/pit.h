@@ -34,11 +34,31 @@ namespace myos
 	      uint8_t inb(uint16_t port);
 uint32_t ticker;
             PITEventHandler* handler;
+            
+            // ns = ((tsc - tscBase) * tscMult) >> tscShift, no 64 bit division
+            static uint32_t tscMult;
+            static uint32_t tscShift;
+            static uint32_t usMult;
+            static uint32_t usShift;
+            static uint64_t tscBase;
+            static uint32_t tscKHz;
+            static volatile uint32_t tickCount;
+            void CalibrateTSC();
         public:
             PITDriver(myos::hardwarecommunication::InterruptManager* manager, PITEventHandler* handler);
             ~PITDriver();
             virtual uint32_t HandleInterrupt(uint32_t esp);
             virtual void Activate();
+            
+            // Monotonic time since Activate(). Uses the TSC calibrated against
+            // PIT channel 2 when the cpu has one, PIT ticks otherwise.
+            static uint64_t Nanoseconds();
+            static uint32_t Microseconds();
+            static uint32_t Milliseconds();
+            // TSC value at which Milliseconds() reaches milli, near now
+            static uint64_t TSCAtMillisecond(uint32_t milli);
+            static uint32_t TSCFrequencyKHz();
+            static uint64_t ReadTSC();
         };
 
     }
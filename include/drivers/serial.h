@@ -11,6 +11,9 @@
 #define SERIAL_PORT_C 0x3E8
 #define SERIAL_PORT_D 0x2E8
 
+#define SERIAL_RING_SIZE	4096	// bytes, power of two
+#define SERIAL_FIFO_SIZE	16	// 16550 transmit FIFO
+
 namespace myos
 {
     namespace drivers
@@ -37,17 +40,30 @@ namespace myos
 	    myos::hardwarecommunication::Port8Bit modemStatusReg;
 	    myos::hardwarecommunication::Port8Bit scratchReg;
 	    
-            uint8_t buffer[3];
-            uint8_t offset;
-            uint8_t buttons;
+	    // Transmit and receive rings. Send() fills txRing and the THRE
+	    // interrupt drains it into the FIFO, the receive interrupt
+	    // empties the FIFO into rxRing for Receive(). Every index is
+	    // written by one side only.
+	    uint8_t txRing[SERIAL_RING_SIZE];
+	    uint8_t rxRing[SERIAL_RING_SIZE];
+	    volatile uint32_t txHead, txTail;
+	    volatile uint32_t rxHead, rxTail;
+	    volatile bool txActive;		// THRE interrupt enabled
+	    uint32_t rxDropped;
 
             SerialEventHandler* handler;
+	    
+	    void Transmit();
         public:
             SerialDriver(myos::hardwarecommunication::InterruptManager* manager, SerialEventHandler* handler);
             ~SerialDriver();
             virtual uint32_t HandleInterrupt(uint32_t esp);
             virtual void Activate();
 	    void Send(uint8_t c);
+	    uint32_t Send(const uint8_t* data, uint32_t length);
+	    uint32_t Receive(uint8_t* data, uint32_t length);
+	    uint32_t Available();
+	    uint32_t Dropped() { return rxDropped; }
 	    int PortIsBusy();
         };
     }
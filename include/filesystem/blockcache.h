@@ -0,0 +1,56 @@
+#ifndef __MYOS__FILESYSTEM_BLOCKCACHE_H
+#define __MYOS__FILESYSTEM_BLOCKCACHE_H
+
+#include <lib/stdint.h>
+#include <drivers/ata.h>
+
+#define BLOCKCACHE_ENTRIES	128	// 64KB of sectors
+#define BLOCKCACHE_MAX_RUN	16	// larger transfers bypass the cache
+
+namespace myos
+{
+  namespace filesystem
+  { 
+    struct BlockCacheEntry
+    {
+      uint32_t sector;
+      uint32_t lastUsed;
+      bool valid;
+      bool dirty;
+    };
+    
+    // Write-back LRU cache of disk sectors between Fat32 and the disk driver.
+    // All storage is part of the object, nothing is allocated at runtime.
+    class BlockCache {
+    
+    private:
+	myos::drivers::BlockDevice *_hd;
+	BlockCacheEntry _entries[BLOCKCACHE_ENTRIES];
+	uint8_t _data[BLOCKCACHE_ENTRIES][ATA_SECTOR_SIZE];
+	uint32_t _clock;
+	int _lastHit;
+	
+	int Find(uint32_t sector);
+	int Allocate(uint32_t sector);
+	int WriteBack(int entry, bool queued = false);
+	void Overlay(uint32_t sector, uint8_t* buffer, uint32_t sectors);
+	
+    public:
+      BlockCache(myos::drivers::BlockDevice *hd);
+      ~BlockCache();
+      
+      void ReadSector(uint32_t sector, uint8_t* buffer, int count = ATA_SECTOR_SIZE);
+      int WriteSector(uint32_t sector, uint8_t* data, uint32_t count);
+      int ReadSectors(uint32_t sector, uint8_t* buffer, uint32_t sectors);
+      int WriteSectors(uint32_t sector, uint8_t* buffer, uint32_t sectors);
+      
+      // direct access to a cached sector, valid until the next cache call
+      uint8_t* GetSector(uint32_t sector);
+      void MarkDirty(uint32_t sector);
+      
+      int Flush();
+      void Invalidate();
+    };
+  }
+}
+#endif
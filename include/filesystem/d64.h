@@ -0,0 +1,81 @@
+#ifndef __MYOS__FILESYSTEM_D64_H
+#define __MYOS__FILESYSTEM_D64_H
+
+#include <lib/stdint.h>
+#include <filesystem/fat.h>
+
+// http://unusedino.de/ec64/technical/formats/d64.html
+
+#define D64_SECTOR_SIZE		256
+#define D64_MAX_TRACKS		40
+#define D64_DIR_TRACK		18
+#define D64_SIZE_35		174848	// 683 sectors
+#define D64_SIZE_35_ERRORS	175531	// followed by one error byte per sector
+#define D64_SIZE_40		196608	// 768 sectors
+#define D64_SIZE_40_ERRORS	197376
+
+namespace myos
+{
+  namespace filesystem
+  {
+    // one CBM directory entry as stored in the image
+    struct D64DirectoryEntry
+    {
+      uint8_t nextTrack;	// only valid in the first entry of a sector
+      uint8_t nextSector;
+      uint8_t type;		// bit 7 closed, bit 6 locked, 0-4 DEL SEQ PRG USR REL
+      uint8_t track;		// first data sector
+      uint8_t sector;
+      uint8_t name[16];		// padded with $A0
+      uint8_t sideTrack;
+      uint8_t sideSector;
+      uint8_t recordLength;
+      uint8_t unused[6];
+      uint16_t blocks;
+    } __attribute__((packed));
+
+    // read position in a file, data bytes of a sector are 2..last
+    struct D64FileStatus
+    {
+      bool open;
+      uint8_t track;
+      uint8_t sector;
+      uint16_t position;	// next byte within the sector
+      uint16_t last;		// last data byte within the sector
+      uint16_t remaining;	// sectors left before a chain is taken as looping
+    };
+
+    // A 1541 disk image read into memory through Fat32. Sectors are
+    // found through a per-track offset table, files are read with the
+    // same calls as Fat32 files. Images are read only.
+    class D64 {
+
+    private:
+	Fat32 *_fs;
+	uint8_t *_image;
+	uint8_t _tracks;
+	uint32_t _trackOffset[D64_MAX_TRACKS + 1];	// byte offset of each track, [0] unused
+	struct D64FileStatus openFilesList[MAX_CBM_FILES_OPEN];
+
+	static uint8_t SectorsPerTrack(uint8_t track);
+	bool NextSector(D64FileStatus* file);
+	D64DirectoryEntry* FindFile(uint8_t* filename, uint8_t length);
+
+    public:
+      D64(Fat32 *fs);
+      ~D64();
+
+      int Mount(uint8_t* filename);
+      uint8_t* Sector(uint8_t track, uint8_t sector);
+
+      int OpenFile(uint8_t filenumber, uint8_t* filename, uint8_t length);
+      int CloseFile(uint8_t filenumber);
+      int ReadNextFileByte(uint8_t filenumber, uint8_t* b);
+      uint32_t ReadFileBlock(uint8_t filenumber, uint8_t* data, uint32_t length);
+
+      void OpenCBMDir(CBMDirCursor* dir, uint16_t address);
+      uint8_t ReadCBMDir(CBMDirCursor* dir, uint8_t* line);
+    };
+  }
+}
+#endif
@@ -9,6 +9,7 @@
 #include <lib/stdio.h>
 #include <lib/vector.h>
 #include <drivers/ata.h>
+#include <filesystem/blockcache.h>
 using namespace myos::drivers;
 // https://www.win.tue.nl/~aeb/linux/fs/fat/fat-1.html
 
@@ -30,8 +31,10 @@ using namespace myos::drivers;
 #define FILE_STATUS_NODEVICE	0x05
 #define FILE_STATUS_FILEEXISTS	0x06
 #define FILE_STATUS_DISKFULL	0x07
+#define FILE_STATUS_NOMEMORY	0x08	// no heap left for the file's buffers
 
-#define MAX_CBM_FILES_OPEN	0x0A
+#define MAX_CBM_FILES_OPEN	0x0F	// one per drive channel, 15 is the command channel
+#define CBMDIR_MAX_LINE		32	// longest line ReadCBMDir hands out
 
 namespace myos
 {
@@ -104,6 +107,18 @@ namespace myos
       uint8_t fatTypeLabel[8];	// Filesystem type ("FAT32   ")
     } __attribute__((packed));
     
+    // FAT32 FSInfo sector (usually sector 1 of the partition)
+    struct FSInfo32
+    {
+      uint32_t leadSignature;	// 0x41615252
+      uint8_t reserved0[480];
+      uint32_t structSignature;	// 0x61417272
+      uint32_t freeCount;	// free clusters, 0xFFFFFFFF if unknown
+      uint32_t nextFree;	// where to start looking, 0xFFFFFFFF if unknown
+      uint8_t reserved1[12];
+      uint32_t trailSignature;	// 0xAA550000
+    } __attribute__((packed));
+    
     struct DirectoryEntryFat32
     {
       uint8_t name[8];
@@ -123,6 +138,13 @@ namespace myos
       uint32_t size;		// File size in bytes
     } __attribute__((packed));
     
+    // run of contiguous clusters of a file
+    struct FileExtent
+    {
+      uint32_t cluster;		// first disk cluster of the run
+      uint32_t count;		// clusters in the run
+    };
+    
     struct FileStatus 
     {
       uint8_t mode;
@@ -130,15 +152,49 @@ namespace myos
       uint8_t ext[3];
       uint32_t size;
       uint32_t locationPtr;
-      uint8_t* buffer;
-      //Vector<uint8_t> fileBuffer;
+      Vector<uint8_t> buffer;	// whole file when reading, a cluster when writing
       uint32_t startingCluster;
+      uint32_t lastCluster;	// tail of the chain while writing
+    };
+
+    // root directory entry kept in the hashed index
+    struct DirectoryIndexEntry
+    {
+      uint8_t name[11];		// 8.3 as on disk, name[0] == 0 marks a free slot
+      uint8_t attributes;
+      uint32_t cluster;
+      uint32_t size;
+      uint32_t sector;		// disk sector holding the entry
+      uint16_t offset;		// byte offset within that sector
+      int32_t next;		// next entry in the bucket (or free list), -1 ends
+    };
+    
+    // position in a cluster chain, one cluster is buffered at a time
+    struct ChainCursor
+    {
+      uint32_t cluster;		// cluster held in buffer (or to be read next)
+      uint32_t sector;		// disk sector of the last sector handed out
+      uint16_t index;		// next sector within the cluster
+      bool loaded;
+      uint8_t endOfChain;
+      uint8_t* buffer;		// one cluster
+    };
+
+    // walks the root directory as a BASIC listing, one line per call
+    struct CBMDirCursor
+    {
+      uint16_t address;		// load address of the next line
+      uint32_t cluster;		// directory cluster being walked
+      uint16_t sector;		// sector within the cluster
+      uint16_t entry;		// entry within the sector
+      uint8_t state;		// header, files, blocks free, end marker, done
     };
 
     class Fat32 {
     
     private:
-	myos::drivers::AdvancedTechnologyAttachment *_hd;
+	myos::drivers::BlockDevice *_hd;
+	BlockCache _cache;		// all disk access goes through here
 	uint8_t _partition;
 	MasterBootRecord _mbr;
 	BiosParameterBlock32 _bpb;
@@ -146,19 +202,54 @@ namespace myos
 	uint32_t _fatStart;
 	uint32_t _dataStart;
 	uint32_t _rootStart;
-	uint8_t* _fat;
 	uint32_t _lastSectorRead;
-	uint8_t *_fatBuffer;
+	uint32_t _clusterCount;		// highest valid cluster + 1
+	uint32_t _nextFree;		// allocation starts looking here
+	uint32_t _freeCount;
+	uint32_t _fsInfoSector;		// 0 if the volume has no valid FSInfo
+	
+	ChainCursor _dirChain;
+	
+	Vector<DirectoryIndexEntry> _dirIndex;	// slots handed out so far
+	Vector<int32_t> _dirBuckets;	// a power of 2, grown with the entries
+	int32_t _dirIndexFree;
+	bool _dirIndexBuilt;
+	uint8_t _volumeLabel[11];	// picked up while building the index
+	bool _mounted;			// Mount() ran
+	bool _valid;			// and found the partition
+	
+	static uint32_t HashName(const uint8_t* name);
+	void BuildDirectoryIndex();
+	bool GrowDirectoryIndex();
+	void DropDirectoryIndex();
+	int32_t AddIndexEntry(const uint8_t* name, uint8_t attributes, uint32_t cluster, uint32_t size, uint32_t sector, uint16_t offset);
+	void RemoveIndexEntry(int32_t entry);
+	int32_t FindIndexEntry(const uint8_t* name);
+	int32_t FindFile(uint8_t* filename);
+	uint8_t* IndexEntryData(int32_t entry);
 	
 	void LoadFAT();
 	uint8_t* ReadNextSectorInChain(uint32_t startOfChain);
+	uint8_t* ReadNextSectorInChain(ChainCursor* cursor, uint32_t startOfChain);
+	uint32_t NextCluster(uint32_t cluster);
+	void SetCluster(uint32_t cluster, uint32_t value);
+	void AppendClusters(uint8_t filenumber, uint32_t first, uint32_t count);
+	void UpdateFSInfo();
+	uint32_t FreeClusters();
+	uint32_t ClusterRun(uint32_t cluster, uint32_t maxClusters, uint32_t* next);
+	bool BuildExtents(uint32_t startCluster, Vector<FileExtent>* extents);
+	uint32_t ReadExtents(const Vector<FileExtent>& extents, uint8_t* data, uint32_t size);
+	inline bool EndOfChain(uint32_t cluster) { return cluster < 2 || cluster >= BADCLUSTER_FAT32; }
+	inline uint32_t ClusterToSector(uint32_t cluster) { return ((cluster-2) * _bpb.sectorsPerCluster) + _dataStart; }
 	struct FileStatus openFilesList[MAX_CBM_FILES_OPEN];
 
 	
     public:
-      Fat32(myos::drivers::AdvancedTechnologyAttachment *hd, uint8_t partition);
+      Fat32(myos::drivers::BlockDevice *hd, uint8_t partition);
       ~Fat32();
       
+      bool Mount();
+      
       void ReadDirectory(uint32_t startCluster);
       void ReadFile(uint8_t *filename, uint8_t* data, uint32_t size);     
       void ReadPartitions();
@@ -169,10 +260,13 @@ namespace myos
       int OpenFile(uint8_t filenumber, uint8_t* filename, uint8_t mode);
       int CloseFile(uint8_t filenumber);
       int ReadNextFileByte(uint8_t filenumber, uint8_t* b);
+      uint32_t ReadFileBlock(uint8_t filenumber, uint8_t* data, uint32_t length);
       
       int ParseFilename(uint8_t* filename, uint8_t* filename8, uint8_t* ext);
       int AllocateCluster(uint32_t* startingCluster);
+      int AllocateRun(uint32_t wanted, uint32_t* first, uint32_t* count);
       int WriteNextFileByte(uint8_t filenumber, uint8_t b);
+      int WriteFileBlock(uint8_t filenumber, uint8_t* data, uint32_t length);
       int FlushWriteBuffer(uint8_t filenumber);
       void ResetOpenFileListEntry(uint8_t filenumber);
       
@@ -183,7 +277,9 @@ namespace myos
       
       void WriteDir(uint8_t* filename, uint8_t* ext, uint32_t size);
       
-      uint16_t GetCBMDir(uint8_t *buffer);
+      void OpenCBMDir(CBMDirCursor* dir, uint16_t address);
+      uint8_t ReadCBMDir(CBMDirCursor* dir, uint8_t* line);
+      static uint8_t CBMDirLine(CBMDirCursor* dir, uint8_t* line, uint16_t number, uint8_t length);
      
       
     };
@@ -28,6 +28,19 @@ namespace myos
         };
 
 
+        // A one-shot timer that replaces the periodic tick. The interrupt
+        // manager brings its clock up to date before any handler runs and
+        // lets it arm the next interrupt for whatever the task manager has
+        // due once they are done.
+        class EventTimer
+        {
+        public:
+            EventTimer();
+            virtual void Update();
+            virtual void Program(TaskManager* taskManager);
+        };
+
+
         class InterruptManager
         {
             friend class InterruptHandler;
@@ -55,6 +68,8 @@ namespace myos
                 } __attribute__((packed));
 
                 uint16_t hardwareInterruptOffset;
+                uint16_t timerInterrupt;    // the scheduler runs on it
+                EventTimer* eventTimer;
                 static void SetInterruptDescriptorTableEntry(uint8_t interrupt,
                     uint16_t codeSegmentSelectorOffset, void (*handler)(),
                     uint8_t DescriptorPrivilegeLevel, uint8_t DescriptorType);
@@ -78,6 +93,7 @@ namespace myos
                 static void HandleInterruptRequest0x0D();
                 static void HandleInterruptRequest0x0E();
                 static void HandleInterruptRequest0x0F();
+                static void HandleInterruptRequest0x10();
                 static void HandleInterruptRequest0x31();
 
                 static void HandleInterruptRequest0x80();
@@ -115,6 +131,7 @@ namespace myos
                 InterruptManager(uint16_t hardwareInterruptOffset, myos::GlobalDescriptorTable* globalDescriptorTable, myos::TaskManager* taskManager);
                 ~InterruptManager();
                 uint16_t HardwareInterruptOffset();
+                void SetEventTimer(uint8_t interrupt, EventTimer* timer);
                 void Activate();
                 void Deactivate();
         };
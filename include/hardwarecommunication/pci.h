@@ -76,6 +76,7 @@ namespace myos
             myos::drivers::Driver* GetDriver(PeripheralComponentInterconnectDeviceDescriptor dev, myos::hardwarecommunication::InterruptManager* interrupts);
             PeripheralComponentInterconnectDeviceDescriptor GetDeviceDescriptor(uint16_t bus, uint16_t device, uint16_t function);
             BaseAddressRegister GetBaseAddressRegister(uint16_t bus, uint16_t device, uint16_t function, uint16_t bar);
+            bool FindDevice(uint8_t class_id, uint8_t subclass_id, PeripheralComponentInterconnectDeviceDescriptor* dev);
         };
 
     }
@@ -69,6 +69,8 @@ namespace myos
 
                 virtual uint16_t Read();
                 virtual void Write(uint16_t data);
+                void ReadString(uint16_t* data, uint32_t count);
+                void WriteString(const uint16_t* data, uint32_t count);
 
             protected:
                 static inline uint16_t Read16(uint16_t _port)
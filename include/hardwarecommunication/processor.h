@@ -0,0 +1,35 @@
+#ifndef __MYOS__HARDWARECOMMUNICATION__PROCESSOR_H
+#define __MYOS__HARDWARECOMMUNICATION__PROCESSOR_H
+
+#include <lib/stdint.h>
+
+namespace myos
+{
+    namespace hardwarecommunication
+    {
+
+        // Feature detection and control register setup for the host cpu.
+        // SSE state is not saved on task switches, so only the emulator
+        // task may use SSE instructions.
+        class Processor
+        {
+            protected:
+                static bool sseEnabled;
+                static uint32_t writeCombiningBase;
+                static uint32_t writeCombiningSize;
+                static void CPUID(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx);
+                static void ReadMSR(uint32_t msr, uint32_t* lo, uint32_t* hi);
+                static void WriteMSR(uint32_t msr, uint32_t lo, uint32_t hi);
+
+            public:
+                static bool HasSSE2();
+                static bool EnableSSE();
+                static bool SSEEnabled();
+                static bool SetWriteCombining(uint32_t base, uint32_t size);
+                static bool ReplicateWriteCombining();
+        };
+
+    }
+}
+
+#endif
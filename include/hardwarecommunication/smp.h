@@ -0,0 +1,80 @@
+#ifndef __MYOS__HARDWARECOMMUNICATION__SMP_H
+#define __MYOS__HARDWARECOMMUNICATION__SMP_H
+
+#include <lib/stdint.h>
+#include <multiboot.h>
+
+// ACPI, the RSDP is searched in the first KB of the EBDA and the BIOS area
+#define ACPI_EBDA_SEGMENT_PTR		0x040E
+#define ACPI_BIOS_AREA_START		0x000E0000
+#define ACPI_BIOS_AREA_END		0x00100000
+#define ACPI_SDT_HEADER_SIZE		36
+#define ACPI_MADT_LAPIC_PROCESSOR	0
+#define ACPI_MADT_ENABLED		0x01
+
+// Local APIC registers, offsets in bytes from the MADT base
+#define LAPIC_DEFAULT_BASE		0xFEE00000
+#define LAPIC_ID			0x020
+#define LAPIC_ICR_LOW			0x300
+#define LAPIC_ICR_HIGH			0x310
+#define LAPIC_ICR_INIT			0x00004500
+#define LAPIC_ICR_STARTUP		0x00004600
+#define LAPIC_ICR_PENDING		0x00001000
+
+// real mode entry of the application processors, one page below 1MB,
+// smpboot.s has the same address
+#define SMP_TRAMPOLINE			0x8000
+#define SMP_TRAMPOLINE_SIZE		0x1000
+#define SMP_MAX_PROCESSORS		16
+#define SMP_STACK_SIZE			16384
+
+namespace myos
+{
+    namespace hardwarecommunication
+    {
+
+        typedef void (*ProcessorJob)(void* arg);
+
+        // Finds the processors in the ACPI MADT and boots the first
+        // application processor as a worker. The worker runs with
+        // interrupts off and no IDT, it spins on a one slot mailbox
+        // and runs each job posted to it. There is one producer, the
+        // bootstrap processor, so no locks are needed.
+        class MultiprocessorController
+        {
+        private:
+            volatile uint32_t* localApic;
+            uint8_t apicIds[SMP_MAX_PROCESSORS];
+            int numProcessors;
+            uint8_t* workerStack;
+
+            static volatile bool workerRunning;
+            static volatile ProcessorJob workerJob;
+            static void* volatile workerArg;
+
+            uint8_t* FindRSDP();
+            uint8_t* FindTable(uint8_t* rsdp, const char* signature);
+            void WriteICR(uint8_t apicId, uint32_t command);
+            void Delay(uint32_t us);
+            bool TrampolineFree(const multiboot_info_t* boot);
+
+        public:
+            MultiprocessorController();
+            ~MultiprocessorController();
+
+            bool Detect();
+            int ProcessorCount() { return numProcessors; }
+            bool StartWorker(const multiboot_info_t* boot);
+            bool WorkerRunning() { return workerRunning; }
+
+            bool Submit(ProcessorJob job, void* arg);
+            bool Busy() { return workerJob != 0; }
+            void Wait();
+
+            static void WorkerMain();
+        };
+
+    }
+}
+
+#endif
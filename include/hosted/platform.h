@@ -0,0 +1,46 @@
+#ifndef __MYOS__HOSTED__PLATFORM_H
+#define __MYOS__HOSTED__PLATFORM_H
+
+#include <lib/stdint.h>
+
+// The hosted build runs the emulator core as a plain 32 bit Linux
+// process, built with the kernel flags and without a C library. It
+// talks to the host through int $0x80 system calls only, everything
+// the core expects from the kernel and its drivers is stubbed in
+// platform.cpp.
+
+#define HOST_SYSCALL_EXIT           1
+#define HOST_SYSCALL_WRITE          4
+#define HOST_SYSCALL_CLOCK_GETTIME  265
+#define HOST_CLOCK_MONOTONIC        1
+#define HOST_STDOUT                 1
+
+// heap handed to the MemoryManager, the machines and their arenas live in it
+#define HOST_HEAP_SIZE              (64*1024*1024)
+
+namespace myos
+{
+    namespace hosted
+    {
+
+        class Host
+        {
+        private:
+            static uint32_t tscKHz;
+            static uint32_t tickTsc;
+            static uint32_t tickRemainder;
+        public:
+            static void Init();
+            static void Write(const void* data, uint32_t length);
+            static void Flush();
+            static void Exit(int status);
+            static uint32_t Microseconds();
+            // advances current_milli from the TSC, call it often
+            static void Tick();
+            static uint32_t TSCFrequencyKHz() { return tscKHz; }
+        };
+
+    }
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define __STDLIB_H
 
 char* itoa(int value, char* result, int base);
+char* utoh(unsigned int value, char* result, int digits);
 unsigned int htoi (const char *ptr);
 int atoi(char *str);
 
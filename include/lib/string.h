@@ -20,6 +20,10 @@ void memset( void *d, char value, unsigned length );
 void* memcpy(uint16_t* destination, const uint16_t* source, size_t num);
 void* memcpy(uint8_t* destination, const uint8_t* source, size_t num);
 void memcpy(void *dest, const void *source, size_t num);
+void* memmove(void *dest, const void *source, size_t num);
+int memcmp(const void *a, const void *b, size_t num);
+// picks the SSE2 kernels, only once the processor has SSE enabled
+void mem_select(bool sse2);
 
 int strncasecmp(const char *s1, const char *s2, size_t n);
 char toupper(char c);
@@ -1,17 +1,71 @@
 #ifndef VECTOR_H
 #define VECTOR_H
 
+#include <lib/stdint.h>
+#include <memorymanagement.h>
+
+// Where a Vector's storage comes from. The allocator object is kept in
+// the container. HeapAllocator is the kernel heap; ArenaAllocator takes
+// blocks from a MemoryArena (e.g. a machine's) and never gives them back,
+// they go when the arena is released.
+class HeapAllocator
+{
+public:
+    void * allocate(unsigned int bytes) { return ::operator new(bytes); }
+    void deallocate(void * p) { ::operator delete(p); }
+};
+
+class ArenaAllocator
+{
+public:
+    ArenaAllocator(myos::MemoryArena * arena = 0) : arena(arena) {}
+    void * allocate(unsigned int bytes) { return arena->Allocate(bytes); }
+    void deallocate(void * p) {}
+private:
+    myos::MemoryArena * arena;
+};
+
+#if __cplusplus >= 201103L
+template <class T> struct VectorRemoveReference { typedef T type; };
+template <class T> struct VectorRemoveReference<T &> { typedef T type; };
+template <class T> struct VectorRemoveReference<T &&> { typedef T type; };
+
 template <class T>
+inline typename VectorRemoveReference<T>::type && vector_move(T && v)
+{
+    return static_cast<typename VectorRemoveReference<T>::type &&>(v);
+}
+
+template <class T>
+inline T && vector_forward(typename VectorRemoveReference<T>::type & v)
+{
+    return static_cast<T &&>(v);
+}
+#define VECTOR_MOVE(v) vector_move(v)
+#else
+#define VECTOR_MOVE(v) (v)
+#endif
+
+// Elements are constructed in place in raw storage, only size() of them
+// exist. The capacity doubles when it runs out. Functions that may have
+// to allocate return false when that fails, the vector is left as it
+// was. Moves (C++11 builds) take the other vector's storage instead of
+// copying, unless it is the inline storage of a SmallVector.
+template <class T, class Allocator = HeapAllocator>
 class  Vector
 {
 public:
 
     typedef T * iterator;
+    typedef const T * const_iterator;
 
-    Vector();
+    Vector(const Allocator & allocator = Allocator());
     Vector(unsigned int size);
-    Vector(unsigned int size, const T & initial);
-    Vector(const Vector<T> & v);      
+    Vector(unsigned int size, const T & initial, const Allocator & allocator = Allocator());
+    Vector(const Vector<T, Allocator> & v);
+#if __cplusplus >= 201103L
+    Vector(Vector<T, Allocator> && v);
+#endif
     ~Vector();
 
     unsigned int capacity() const;
@@ -19,167 +73,511 @@ public:
     bool empty() const;
     iterator begin();
     iterator end();
+    const_iterator begin() const;
+    const_iterator end() const;
+    T * data();
     T & front();
     T & back();
-    void push_back(const T & value); 
-    void pop_back();  
-
-    void reserve(unsigned int capacity);   
-    void resize(unsigned int size);   
-    
-    T & operator[](unsigned int index);  
-    Vector<T> & operator=(const Vector<T> &);
+    bool push_back(const T & value);
+#if __cplusplus >= 201103L
+    bool push_back(T && value);
+    template <class... Args>
+    bool emplace_back(Args &&... args);
+#else
+    bool emplace_back();
+#endif
+    void pop_back();
+
+    bool reserve(unsigned int capacity);
+    bool resize(unsigned int size);
+    bool resize(unsigned int size, const T & value);
+    void shrink_to_fit();
+
+    T & operator[](unsigned int index);
+    const T & operator[](unsigned int index) const;
+    Vector<T, Allocator> & operator=(const Vector<T, Allocator> &);
+#if __cplusplus >= 201103L
+    Vector<T, Allocator> & operator=(Vector<T, Allocator> && v);
+#endif
+    void swap(Vector<T, Allocator> & v);
     void clear();
+    const Allocator & allocator() const;
+
+protected:
+    // SmallVector hands in its inline storage
+    Vector(T * small, unsigned int smallCapacity, const Allocator & allocator);
+
 private:
     unsigned int my_size;
     unsigned int my_capacity;
     T * buffer;
+    T * my_small;                   // inline storage, 0 if there is none
+    unsigned int my_small_capacity;
+    Allocator my_allocator;
+
+    bool grow();
+    bool relocate(unsigned int capacity);
+    void release();
+    void destroy(unsigned int from);
+    bool uses_small() const { return buffer != 0 && buffer == my_small; }
 };
 
-template<class T>
-Vector<T>::Vector()
+// Vector with room for N elements inside the object itself, it only
+// allocates when it grows past them. Copies and moves of the inline
+// elements are element by element.
+template <class T, unsigned int N, class Allocator = HeapAllocator>
+class SmallVector : public Vector<T, Allocator>
+{
+public:
+    SmallVector(const Allocator & allocator = Allocator())
+    : Vector<T, Allocator>((T *)storage, N, allocator) {}
+
+    SmallVector(const SmallVector<T, N, Allocator> & v)
+    : Vector<T, Allocator>((T *)storage, N, v.allocator())
+    {
+        Vector<T, Allocator>::operator=(v);
+    }
+
+    SmallVector(const Vector<T, Allocator> & v)
+    : Vector<T, Allocator>((T *)storage, N, v.allocator())
+    {
+        Vector<T, Allocator>::operator=(v);
+    }
+
+    SmallVector<T, N, Allocator> & operator=(const SmallVector<T, N, Allocator> & v)
+    {
+        Vector<T, Allocator>::operator=(v);
+        return *this;
+    }
+
+    SmallVector<T, N, Allocator> & operator=(const Vector<T, Allocator> & v)
+    {
+        Vector<T, Allocator>::operator=(v);
+        return *this;
+    }
+
+#if __cplusplus >= 201103L
+    SmallVector(SmallVector<T, N, Allocator> && v)
+    : Vector<T, Allocator>((T *)storage, N, v.allocator())
+    {
+        Vector<T, Allocator>::operator=(vector_move(v));
+    }
+
+    SmallVector(Vector<T, Allocator> && v)
+    : Vector<T, Allocator>((T *)storage, N, v.allocator())
+    {
+        Vector<T, Allocator>::operator=(vector_move(v));
+    }
+
+    SmallVector<T, N, Allocator> & operator=(SmallVector<T, N, Allocator> && v)
+    {
+        Vector<T, Allocator>::operator=(vector_move(v));
+        return *this;
+    }
+
+    SmallVector<T, N, Allocator> & operator=(Vector<T, Allocator> && v)
+    {
+        Vector<T, Allocator>::operator=(vector_move(v));
+        return *this;
+    }
+#endif
+
+private:
+    uint8_t storage[N * sizeof(T)] __attribute__((aligned(__alignof__(T))));
+};
+
+template<class T, class Allocator>
+Vector<T, Allocator>::Vector(const Allocator & allocator)
+: my_allocator(allocator)
 {
     my_capacity = 0;
     my_size = 0;
     buffer = 0;
+    my_small = 0;
+    my_small_capacity = 0;
 }
 
-template<class T>
-Vector<T>::Vector(const Vector<T> & v)
+template<class T, class Allocator>
+Vector<T, Allocator>::Vector(T * small, unsigned int smallCapacity, const Allocator & allocator)
+: my_allocator(allocator)
 {
-    my_size = v.my_size;
-    my_capacity = v.my_capacity;
-    buffer = new T[my_size];  
-    for (unsigned int i = 0; i < my_size; i++)
-        buffer[i] = v.buffer[i];  
+    my_capacity = smallCapacity;
+    my_size = 0;
+    buffer = small;
+    my_small = small;
+    my_small_capacity = smallCapacity;
+}
+
+template<class T, class Allocator>
+Vector<T, Allocator>::Vector(const Vector<T, Allocator> & v)
+: my_allocator(v.my_allocator)
+{
+    my_capacity = 0;
+    my_size = 0;
+    buffer = 0;
+    my_small = 0;
+    my_small_capacity = 0;
+    *this = v;
 }
 
-template<class T>
-Vector<T>::Vector(unsigned int size)
+#if __cplusplus >= 201103L
+template<class T, class Allocator>
+Vector<T, Allocator>::Vector(Vector<T, Allocator> && v)
+: my_allocator(v.my_allocator)
 {
-    my_capacity = size;
-    my_size = size;
-    buffer = new T[size];
+    my_capacity = 0;
+    my_size = 0;
+    buffer = 0;
+    my_small = 0;
+    my_small_capacity = 0;
+    *this = vector_move(v);
 }
+#endif
 
-template<class T>
-Vector<T>::Vector(unsigned int size, const T & initial)
+template<class T, class Allocator>
+Vector<T, Allocator>::Vector(unsigned int size)
 {
-    my_size = size;
-    my_capacity = size;
-    buffer = new T [size];
-    for (unsigned int i = 0; i < size; i++)
-        buffer[i] = initial;
-    //T();
+    my_capacity = 0;
+    my_size = 0;
+    buffer = 0;
+    my_small = 0;
+    my_small_capacity = 0;
+    resize(size);
 }
 
-template<class T>
-Vector<T> & Vector<T>::operator = (const Vector<T> & v)
+template<class T, class Allocator>
+Vector<T, Allocator>::Vector(unsigned int size, const T & initial, const Allocator & allocator)
+: my_allocator(allocator)
 {
-    delete[ ] buffer;
+    my_capacity = 0;
+    my_size = 0;
+    buffer = 0;
+    my_small = 0;
+    my_small_capacity = 0;
+    resize(size, initial);
+}
+
+template<class T, class Allocator>
+Vector<T, Allocator> & Vector<T, Allocator>::operator = (const Vector<T, Allocator> & v)
+{
+    if (this == &v)
+        return *this;
+    clear();
+    if (!reserve(v.my_size))
+        return *this;
+    for (unsigned int i = 0; i < v.my_size; i++)
+        new(buffer + i) T(v.buffer[i]);
     my_size = v.my_size;
-    my_capacity = v.my_capacity;
-    buffer = new T [my_size];
-    for (unsigned int i = 0; i < my_size; i++)
-        buffer[i] = v.buffer[i];
     return *this;
 }
 
-template<class T>
-typename Vector<T>::iterator Vector<T>::begin()
+#if __cplusplus >= 201103L
+// takes v's heap storage along with its allocator, inline elements are
+// moved one by one
+template<class T, class Allocator>
+Vector<T, Allocator> & Vector<T, Allocator>::operator = (Vector<T, Allocator> && v)
+{
+    if (this == &v)
+        return *this;
+    clear();
+    if (v.buffer != 0 && !v.uses_small())
+    {
+        release();
+        my_allocator = v.my_allocator;
+        buffer = v.buffer;
+        my_size = v.my_size;
+        my_capacity = v.my_capacity;
+        v.buffer = v.my_small;
+        v.my_capacity = v.my_small_capacity;
+        v.my_size = 0;
+        return *this;
+    }
+    if (!reserve(v.my_size))
+        return *this;
+    for (unsigned int i = 0; i < v.my_size; i++)
+        new(buffer + i) T(vector_move(v.buffer[i]));
+    my_size = v.my_size;
+    v.clear();
+    return *this;
+}
+#endif
+
+template<class T, class Allocator>
+void Vector<T, Allocator>::swap(Vector<T, Allocator> & v)
+{
+    if (uses_small() || v.uses_small())
+    {
+        Vector<T, Allocator> t(VECTOR_MOVE(v));
+        v = VECTOR_MOVE(*this);
+        *this = VECTOR_MOVE(t);
+        return;
+    }
+    T * b = buffer; buffer = v.buffer; v.buffer = b;
+    unsigned int s = my_size; my_size = v.my_size; v.my_size = s;
+    unsigned int c = my_capacity; my_capacity = v.my_capacity; v.my_capacity = c;
+    Allocator a = my_allocator; my_allocator = v.my_allocator; v.my_allocator = a;
+    // an empty SmallVector has no storage of its own to swap
+    if (buffer == 0) { buffer = my_small; my_capacity = my_small_capacity; }
+    if (v.buffer == 0) { v.buffer = v.my_small; v.my_capacity = v.my_small_capacity; }
+}
+
+template<class T, class Allocator>
+typename Vector<T, Allocator>::iterator Vector<T, Allocator>::begin()
 {
     return buffer;
 }
 
-template<class T>
-typename Vector<T>::iterator Vector<T>::end()
+template<class T, class Allocator>
+typename Vector<T, Allocator>::iterator Vector<T, Allocator>::end()
 {
     return buffer + size();
 }
 
-template<class T>
-T& Vector<T>::front()
+template<class T, class Allocator>
+typename Vector<T, Allocator>::const_iterator Vector<T, Allocator>::begin() const
+{
+    return buffer;
+}
+
+template<class T, class Allocator>
+typename Vector<T, Allocator>::const_iterator Vector<T, Allocator>::end() const
+{
+    return buffer + size();
+}
+
+template<class T, class Allocator>
+T * Vector<T, Allocator>::data()
+{
+    return buffer;
+}
+
+template<class T, class Allocator>
+T& Vector<T, Allocator>::front()
 {
     return buffer[0];
 }
 
-template<class T>
-T& Vector<T>::back()
+template<class T, class Allocator>
+T& Vector<T, Allocator>::back()
 {
     return buffer[my_size - 1];
 }
 
-template<class T>
-void Vector<T>::push_back(const T & v)
+// value may live in the vector itself, it is copied before the
+// storage moves
+template<class T, class Allocator>
+bool Vector<T, Allocator>::push_back(const T & v)
 {
-    if (my_size >= my_capacity)
-        reserve(my_capacity +5);
-    buffer [my_size++] = v;
+    if (my_size < my_capacity)
+    {
+        new(buffer + my_size++) T(v);
+        return true;
+    }
+    T value(v);
+    if (!grow())
+        return false;
+    new(buffer + my_size++) T(VECTOR_MOVE(value));
+    return true;
 }
 
-template<class T>
-void Vector<T>::pop_back()
+#if __cplusplus >= 201103L
+template<class T, class Allocator>
+bool Vector<T, Allocator>::push_back(T && v)
 {
-    my_size--;
+    if (my_size < my_capacity)
+    {
+        new(buffer + my_size++) T(vector_move(v));
+        return true;
+    }
+    T value(vector_move(v));
+    if (!grow())
+        return false;
+    new(buffer + my_size++) T(vector_move(value));
+    return true;
 }
 
-template<class T>
-void Vector<T>::reserve(unsigned int capacity)
+template<class T, class Allocator>
+template<class... Args>
+bool Vector<T, Allocator>::emplace_back(Args &&... args)
 {
-    if(buffer == 0)
+    if (my_size < my_capacity)
     {
-        my_size = 0;
-        my_capacity = 0;
-    }    
-    T * Newbuffer = new T [capacity];
-    //assert(Newbuffer);
-    unsigned int l_Size = capacity < my_size ? capacity : my_size;
-    //copy (buffer, buffer + l_Size, Newbuffer);
+        new(buffer + my_size++) T(vector_forward<Args>(args)...);
+        return true;
+    }
+    T value(vector_forward<Args>(args)...);
+    if (!grow())
+        return false;
+    new(buffer + my_size++) T(vector_move(value));
+    return true;
+}
+#else
+// default constructs the new element in place, fill it in through back()
+template<class T, class Allocator>
+bool Vector<T, Allocator>::emplace_back()
+{
+    if (my_size == my_capacity && !grow())
+        return false;
+    new(buffer + my_size++) T();
+    return true;
+}
+#endif
+
+template<class T, class Allocator>
+void Vector<T, Allocator>::pop_back()
+{
+    buffer[--my_size].~T();
+}
+
+template<class T, class Allocator>
+bool Vector<T, Allocator>::reserve(unsigned int capacity)
+{
+    if (capacity <= my_capacity)
+        return true;
+    return relocate(capacity);
+}
+
+template<class T, class Allocator>
+bool Vector<T, Allocator>::grow()
+{
+    return relocate(my_capacity ? my_capacity * 2 : 4);
+}
 
-    for (unsigned int i = 0; i < l_Size; i++)
-        Newbuffer[i] = buffer[i];
+// Moves the elements to storage for capacity of them, the inline storage
+// if they fit there
+template<class T, class Allocator>
+bool Vector<T, Allocator>::relocate(unsigned int capacity)
+{
+    T * to = my_small;
+    if (capacity > my_small_capacity)
+    {
+        to = (T *)my_allocator.allocate(capacity * sizeof(T));
+        if (to == 0)
+            return false;
+    }
+    else
+        capacity = my_small_capacity;
+    if (to == buffer)
+        return true;
 
+    for (unsigned int i = 0; i < my_size; i++)
+    {
+        new(to + i) T(VECTOR_MOVE(buffer[i]));
+        buffer[i].~T();
+    }
+    release();
+    buffer = to;
     my_capacity = capacity;
-    delete[] buffer;
-    buffer = Newbuffer;
+    return true;
 }
 
-template<class T>
-unsigned int Vector<T>::size()const//
+// gives back heap storage, the elements must be gone already
+template<class T, class Allocator>
+void Vector<T, Allocator>::release()
+{
+    if (buffer != 0 && buffer != my_small)
+        my_allocator.deallocate(buffer);
+    buffer = my_small;
+    my_capacity = my_small_capacity;
+}
+
+template<class T, class Allocator>
+void Vector<T, Allocator>::destroy(unsigned int from)
+{
+    for (unsigned int i = from; i < my_size; i++)
+        buffer[i].~T();
+    my_size = from;
+}
+
+template<class T, class Allocator>
+unsigned int Vector<T, Allocator>::size()const//
 {
     return my_size;
 }
 
-template<class T>
-void Vector<T>::resize(unsigned int size)
+template<class T, class Allocator>
+bool Vector<T, Allocator>::empty()const
+{
+    return my_size == 0;
+}
+
+template<class T, class Allocator>
+bool Vector<T, Allocator>::resize(unsigned int size)
+{
+    if (size < my_size)
+    {
+        destroy(size);
+        return true;
+    }
+    if (!reserve(size))
+        return false;
+    for (; my_size < size; my_size++)
+        new(buffer + my_size) T();
+    return true;
+}
+
+template<class T, class Allocator>
+bool Vector<T, Allocator>::resize(unsigned int size, const T & value)
 {
-    reserve(size);
-    my_size = size;
+    if (size < my_size)
+    {
+        destroy(size);
+        return true;
+    }
+    T copy(value);
+    if (!reserve(size))
+        return false;
+    for (; my_size < size; my_size++)
+        new(buffer + my_size) T(copy);
+    return true;
 }
 
-template<class T>
-T& Vector<T>::operator[](unsigned int index)
+// down to size() elements, empty gives all heap storage back
+template<class T, class Allocator>
+void Vector<T, Allocator>::shrink_to_fit()
+{
+    if (my_size == 0)
+        release();
+    else if (my_size < my_capacity)
+        relocate(my_size);
+}
+
+template<class T, class Allocator>
+T& Vector<T, Allocator>::operator[](unsigned int index)
 {
     return buffer[index];
-}  
+}
+
+template<class T, class Allocator>
+const T& Vector<T, Allocator>::operator[](unsigned int index) const
+{
+    return buffer[index];
+}
 
-template<class T>
-unsigned int Vector<T>::capacity()const
+template<class T, class Allocator>
+unsigned int Vector<T, Allocator>::capacity()const
 {
     return my_capacity;
 }
 
-template<class T>
-Vector<T>::~Vector()
+template<class T, class Allocator>
+const Allocator & Vector<T, Allocator>::allocator()const
 {
-    delete[ ] buffer;
+    return my_allocator;
 }
-template <class T>
-void Vector<T>::clear()
+
+template<class T, class Allocator>
+Vector<T, Allocator>::~Vector()
 {
-    my_capacity = 0;
-    my_size = 0;
-    buffer = 0;
+    destroy(0);
+    release();
+}
+
+// the elements go, the capacity stays
+template <class T, class Allocator>
+void Vector<T, Allocator>::clear()
+{
+    destroy(0);
 }
 
-#endif
\ No newline at end of file
+#endif
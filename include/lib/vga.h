@@ -538,12 +538,19 @@ static uint32_t vga_height;
 static uint32_t vga_pitch;
 static uint8_t vga_mode_bpp;
 static uint8_t vga_pixel_width;
-static uint8_t vga_textCols=100, vga_textRows=37;
+#define VGA_MAX_COLS 100
+#define VGA_MAX_ROWS 37
+#define VGA_GLYPH_HEIGHT 16
+static uint8_t vga_textCols=VGA_MAX_COLS, vga_textRows=VGA_MAX_ROWS;
 static uint8_t vga_cursorCol=0,vga_cursorRow=0;
 static uint8_t vga_backColor=0, vga_foreColor=15;
 static uint8_t vga_cursorOn=0;
 static uint16_t vga_color_palette[16];
-static uint8_t vga_textscreen[100][37];
+// text cells row by row, and the glyph each cell shows on screen
+static uint8_t vga_textscreen[VGA_MAX_ROWS][VGA_MAX_COLS];
+static uint8_t vga_drawn[VGA_MAX_ROWS][VGA_MAX_COLS];
+// font byte to 8 pixels in the text colors
+static uint16_t vga_glyph_rows[256][8];
 
 void vga_init(uint32_t* videoMem, uint32_t vga_width, uint32_t vga_height, uint32_t vga_pitch, uint8_t vga_mode_bpp);
 void vga_clear();
@@ -556,6 +563,7 @@ void vga_cursor_disable();
 void vga_cursor_update();
 void vga_scroll();
 void vga_restore_textscreen();
+void vga_invalidate();
 
 void putc_col_row(int8_t col, uint8_t row, uint8_t c);
 void putc(uint8_t c);
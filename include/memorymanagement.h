@@ -8,12 +8,42 @@
 namespace myos
 {
     
+    // 16 bytes, so blocks after it keep the 16 byte alignment FXSAVE
+    // and SSE need
     struct MemoryChunk
     {
         MemoryChunk *next;
         MemoryChunk *prev;
         bool allocated;
         size_t size;
+    } __attribute__((aligned(16)));
+    
+    struct MemoryStats
+    {
+        size_t used;            // bytes handed out, slab blocks count their whole class
+        size_t peak;
+        size_t chunks;          // blocks in the large block list
+        size_t freeBytes;       // free bytes in the large block list
+        size_t largestFree;
+        size_t fragmentation;   // percent of the free bytes outside the largest block
+        size_t slabPages;
+        size_t slabPagesTotal;
+        uint32_t allocations;
+        uint32_t failures;
+    };
+    
+    // one traced new or delete, size is 0 for a delete
+    struct MemoryTraceEntry
+    {
+        void* caller;
+        void* ptr;
+        size_t size;
+    };
+    
+    // free block of a slab page, the link lives in the block itself
+    struct SlabBlock
+    {
+        SlabBlock *next;
     };
     
     
@@ -21,7 +51,39 @@ namespace myos
     {
         
     protected:
+        // large blocks, first fit over a linked list of chunks
         MemoryChunk* first;
+        
+        // Small objects come from 4KB slab pages at the start of the
+        // heap, all blocks of a page belong to one size class and free
+        // blocks are kept on a list per class.
+        static const size_t slabPageSize = 4096;
+        static const int slabClasses = 8;           // 16, 32, .. 2048 bytes
+        static const size_t slabMaxSize = 16 << (slabClasses - 1);
+        static const size_t slabMaxPages = 1024;    // 4MB
+        size_t slabStart;
+        size_t slabNext;                            // first page not handed out yet
+        size_t slabEnd;
+        uint8_t pageClass[slabMaxPages];
+        SlabBlock* freeBlocks[slabClasses];
+        
+        static int SizeClass(size_t size);
+        void* SlabAlloc(int sizeClass);
+        void* ChunkAlloc(size_t size);
+        void ChunkFree(void* ptr);
+        void* UnlockedMalloc(size_t size);
+        void UnlockedFree(void* ptr);
+        
+        // counters and the allocation trace ring
+        size_t usedBytes;
+        size_t peakBytes;
+        uint32_t allocations;
+        uint32_t failures;
+        static const int traceSize = 64;
+        MemoryTraceEntry trace[traceSize];
+        uint32_t traceCount;
+        bool tracing;
+        void TraceEvent(void* caller, void* ptr, size_t size);
     public:
         
         static MemoryManager *activeMemoryManager;
@@ -29,8 +91,38 @@ namespace myos
         MemoryManager(size_t first, size_t size);
         ~MemoryManager();
         
-        void* malloc(size_t size);
-        void free(void* ptr);
+        // caller is recorded in the trace ring, 0 leaves the call out
+        void* malloc(size_t size, void* caller = 0);
+        void free(void* ptr, void* caller = 0);
+        
+        void GetStats(MemoryStats* stats);
+        void Trace(bool on);
+        bool Tracing() { return tracing; }
+        MemoryTraceEntry* GetTraceEntry(int age);   // 0 is the newest
+    };
+    
+    struct MemoryArenaBlock
+    {
+        MemoryArenaBlock *next;
+        size_t size;
+        size_t used;
+    };
+    
+    // Bump allocator for memory that lives as long as its owner.
+    // Blocks are taken from the heap as needed and all of them are
+    // given back at once by Release() or the destructor, single
+    // allocations are never freed.
+    class MemoryArena
+    {
+    protected:
+        MemoryArenaBlock* blocks;
+        size_t blockSize;
+    public:
+        MemoryArena(size_t blockSize);
+        ~MemoryArena();
+        
+        void* Allocate(size_t size);
+        void Release();
     };
 }
 
@@ -42,6 +134,10 @@ void* operator new[](unsigned size);
 void* operator new(unsigned size, void* ptr);
 void* operator new[](unsigned size, void* ptr);
 
+// arena new, the memory goes away with the arena
+void* operator new(unsigned size, myos::MemoryArena* arena);
+void* operator new[](unsigned size, myos::MemoryArena* arena);
+
 void operator delete(void* ptr);
 void operator delete[](void* ptr);
 
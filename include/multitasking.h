@@ -34,29 +34,70 @@ namespace myos
     } __attribute__((packed));
     
     
+    #define TASK_STACK_SIZE (64*1024)
+    
+    // priority classes, a lower number runs first
+    #define TASK_PRIORITY_REALTIME      0   // audio refills, frame presentation
+    #define TASK_PRIORITY_INTERACTIVE   1   // emulated machines
+    #define TASK_PRIORITY_BACKGROUND    2   // flushes, housekeeping
+    
     class Task
     {
     friend class TaskManager;
     private:
-        uint8_t stack[4096]; // 4 KiB
+        uint8_t stack[TASK_STACK_SIZE]; // 64 KiB, enough for an emulator
         CPUState* cpustate;
+        uint8_t fpustate[512] __attribute__((aligned(16))); // FXSAVE area
+        uint32_t timeslice;   // milliseconds per turn
+        uint8_t priority;
+        bool sleeping;
+        uint32_t wakeup;      // current_milli to leave the sleep at
+        bool hasDeadline;
+        uint32_t deadline;    // current_milli the task's work is due by
     public:
-        Task(GlobalDescriptorTable *gdt, void entrypoint());
+        Task(GlobalDescriptorTable *gdt, void entrypoint(), uint32_t timeslice = 1,
+             uint8_t priority = TASK_PRIORITY_INTERACTIVE);
         ~Task();
     };
     
     
+    // Picks the runnable task of the best priority class, within a class
+    // the earliest deadline first, then those without one, round-robin
+    // among equals. The running task
+    // keeps the processor for its timeslice unless it sleeps, yields or
+    // a better task woke up. When every task sleeps the context that was
+    // interrupted by the first switch, the kernel's idle loop, runs.
+    // FPU/SSE registers are switched with the task when SSE is enabled.
+    // Preemption can be held off around code that uses shared drivers,
+    // the timer then just returns to the running task. NextEvent() tells
+    // a one-shot timer when the scheduler has something to do next.
     class TaskManager
     {
     private:
         Task* tasks[256];
         int numTasks;
-        int currentTask;
+        int currentTask;      // -1 while idle
+        uint32_t sliceEnd;    // current_milli the running task's turn ends at
+        CPUState* idleState;
+        bool waiting;         // a caller that could not sleep waits itself
+        uint32_t waitWakeup;
+        static volatile int preemptionLocks;
+        
+        bool Runnable(int task);
+        bool Before(int a, int b);
+        int Pick();
+        CPUState* Switch(CPUState* cpustate, int next);
     public:
         TaskManager();
         ~TaskManager();
         bool AddTask(Task* task);
         CPUState* Schedule(CPUState* cpustate);
+        CPUState* Yield(CPUState* cpustate);
+        bool SleepUntil(uint32_t wakeup, bool hasDeadline, uint32_t deadline);
+        uint32_t NextEvent(uint32_t latest);
+        
+        static void DisablePreemption();
+        static void EnablePreemption();
     };
     
     
@@ -7,17 +7,30 @@
 #include <hardwarecommunication/interrupts.h>
 #include <multitasking.h>
 
+// int 0x80 with the number in eax, arguments in ebx, ecx, edx
+#define SYSCALL_PRINT           4       // ebx = string
+#define SYSCALL_YIELD           158
+#define SYSCALL_SLEEP_UNTIL     162     // ebx = wakeup, ecx = has deadline, edx = deadline
+
 namespace myos
 {
     
     class SyscallHandler : public hardwarecommunication::InterruptHandler
     {
+    private:
+        TaskManager* taskManager;
         
     public:
-        SyscallHandler(hardwarecommunication::InterruptManager* interruptManager, uint8_t InterruptNumber);
+        SyscallHandler(hardwarecommunication::InterruptManager* interruptManager, uint8_t InterruptNumber,
+                       TaskManager* taskManager);
         ~SyscallHandler();
         
         virtual uint32_t HandleInterrupt(uint32_t esp);
+        
+        // callers' side, usable from any task
+        static void Yield();
+        static bool SleepUntil(uint32_t wakeup);
+        static bool SleepUntil(uint32_t wakeup, uint32_t deadline);
 
     };
     
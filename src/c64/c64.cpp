@@ -15,22 +15,48 @@
  * limitations under the License.
  */
 #include <c64/c64.h>
+#include <lib/string.h>
 
-C64::C64()
+extern uint32_t current_milli;
+
+C64::C64() : arena_(kArenaBlockSize)
 {
   /* create chips */
-  io_   = new IO();
-  cpu_  = new Cpu();
-  mem_  = new Memory();
-  cia1_ = new Cia1();
-  cia2_ = new Cia2();
-  vic_  = new Vic();
-  sid_  = new Sid();
-  mon_  = new Monitor();
+  io_   = new(&arena_) IO();
+  cpu_  = new(&arena_) Cpu();
+  mem_  = new(&arena_) Memory(&arena_);
+  cia1_ = new(&arena_) Cia1();
+  cia2_ = new(&arena_) Cia2();
+  vic_  = new(&arena_) Vic();
+  sid_  = new(&arena_) Sid();
+  mon_  = new(&arena_) Monitor();
+  jit_  = new(&arena_) Jit();
+  iec_  = new(&arena_) Iec();
+  profiler_ = new(&arena_) Profiler();
+  stats_ = new(&arena_) FrameStats();
+  rewind_ = new(&arena_) Rewind();
+  input_ = new(&arena_) InputLog();
+  reu_  = new(&arena_) Reu();
+  cart_ = new(&arena_) Cartridge();
+  debugger_ = new(&arena_) Debugger();
+  trace_ = new(&arena_) Trace();
+  natives_ = new(&arena_) Natives();
+  snapshot_base_ = 0;
+  snapshot_chain_ = 0;
+  snapshot_seq_ = 0;
   
   /* init cpu */
   cpu_->memory(mem_);
   cpu_->reset();
+  /* init recompiler */
+  jit_->cpu(cpu_);
+  jit_->memory(mem_);
+  jit_->arena(&arena_);
+  cpu_->jit(jit_);
+  cpu_->io(io_);
+  /* init profiler, off until the monitor turns it on */
+  profiler_->arena(&arena_);
+  cpu_->profiler(profiler_);
   /* init vic-ii */
   vic_->memory(mem_);
   vic_->cpu(cpu_);
@@ -40,33 +66,150 @@ C64::C64()
   cia1_->io(io_);
   /* init cia2 */
   cia2_->cpu(cpu_);
+  cia2_->iec(iec_);
+  /* init serial bus */
+  iec_->cpu(cpu_);
+  iec_->io(io_);
+  /* init reu, unplugged until attach() */
+  reu_->cpu(cpu_);
+  reu_->memory(mem_);
+  reu_->arena(&arena_);
+  mem_->reu(reu_);
+  /* init expansion port, empty until an image is inserted */
+  cart_->cpu(cpu_);
+  cart_->memory(mem_);
+  mem_->cartridge(cart_);
+  /* init debugger, nothing is checked until something is set */
+  debugger_->cpu(cpu_);
+  debugger_->memory(mem_);
+  mem_->debugger(debugger_);
+  cpu_->debugger(debugger_);
+  /* init trace, the ring is allocated when recording starts */
+  trace_->arena(&arena_);
+  cpu_->trace(trace_);
+  /* init natives, the routines only run where the ROM set has traps */
+  natives_->cpu(cpu_);
+  natives_->memory(mem_);
+  cpu_->natives(natives_);
+  /* init sid */
+  sid_->cpu(cpu_);
   /* init io */
   io_->cpu(cpu_);
   io_->memory(mem_);
+  io_->arena(&arena_);
+  io_->stats(stats_);
+  /* init rewind, the history is allocated on the first capture */
+  rewind_->arena(&arena_);
+  /* init input log, off until the monitor records or replays */
+  input_->arena(&arena_);
+  io_->input(input_);
 
   /* DMA */
   mem_->vic(vic_);
   mem_->cia1(cia1_);
   mem_->cia2(cia2_);
   mem_->sid(sid_);
+  mem_->cpu(cpu_);
  /* r2 support */
  
   mon_->io(io_);
   mon_->mem(mem_);
   mon_->cpu(cpu_);
+  mon_->c64(this);
 }
 
+/**
+ * @brief tears the machine down
+ *
+ * The chips live in the arena, their destructors are run here and
+ * the memory itself is released with arena_.
+ */
 C64::~C64()
 {
-  delete cpu_;
-  delete mem_;
-  delete cia1_;
-  delete cia2_;
-  delete vic_;
-  delete sid_;
-  delete io_;
-  delete mon_;
+  jit_->~Jit();
+  iec_->~Iec();
+  cpu_->~Cpu();
+  mem_->~Memory();
+  cia1_->~Cia1();
+  cia2_->~Cia2();
+  vic_->~Vic();
+  sid_->~Sid();
+  io_->~IO();
+  mon_->~Monitor();
+  profiler_->~Profiler();
+  stats_->~FrameStats();
+  rewind_->~Rewind();
+  input_->~InputLog();
+  reu_->~Reu();
+  cart_->~Cartridge();
+  debugger_->~Debugger();
+  trace_->~Trace();
+  natives_->~Natives();
+}
 
+/**
+ * @brief cycles the cpu can run before any chip needs attention
+ *
+ * The main loop runs the cpu in batches up to the nearest
+ * chip event (next raster line or CIA timer underflow) and then
+ * lets every chip catch up once, instead of polling all of them
+ * after each instruction.
+ */
+unsigned int C64::batch_cycles()
+{
+  unsigned int budget = vic_->cycles_to_next_event();
+  unsigned int t = cia1_->cycles_to_next_event();
+  if(t < budget) budget = t;
+  t = cia2_->cycles_to_next_event();
+  if(t < budget) budget = t;
+  return budget;
+}
+
+/**
+ * @brief runs one cpu batch and lets every chip catch up
+ *
+ * Returns false once a chip failed or a reset was requested.
+ */
+bool C64::emulate()
+{
+  /* CPU */
+  stats_->mark(FrameStats::kCpu);
+  if(io_->step)
+  {
+    if(!cpu_->emulate(true))
+      return false;
+  }
+  else if(!cpu_->run(cpu_->cycles() + batch_cycles()))
+    return false;
+  /* breakpoint or watchpoint, the monitor opens after this batch */
+  if(debugger_->hit() != Debugger::kNone)
+    stop();
+  /* CIA1 */
+  stats_->mark(FrameStats::kChips);
+  if(!cia1_->emulate())
+    return false;
+  /* CIA2 */
+  if(!cia2_->emulate())
+    return false;
+  /* VIC-II */
+  stats_->mark(FrameStats::kVic);
+  if(!vic_->emulate())
+    return false;
+  stats_->mark(FrameStats::kChips);
+  /* SID */
+  if(!sid_->emulate())
+    return false;
+  /* IO */
+  if(!io_->emulate())
+    return false;
+  if(rewind_->due(vic_->frames()))
+    rewind_capture();
+  if(rewind_request)
+  {
+    rewind_request = false;
+    rewind(Rewind::kPerSecond);
+  }
+  return !reset;
 }
 
 void C64::start()
@@ -76,28 +219,21 @@ void C64::start()
   {
     if(isRunning)
     {
-      /* CIA1 */
-      if(!cia1_->emulate())
-	break;
-      /* CIA2 */
-      if(!cia2_->emulate())
-	break;
-      /* CPU */
-      if(!cpu_->emulate(io_->step))
-	break;
-      /* VIC-II */
-      if(!vic_->emulate())
-	break;
-      /* IO */
-      if(!io_->emulate())
-	break;
-      if(reset)
+      if(!emulate())
 	break;
     }
     else
     {
+      /* other machines pause while the monitor owns screen and disk */
+      myos::TaskManager::DisablePreemption();
+      io_->show_console();
       mon_->Start();
+      debugger_->resume();
       isRunning = true;
+      /* the monitor drew over the emulator screen */
+      io_->screen_invalidate();
+      stats_->resync();
+      myos::TaskManager::EnablePreemption();
     }
   }
 }
@@ -112,3 +248,243 @@ void C64::stop()
 
  
 
+/**
+ * @brief saves or restores the state of every chip
+ */
+void C64::snapshot(Snapshot *s, bool delta)
+{
+  cpu_->snapshot(s);
+  mem_->snapshot(s,snapshot_base_,delta);
+  vic_->snapshot(s);
+  cia1_->snapshot(s);
+  cia2_->snapshot(s);
+  sid_->snapshot(s);
+}
+
+/**
+ * @brief saves or restores every chip but memory, for rewind records
+ */
+void C64::chips_snapshot(Snapshot *s)
+{
+  cpu_->snapshot(s);
+  vic_->snapshot(s);
+  cia1_->snapshot(s);
+  cia2_->snapshot(s);
+  sid_->snapshot(s);
+}
+
+/**
+ * @brief appends a record to the rewind history
+ *
+ * The first record has nothing older to return to, it only seeds
+ * the base copy of RAM.
+ */
+void C64::rewind_capture()
+{
+  uint8_t *buf = rewind_->reserve();
+  if(buf == 0)
+  {
+    /* off, do not try again every batch */
+    rewind_->resync(vic_->frames());
+    return;
+  }
+  Snapshot s(buf,Rewind::kMaxRecord,true);
+  chips_snapshot(&s);
+  mem_->rewind(&s,rewind_->base(),rewind_->count() > 0);
+  if(s.ok())
+    rewind_->commit(s.used(),vic_->frames());
+  else
+    rewind_->resync(vic_->frames());
+}
+
+/**
+ * @brief steps the machine back, returns the records gone through
+ *
+ * The first step returns to the newest record, each further one
+ * reads the undo pages of the newest into the base and drops it.
+ * The record that is restored stays, it is now the present.
+ */
+unsigned int C64::rewind(unsigned int steps)
+{
+  if(steps > rewind_->count())
+    steps = rewind_->count();
+  for(unsigned int i=0 ; i < steps ; i++)
+  {
+    uint32_t length;
+    uint8_t *buf = rewind_->newest(&length);
+    Snapshot s(buf,length,false);
+    chips_snapshot(&s);
+    if(i + 1 < steps)
+    {
+      mem_->rewind(&s,rewind_->base(),true);
+      rewind_->drop_newest();
+    }
+  }
+  if(steps > 0)
+  {
+    mem_->restore_ram(rewind_->base());
+    rewind_->resync(vic_->frames());
+    /* a file delta would no longer build on the last file snapshot */
+    snapshot_chain_ = 0;
+    jit_->flush();
+    io_->screen_invalidate();
+  }
+  return steps;
+}
+
+/**
+ * @brief writes a snapshot of the machine to a file
+ *
+ * A delta only stores the RAM pages changed since the previous
+ * snapshot (taken or restored), it falls back to a full one when
+ * there is nothing to build on.
+ */
+int C64::save_snapshot(Fat32 *fs, uint8_t *filename, bool delta)
+{
+  if(snapshot_base_ == 0)
+    snapshot_base_ = new(&arena_) uint8_t[Memory::kMemSize]();
+  if(snapshot_chain_ == 0)
+    delta = false;
+  SnapshotHeader h;
+  memcpy(h.magic,Snapshot::kMagic,sizeof(h.magic));
+  h.version = Snapshot::kVersion;
+  h.flags = delta ? Snapshot::kDelta : 0;
+  h.length = 0;
+  h.chain = delta ? snapshot_chain_ : (current_milli ^ cpu_->cycles()) | 1;
+  h.sequence = delta ? snapshot_seq_ + 1 : 0;
+  uint8_t *buf = new uint8_t[Snapshot::kMaxSize];
+  Snapshot s(buf,Snapshot::kMaxSize,true);
+  s.value(h);
+  snapshot(&s,delta);
+  ((SnapshotHeader *)buf)->length = s.used();
+  /* replace an older snapshot with the same name */
+  if(fs->GetFileSize(filename) != 0)
+    fs->DeleteFile(filename);
+  int fstatus = fs->OpenFile(0,filename,FILEACCESSMODE_CREATE);
+  if(fstatus == FILE_STATUS_OK)
+  {
+    fstatus = fs->WriteFileBlock(0,buf,s.used());
+    fs->CloseFile(0);
+  }
+  delete [] buf;
+  if(fstatus == FILE_STATUS_OK)
+  {
+    snapshot_chain_ = h.chain;
+    snapshot_seq_ = h.sequence;
+  }
+  else
+  {
+    /* the base already moved on, start over with a full one */
+    snapshot_chain_ = 0;
+  }
+  return fstatus;
+}
+
+/**
+ * @brief restores the machine from a snapshot file
+ *
+ * The header is checked before any chip is touched, a delta is
+ * only accepted right after the snapshot it was taken on top of.
+ * Drive channels and the serial bus are not part of the state.
+ */
+int C64::load_snapshot(Fat32 *fs, uint8_t *filename)
+{
+  uint32_t size = fs->GetFileSize(filename);
+  if(size == 0)
+    return FILE_STATUS_NOTFOUND;
+  if(size < sizeof(SnapshotHeader) || size > Snapshot::kMaxSize)
+    return Snapshot::kBadFormat;
+  int fstatus = fs->OpenFile(0,filename,FILEACCESSMODE_READ);
+  if(fstatus != FILE_STATUS_OK)
+    return fstatus;
+  uint8_t *buf = new uint8_t[size];
+  uint32_t n = fs->ReadFileBlock(0,buf,size);
+  fs->CloseFile(0);
+  SnapshotHeader h;
+  Snapshot s(buf,n,false);
+  s.value(h);
+  bool delta = (h.flags & Snapshot::kDelta) != 0;
+  if(memcmp(h.magic,Snapshot::kMagic,sizeof(h.magic)) != 0 ||
+     h.version != Snapshot::kVersion || h.length != n)
+    fstatus = Snapshot::kBadFormat;
+  else if(delta && (snapshot_chain_ == 0 || h.chain != snapshot_chain_ ||
+                    h.sequence != snapshot_seq_ + 1))
+    fstatus = Snapshot::kWrongBase;
+  else
+  {
+    if(snapshot_base_ == 0)
+      snapshot_base_ = new(&arena_) uint8_t[Memory::kMemSize]();
+    snapshot(&s,delta);
+    snapshot_chain_ = h.chain;
+    snapshot_seq_ = h.sequence;
+    /* recompiled blocks may be stale */
+    jit_->flush();
+    io_->screen_invalidate();
+  }
+  delete [] buf;
+  return fstatus;
+}
+
+/**
+ * @brief the snapshot name that goes with an input log, NAME.SNP
+ */
+static void snapshot_name(const uint8_t *filename, uint8_t *name)
+{
+  int i = 0;
+  for( ; filename[i] != 0 && filename[i] != '.' && i < 8 ; i++)
+    name[i] = filename[i];
+  memcpy(name + i, ".SNP", 5);
+}
+
+/**
+ * @brief starts recording keys on top of a full snapshot
+ *
+ * The snapshot is the start of the run a replay repeats, it is
+ * written next to the log with the same name.
+ */
+int C64::record_input(Fat32 *fs, uint8_t *filename)
+{
+  uint8_t name[13];
+  snapshot_name(filename, name);
+  int fstatus = save_snapshot(fs, name, false);
+  if(fstatus == FILE_STATUS_OK)
+    input_->record();
+  return fstatus;
+}
+
+/**
+ * @brief stops recording and writes the log
+ */
+int C64::save_input(Fat32 *fs, uint8_t *filename)
+{
+  input_->stop();
+  return input_->save(fs, filename);
+}
+
+/**
+ * @brief restores the snapshot of a log and replays the log on it
+ */
+int C64::replay_input(Fat32 *fs, uint8_t *filename)
+{
+  uint8_t name[13];
+  snapshot_name(filename, name);
+  int fstatus = input_->load(fs, filename);
+  if(fstatus == FILE_STATUS_OK)
+    fstatus = load_snapshot(fs, name);
+  if(fstatus == FILE_STATUS_OK)
+    input_->replay();
+  return fstatus;
+}
+
+/**
+ * @brief plugs a cartridge in (or none) and resets the cpu
+ *
+ * The image belongs to the machine afterwards. Used on a freshly
+ * built machine, the cpu fetches the reset vector through the new
+ * memory map.
+ */
+void C64::cartridge(CartridgeImage *image)
+{
+  cart_->insert(image);
+  cpu_->reset();
+}
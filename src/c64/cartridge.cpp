@@ -0,0 +1,355 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <c64/cartridge.h>
+#include <lib/string.h>
+
+using namespace myos::filesystem;
+
+static const char kMagic[16] =
+{
+  'C','6','4',' ','C','A','R','T','R','I','D','G','E',' ',' ',' '
+};
+
+static inline uint16_t be16(const uint8_t *p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t be32(const uint8_t *p)
+{
+  return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// image ///////////////////////////////////////////////////////////////////
+
+CartridgeImage::CartridgeImage()
+{
+  type_ = kNormal;
+  exrom_ = game_ = false;
+  name_[0] = 0;
+  banks_ = 0;
+  for(unsigned int b=0 ; b < kMaxBanks ; b++)
+    roml_[b] = romh_[b] = 0;
+}
+
+CartridgeImage::~CartridgeImage()
+{
+  for(unsigned int b=0 ; b < kMaxBanks ; b++)
+  {
+    delete [] roml_[b];
+    delete [] romh_[b];
+  }
+}
+
+bool CartridgeImage::supported(uint16_t type)
+{
+  switch(type)
+  {
+  case kNormal:
+  case kSimonsBasic:
+  case kOcean:
+  case kEpyxFastload:
+  case kSystem3:
+  case kDinamic:
+  case kMagicDesk:
+    return true;
+  }
+  return false;
+}
+
+/**
+ * @brief reads and parses a CRT file, null on failure
+ *
+ * status gets a FILE_STATUS_ code, kBadFormat or kUnsupported.
+ */
+CartridgeImage *CartridgeImage::load(Fat32 *fs, uint8_t *filename, int *status)
+{
+  uint32_t size = fs->GetFileSize(filename);
+  if(size == 0)
+  {
+    *status = FILE_STATUS_NOTFOUND;
+    return 0;
+  }
+  if(size < kHeaderSize)
+  {
+    *status = kBadFormat;
+    return 0;
+  }
+  uint8_t *buf = new uint8_t[size];
+  fs->ReadFile(filename,buf,size);
+  CartridgeImage *image = new CartridgeImage();
+  *status = FILE_STATUS_OK;
+  if(!image->parse(buf,size))
+    *status = kBadFormat;
+  else if(!supported(image->type_))
+    *status = kUnsupported;
+  delete [] buf;
+  if(*status != FILE_STATUS_OK)
+  {
+    delete image;
+    image = 0;
+  }
+  return image;
+}
+
+/**
+ * @brief header and CHIP packets, false if anything is off
+ */
+bool CartridgeImage::parse(const uint8_t *buf, uint32_t size)
+{
+  if(memcmp(buf,kMagic,sizeof(kMagic)) != 0)
+    return false;
+  /* a few files have the header length wrong, it is 64 bytes */
+  uint32_t offset = be32(buf + 0x10);
+  if(offset < kHeaderSize)
+    offset = kHeaderSize;
+  type_ = be16(buf + 0x16);
+  exrom_ = buf[0x18] == 0;
+  game_ = buf[0x19] == 0;
+  memcpy(name_,buf + 0x20,32);
+  name_[32] = 0;
+  while(offset + kChipHeaderSize <= size)
+  {
+    const uint8_t *chip = buf + offset;
+    uint32_t length = be32(chip + 4);
+    uint16_t bank = be16(chip + 0x0a);
+    uint16_t load = be16(chip + 0x0c);
+    uint32_t rom_size = be16(chip + 0x0e);
+    if(memcmp(chip,"CHIP",4) != 0 || length < kChipHeaderSize ||
+       length > size - offset || rom_size + kChipHeaderSize > length ||
+       rom_size == 0 || (rom_size & (rom_size - 1)) != 0 ||
+       rom_size > 2 * kBankSize || bank >= kMaxBanks)
+      return false;
+    const uint8_t *data = chip + kChipHeaderSize;
+    /* 16KB chips fill a ROML and a ROMH bank */
+    for(uint32_t half=0 ; half < rom_size ; half += kBankSize)
+    {
+      uint16_t addr = load + half;
+      uint8_t **slot;
+      if(addr >= 0x8000 && addr < 0xa000)
+        slot = &roml_[bank];
+      else if(addr >= 0xa000 && addr < 0xc000)
+        slot = &romh_[bank];
+      else if(addr >= 0xe000)
+        slot = &romh_[bank];
+      else
+        return false;
+      if(*slot == 0)
+        *slot = new uint8_t[kBankSize];
+      uint32_t n = rom_size - half < kBankSize ? rom_size - half : kBankSize;
+      for(uint32_t i=0 ; i < kBankSize ; i += n)
+        memcpy(*slot + i,data + half,n);
+    }
+    if(bank + 1u > banks_)
+      banks_ = bank + 1;
+    offset += length;
+  }
+  return banks_ != 0;
+}
+
+// expansion port //////////////////////////////////////////////////////////
+
+Cartridge::Cartridge()
+{
+  cpu_ = 0;
+  mem_ = 0;
+  image_ = 0;
+  mode_ = kOff;
+  bank_ = 0;
+  charged_at_ = 0;
+}
+
+Cartridge::~Cartridge()
+{
+  delete image_;
+}
+
+/**
+ * @brief plugs an image in, replacing (and freeing) the previous one
+ *
+ * The port lines start as the CRT header has them, the machine is
+ * expected to be reset afterwards.
+ */
+void Cartridge::insert(CartridgeImage *image)
+{
+  delete image_;
+  image_ = image;
+  bank_ = 0;
+  charged_at_ = cpu_->cycles();
+  kMode m = kOff;
+  if(image != 0)
+  {
+    if(image->exrom())
+      m = image->game() ? k16K : k8K;
+    else if(image->game())
+      m = kUltimax;
+  }
+  mode_ = m;
+  mem_->cartridge_changed();
+}
+
+/**
+ * @brief unplugs the image and hands it to the caller
+ */
+CartridgeImage *Cartridge::remove()
+{
+  CartridgeImage *image = image_;
+  image_ = 0;
+  mode_ = kOff;
+  mem_->cartridge_changed();
+  return image;
+}
+
+void Cartridge::switch_mode(kMode m)
+{
+  if(m == mode_)
+    return;
+  mode_ = m;
+  mem_->cartridge_changed();
+}
+
+void Cartridge::switch_bank(unsigned int b)
+{
+  b %= image_->banks();
+  if(b == bank_)
+    return;
+  bank_ = b;
+  mem_->cartridge_changed();
+}
+
+/**
+ * @brief current ROML bank, null when reads have to be seen
+ */
+uint8_t *Cartridge::roml()
+{
+  if(image_ == 0 || image_->type() == CartridgeImage::kEpyxFastload)
+    return 0;
+  return image_->roml(bank_);
+}
+
+uint8_t *Cartridge::romh()
+{
+  if(image_ == 0)
+    return 0;
+  return image_->romh(bank_);
+}
+
+/**
+ * @brief true while the Epyx capacitor holds the ROM enabled
+ *
+ * Each access charges it again, after kEpyxCycles without one the
+ * cartridge has switched itself off.
+ */
+bool Cartridge::epyx_charged()
+{
+  unsigned int now = cpu_->cycles();
+  if((int)(now - charged_at_) > (int)kEpyxCycles)
+    return false;
+  charged_at_ = now;
+  return true;
+}
+
+/**
+ * @brief ROML read through read_io(), see roml()
+ */
+uint8_t Cartridge::read_roml(uint16_t addr)
+{
+  if(image_ != 0 && image_->type() == CartridgeImage::kEpyxFastload &&
+     !epyx_charged())
+  {
+    switch_mode(kOff);
+    return mem_->read_byte(addr);
+  }
+  uint8_t *rom = image_ != 0 ? image_->roml(bank_) : 0;
+  return rom != 0 ? rom[addr & 0x1fff] : mem_->read_byte_no_io(addr);
+}
+
+/**
+ * @brief ROMH read of a bank without a chip
+ */
+uint8_t Cartridge::read_romh(uint16_t addr)
+{
+  uint8_t *rom = image_ != 0 ? image_->romh(bank_) : 0;
+  return rom != 0 ? rom[addr & 0x1fff] : mem_->read_byte_no_io(addr);
+}
+
+// I/O area ////////////////////////////////////////////////////////////////
+
+/**
+ * @brief IO1 reads, nothing drives the bus so RAM is returned
+ */
+uint8_t Cartridge::read_io1(uint16_t addr)
+{
+  switch(image_->type())
+  {
+  case CartridgeImage::kSimonsBasic:
+    switch_mode(k8K);
+    break;
+  case CartridgeImage::kEpyxFastload:
+    charged_at_ = cpu_->cycles();
+    switch_mode(k8K);
+    break;
+  case CartridgeImage::kSystem3:
+    switch_bank(0);
+    break;
+  case CartridgeImage::kDinamic:
+    switch_bank(addr & 0x0f);
+    break;
+  }
+  return mem_->read_byte_no_io(addr);
+}
+
+void Cartridge::write_io1(uint16_t addr, uint8_t v)
+{
+  switch(image_->type())
+  {
+  case CartridgeImage::kSimonsBasic:
+    switch_mode(k16K);
+    break;
+  case CartridgeImage::kOcean:
+    switch_bank(v & 0x3f);
+    break;
+  case CartridgeImage::kSystem3:
+    switch_bank(addr & 0x3f);
+    break;
+  case CartridgeImage::kMagicDesk:
+    if((addr & 0xff) == 0)
+    {
+      switch_bank(v & 0x3f);
+      switch_mode((v & 0x80) ? kOff : k8K);
+    }
+    break;
+  }
+  mem_->write_byte_no_io(addr,v);
+}
+
+/**
+ * @brief IO2 reads, the Epyx FastLoad shows the last ROML page
+ */
+uint8_t Cartridge::read_io2(uint16_t addr)
+{
+  if(image_->type() == CartridgeImage::kEpyxFastload && image_->roml(0) != 0)
+    return image_->roml(0)[0x1f00 | (addr & 0xff)];
+  return mem_->read_byte_no_io(addr);
+}
+
+void Cartridge::write_io2(uint16_t addr, uint8_t v)
+{
+  mem_->write_byte_no_io(addr,v);
+}
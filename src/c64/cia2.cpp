@@ -16,6 +16,7 @@
  */
 
 #include <c64/cia2.h>
+#include <c64/snapshot.h>
 
 // ctor  /////////////////////////////////////////////////////////////////////
 
@@ -27,7 +28,12 @@ Cia2::Cia2()
   timer_a_input_mode_ = timer_b_input_mode_ = kModeProcessor;
   timer_a_run_mode_ = timer_b_run_mode_ = kModeRestart;
   pra_ = prb_ = 0xff;
-  prev_cpu_cycles_ = 0;
+  timer_a_underflow_ = timer_b_underflow_ = 0;
+  next_event_ = 0;
+  event_pending_ = false;
+  cra_ = crb_ = 0;
+  tod_irq_enabled_ = tod_irq_triggered_ = false;
+  iec_ = 0;
 }
 
 // DMA register access  //////////////////////////////////////////////////////
@@ -39,6 +45,8 @@ void Cia2::write_register(uint8_t r, uint8_t v)
   /* data port a (PRA) */
   case 0x0:
     pra_ = v;
+    if(iec_ != 0)
+      iec_->write(v);
     break;
   /* data port b (PRB) */
   case 0x1:
@@ -70,47 +78,64 @@ void Cia2::write_register(uint8_t r, uint8_t v)
     timer_b_latch_ &= 0x00ff;
     timer_b_latch_ |= v << 8;
     break;
-  /* RTC 1/10s  */
+  /* time of day: 1/10s, seconds, minutes, hours, CRB bit 7 selects the alarm */
   case 0x8:
-    break;
-  /* RTC seconds */
   case 0x9:
-    break;
-  /* RTC minutes */
   case 0xa:
-    break;
-  /* RTC hours */
   case 0xb:
+    tod_.write(r - 0x8, v, ISSET_BIT(crb_,7));
     break;
   /* shift serial */
   case 0xc:
     break;
   /* interrupt control and status */
   case 0xd:
+  {
+    bool pending = interrupt_pending();
     /**
      * if bit 7 is set, enable selected mask of 
      * interrupts, else disable them
      */
     if(ISSET_BIT(v,0)) timer_a_irq_enabled_ = ISSET_BIT(v,7);
     if(ISSET_BIT(v,1)) timer_b_irq_enabled_ = ISSET_BIT(v,7);
+    if(ISSET_BIT(v,2)) tod_irq_enabled_ = ISSET_BIT(v,7);
+    if(!pending && interrupt_pending())
+      cpu_->nmi();
     break;
+  }
   /* control timer a */
   case 0xe:
+    timer_a_counter_ = timer_a_value();
+    cra_ = v;
     timer_a_enabled_ = ((v&(1<<0))!=0);
+    timer_a_run_mode_ = (v&(1<<3)) ? kModeOneTime : kModeRestart;
     timer_a_input_mode_ = (v&(1<<5)) >> 5;
     /* load latch requested */
     if((v&(1<<4))!=0)
       timer_a_counter_ = timer_a_latch_;
+    if(timer_a_counting())
+      timer_a_underflow_ = cpu_->cycles() + timer_a_counter_;
     break;
   /* control timer b */
   case 0xf:
+    timer_b_counter_ = timer_b_value();
+    crb_ = v;
     timer_b_enabled_ = ((v&0x1)!=0);
-    timer_b_input_mode_ = (v&(1<<5)) | (v&(1<<6)) >> 5;
+    timer_b_run_mode_ = (v&(1<<3)) ? kModeOneTime : kModeRestart;
+    timer_b_input_mode_ = (v >> 5) & 0x3;
     /* load latch requested */
     if((v&(1<<4))!=0)
       timer_b_counter_ = timer_b_latch_;
+    if(timer_b_counting())
+      timer_b_underflow_ = cpu_->cycles() + timer_b_counter_;
     break;
   }
+  /* timer state changed, reschedule */
+  if(r >= 0x8 && r != 0xc)
+  {
+    schedule();
+    cpu_->end_batch();
+  }
 }
 
 uint8_t Cia2::read_register(uint8_t r)
@@ -121,7 +146,8 @@ uint8_t Cia2::read_register(uint8_t r)
   {
   /* data port a (PRA) */
   case 0x0:
-    retval = pra_;
+    /* serial bus lines in bits 6 and 7 */
+    retval = (iec_ != 0) ? ((pra_ & 0x3f) | iec_->read()) : pra_;
     break;
   /* data port b (PRB) */
   case 0x1:
@@ -135,50 +161,49 @@ uint8_t Cia2::read_register(uint8_t r)
     break;
   /* timer a low byte */
   case 0x4:
-    retval = (uint8_t)(timer_a_counter_ & 0x00ff);
+    retval = (uint8_t)(timer_a_value() & 0x00ff);
     break;
   /* timer a high byte */
   case 0x5:
-    retval = (uint8_t)((timer_a_counter_ & 0xff00) >> 8);
+    retval = (uint8_t)((timer_a_value() & 0xff00) >> 8);
     break;
   /* timer b low byte */
   case 0x6:
-    retval = (uint8_t)(timer_b_counter_ & 0x00ff);
+    retval = (uint8_t)(timer_b_value() & 0x00ff);
     break;
   /* timer b high byte */
   case 0x7: 
-    retval = (uint8_t)((timer_b_counter_ & 0xff00) >> 8);
+    retval = (uint8_t)((timer_b_value() & 0xff00) >> 8);
     break;
-  /* RTC 1/10s  */
+  /* time of day: 1/10s, seconds, minutes, hours */
   case 0x8:
-    break;
-  /* RTC seconds */
   case 0x9:
-    break;
-  /* RTC minutes */
   case 0xa:
-    break;
-  /* RTC hours */
   case 0xb:
+    retval = tod_.read(r - 0x8);
     break;
   /* shift serial */
   case 0xc:
     break;
-  /* interrupt control and status */
+  /* interrupt control and status, reading acknowledges */
   case 0xd:
-    if(timer_a_irq_triggered_ ||
-       timer_b_irq_triggered_)
-    {
+    /* a masked alarm is not scheduled, polling latches it */
+    if(tod_.alarm())
+      tod_irq_triggered_ = true;
+    if(interrupt_pending())
       retval |= (1 << 7); // IRQ occured
-      if(timer_a_irq_triggered_) retval |= (1 << 0);
-      if(timer_b_irq_triggered_) retval |= (1 << 1);
-    }
+    if(timer_a_irq_triggered_) retval |= (1 << 0);
+    if(timer_b_irq_triggered_) retval |= (1 << 1);
+    if(tod_irq_triggered_) retval |= (1 << 2);
+    timer_a_irq_triggered_ = timer_b_irq_triggered_ = tod_irq_triggered_ = false;
     break;
-  /* control timer a */
+  /* control timer a, the load strobe reads back as 0 */
   case 0xe:
+    retval = (cra_ & 0xee) | (timer_a_enabled_ ? 0x01 : 0);
     break;
   /* control timer b */
   case 0xf:
+    retval = (crb_ & 0xee) | (timer_b_enabled_ ? 0x01 : 0);
     break;
   }
   return retval;
@@ -191,9 +216,13 @@ void Cia2::reset_timer_a()
   switch(timer_a_run_mode_)
   {
   case kModeRestart:
-    timer_a_counter_ = timer_a_latch_;
+    timer_a_underflow_ += timer_a_latch_;
+    /* a latch of 0 underflows on every cycle, at most once per batch here */
+    if((int)(timer_a_underflow_ - cpu_->cycles()) <= 0)
+      timer_a_underflow_ = cpu_->cycles() + (timer_a_latch_ ? timer_a_latch_ : 1);
     break;
   case kModeOneTime:
+    timer_a_counter_ = timer_a_latch_;
     timer_a_enabled_ = false;
     break;
   }
@@ -204,9 +233,13 @@ void Cia2::reset_timer_b()
   switch(timer_b_run_mode_)
   {
   case kModeRestart:
-    timer_b_counter_ = timer_b_latch_;
+    timer_b_underflow_ += timer_b_latch_;
+    /* a latch of 0 underflows on every cycle, at most once per batch here */
+    if((int)(timer_b_underflow_ - cpu_->cycles()) <= 0)
+      timer_b_underflow_ = cpu_->cycles() + (timer_b_latch_ ? timer_b_latch_ : 1);
     break;
   case kModeOneTime:
+    timer_b_counter_ = timer_b_latch_;
     timer_b_enabled_ = false;
     break;
   }      
@@ -229,56 +262,171 @@ uint16_t Cia2::vic_base_address()
   return ((~pra_&0x3) << 14);
 }
 
+/**
+ * @brief timer b counting one timer a underflow
+ */
+void Cia2::timer_b_count()
+{
+  if(timer_b_counter_ > 1)
+  {
+    timer_b_counter_--;
+    return;
+  }
+  timer_b_irq_triggered_ = true;
+  timer_b_counter_ = timer_b_latch_;
+  if(timer_b_run_mode_ == kModeOneTime)
+    timer_b_enabled_ = false;
+}
+
 // emulation  ////////////////////////////////////////////////////////////////
 
-bool Cia2::emulate()
+/**
+ * @brief current value of a timer
+ *
+ * Counting timers are not decremented as the cpu runs, their value
+ * follows from the cycle they underflow on.
+ */
+uint16_t Cia2::timer_a_value()
+{
+  if(!timer_a_counting())
+    return timer_a_counter_;
+  int left = timer_a_underflow_ - cpu_->cycles();
+  return left > 0 ? left : 0;
+}
+
+uint16_t Cia2::timer_b_value()
+{
+  if(!timer_b_counting())
+    return timer_b_counter_;
+  int left = timer_b_underflow_ - cpu_->cycles();
+  return left > 0 ? left : 0;
+}
+
+/**
+ * @brief picks the earliest underflow as the next event
+ */
+void Cia2::schedule()
 {
-  /* timer a */
-  if(timer_a_enabled_)
+  event_pending_ = false;
+  if(timer_a_counting())
+  {
+    next_event_ = timer_a_underflow_;
+    event_pending_ = true;
+  }
+  if(timer_b_counting() &&
+     (!event_pending_ || (int)(timer_b_underflow_ - next_event_) < 0))
+  {
+    next_event_ = timer_b_underflow_;
+    event_pending_ = true;
+  }
+  /* the alarm runs on host time, check again after about as long */
+  if(tod_irq_enabled_)
   {
-    switch(timer_a_input_mode_)
+    unsigned int t = tod_.cycles_to_alarm();
+    if(t > kNoEvent) t = kNoEvent;
+    t += cpu_->cycles();
+    if(!event_pending_ || (int)(t - next_event_) < 0)
     {
-    case kModeProcessor:
-      timer_a_counter_ -= cpu_->cycles() - prev_cpu_cycles_;
-      if (timer_a_counter_ <= 0)
-      {
-        if(timer_a_irq_enabled_) 
-        {
-          timer_a_irq_triggered_ = true;
-          cpu_->nmi();
-        }
-        reset_timer_a();
-      }
-      break;
-    case kModeCNT:
-      break;
+      next_event_ = t;
+      event_pending_ = true;
     }
   }
+}
+
+/**
+ * @brief an enabled interrupt source has fired
+ */
+bool Cia2::interrupt_pending()
+{
+  return (timer_a_irq_triggered_ && timer_a_irq_enabled_) ||
+         (timer_b_irq_triggered_ && timer_b_irq_enabled_) ||
+         (tod_irq_triggered_ && tod_irq_enabled_);
+}
+
+
+/**
+ * @brief cycles left until the next timer underflow
+ *
+ * Returns kNoEvent if no timer is counting cpu cycles.
+ */
+unsigned int Cia2::cycles_to_next_event()
+{
+  if(!event_pending_)
+    return kNoEvent;
+  int d = next_event_ - cpu_->cycles();
+  if(d > kNoEvent) d = kNoEvent;
+  return d > 0 ? d : 0;
+}
+
+/**
+ * @brief handles the timers that underflowed
+ *
+ * Nothing is done until the cycle of the next underflow, the
+ * batch scheduler stops the cpu right there.
+ */
+bool Cia2::emulate()
+{
+  if(!event_pending_ || (int)(next_event_ - cpu_->cycles()) > 0)
+    return true;
+  bool pending = interrupt_pending();
+  /* timer a, timer b may count its underflows */
+  if(timer_a_counting() && (int)(timer_a_underflow_ - cpu_->cycles()) <= 0)
+  {
+    timer_a_irq_triggered_ = true;
+    if(timer_b_cascaded())
+      timer_b_count();
+    reset_timer_a();
+  }
   /* timer b */
-  if(timer_b_enabled_)
+  if(timer_b_counting() && (int)(timer_b_underflow_ - cpu_->cycles()) <= 0)
   {
-    switch(timer_b_input_mode_)
-    {
-    case kModeProcessor:
-      timer_b_counter_ -= cpu_->cycles() - prev_cpu_cycles_;
-      if (timer_b_counter_ <= 0)
-      {
-        if(timer_b_irq_enabled_)
-        {
-          timer_b_irq_triggered_ = true;
-          cpu_->nmi();
-        }
-        reset_timer_b();
-      }   
-      break;
-    case kModeCNT:
-      break;
-    case kModeTimerA:
-      break;
-    case kModeTimerACNT:
-      break;
-    }
+    timer_b_irq_triggered_ = true;
+    reset_timer_b();
   }
-  prev_cpu_cycles_ = cpu_->cycles();
+  /* time of day alarm, latched whatever the mask */
+  if(tod_.alarm())
+    tod_irq_triggered_ = true;
+  if(!pending && interrupt_pending())
+    cpu_->nmi();
+  schedule();
   return true;
 }
+
+/**
+ * @brief saves or restores ports and timers
+ */
+void Cia2::snapshot(Snapshot *s)
+{
+  if(s->saving())
+  {
+    timer_a_counter_ = timer_a_value();
+    timer_b_counter_ = timer_b_value();
+  }
+  s->value(timer_a_latch_);
+  s->value(timer_b_latch_);
+  s->value(timer_a_counter_);
+  s->value(timer_b_counter_);
+  s->value(timer_a_enabled_);
+  s->value(timer_b_enabled_);
+  s->value(timer_a_irq_enabled_);
+  s->value(timer_b_irq_enabled_);
+  s->value(timer_a_irq_triggered_);
+  s->value(timer_b_irq_triggered_);
+  s->value(timer_a_run_mode_);
+  s->value(timer_b_run_mode_);
+  s->value(timer_a_input_mode_);
+  s->value(timer_b_input_mode_);
+  s->value(cra_);
+  s->value(crb_);
+  s->value(tod_irq_enabled_);
+  s->value(tod_irq_triggered_);
+  tod_.snapshot(s);
+  s->value(pra_);
+  s->value(prb_);
+  if(!s->saving())
+  {
+    timer_a_underflow_ = cpu_->cycles() + timer_a_counter_;
+    timer_b_underflow_ = cpu_->cycles() + timer_b_counter_;
+    schedule();
+  }
+}
@@ -16,9 +16,34 @@
  */
 
 #include <c64/cpu.h>
+#include <c64/jit.h>
+#include <c64/io.h>
+#include <c64/snapshot.h>
+#include <c64/profiler.h>
+#include <c64/debugger.h>
+#include <c64/trace.h>
+#include <c64/natives.h>
 //#include <c64/util.h>
 //#include <sstream>
 
+Cpu::Cpu()
+{
+  mem_ = 0;
+  jit_ = 0;
+  jit_enabled_ = false;
+  io_ = 0;
+  profiler_ = 0;
+  debugger_ = 0;
+  trace_ = 0;
+  natives_ = 0;
+  speed_ = 1;
+  batch_speed_ = 1;
+  speed_rest_ = 0;
+  bus_base_ = 0;
+  cpu_base_ = 0;
+  accelerator_ = 0;
+}
+
 /**
  * @brief Cold reset
  *
@@ -27,9 +52,12 @@
 void Cpu::reset()
 {
   a_ = x_ = y_ = sp_ = 0;
-  cf_ = zf_ = idf_ = dmf_ = bcf_ = of_ = nf_ = false;
+  p_ = 0;
+  nz_ = 1;
   pc(mem_->read_word(Memory::kAddrResetVector));
   cycles_ = 6;
+  deadline_ = cycles_;
+  irq_lines_ = 0;
 }
 
 void Cpu::displayRegs()
@@ -84,339 +112,484 @@ void Cpu::getCpuState(struct cpuState* currentCpuState)
   return;
 }
 
+/**
+ * @brief implemented opcodes
+ *
+ * Each entry is OP(opcode, cycles, statement), both the switch based 
+ * decoder and the threaded interpreter are generated from it.
+ *
+ * cycles is the base cost of the instruction, the addressing mode 
+ * helpers add the extra cycle of indexed reads crossing a page and 
+ * the branch helper adds the taken/page crossing penalties. Stores 
+ * and read-modify-write instructions always spend the extra cycle, 
+ * so it's part of their base cost and they use the _w helpers.
+ */
+#define CPU_OPCODES(OP) \
+  OP(0x00, 7, brk())                          /* BRK */ \
+  OP(0x01, 6, ora(load_byte(addr_indx())))    /* ORA (nn,X) */ \
+  OP(0x02, 2, trap())                         /* TRAP nn */ \
+  OP(0x05, 3, ora(load_byte(addr_zero())))    /* ORA nn */ \
+  OP(0x06, 5, asl_mem(addr_zero()))           /* ASL nn */ \
+  OP(0x08, 3, php())                          /* PHP */ \
+  OP(0x09, 2, ora(fetch_op()))                /* ORA #nn */ \
+  OP(0x0A, 2, asl_a())                        /* ASL A */ \
+  OP(0x0D, 4, ora(load_byte(addr_abs())))     /* ORA nnnn */ \
+  OP(0x0E, 6, asl_mem(addr_abs()))            /* ASL nnnn */ \
+  OP(0x10, 2, bpl())                          /* BPL nn */ \
+  OP(0x11, 5, ora(load_byte(addr_indy())))    /* ORA (nn,Y) */ \
+  OP(0x15, 4, ora(load_byte(addr_zerox())))   /* ORA nn,X */ \
+  OP(0x16, 6, asl_mem(addr_zerox()))          /* ASL nn,X */ \
+  OP(0x18, 2, clc())                          /* CLC */ \
+  OP(0x19, 4, ora(load_byte(addr_absy())))    /* ORA nnnn,Y */ \
+  OP(0x1D, 4, ora(load_byte(addr_absx())))    /* ORA nnnn,X */ \
+  OP(0x1E, 7, asl_mem(addr_absx_w()))         /* ASL nnnn,X */ \
+  OP(0x20, 6, jsr())                          /* JSR */ \
+  OP(0x21, 6, _and(load_byte(addr_indx())))   /* AND (nn,X) */ \
+  OP(0x24, 3, bit(addr_zero()))               /* BIT nn */ \
+  OP(0x25, 3, _and(load_byte(addr_zero())))   /* AND nn */ \
+  OP(0x26, 5, rol_mem(addr_zero()))           /* ROL nn */ \
+  OP(0x28, 4, plp())                          /* PLP */ \
+  OP(0x29, 2, _and(fetch_op()))               /* AND #nn */ \
+  OP(0x2A, 2, rol_a())                        /* ROL A */ \
+  OP(0x2C, 4, bit(addr_abs()))                /* BIT nnnn */ \
+  OP(0x2D, 4, _and(load_byte(addr_abs())))    /* AND nnnn */ \
+  OP(0x2E, 6, rol_mem(addr_abs()))            /* ROL nnnn */ \
+  OP(0x30, 2, bmi())                          /* BMI nn */ \
+  OP(0x31, 5, _and(load_byte(addr_indy())))   /* AND (nn,Y) */ \
+  OP(0x35, 4, _and(load_byte(addr_zerox())))  /* AND nn,X */ \
+  OP(0x36, 6, rol_mem(addr_zerox()))          /* ROL nn,X */ \
+  OP(0x38, 2, sec())                          /* SEC */ \
+  OP(0x39, 4, _and(load_byte(addr_absy())))   /* AND nnnn,Y */ \
+  OP(0x3D, 4, _and(load_byte(addr_absx())))   /* AND nnnn,X */ \
+  OP(0x3E, 7, rol_mem(addr_absx_w()))         /* ROL nnnn,X */ \
+  OP(0x40, 6, rti())                          /* RTI */ \
+  OP(0x41, 6, eor(load_byte(addr_indx())))    /* EOR (nn,X) */ \
+  OP(0x45, 3, eor(load_byte(addr_zero())))    /* EOR nn */ \
+  OP(0x46, 5, lsr_mem(addr_zero()))           /* LSR nn */ \
+  OP(0x48, 3, pha())                          /* PHA */ \
+  OP(0x49, 2, eor(fetch_op()))                /* EOR #nn */ \
+  OP(0x50, 2, bvc())                          /* BVC */ \
+  OP(0x4C, 3, jmp())                          /* JMP nnnn */ \
+  OP(0x4D, 4, eor(load_byte(addr_abs())))     /* EOR nnnn */ \
+  OP(0x4A, 2, lsr_a())                        /* LSR A */ \
+  OP(0x4E, 6, lsr_mem(addr_abs()))            /* LSR nnnn */ \
+  OP(0x51, 5, eor(load_byte(addr_indy())))    /* EOR (nn,Y) */ \
+  OP(0x55, 4, eor(load_byte(addr_zerox())))   /* EOR nn,X */ \
+  OP(0x56, 6, lsr_mem(addr_zerox()))          /* LSR nn,X */ \
+  OP(0x58, 2, cli())                          /* CLI */ \
+  OP(0x59, 4, eor(load_byte(addr_absy())))    /* EOR nnnn,Y */ \
+  OP(0x5D, 4, eor(load_byte(addr_absx())))    /* EOR nnnn,X */ \
+  OP(0x5E, 7, lsr_mem(addr_absx_w()))         /* LSR nnnn,X */ \
+  OP(0x60, 6, rts())                          /* RTS */ \
+  OP(0x61, 6, adc(load_byte(addr_indx())))    /* ADC (nn,X) */ \
+  OP(0x65, 3, adc(load_byte(addr_zero())))    /* ADC nn */ \
+  OP(0x66, 5, ror_mem(addr_zero()))           /* ROR nn */ \
+  OP(0x68, 4, pla())                          /* PLA */ \
+  OP(0x69, 2, adc(fetch_op()))                /* ADC #nn */ \
+  OP(0x6A, 2, ror_a())                        /* ROR A */ \
+  OP(0x6C, 5, jmp_ind())                      /* JMP (nnnn) */ \
+  OP(0x6D, 4, adc(load_byte(addr_abs())))     /* ADC nnnn */ \
+  OP(0x6E, 6, ror_mem(addr_abs()))            /* ROR nnnn */ \
+  OP(0x70, 2, bvs())                          /* BVS */ \
+  OP(0x71, 5, adc(load_byte(addr_indy())))    /* ADC (nn,Y) */ \
+  OP(0x75, 4, adc(load_byte(addr_zerox())))   /* ADC nn,X */ \
+  OP(0x76, 6, ror_mem(addr_zerox()))          /* ROR nn,X */ \
+  OP(0x78, 2, sei())                          /* SEI */ \
+  OP(0x79, 4, adc(load_byte(addr_absy())))    /* ADC nnnn,Y */ \
+  OP(0x7D, 4, adc(load_byte(addr_absx())))    /* ADC nnnn,X */ \
+  OP(0x7E, 7, ror_mem(addr_absx_w()))         /* ROR nnnn,X */ \
+  OP(0x81, 6, sta(addr_indx()))               /* STA (nn,X) */ \
+  OP(0x84, 3, sty(addr_zero()))               /* STY nn */ \
+  OP(0x85, 3, sta(addr_zero()))               /* STA nn */ \
+  OP(0x86, 3, stx(addr_zero()))               /* STX nn */ \
+  OP(0x88, 2, dey())                          /* DEY */ \
+  OP(0x8A, 2, txa())                          /* TXA */ \
+  OP(0x8C, 4, sty(addr_abs()))                /* STY nnnn */ \
+  OP(0x8D, 4, sta(addr_abs()))                /* STA nnnn */ \
+  OP(0x8E, 4, stx(addr_abs()))                /* STX nnnn */ \
+  OP(0x90, 2, bcc())                          /* BCC nn */ \
+  OP(0x91, 6, sta(addr_indy_w()))             /* STA (nn,Y) */ \
+  OP(0x94, 4, sty(addr_zerox()))              /* STY nn,X */ \
+  OP(0x95, 4, sta(addr_zerox()))              /* STA nn,X */ \
+  OP(0x96, 4, stx(addr_zeroy()))              /* STX nn,Y */ \
+  OP(0x98, 2, tya())                          /* TYA */ \
+  OP(0x99, 5, sta(addr_absy_w()))             /* STA nnnn,Y */ \
+  OP(0x9A, 2, txs())                          /* TXS */ \
+  OP(0x9D, 5, sta(addr_absx_w()))             /* STA nnnn,X */ \
+  OP(0xA0, 2, ldy(fetch_op()))                /* LDY #nn */ \
+  OP(0xA1, 6, lda(load_byte(addr_indx())))    /* LDA (nn,X) */ \
+  OP(0xA2, 2, ldx(fetch_op()))                /* LDX #nn */ \
+  OP(0xA4, 3, ldy(load_byte(addr_zero())))    /* LDY nn */ \
+  OP(0xA5, 3, lda(load_byte(addr_zero())))    /* LDA nn */ \
+  OP(0xA6, 3, ldx(load_byte(addr_zero())))    /* LDX nn */ \
+  OP(0xA8, 2, tay())                          /* TAY */ \
+  OP(0xA9, 2, lda(fetch_op()))                /* LDA #nn */ \
+  OP(0xAA, 2, tax())                          /* TAX */ \
+  OP(0xAC, 4, ldy(load_byte(addr_abs())))     /* LDY nnnn */ \
+  OP(0xAD, 4, lda(load_byte(addr_abs())))     /* LDA nnnn */ \
+  OP(0xAE, 4, ldx(load_byte(addr_abs())))     /* LDX nnnn */ \
+  OP(0xB0, 2, bcs())                          /* BCS nn */ \
+  OP(0xB1, 5, lda(load_byte(addr_indy())))    /* LDA (nn,Y) */ \
+  OP(0xB4, 4, ldy(load_byte(addr_zerox())))   /* LDY nn,X */ \
+  OP(0xB5, 4, lda(load_byte(addr_zerox())))   /* LDA nn,X */ \
+  OP(0xB6, 4, ldx(load_byte(addr_zeroy())))   /* LDX nn,Y */ \
+  OP(0xB8, 2, clv())                          /* CLV */ \
+  OP(0xB9, 4, lda(load_byte(addr_absy())))    /* LDA nnnn,Y */ \
+  OP(0xBA, 2, tsx())                          /* TSX */ \
+  OP(0xBC, 4, ldy(load_byte(addr_absx())))    /* LDY nnnn,X */ \
+  OP(0xBD, 4, lda(load_byte(addr_absx())))    /* LDA nnnn,X */ \
+  OP(0xBE, 4, ldx(load_byte(addr_absy())))    /* LDX nnnn,Y */ \
+  OP(0xC0, 2, cpy(fetch_op()))                /* CPY #nn */ \
+  OP(0xC1, 6, cmp(load_byte(addr_indx())))    /* CMP (nn,X) */ \
+  OP(0xC4, 3, cpy(load_byte(addr_zero())))    /* CPY nn */ \
+  OP(0xC5, 3, cmp(load_byte(addr_zero())))    /* CMP nn */ \
+  OP(0xC6, 5, dec(addr_zero()))               /* DEC nn */ \
+  OP(0xC8, 2, iny())                          /* INY */ \
+  OP(0xC9, 2, cmp(fetch_op()))                /* CMP #nn */ \
+  OP(0xCA, 2, dex())                          /* DEX */ \
+  OP(0xCC, 4, cpy(load_byte(addr_abs())))     /* CPY nnnn */ \
+  OP(0xCD, 4, cmp(load_byte(addr_abs())))     /* CMP nnnn */ \
+  OP(0xCE, 6, dec(addr_abs()))                /* DEC nnnn */ \
+  OP(0xD0, 2, bne())                          /* BNE nn */ \
+  OP(0xD1, 5, cmp(load_byte(addr_indy())))    /* CMP (nn,Y) */ \
+  OP(0xD5, 4, cmp(load_byte(addr_zerox())))   /* CMP nn,X */ \
+  OP(0xD6, 6, dec(addr_zerox()))              /* DEC nn,X */ \
+  OP(0xD8, 2, cld())                          /* CLD */ \
+  OP(0xD9, 4, cmp(load_byte(addr_absy())))    /* CMP nnnn,Y */ \
+  OP(0xDD, 4, cmp(load_byte(addr_absx())))    /* CMP nnnn,X */ \
+  OP(0xDE, 7, dec(addr_absx_w()))             /* DEC nnnn,X */ \
+  OP(0xE0, 2, cpx(fetch_op()))                /* CPX #nn */ \
+  OP(0xE1, 6, sbc(load_byte(addr_indx())))    /* SBC (nn,X) */ \
+  OP(0xE4, 3, cpx(load_byte(addr_zero())))    /* CPX nn */ \
+  OP(0xE5, 3, sbc(load_byte(addr_zero())))    /* SBC nn */ \
+  OP(0xE6, 5, inc(addr_zero()))               /* INC nn */ \
+  OP(0xE8, 2, inx())                          /* INX */ \
+  OP(0xE9, 2, sbc(fetch_op()))                /* SBC #nn */ \
+  OP(0xEA, 2, nop())                          /* NOP */ \
+  OP(0xEC, 4, cpx(load_byte(addr_abs())))     /* CPX nnnn */ \
+  OP(0xED, 4, sbc(load_byte(addr_abs())))     /* SBC nnnn */ \
+  OP(0xEE, 6, inc(addr_abs()))                /* INC nnnn */ \
+  OP(0xF0, 2, beq())                          /* BEQ nn */ \
+  OP(0xF1, 5, sbc(load_byte(addr_indy())))    /* SBC (nn,Y) */ \
+  OP(0xF5, 4, sbc(load_byte(addr_zerox())))   /* SBC nn,X */ \
+  OP(0xF6, 6, inc(addr_zerox()))              /* INC nn,X */ \
+  OP(0xF8, 2, sed())                          /* SED */ \
+  OP(0xF9, 4, sbc(load_byte(addr_absy())))    /* SBC nnnn,Y */ \
+  OP(0xFD, 4, sbc(load_byte(addr_absx())))    /* SBC nnnn,X */ \
+  OP(0xFE, 7, inc(addr_absx_w()))             /* INC nnnn,X */
+
+/** 
+ * @brief emulate a single instruction
+ * @return returns false if something goes wrong (e.g. illegal instruction)
+ */
+bool Cpu::emulate(bool step)
+{
+  if(step)
+    displayRegs();
+  if(irq_lines_ != 0)
+    irq();
+  return execute();
+}
+
+/**
+ * @brief run instructions until the cycle deadline is reached
+ * @return returns false if something goes wrong (e.g. illegal instruction)
+ *
+ * The deadline is the cycle count of the nearest pending chip event,
+ * the batch may overshoot it by the length of the last instruction.
+ * Chips whose next event moves closer while the batch is running
+ * (e.g. a CIA timer being started) call end_batch() so we return
+ * right after the current instruction. Pending level triggered
+ * interrupts are serviced between instructions.
+ */
+bool Cpu::run(unsigned int deadline)
+{
+  if(speed_ != 1 && batch_speed_ == 1)
+    return run_fast(deadline);
+  deadline_ = deadline;
+  if(debugger_ != 0 && debugger_->active())
+    return run_debug();
+  if(trace_ != 0 && trace_->recording())
+    return run_traced();
+  if(profiler_ != 0 && profiler_->mode() != Profiler::kOff)
+  {
+    if(profiler_->exact())
+      return run_profiled();
+    profiler_->sample(pc_,cycles());
+  }
+  if(jit_enabled_)
+    return run_jit();
+#ifdef CPU_THREADED_DISPATCH
+  /**
+   * threaded dispatch: every handler jumps straight to the 
+   * next one through the label table, so there's one indirect
+   * branch per opcode instead of a single shared one.
+   */
+  static void *dispatch[256];
+  static bool dispatch_ready = false;
+  if(!dispatch_ready)
+  {
+    for(int i=0 ; i < 256 ; i++)
+      dispatch[i] = &&illegal;
+#define CPU_LABEL(op, cycles, stmt) dispatch[op] = &&op_##op;
+    CPU_OPCODES(CPU_LABEL)
+#undef CPU_LABEL
+    dispatch_ready = true;
+  }
+  if(irq_lines_ != 0)
+    irq();
+  goto *dispatch[fetch_op()];
+#define CPU_THREAD(op, cycles, stmt) \
+  op_##op: \
+    stmt; \
+    tick(cycles); \
+    if((int)(cycles_ - deadline_) >= 0) \
+      return true; \
+    if(irq_lines_ != 0) \
+      irq(); \
+    goto *dispatch[fetch_op()];
+  CPU_OPCODES(CPU_THREAD)
+#undef CPU_THREAD
+illegal:
+  return false;
+#else
+  do
+  {
+    if(irq_lines_ != 0)
+      irq();
+    if(!execute())
+      return false;
+  }
+  while((int)(cycles_ - deadline_) < 0);
+  return true;
+#endif
+}
+
+/**
+ * @brief runs a batch with the accelerator on
+ *
+ * The deadline and everything the chips read through cycles() stay
+ * in chip cycles. Afterwards cycles_ is a chip count again and the
+ * cpu cycles short of a whole chip cycle go to the next batch.
+ */
+bool Cpu::run_fast(unsigned int deadline)
+{
+  unsigned int speed = speed_;
+  bus_base_ = cycles_;
+  cpu_base_ = cycles_ - speed_rest_;
+  batch_speed_ = speed;
+  bool ok = run(cpu_base_ + (deadline - bus_base_) * speed);
+  unsigned int elapsed = cycles_ - cpu_base_;
+  batch_speed_ = 1;
+  cycles_ = bus_base_ + elapsed / speed;
+  speed_rest_ = elapsed % speed;
+  deadline_ = cycles_;
+  return ok;
+}
+
+/**
+ * @brief switches the accelerator, from the next batch on
+ *
+ * A register write lands here in the middle of a batch, which ends
+ * after the current instruction so the new speed starts right away.
+ */
+void Cpu::speed(unsigned int v)
+{
+  if(v == 0)
+    v = 1;
+  if(v == speed_)
+    return;
+  speed_ = v;
+  speed_rest_ = 0;
+  end_batch();
+}
+
+// block recompiler  /////////////////////////////////////////////////////////
+
+/**
+ * @brief per-opcode instruction bodies
+ */
+#define CPU_EXEC(op, cycles, stmt) \
+  template<> inline void Cpu::exec<op>() { stmt; tick(cycles); }
+CPU_OPCODES(CPU_EXEC)
+#undef CPU_EXEC
+
+/**
+ * @brief handler called from translated code
+ *
+ * The opcode has already been decoded by the recompiler, so we 
+ * skip it and run the instruction body. Returns true once the 
+ * cycle deadline has been reached so the block exits early.
+ */
+template<int op> bool Cpu::jit_handler(Cpu *cpu)
+{
+  cpu->pc_++;
+  cpu->exec<op>();
+  return (int)(cpu->cycles_ - cpu->deadline_) >= 0;
+}
+
+/**
+ * @brief fills the recompiler handler table, null for illegal opcodes
+ */
+void Cpu::jit_handlers(JitHandler *table)
+{
+  for(int i=0 ; i < 256 ; i++)
+    table[i] = 0;
+#define CPU_JIT_ENTRY(op, cycles, stmt) table[op] = &Cpu::jit_handler<op>;
+  CPU_OPCODES(CPU_JIT_ENTRY)
+#undef CPU_JIT_ENTRY
+}
+
+/**
+ * @brief runs translated blocks until the cycle deadline is reached
+ */
+bool Cpu::run_jit()
+{
+  do
+  {
+    if(irq_lines_ != 0)
+      irq();
+    if(!jit_->execute())
+      return false;
+  }
+  while((int)(cycles_ - deadline_) < 0);
+  return true;
+}
+
+// profiler  /////////////////////////////////////////////////////////////////
+
+/**
+ * @brief interpreter loop reporting every instruction to the profiler
+ *
+ * Kept apart from the other loops so they pay nothing for it, the
+ * recompiler is bypassed while exact profiling is on.
+ */
+bool Cpu::run_profiled()
+{
+  do
+  {
+    if(irq_lines_ != 0)
+      irq();
+    uint16_t pc = pc_;
+    unsigned int start = cycles();
+    uint8_t *page = mem_->page_base(pc >> 8);
+    uint8_t op = page ? page[pc] : 0;
+    if(!execute())
+      return false;
+    profiler_->instruction(pc,op,cycles() - start,sp_,pc_,cycles());
+  }
+  while((int)(cycles_ - deadline_) < 0);
+  return true;
+}
+
+// debugger  /////////////////////////////////////////////////////////////////
+
+/**
+ * @brief interpreter loop checking breakpoints before every instruction
+ *
+ * Only entered while the debugger has something set, the recompiler
+ * is bypassed so no block runs past a breakpoint. A hit leaves the
+ * pc on the breakpoint, or right after the instruction that touched
+ * a watched address.
+ */
+bool Cpu::run_debug()
+{
+  do
+  {
+    if(irq_lines_ != 0)
+      irq();
+    if(debugger_->stop_at(pc_))
+      return true;
+    if(trace_ != 0 && trace_->recording())
+      trace_record();
+    uint16_t pc = pc_;
+    if(!execute())
+      return false;
+    if(debugger_->hit() != Debugger::kNone)
+    {
+      debugger_->hit_pc(pc);
+      return true;
+    }
+  }
+  while((int)(cycles_ - deadline_) < 0);
+  return true;
+}
+
+// trace  ////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief adds the instruction at pc to the trace, before it runs
+ */
+void Cpu::trace_record()
+{
+  uint8_t regs[Trace::kRegs] = {a_, x_, y_, sp_, flags()};
+  uint8_t *page = mem_->page_base(pc_ >> 8);
+  uint8_t op = page ? page[pc_] : mem_->read_byte_no_io(pc_);
+  trace_->record(pc_,op,regs,cycles());
+}
+
+/**
+ * @brief interpreter loop recording every instruction to the trace
+ *
+ * The recompiler is bypassed like for exact profiling. An illegal
+ * opcode is recorded before the loop gives up on it, so the trace
+ * ends with what stopped the machine.
+ */
+bool Cpu::run_traced()
+{
+  do
+  {
+    if(irq_lines_ != 0)
+      irq();
+    trace_record();
+    if(!execute())
+      return false;
+  }
+  while((int)(cycles_ - deadline_) < 0);
+  return true;
+}
+
+void Cpu::jit_enabled(bool v)
+{
+  if(!v && jit_ != 0)
+    jit_->flush();
+  jit_enabled_ = v && (jit_ != 0);
+}
+
+/**
+ * @brief a page holding translated code has been written to
+ */
+void Cpu::code_written(uint16_t addr)
+{
+  if(jit_ != 0)
+    jit_->invalidate(addr);
+}
+
 /** 
- * @brief emulate instruction 
+ * @brief fetch, decode and execute one instruction
  * @return returns false if something goes wrong (e.g. illegal instruction)
  *
  * Current limitations:
  * 
  * - Illegal instructions are not implemented
- * - Excess cycles due to page boundary crossing are not calculated
  * - Some known architectural bugs are not emulated
  */
-bool Cpu::emulate(bool step)
+bool Cpu::execute()
 {
-  
-  if(step)
-    displayRegs();
-  
-  
-
   /* fetch instruction */
   uint8_t insn = fetch_op();
-  bool retval = true;
   /* emulate instruction */
-  
   switch(insn)
   {
-  /* BRK */
-  case 0x0: brk(); break;
-  /* ORA (nn,X) */
-  case 0x1: ora(load_byte(addr_indx()),6); break;
-  /* ORA nn */
-  case 0x5: ora(load_byte(addr_zero()),3); break;
-  /* ASL nn */
-  case 0x6: asl_mem(addr_zero(),5); break;
-  /* PHP */
-  case 0x8: php(); break;
-  /* ORA #nn */
-  case 0x9: ora(fetch_op(),2); break;
-  /* ASL A */
-  case 0xA: asl_a(); break;
-  /* ORA nnnn */
-  case 0xD: ora(load_byte(addr_abs()),4); break;
-  /* ASL nnnn */
-  case 0xE: asl_mem(addr_abs(),6); break; 
-  /* BPL nn */
-  case 0x10: bpl(); break;
-  /* ORA (nn,Y) */
-  case 0x11: ora(load_byte(addr_indy()),5); break;
-  /* ORA nn,X */
-  case 0x15: ora(load_byte(addr_zerox()),4); break;
-  /* ASL nn,X */
-  case 0x16: asl_mem(addr_zerox(),6); break;
-  /* CLC */
-  case 0x18: clc(); break;
-  /* ORA nnnn,Y */
-  case 0x19: ora(load_byte(addr_absy()),4); break;
-  /* ORA nnnn,X */
-  case 0x1D: ora(load_byte(addr_absx()),4); break;
-  /* ASL nnnn,X */
-  case 0x1E: asl_mem(addr_absx(),7); break;
-  /* JSR */
-  case 0x20: jsr(); break;
-  /* AND (nn,X) */
-  case 0x21: _and(load_byte(addr_indx()),6); break;
-  /* BIT nn */
-  case 0x24: bit(addr_zero(),3); break;
-  /* AND nn */
-  case 0x25: _and(load_byte(addr_zero()),3); break;
-  /* ROL nn */
-  case 0x26: rol_mem(addr_zero(),5); break;
-  /* PLP */
-  case 0x28: plp(); break;
-  /* AND #nn */
-  case 0x29: _and(fetch_op(),2); break;
-  /* ROL A */
-  case 0x2A: rol_a(); break;
-  /* BIT nnnn */
-  case 0x2C: bit(addr_abs(),4); break;
-  /* AND nnnn */
-  case 0x2D: _and(load_byte(addr_abs()),4); break;
-  /* ROL nnnn */
-  case 0x2E: rol_mem(addr_abs(),6); break;
-  /* BMI nn */
-  case 0x30: bmi(); break;
-  /* AND (nn,Y) */
-  case 0x31: _and(load_byte(addr_indy()),5); break;               
-  /* AND nn,X */
-  case 0x35: _and(load_byte(addr_zerox()),4); break;
-  /* ROL nn,X */
-  case 0x36: rol_mem(addr_zerox(),6); break;
-  /* SEC */
-  case 0x38: sec(); break;
-  /* AND nnnn,Y */
-  case 0x39: _and(load_byte(addr_absy()),4); break;
-  /* AND nnnn,X */
-  case 0x3D: _and(load_byte(addr_absx()),4); break;
-  /* ROL nnnn,X */
-  case 0x3E: rol_mem(addr_absx(),7); break;
-  /* RTI */
-  case 0x40: rti(); break;
-  /* EOR (nn,X) */
-  case 0x41: eor(load_byte(addr_indx()),6); break;
-  /* EOR nn */
-  case 0x45: eor(load_byte(addr_zero()),3); break;
-  /* LSR nn */
-  case 0x46: lsr_mem(addr_zero(),5); break;
-  /* PHA */
-  case 0x48: pha(); break;
-  /* EOR #nn */
-  case 0x49: eor(fetch_op(),2); break;
-  /* BVC */
-  case 0x50: bvc(); break;
-  /* JMP nnnn */
-  case 0x4C: jmp(); break;
-  /* EOR nnnn */
-  case 0x4D: eor(load_byte(addr_abs()),4); break;
-  /* LSR A */
-  case 0x4A: lsr_a(); break;
-  /* LSR nnnn */
-  case 0x4E: lsr_mem(addr_abs(),6); break;
-  /* EOR (nn,Y) */
-  case 0x51: eor(load_byte(addr_indy()),5); break;
-  /* EOR nn,X */
-  case 0x55: eor(load_byte(addr_zerox()),4); break;
-  /* LSR nn,X */
-  case 0x56: lsr_mem(addr_zerox(),6); break;
-  /* CLI */
-  case 0x58: cli(); break;
-  /* EOR nnnn,Y */
-  case 0x59: eor(load_byte(addr_absy()),4); break;
-  /* EOR nnnn,X */
-  case 0x5D: eor(load_byte(addr_absx()),4); break;
-  /* LSR nnnn,X */
-  case 0x5E: lsr_mem(addr_absx(),7); break;
-  /* RTS */
-  case 0x60: rts(); break;
-  /* ADC (nn,X) */
-  case 0x61: adc(load_byte(addr_indx()),6); break;
-  /* ADC nn */
-  case 0x65: adc(load_byte(addr_zero()),3); break;
-  /* ROR nn */
-  case 0x66: ror_mem(addr_zero(),5); break;
-  /* PLA */
-  case 0x68: pla(); break;
-  /* ADC #nn */
-  case 0x69: adc(fetch_op(),2); break;
-  /* ROR A */
-  case 0x6A: ror_a(); break;
-  /* JMP (nnnn) */
-  case 0x6C: jmp_ind(); break;
-  /* ADC nnnn */
-  case 0x6D: adc(load_byte(addr_abs()),4); break;
-  /* ROR nnnn */
-  case 0x6E: ror_mem(addr_abs(),6); break;
-  /* BVS */
-  case 0x70: bvs(); break;
-  /* ADC (nn,Y) */
-  case 0x71: adc(load_byte(addr_indy()),5); break;
-  /* ADC nn,X */
-  case 0x75: adc(load_byte(addr_zerox()),4); break;
-  /* ROR nn,X */
-  case 0x76: ror_mem(addr_zerox(),6); break;
-  /* SEI */
-  case 0x78: sei(); break;
-  /* ADC nnnn,Y */
-  case 0x79: adc(load_byte(addr_absy()),4); break;
-  /* ADC nnnn,X */
-  case 0x7D: adc(load_byte(addr_absx()),4); break;
-  /* ROR nnnn,X */
-  case 0x7E: ror_mem(addr_absx(),7); break;
-  /* STA (nn,X) */
-  case 0x81: sta(addr_indx(),6); break;
-  /* STY nn */
-  case 0x84: sty(addr_zero(),3); break;
-  /* STA nn */
-  case 0x85: sta(addr_zero(),3); break;
-  /* STX nn */
-  case 0x86: stx(addr_zero(),3); break;
-  /* DEY */
-  case 0x88: dey(); break;
-  /* TXA */
-  case 0x8A: txa(); break;
-  /* STY nnnn */
-  case 0x8C: sty(addr_abs(),4); break;
-  /* STA nnnn */
-  case 0x8D: sta(addr_abs(),4); break;
-  /* STX nnnn */
-  case 0x8E: stx(addr_abs(),4); break;
-  /* BCC nn */
-  case 0x90: bcc(); break;
-  /* STA (nn,Y) */
-  case 0x91: sta(addr_indy(),6); break;
-  /* STY nn,X */
-  case 0x94: sty(addr_zerox(),4); break;
-  /* STA nn,X */
-  case 0x95: sta(addr_zerox(),4); break;
-  /* STX nn,Y */
-  case 0x96: stx(addr_zeroy(),4); break;
-  /* TYA */
-  case 0x98: tya(); break;
-  /* STA nnnn,Y */
-  case 0x99: sta(addr_absy(),5); break;
-  /* TXS */
-  case 0x9A: txs(); break;
-  /* STA nnnn,X */
-  case 0x9D: sta(addr_absx(),5); break;
-  /* LDY #nn */
-  case 0xA0: ldy(fetch_op(),2); break; 
-  /* LDA (nn,X) */
-  case 0xA1: lda(load_byte(addr_indx()),6); break;
-  /* LDX #nn */
-  case 0xA2: ldx(fetch_op(),2); break;
-  /* LDY nn */
-  case 0xA4: ldy(load_byte(addr_zero()),3); break;
-  /* LDA nn */
-  case 0xA5: lda(load_byte(addr_zero()),3); break;
-  /* LDX nn */
-  case 0xA6: ldx(load_byte(addr_zero()),3); break;
-  /* TAY */
-  case 0xA8: tay(); break;
-  /* LDA #nn */
-  case 0xA9: lda(fetch_op(),2); break;
-  /* TAX */
-  case 0xAA: tax(); break;
-  /* LDY nnnn */
-  case 0xAC: ldy(load_byte(addr_abs()),4); break;
-  /* LDA nnnn */
-  case 0xAD: lda(load_byte(addr_abs()),4); break;
-  /* LDX nnnn */
-  case 0xAE: ldx(load_byte(addr_abs()),4); break;
-  /* BCS nn */
-  case 0xB0: bcs(); break;
-  /* LDA (nn,Y) */
-  case 0xB1: lda(load_byte(addr_indy()),5); break;
-  /* LDY nn,X */
-  case 0xB4: ldy(load_byte(addr_zerox()),3); break;
-  /* LDA nn,X */
-  case 0xB5: lda(load_byte(addr_zerox()),3); break;
-  /* LDX nn,Y */
-  case 0xB6: ldx(load_byte(addr_zeroy()),3); break;
-  /* CLV */
-  case 0xB8: clv(); break;
-  /* LDA nnnn,Y */
-  case 0xB9: lda(load_byte(addr_absy()),4); break;
-  /* TSX */
-  case 0xBA: tsx(); break;
-  /* LDY nnnn,X */
-  case 0xBC: ldy(load_byte(addr_absx()),4); break;
-  /* LDA nnnn,X */
-  case 0xBD: lda(load_byte(addr_absx()),4); break;
-  /* LDX nnnn,Y */
-  case 0xBE: ldx(load_byte(addr_absy()),4); break;
-  /* CPY #nn */
-  case 0xC0: cpy(fetch_op(),2); break;
-  /* CMP (nn,X) */
-  case 0xC1: cmp(load_byte(addr_indx()),6); break;
-  /* CPY nn */
-  case 0xC4: cpy(load_byte(addr_zero()),3); break;
-  /* CMP nn */
-  case 0xC5: cmp(load_byte(addr_zero()),3); break;
-  /* DEC nn */
-  case 0xC6: dec(addr_zero(),5); break;
-  /* INY */
-  case 0xC8: iny(); break;
-  /* CMP #nn */
-  case 0xC9: cmp(fetch_op(),2); break;
-  /* DEX */
-  case 0xCA: dex(); break;
-  /* CPY nnnn */
-  case 0xCC: cpy(load_byte(addr_abs()),4); break;
-  /* CMP nnnn */
-  case 0xCD: cmp(load_byte(addr_abs()),4); break;
-  /* DEC nnnn */
-  case 0xCE: dec(addr_abs(),6); break;
-  /* BNE nn */
-  case 0xD0: bne(); break;
-  /* CMP (nn,Y) */
-  case 0xD1: cmp(load_byte(addr_indy()),5); break;
-  /* CMP nn,X */
-  case 0xD5: cmp(load_byte(addr_zerox()),4); break;
-  /* DEC nn,X */
-  case 0xD6: dec(addr_zerox(),6); break;
-  /* CLD */
-  case 0xD8: cld(); break;
-  /* CMP nnnn,Y */
-  case 0xD9: cmp(load_byte(addr_absy()),4); break;
-  /* CMP nnnn,X */
-  case 0xDD: cmp(load_byte(addr_absx()),4); break;
-  /* DEC nnnn,X */
-  case 0xDE: dec(addr_absx(),7); break;
-  /* CPX #nn */
-  case 0xE0: cpx(fetch_op(),2); break;
-  /* SBC (nn,X) */
-  case 0xE1: sbc(load_byte(addr_indx()),6); break;
-  /* CPX nn */
-  case 0xE4: cpx(load_byte(addr_zero()),3); break;
-  /* SBC nn */
-  case 0xE5: sbc(load_byte(addr_zero()),3); break;
-  /* INC nn */
-  case 0xE6: inc(addr_zero(),5); break;
-  /* INX */
-  case 0xE8: inx(); break;
-  /* SBC #nn */
-  case 0xE9: sbc(fetch_op(),2); break;
-  /* NOP */
-  case 0xEA: nop(); break;
-  /* CPX nnnn */
-  case 0xEC: cpx(load_byte(addr_abs()),4); break;
-  /* SBC nnnn */
-  case 0xED: sbc(load_byte(addr_abs()),4); break;
-  /* INC nnnn */
-  case 0xEE: inc(addr_abs(),6); break;
-  /* BEQ nn */
-  case 0xF0: beq(); break;
-  /* SBC (nn,Y) */
-  case 0xF1: sbc(load_byte(addr_indy()),5); break;
-  /* SBC nn,X */
-  case 0xF5: sbc(load_byte(addr_zerox()),4); break;
-  /* INC nn,X */
-  case 0xF6: inc(addr_zerox(),6); break;
-  /* SED */
-  case 0xF8: sed(); break;
-  /* SBC nnnn,Y */
-  case 0xF9: sbc(load_byte(addr_absy()),4); break;
-  /* SBC nnnn,X */
-  case 0xFD: sbc(load_byte(addr_absx()),4); break;
-  /* INC nnnn,X */
-  case 0xFE: inc(addr_absx(),7); break;
+#define CPU_CASE(op, cycles, stmt) case op: stmt; tick(cycles); break;
+  CPU_OPCODES(CPU_CASE)
+#undef CPU_CASE
   /* Unknown or illegal instruction */
   default:
     //D("Unknown instruction: %X at %04x\n", insn,pc());
-    retval = false;
+    return false;
   }
-  return retval;
+  return true;
 }
 
 // helpers ///////////////////////////////////////////////////////////////////
@@ -477,13 +650,40 @@ uint16_t Cpu::addr_abs()
   return addr;
 }
 
+/**
+ * @brief one extra cycle if the indexed address crossed a page
+ *
+ * Computed from the address bits rather than tested, so it doesn't 
+ * add a conditional branch to every indexed read.
+ */
+void Cpu::page_penalty(uint16_t base, uint16_t addr)
+{
+  tick(((base ^ addr) & 0xff00) != 0);
+}
+
 uint16_t Cpu::addr_absy()
+{
+  uint16_t base = fetch_opw();
+  uint16_t addr = base + y();
+  page_penalty(base,addr);
+  return addr;
+}
+
+uint16_t Cpu::addr_absy_w()
 {
   uint16_t addr = fetch_opw() + y();
   return addr;
 }
 
 uint16_t Cpu::addr_absx()
+{
+  uint16_t base = fetch_opw();
+  uint16_t addr = base + x();
+  page_penalty(base,addr);
+  return addr;  
+}
+
+uint16_t Cpu::addr_absx_w()
 {
   uint16_t addr = fetch_opw() + x();
   return addr;  
@@ -497,38 +697,59 @@ uint16_t Cpu::addr_indx()
 }
 
 uint16_t Cpu::addr_indy()
+{
+  uint16_t base = mem_->read_word(addr_zero());
+  uint16_t addr = base + y();
+  page_penalty(base,addr);
+  return addr;
+}
+
+uint16_t Cpu::addr_indy_w()
 {
   uint16_t addr = mem_->read_word(addr_zero()) + y();
   return addr;
 }
 
+/**
+ * @brief relative branch
+ *
+ * A taken branch costs one extra cycle, two if the target lies in 
+ * another page. The new pc and the penalty are selected with masks 
+ * so the emulator itself doesn't branch on the 6510 flags.
+ */
+void Cpu::branch(bool cond)
+{
+  uint16_t addr = (int8_t) fetch_op() + pc();
+  uint16_t mask = -(uint16_t)cond;
+  uint8_t cross = ((pc() ^ addr) & 0xff00) != 0;
+  tick(cond + (cond & cross));
+  pc((addr & mask) | (pc() & ~mask));
+}
+
 // Instructions: data handling and memory operations  ////////////////////////
 
 /**
  * @brief STore Accumulator
  */
-void Cpu::sta(uint16_t addr, uint8_t cycles)
+void Cpu::sta(uint16_t addr)
 {
   mem_->write_byte(addr,a());
-  tick(cycles);
 }
 
 /**
  * @brief STore X
  */
-void Cpu::stx(uint16_t addr, uint8_t cycles)
+void Cpu::stx(uint16_t addr)
 {
   mem_->write_byte(addr,x());
-  tick(cycles);
 }
 
 /**
  * @brief STore Y
  */
-void Cpu::sty(uint16_t addr, uint8_t cycles)
+void Cpu::sty(uint16_t addr)
 {
   mem_->write_byte(addr,y());
-  tick(cycles);
 }
 
 /**
@@ -537,7 +758,6 @@ void Cpu::sty(uint16_t addr, uint8_t cycles)
 void Cpu::txs()
 {
   sp(x());
-  tick(2);
 }
 
 /**
@@ -546,42 +766,34 @@ void Cpu::txs()
 void Cpu::tsx()
 {
   x(sp());
-  SET_ZF(x());
-  SET_NF(x());
-  tick(2);
+  SET_NZ(x());
 }
 
 /**
  * @brief LoaD Accumulator
  */
-void Cpu::lda(uint8_t v, uint8_t cycles)
+void Cpu::lda(uint8_t v)
 {
   a(v);
-  SET_ZF(a());
-  SET_NF(a());
-  tick(cycles);
+  SET_NZ(a());
 }
 
 /**
  * @brief LoaD X
  */
-void Cpu::ldx(uint8_t v, uint8_t cycles)
+void Cpu::ldx(uint8_t v)
 {
   x(v);
-  SET_ZF(x());
-  SET_NF(x());
-  tick(cycles);
+  SET_NZ(x());
 }
 
 /**
  * @brief LoaD Y
  */
-void Cpu::ldy(uint8_t v, uint8_t cycles)
+void Cpu::ldy(uint8_t v)
 {
   y(v);
-  SET_ZF(y());
-  SET_NF(y());
-  tick(cycles);
+  SET_NZ(y());
 }
 
 /**
@@ -590,9 +802,7 @@ void Cpu::ldy(uint8_t v, uint8_t cycles)
 void Cpu::txa()
 {
   a(x());
-  SET_ZF(a());
-  SET_NF(a());
-  tick(2);
+  SET_NZ(a());
 }
 
 /**
@@ -601,9 +811,7 @@ void Cpu::txa()
 void Cpu::tax()
 {
   x(a());
-  SET_ZF(x());
-  SET_NF(x());
-  tick(2);
+  SET_NZ(x());
 }
 
 /**
@@ -612,9 +820,7 @@ void Cpu::tax()
 void Cpu::tay()
 {
   y(a());
-  SET_ZF(y());
-  SET_NF(y());
-  tick(2);
+  SET_NZ(y());
 }
 
 /**
@@ -623,9 +829,7 @@ void Cpu::tay()
 void Cpu::tya()
 {
   a(y());
-  SET_ZF(a());
-  SET_NF(a());
-  tick(2);
+  SET_NZ(a());
 }
 
 /**
@@ -634,7 +838,6 @@ void Cpu::tya()
 void Cpu::pha()
 {
   push(a());
-  tick(3);
 }
 
 /**
@@ -643,9 +846,7 @@ void Cpu::pha()
 void Cpu::pla()
 {
   a(pop());
-  SET_ZF(a());
-  SET_NF(a());
-  tick(4);
+  SET_NZ(a());
 }
  
 // Instructions: logic operations  ///////////////////////////////////////////
@@ -653,35 +854,30 @@ void Cpu::pla()
 /**
  * @brief Logical OR on Accumulator
  */
-void Cpu::ora(uint8_t v, uint8_t cycles)
+void Cpu::ora(uint8_t v)
 {
   a(a()|v);
-  SET_ZF(a());
-  SET_NF(a());
-  tick(cycles);
+  SET_NZ(a());
 }
 
 /**
  * @brief Logical AND
  */
-void Cpu::_and(uint8_t v, uint8_t cycles)
+void Cpu::_and(uint8_t v)
 {
   a(a()&v);
-  SET_ZF(a());
-  SET_NF(a());
-  tick(cycles);
+  SET_NZ(a());
 }
 
 /**
  * @brief BIT test
  */
-void Cpu::bit(uint16_t addr, uint8_t cycles)
+void Cpu::bit(uint16_t addr)
 {
   uint8_t t = load_byte(addr);
-  of((t&0x40)!=0);
-  SET_NF(t);
-  SET_ZF(t&a());
-  tick(cycles);
+  p_ = (p_ & ~kFlagV) | (t & kFlagV);
+  /* N comes from the operand, Z from the masked value */
+  nz_ = ((t & 0x80) << 1) | (uint8_t)(t & a());
 }
  
 /**
@@ -691,8 +887,7 @@ uint8_t Cpu::rol(uint8_t v)
 {
   uint16_t t = (v << 1) | (uint8_t)cf();
   cf((t&0x100)!=0);
-  SET_ZF(t);
-  SET_NF(t);
+  SET_NZ(t);
   return (uint8_t)t;
 }
 
@@ -702,19 +897,17 @@ uint8_t Cpu::rol(uint8_t v)
 void Cpu::rol_a()
 {
   a(rol(a()));
-  tick(2);
 }
 
 /**
  * @brief ROL mem 
  */
-void Cpu::rol_mem(uint16_t addr, uint8_t cycles)
+void Cpu::rol_mem(uint16_t addr)
 {
   uint8_t v = load_byte(addr);
   /* see ASL doc */
   mem_->write_byte(addr,v);
   mem_->write_byte(addr,rol(v));
-  tick(cycles);
 }
 
 /**
@@ -724,8 +917,7 @@ uint8_t Cpu::ror(uint8_t v)
 {
   uint16_t t = (v >> 1) | (uint8_t)(cf() << 7);
   cf((v&0x1)!=0);
-  SET_ZF(t);
-  SET_NF(t);
+  SET_NZ(t);
   return (uint8_t)t;
 }
 
@@ -735,19 +927,17 @@ uint8_t Cpu::ror(uint8_t v)
 void Cpu::ror_a()
 {
   a(ror(a()));
-  tick(2);
 }
 
 /**
  * @brief ROR mem 
  */
-void Cpu::ror_mem(uint16_t addr, uint8_t cycles)
+void Cpu::ror_mem(uint16_t addr)
 {
   uint8_t v = load_byte(addr);
   /* see ASL doc */
   mem_->write_byte(addr,v);
   mem_->write_byte(addr,ror(v));
-  tick(cycles);
 }       
 
 /**
@@ -757,8 +947,7 @@ uint8_t Cpu::lsr(uint8_t v)
 {
   uint8_t t = v >> 1;
   cf((v&0x1)!=0);
-  SET_ZF(t);
-  SET_NF(t);
+  SET_NZ(t);
   return t;
 }
 
@@ -768,19 +957,17 @@ uint8_t Cpu::lsr(uint8_t v)
 void Cpu::lsr_a()
 {
   a(lsr(a()));
-  tick(2);
 }
 
 /**
  * @brief LSR mem
  */
-void Cpu::lsr_mem(uint16_t addr, uint8_t cycles)
+void Cpu::lsr_mem(uint16_t addr)
 {
   uint8_t v = load_byte(addr);
   /* see ASL doc */
   mem_->write_byte(addr,v);
   mem_->write_byte(addr,lsr(v));
-  tick(cycles);
 }
 
 /**
@@ -790,8 +977,7 @@ uint8_t Cpu::asl(uint8_t v)
 {
   uint8_t t = (v << 1) & 0xff;
   cf((v&0x80)!=0);
-  SET_ZF(t);
-  SET_NF(t);
+  SET_NZ(t);
   return t;
 }
 
@@ -801,7 +987,6 @@ uint8_t Cpu::asl(uint8_t v)
 void Cpu::asl_a()
 {
   a(asl(a()));
-  tick(2);
 }
 
 /**
@@ -826,23 +1011,20 @@ void Cpu::asl_a()
  *
  * So.. we need to mimic the behaviour.
  */
-void Cpu::asl_mem(uint16_t addr, uint8_t cycles)
+void Cpu::asl_mem(uint16_t addr)
 {
   uint8_t v = load_byte(addr);
   mem_->write_byte(addr,v); 
   mem_->write_byte(addr,asl(v));
-  tick(cycles);
 } 
 
 /**
  * @brief Exclusive OR 
  */
-void Cpu::eor(uint8_t v, uint8_t cycles)
+void Cpu::eor(uint8_t v)
 {
   a(a()^v);
-  SET_ZF(a());
-  SET_NF(a());
-  tick(cycles);
+  SET_NZ(a());
 }
  
 // Instructions: arithmetic operations  //////////////////////////////////////
@@ -850,29 +1032,27 @@ void Cpu::eor(uint8_t v, uint8_t cycles)
 /**
  * @brief INCrement
  */
-void Cpu::inc(uint16_t addr, uint8_t cycles)
+void Cpu::inc(uint16_t addr)
 {
   uint8_t v = load_byte(addr);
   /* see ASL doc */
   mem_->write_byte(addr,v);
   v++;
   mem_->write_byte(addr,v);
-  SET_ZF(v);
-  SET_NF(v);
+  SET_NZ(v);
 }
 
 /**
  * @brief DECrement
  */
-void Cpu::dec(uint16_t addr, uint8_t cycles)
+void Cpu::dec(uint16_t addr)
 {
   uint8_t v = load_byte(addr);
   /* see ASL doc */
   mem_->write_byte(addr,v);
   v--;
   mem_->write_byte(addr,v);
-  SET_ZF(v);
-  SET_NF(v);
+  SET_NZ(v);
 }
 
 /**
@@ -881,9 +1061,7 @@ void Cpu::dec(uint16_t addr, uint8_t cycles)
 void Cpu::inx()
 {
   x_+=1;
-  SET_ZF(x());
-  SET_NF(x());
-  tick(2);
+  SET_NZ(x());
 }
 
 /**
@@ -892,9 +1070,7 @@ void Cpu::inx()
 void Cpu::iny()
 {
   y_+=1;
-  SET_ZF(y());
-  SET_NF(y());
-  tick(2);
+  SET_NZ(y());
 }
 
 /**
@@ -903,9 +1079,7 @@ void Cpu::iny()
 void Cpu::dex()
 {
   x_-=1;
-  SET_ZF(x());
-  SET_NF(x());
-  tick(2);
+  SET_NZ(x());
 }
 
 /**
@@ -914,15 +1088,13 @@ void Cpu::dex()
 void Cpu::dey()
 {
   y_-=1;
-  SET_ZF(y());
-  SET_NF(y());
-  tick(2);
+  SET_NZ(y());
 }
 
 /**
  * @brief ADd with Carry
  */
-void Cpu::adc(uint8_t v, uint8_t cycles)
+void Cpu::adc(uint8_t v)
 {
   uint16_t t;
   if(dmf())
@@ -941,15 +1113,14 @@ void Cpu::adc(uint8_t v, uint8_t cycles)
   cf(t>0xff);
   t=t&0xff;
   of(!((a()^v)&0x80) && ((a()^t) & 0x80));
-  SET_ZF(t);
-  SET_NF(t);
+  SET_NZ(t);
   a((uint8_t)t);
 }
 
 /**
  * @brief SuBstract with Carry
  */
-void Cpu::sbc(uint8_t v, uint8_t cycles)
+void Cpu::sbc(uint8_t v)
 {
   uint16_t t;
   if(dmf())
@@ -969,8 +1140,7 @@ void Cpu::sbc(uint8_t v, uint8_t cycles)
   cf(t<0x100);
   t=t&0xff;
   of(((a()^t)&0x80) && ((a()^v) & 0x80));
-  SET_ZF(t);
-  SET_NF(t);
+  SET_NZ(t);
   a((uint8_t)t);
 }
  
@@ -982,7 +1152,6 @@ void Cpu::sbc(uint8_t v, uint8_t cycles)
 void Cpu::sei()
 {
   idf(true);
-  tick(2);
 }
 
 /**
@@ -991,7 +1160,6 @@ void Cpu::sei()
 void Cpu::cli()
 {
   idf(false);
-  tick(2);
 }
 
 /**
@@ -1000,7 +1168,6 @@ void Cpu::cli()
 void Cpu::sec()
 {
   cf(true);
-  tick(2);
 }
  
 /**
@@ -1009,7 +1176,6 @@ void Cpu::sec()
 void Cpu::clc()
 {
   cf(false);
-  tick(2);
 }
 
 /**
@@ -1018,7 +1184,6 @@ void Cpu::clc()
 void Cpu::sed()
 {
   dmf(true);
-  tick(2);
 }
  
 /**
@@ -1027,7 +1192,6 @@ void Cpu::sed()
 void Cpu::cld()
 {
   dmf(false);
-  tick(2);
 }
 
 /**
@@ -1036,33 +1200,30 @@ void Cpu::cld()
 void Cpu::clv()
 {
   of(false);
-  tick(2);
 }
 
+/**
+ * @brief P register as pushed on the stack
+ *
+ * C, I, D and V already sit at their bit positions in p_, only N and
+ * Z have to be derived from the last result.
+ */
 uint8_t Cpu::flags()
 {
-  uint8_t v=0;
-  v |= cf()  << 0;
-  v |= zf()  << 1;
-  v |= idf() << 2;
-  v |= dmf() << 3;
+  uint8_t v = p_ & (kFlagC|kFlagI|kFlagD|kFlagV);
+  v |= zf() ? kFlagZ : 0;
+  v |= nf() ? kFlagN : 0;
   /* brk & php instructions push the bcf flag active */
-  v |= 1 << 4;
+  v |= kFlagB;
   /* unused, always set */
-  v |= 1     << 5;
-  v |= of()  << 6;
-  v |= nf()  << 7;
+  v |= kFlagU;
   return v;
 }
 
 void Cpu::flags(uint8_t v)
 {
-  cf(ISSET_BIT(v,0));
-  zf(ISSET_BIT(v,1));
-  idf(ISSET_BIT(v,2));
-  dmf(ISSET_BIT(v,3));
-  of(ISSET_BIT(v,6));
-  nf(ISSET_BIT(v,7));     
+  p_ = (p_ & kFlagB) | (v & (kFlagC|kFlagI|kFlagD|kFlagV));
+  nz(ISSET_BIT(v,7),ISSET_BIT(v,1));
 }
 
 /**
@@ -1071,7 +1232,6 @@ void Cpu::flags(uint8_t v)
 void Cpu::php()
 {
   push(flags());
-  tick(3);
 }
 
 /**
@@ -1080,7 +1240,6 @@ void Cpu::php()
 void Cpu::plp()
 {
   flags(pop());
-  tick(4);
 }
 
 /**
@@ -1096,7 +1255,6 @@ void Cpu::jsr()
   push(((pc()-1) >> 8) & 0xff);
   push(((pc()-1) & 0xff));
   pc(addr);
-  tick(6);
 }
 
 /**
@@ -1106,7 +1264,6 @@ void Cpu::jmp()
 {
   uint16_t addr = addr_abs();
   pc(addr);
-  tick(3);
 }
 
 /**
@@ -1116,7 +1273,6 @@ void Cpu::jmp_ind()
 {
   uint16_t addr = mem_->read_word(addr_abs());
   pc(addr);
-  tick(3);    
 }
  
 /**
@@ -1126,7 +1282,6 @@ void Cpu::rts()
 {
   uint16_t addr = (pop() + (pop() << 8)) + 1;
   pc(addr);
-  tick(6);
 }
 
 /** 
@@ -1134,51 +1289,43 @@ void Cpu::rts()
  */
 void Cpu::bne()
 {
-  uint16_t addr = (int8_t) fetch_op() + pc();
-  if(!zf()) pc(addr);
-  tick(2);
+  branch(!zf());
 }
 
 /** 
  * @brief CoMPare
  */
-void Cpu::cmp(uint8_t v, uint8_t cycles)
+void Cpu::cmp(uint8_t v)
 {
   uint16_t t;
   t = a() - v;
   cf(t<0x100);
   t = t&0xff;
-  SET_ZF(t);
-  SET_NF(t);
-  tick(cycles);
+  SET_NZ(t);
 }
 
 /** 
  * @brief CoMPare X
  */
-void Cpu::cpx(uint8_t v, uint8_t cycles)
+void Cpu::cpx(uint8_t v)
 {
   uint16_t t;
   t = x() - v;
   cf(t<0x100);
   t = t&0xff;
-  SET_ZF(t);
-  SET_NF(t);
-  tick(cycles);
+  SET_NZ(t);
 }
 
 /** 
  * @brief CoMPare Y
  */
-void Cpu::cpy(uint8_t v, uint8_t cycles)
+void Cpu::cpy(uint8_t v)
 {
   uint16_t t;
   t = y() - v;
   cf(t<0x100);
   t = t&0xff;
-  SET_ZF(t);
-  SET_NF(t);
-  tick(cycles);
+  SET_NZ(t);
 }
  
 /** 
@@ -1186,9 +1333,7 @@ void Cpu::cpy(uint8_t v, uint8_t cycles)
  */
 void Cpu::beq()
 {
-  uint16_t addr = (int8_t) fetch_op() + pc();
-  if(zf()) pc(addr);
-  tick(2);
+  branch(zf());
 }
 
 /** 
@@ -1196,9 +1341,7 @@ void Cpu::beq()
  */
 void Cpu::bcs()
 {
-  uint16_t addr = (int8_t) fetch_op() + pc();
-  if(cf()) pc(addr);
-  tick(2);
+  branch(cf());
 }
 
 /** 
@@ -1206,9 +1349,7 @@ void Cpu::bcs()
  */
 void Cpu::bcc()
 {
-  uint16_t addr = (int8_t) fetch_op() + pc();
-  if(!cf()) pc(addr);
-  tick(2);
+  branch(!cf());
 }
  
 /**
@@ -1216,9 +1357,7 @@ void Cpu::bcc()
  */
 void Cpu::bpl()
 {
-  uint16_t addr = (int8_t) fetch_op() + pc();
-  if(!nf()) pc(addr);
-  tick(2);
+  branch(!nf());
 }
 
 /**
@@ -1226,9 +1365,7 @@ void Cpu::bpl()
  */
 void Cpu::bmi()
 {
-  uint16_t addr = (int8_t) fetch_op() + pc();
-  if(nf()) pc(addr);
-  tick(2);    
+  branch(nf());
 }
 
 /**
@@ -1236,9 +1373,7 @@ void Cpu::bmi()
  */
 void Cpu::bvc()
 {
-  uint16_t addr = (int8_t) fetch_op() + pc();
-  if(!of()) pc(addr);
-  tick(2);    
+  branch(!of());
 }
 
 /**
@@ -1246,9 +1381,7 @@ void Cpu::bvc()
  */
 void Cpu::bvs()
 {
-  uint16_t addr = (int8_t) fetch_op() + pc();
-  if(of()) pc(addr);
-  tick(2);    
+  branch(of());
 }
 
 // misc //////////////////////////////////////////////////////////////////////
@@ -1258,7 +1391,27 @@ void Cpu::bvs()
  */
 void Cpu::nop()
 {
-  tick(2);
+}
+
+/**
+ * @brief kernal TRAP
+ *
+ * $02 jams a real 6510, the patched KERNAL uses it followed by
+ * a trap number to call into IO. The batch ends afterwards as
+ * the handler may have changed memory and registers.
+ */
+void Cpu::trap()
+{
+  uint8_t n = fetch_op();
+  /* a native routine is like a long instruction, the batch goes on */
+  if(n >= Natives::kFirstTrap && natives_ != 0)
+  {
+    natives_->trap(n);
+    return;
+  }
+  if(io_ != 0)
+    io_->trap(n);
+  end_batch();
 }
 
 /**
@@ -1272,7 +1425,6 @@ void Cpu::brk()
   pc(mem_->read_word(Memory::kAddrIRQVector));
   idf(true);
   bcf(true);
-  tick(7);
 }
 
 /**
@@ -1282,7 +1434,6 @@ void Cpu::rti()
 {
   flags(pop());
   pc(pop() + (pop() << 8));
-  tick(7);
 }
 
 // interrupts  ///////////////////////////////////////////////////////////////
@@ -1300,7 +1451,10 @@ void Cpu::irq()
     push((flags()&0xef));
     pc(mem_->read_word(Memory::kAddrIRQVector));
     idf(true);
+    unsigned int start = cycles();
     tick(7);
+    if(profiler_ != 0)
+      profiler_->interrupt(pc_,sp_,false,cycles() - start,cycles());
   }
 }
 
@@ -1314,8 +1468,25 @@ void Cpu::nmi()
   /* push flags with bcf cleared */
   push((flags() & 0xef));
   pc(mem_->read_word(Memory::kAddrNMIVector));
+  unsigned int start = cycles();
   tick(7);
+  if(profiler_ != 0)
+    profiler_->interrupt(pc_,sp_,true,cycles() - start,cycles());
 }
 
-
-
+/**
+ * @brief saves or restores registers, flags and the clock
+ */
+void Cpu::snapshot(Snapshot *s)
+{
+  s->value(pc_);
+  s->value(sp_);
+  s->value(a_);
+  s->value(x_);
+  s->value(y_);
+  s->value(p_);
+  s->value(nz_);
+  s->value(cycles_);
+  s->value(irq_lines_);
+  deadline_ = cycles_;
+}
@@ -0,0 +1,192 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <c64/debugger.h>
+#include <c64/cpu.h>
+#include <c64/memory.h>
+#include <lib/string.h>
+#include <lib/stdio.h>
+
+Debugger::Debugger()
+{
+  cpu_ = 0;
+  mem_ = 0;
+  memset(exec_,0,sizeof(exec_));
+  breakpoints_ = 0;
+  watch_count_ = 0;
+  hit_ = kNone;
+  hit_pc_ = hit_addr_ = 0;
+  resume_ = false;
+  resume_pc_ = 0;
+}
+
+Debugger::~Debugger()
+{
+}
+
+// breakpoints /////////////////////////////////////////////////////////////
+
+/**
+ * @brief sets or clears the breakpoint at addr, returns it is now set
+ */
+bool Debugger::toggle_breakpoint(uint16_t addr)
+{
+  uint32_t bit = 1u << (addr & 31);
+  exec_[addr >> 5] ^= bit;
+  bool set = (exec_[addr >> 5] & bit) != 0;
+  if(set)
+    breakpoints_++;
+  else
+    breakpoints_--;
+  return set;
+}
+
+void Debugger::clear_breakpoints()
+{
+  memset(exec_,0,sizeof(exec_));
+  breakpoints_ = 0;
+}
+
+// watchpoints /////////////////////////////////////////////////////////////
+
+/**
+ * @brief watches reads and/or writes to first..last
+ * @return false when all kMaxWatches are in use
+ */
+bool Debugger::watch(uint16_t first, uint16_t last, uint8_t kind)
+{
+  if(watch_count_ == kMaxWatches || last < first)
+    return false;
+  watches_[watch_count_].first = first;
+  watches_[watch_count_].last = last;
+  watches_[watch_count_].kind = kind;
+  watch_count_++;
+  update_pages();
+  return true;
+}
+
+void Debugger::clear_watches()
+{
+  watch_count_ = 0;
+  update_pages();
+}
+
+/**
+ * @brief tells memory which pages to trap
+ */
+void Debugger::update_pages()
+{
+  uint8_t pages[256];
+  memset(pages,0,sizeof(pages));
+  for(int i=0 ; i < watch_count_ ; i++)
+  {
+    for(int page=watches_[i].first >> 8 ; page <= watches_[i].last >> 8 ; page++)
+      pages[page] |= watches_[i].kind;
+  }
+  mem_->watch_pages(pages);
+}
+
+/**
+ * @brief an access to a trapped page, stops when a range matches
+ *
+ * Traps share pages with addresses nobody watches, so most calls
+ * only compare and return.
+ */
+void Debugger::access(uint16_t addr, bool write)
+{
+  uint8_t kind = write ? kWatchWrite : kWatchRead;
+  if(hit_ != kNone)
+    return;
+  for(int i=0 ; i < watch_count_ ; i++)
+  {
+    if((watches_[i].kind & kind) && addr >= watches_[i].first && addr <= watches_[i].last)
+    {
+      hit(write ? kWrite : kRead,cpu_->pc(),addr);
+      return;
+    }
+  }
+}
+
+// hits ////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief records a hit and ends the cpu batch
+ */
+void Debugger::hit(int kind, uint16_t pc, uint16_t addr)
+{
+  hit_ = kind;
+  hit_pc_ = pc;
+  hit_addr_ = addr;
+  cpu_->end_batch();
+}
+
+/**
+ * @brief the machine runs again, the stop it was in is forgotten
+ *
+ * Also discards what the monitor's own accesses to watched memory
+ * tripped over while the machine was stopped.
+ */
+void Debugger::resume()
+{
+  hit_ = kNone;
+  resume_ = true;
+  resume_pc_ = cpu_->pc();
+}
+
+// monitor /////////////////////////////////////////////////////////////////
+
+void Debugger::report_hit()
+{
+  switch(hit_)
+  {
+  case kExec:
+    printf("Breakpoint at %04X\n\n", hit_pc_);
+    break;
+  case kRead:
+    printf("Read from %04X by %04X\n\n", hit_addr_, hit_pc_);
+    break;
+  case kWrite:
+    printf("Write to %04X by %04X\n\n", hit_addr_, hit_pc_);
+    break;
+  }
+}
+
+/**
+ * @brief lists breakpoints and watchpoints
+ */
+void Debugger::report()
+{
+  printf("\n%u breakpoints", breakpoints_);
+  for(int w=0 ; w < 0x10000 / 32 ; w++)
+  {
+    if(exec_[w] == 0)
+      continue;
+    for(int bit=0 ; bit < 32 ; bit++)
+    {
+      if(exec_[w] & (1u << bit))
+        printf(" %04X", w * 32 + bit);
+    }
+  }
+  printf("\n%d watchpoints", watch_count_);
+  for(int i=0 ; i < watch_count_ ; i++)
+  {
+    printf("\n %s %04X-%04X",
+      watches_[i].kind == kWatchRead ? "R " : (watches_[i].kind == kWatchWrite ? "W " : "RW"),
+      watches_[i].first, watches_[i].last);
+  }
+}
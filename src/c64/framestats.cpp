@@ -0,0 +1,218 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <c64/framestats.h>
+#include <drivers/pit.h>
+#include <lib/stdio.h>
+#include <lib/stdlib.h>
+
+using namespace myos::drivers;
+
+extern uint32_t current_milli;
+
+static const char *kPhaseNames[FrameStats::kPhases] =
+{
+  "cpu", "chips", "vic", "present", "idle"
+};
+
+/* histogram bucket i counts frames under 1ms << i, the last one the rest */
+static const char *kBucketNames[FrameStats::kBuckets] =
+{
+  "<1", "<2", "<4", "<8", "<16", "<32", ">=32"
+};
+
+// ctor  /////////////////////////////////////////////////////////////////////
+
+FrameStats::FrameStats()
+{
+  overlay_ = false;
+  phase_ = kCpu;
+  clear();
+}
+
+void FrameStats::clear()
+{
+  for(unsigned int i=0 ; i < kHistory ; i++)
+    for(unsigned int p=0 ; p < kPhases ; p++)
+      history_[i][p] = 0;
+  head_ = 0;
+  frames_ = 0;
+  speed_ = fps_ = 0;
+  resync();
+}
+
+/**
+ * @brief drops the frame in progress, e.g. after the monitor ran
+ */
+void FrameStats::resync()
+{
+  for(unsigned int p=0 ; p < kPhases ; p++)
+    acc_[p] = 0;
+  last_ = ticks();
+  window_milli_ = current_milli;
+  window_frames_ = window_presents_ = 0;
+}
+
+// helpers ///////////////////////////////////////////////////////////////////
+
+uint32_t FrameStats::ticks()
+{
+  return (uint32_t)PITDriver::ReadTSC();
+}
+
+/**
+ * @brief tsc ticks to microseconds, raw ticks if the tsc was
+ * not calibrated
+ */
+uint32_t FrameStats::micros(uint32_t t)
+{
+  uint32_t mhz = PITDriver::TSCFrequencyKHz() / 1000;
+  return mhz ? t / mhz : t;
+}
+
+// recording /////////////////////////////////////////////////////////////////
+
+/**
+ * @brief closes the frame, called once per emulated frame
+ */
+void FrameStats::frame(bool presented)
+{
+  uint32_t *h = history_[head_];
+  for(unsigned int p=0 ; p < kPhases ; p++)
+  {
+    h[p] = micros(acc_[p]);
+    acc_[p] = 0;
+  }
+  head_ = (head_ + 1) % kHistory;
+  if(frames_ < kHistory)
+    frames_++;
+  /* speed and fps are refreshed once per second */
+  window_frames_++;
+  if(presented)
+    window_presents_++;
+  uint32_t elapsed = current_milli - window_milli_;
+  if(elapsed >= 1000)
+  {
+    speed_ = (window_frames_ * (kFrameMicros / 10) + elapsed / 2) / elapsed;
+    fps_ = (window_presents_ * 1000 + elapsed / 2) / elapsed;
+    window_milli_ = current_milli;
+    window_frames_ = window_presents_ = 0;
+  }
+}
+
+// results ///////////////////////////////////////////////////////////////////
+
+static unsigned int bucket(uint32_t us)
+{
+  unsigned int b = 0;
+  uint32_t limit = 1000;
+  while(b < FrameStats::kBuckets - 1 && us >= limit)
+  {
+    b++;
+    limit <<= 1;
+  }
+  return b;
+}
+
+/**
+ * @brief prints speed, the share of each phase and their histograms
+ */
+void FrameStats::report()
+{
+  printf("\nspeed %u%%, %u fps, last %u frames", speed_, fps_, frames_);
+  if(frames_ == 0)
+    return;
+  uint32_t total = 0;
+  uint32_t sum[kPhases];
+  uint32_t max[kPhases];
+  unsigned int hist[kPhases][kBuckets];
+  for(unsigned int p=0 ; p < kPhases ; p++)
+  {
+    sum[p] = max[p] = 0;
+    for(unsigned int b=0 ; b < kBuckets ; b++)
+      hist[p][b] = 0;
+  }
+  for(unsigned int i=0 ; i < frames_ ; i++)
+  {
+    for(unsigned int p=0 ; p < kPhases ; p++)
+    {
+      uint32_t us = history_[i][p];
+      sum[p] += us;
+      total += us;
+      if(us > max[p])
+	max[p] = us;
+      hist[p][bucket(us)]++;
+    }
+  }
+  printf("\n PHASE AVG MAX %% / frames per bucket (ms)");
+  printf("\n      ");
+  for(unsigned int b=0 ; b < kBuckets ; b++)
+    printf(" %s", kBucketNames[b]);
+  for(unsigned int p=0 ; p < kPhases ; p++)
+  {
+    printf("\n %s %u %u %u%% /", kPhaseNames[p], sum[p] / frames_, max[p],
+	   total ? sum[p] * 100 / total : 0);
+    for(unsigned int b=0 ; b < kBuckets ; b++)
+      printf(" %u", hist[p][b]);
+  }
+  printf("\n frame %u us", total / frames_);
+}
+
+static char *put_str(char *p, const char *s)
+{
+  while(*s)
+    *p++ = *s++;
+  return p;
+}
+
+static char *put_dec(char *p, uint32_t v)
+{
+  char digits[12];
+  itoa(v, digits, 10);
+  return put_str(p, digits);
+}
+
+/**
+ * @brief one line for the overlay, speed, fps and the phase shares
+ */
+int FrameStats::text(char *buf)
+{
+  uint32_t total = 0;
+  uint32_t sum[kPhases];
+  for(unsigned int p=0 ; p < kPhases ; p++)
+  {
+    sum[p] = 0;
+    for(unsigned int i=0 ; i < frames_ ; i++)
+      sum[p] += history_[i][p];
+    total += sum[p];
+  }
+  if(total == 0)
+    total = 1;
+  static const char kLabels[kPhases] = {'C', 'H', 'V', 'P', 'I'};
+  char *p = put_str(buf, "SPD ");
+  p = put_dec(p, speed_);
+  p = put_str(p, "% FPS ");
+  p = put_dec(p, fps_);
+  for(unsigned int i=0 ; i < kPhases ; i++)
+  {
+    *p++ = ' ';
+    *p++ = kLabels[i];
+    p = put_dec(p, sum[i] * 100 / total);
+  }
+  *p = 0;
+  return p - buf;
+}
@@ -0,0 +1,351 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <c64/iec.h>
+
+// ctor  /////////////////////////////////////////////////////////////////////
+
+Iec::Iec()
+{
+  cpu_ = 0;
+  io_ = 0;
+  atn_ = clk_ = data_ = false;
+  drive_clk_ = drive_data_ = false;
+  state_ = kIdle;
+  since_ = 0;
+  byte_ = bits_ = 0;
+  eoi_ = false;
+  last_clk_ = false;
+  role_ = kNone;
+  under_atn_ = false;
+  fast_ = false;
+  fast_request_ = fast_pos_ = 0;
+  fast_status_ = 0;
+}
+
+// port access  //////////////////////////////////////////////////////////////
+
+/**
+ * @brief CIA2 port A written, bits 3-5 pull ATN, CLK and DATA low
+ */
+void Iec::write(uint8_t pra)
+{
+  bool atn = (pra & 0x08) != 0;
+  bool clk = (pra & 0x10) != 0;
+  bool data = (pra & 0x20) != 0;
+  if(!fast_ && io_->drive_loader() != IO::kLoaderNone)
+  {
+    /* the loader the c64 just started owns the bus */
+    fast_ = true;
+    fast_request_ = fast_pos_ = 0;
+    drive_clk_ = drive_data_ = false;
+    role_ = kNone;
+    under_atn_ = false;
+    state_ = kFastRequest;
+    atn_ = atn;
+  }
+  if(fast_)
+  {
+    if(atn != atn_)
+      fast_edge(clk, data);
+    atn_ = atn;
+    clk_ = clk;
+    data_ = data;
+    return;
+  }
+  /* catch up with the old line levels first */
+  step();
+  if(atn && !atn_)
+  {
+    /* every device listens to ATN, DATA says we're here */
+    under_atn_ = true;
+    drive_clk_ = false;
+    drive_data_ = true;
+    state_ = kListenWait;
+  }
+  else if(!atn && atn_)
+  {
+    under_atn_ = false;
+    if(role_ == kTalker)
+      state_ = kTurnaround;
+    else if(role_ == kNone)
+    {
+      drive_clk_ = drive_data_ = false;
+      state_ = kIdle;
+    }
+  }
+  atn_ = atn;
+  clk_ = clk;
+  data_ = data;
+  step();
+}
+
+/**
+ * @brief CLK in (bit 6) and DATA in (bit 7), 1 while the line is high
+ */
+uint8_t Iec::read()
+{
+  step();
+  return (clk_line() ? 0 : 0x40) | (data_line() ? 0 : 0x80);
+}
+
+// drive  ////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief a byte came in, commands under ATN pick the role
+ */
+void Iec::received(uint8_t b)
+{
+  if(!under_atn_)
+  {
+    if(role_ == kListener)
+      io_->bus_put(b);
+    return;
+  }
+  if(b == 0x3f || b == 0x5f)
+  {
+    /* UNLISTEN, UNTALK */
+    if(role_ != kNone)
+      io_->bus_release();
+    role_ = kNone;
+  }
+  else if((b & 0xe0) == 0x20)
+    role_ = io_->bus_address(b & 0x1f) == 0 ? kListener : kNone;
+  else if((b & 0xe0) == 0x40)
+    role_ = io_->bus_address(b & 0x1f) == 0 ? kTalker : kNone;
+  else if(role_ != kNone)
+    io_->bus_secondary(b);
+}
+
+/**
+ * @brief fetch the next byte to talk, release the lines if there's none
+ */
+void Iec::next_byte()
+{
+  uint8_t status = 0;
+  byte_ = io_->bus_get(&status);
+  if(status & 0x02)
+  {
+    /* nothing to send, the listener times out */
+    drive_clk_ = drive_data_ = false;
+    state_ = kIdle;
+    return;
+  }
+  eoi_ = (status & 0x40) != 0;
+  /* ready to send */
+  drive_clk_ = false;
+  state_ = kTalkWait;
+}
+
+/**
+ * @brief advance the drive up to the current cycle
+ *
+ * Runs until the state settles, several steps may happen at once
+ * when the c64 hasn't looked at the port for a while.
+ */
+void Iec::step()
+{
+  bool clk = clk_line();
+  bool clk_released = last_clk_ && !clk;
+  bool clk_pulled = !last_clk_ && clk;
+  
+  for(int i=0 ; i < 8 ; i++)
+  {
+    kState prev = state_;
+    switch(state_)
+    {
+    case kIdle:
+      break;
+    /* listener */
+    case kListenWait:
+      drive_data_ = true;
+      if(!clk_line())
+      {
+        /* talker ready to send, we're ready for data */
+        drive_data_ = false;
+        eoi_ = false;
+        since_ = cpu_->cycles();
+        state_ = kListenReady;
+      }
+      break;
+    case kListenReady:
+      if(clk_line())
+      {
+        byte_ = bits_ = 0;
+        clk_pulled = false;
+        state_ = kListenBits;
+      }
+      else if(!eoi_ && !under_atn_ && elapsed() >= kEoiTimeout)
+      {
+        /* the talker is holding back: last byte, acknowledge it */
+        eoi_ = true;
+        drive_data_ = true;
+        since_ = cpu_->cycles();
+        state_ = kListenEoi;
+      }
+      break;
+    case kListenEoi:
+      if(elapsed() >= kEoiHold)
+      {
+        drive_data_ = false;
+        state_ = kListenReady;
+      }
+      break;
+    case kListenBits:
+      if(clk_released && bits_ < 8)
+      {
+        /* bits are valid while CLK is high, LSB first */
+        if(!data_line())
+          byte_ |= 1 << bits_;
+        bits_++;
+        clk_released = false;
+      }
+      else if(clk_pulled && bits_ == 8)
+      {
+        /* frame handshake */
+        drive_data_ = true;
+        clk_pulled = false;
+        state_ = kListenWait;
+        received(byte_);
+      }
+      break;
+    /* talker */
+    case kTurnaround:
+      if(!clk_)
+      {
+        drive_clk_ = true;
+        drive_data_ = false;
+        since_ = cpu_->cycles();
+        state_ = kTalkReady;
+      }
+      break;
+    case kTalkReady:
+      if(elapsed() >= kByteGap)
+        next_byte();
+      break;
+    case kTalkWait:
+      if(!data_line())
+      {
+        since_ = cpu_->cycles();
+        state_ = eoi_ ? kTalkEoi : kTalkBits;
+      }
+      break;
+    case kTalkEoi:
+      if(data_line())
+        state_ = kTalkEoiRelease;
+      break;
+    case kTalkEoiRelease:
+      if(!data_line())
+      {
+        since_ = cpu_->cycles();
+        state_ = kTalkBits;
+      }
+      break;
+    case kTalkBits:
+    {
+      /* CLK low with the bit on DATA, then CLK high while it's valid */
+      unsigned int phase = elapsed() / kBitHalf;
+      if(phase < 16)
+      {
+        drive_clk_ = (phase & 1) == 0;
+        drive_data_ = ((byte_ >> (phase >> 1)) & 1) == 0;
+      }
+      else
+      {
+        drive_clk_ = true;
+        drive_data_ = false;
+        state_ = kTalkAck;
+      }
+      break;
+    }
+    case kFastRequest:
+    case kFastReply:
+      break;
+    case kTalkAck:
+      if(data_line())
+      {
+        since_ = cpu_->cycles();
+        if(eoi_)
+        {
+          drive_clk_ = false;
+          state_ = kIdle;
+        }
+        else
+          state_ = kTalkReady;
+      }
+      break;
+    }
+    if(state_ == prev)
+      break;
+  }
+  last_clk_ = clk_line();
+}
+
+// fast loader  //////////////////////////////////////////////////////////////
+
+/**
+ * @brief ATN changed, the c64 clocks the next two bits
+ */
+void Iec::fast_edge(bool clk, bool data)
+{
+  if(state_ == kFastRequest)
+  {
+    fast_request_ |= ((clk ? 1 : 0) | (data ? 2 : 0)) << fast_pos_;
+    fast_pos_ += 2;
+    if(fast_pos_ < 16)
+      return;
+    uint8_t track = fast_request_ & 0xff;
+    uint8_t sector = fast_request_ >> 8;
+    fast_request_ = fast_pos_ = 0;
+    if(track == 0)
+    {
+      /* back to the DOS */
+      io_->drive_loader_exit();
+      fast_ = false;
+      drive_clk_ = drive_data_ = false;
+      last_clk_ = clk_line();
+      state_ = kIdle;
+      return;
+    }
+    fast_status_ = io_->drive_sector(track, sector, fast_sector_) ? 0 : 1;
+    if(fast_status_ != 0)
+      memset(fast_sector_, 0, sizeof(fast_sector_));
+    state_ = kFastReply;
+    fast_show();
+    return;
+  }
+  if(++fast_pos_ == 257 * 4)
+  {
+    fast_pos_ = 0;
+    drive_clk_ = drive_data_ = false;
+    state_ = kFastRequest;
+    return;
+  }
+  fast_show();
+}
+
+/**
+ * @brief puts the bit pair fast_pos_ of the reply on CLK and DATA
+ */
+void Iec::fast_show()
+{
+  unsigned int n = fast_pos_ >> 2;
+  uint8_t b = n == 0 ? fast_status_ : fast_sector_[n - 1];
+  b >>= (fast_pos_ & 3) * 2;
+  drive_clk_ = (b & 1) != 0;
+  drive_data_ = (b & 2) != 0;
+}
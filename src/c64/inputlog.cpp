@@ -0,0 +1,214 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <c64/inputlog.h>
+#include <lib/stdio.h>
+#include <lib/string.h>
+
+using namespace myos::filesystem;
+
+const char InputLog::kMagic[8] = {'O','S','6','4','K','E','Y','S'};
+
+/* magic, version, count */
+static const uint32_t kHeaderSize = 8 + 2 + 4;
+/* the longest varint of a 32 bit delta, key and flags */
+static const uint32_t kMaxEventSize = 5 + 2;
+
+// ctor  /////////////////////////////////////////////////////////////////////
+
+InputLog::InputLog()
+{
+  arena_ = 0;
+  events_ = 0;
+  count_ = next_ = 0;
+  mode_ = kOff;
+}
+
+bool InputLog::allocate()
+{
+  if(events_ == 0 && arena_ != 0)
+    events_ = new(arena_) Event[kMaxEvents];
+  return events_ != 0;
+}
+
+// recording and replay //////////////////////////////////////////////////////
+
+/**
+ * @brief starts an empty log
+ */
+void InputLog::record()
+{
+  if(!allocate())
+    return;
+  count_ = next_ = 0;
+  mode_ = kRecord;
+}
+
+/**
+ * @brief replays the log from its first event, false if it is empty
+ */
+bool InputLog::replay()
+{
+  next_ = 0;
+  mode_ = count_ > 0 ? kReplay : kOff;
+  return mode_ == kReplay;
+}
+
+void InputLog::log(uint32_t cycle, uint8_t key, bool down)
+{
+  if(count_ == kMaxEvents)
+  {
+    /* full, the log so far is kept */
+    mode_ = kOff;
+    return;
+  }
+  Event &e = events_[count_++];
+  e.cycle = cycle;
+  e.key = key;
+  e.down = down;
+}
+
+/**
+ * @brief the next event due at cycle now, replay ends after the last
+ */
+bool InputLog::next(uint32_t now, uint8_t *key, bool *down)
+{
+  if(next_ == count_)
+  {
+    mode_ = kOff;
+    return false;
+  }
+  Event &e = events_[next_];
+  if((int32_t)(now - e.cycle) < 0)
+    return false;
+  *key = e.key;
+  *down = e.down;
+  next_++;
+  return true;
+}
+
+// files /////////////////////////////////////////////////////////////////////
+
+int InputLog::save(Fat32 *fs, uint8_t *filename)
+{
+  uint8_t *buf = new uint8_t[kHeaderSize + count_ * kMaxEventSize];
+  uint8_t *p = buf;
+  memcpy(p, kMagic, sizeof(kMagic));
+  p += sizeof(kMagic);
+  *p++ = kVersion & 0xff;
+  *p++ = kVersion >> 8;
+  for(int i=0 ; i < 4 ; i++)
+    *p++ = count_ >> (i * 8);
+  /* the first delta is the absolute cycle */
+  uint32_t prev = 0;
+  for(unsigned int i=0 ; i < count_ ; i++)
+  {
+    uint32_t delta = events_[i].cycle - prev;
+    prev = events_[i].cycle;
+    while(delta >= 0x80)
+    {
+      *p++ = (delta & 0x7f) | 0x80;
+      delta >>= 7;
+    }
+    *p++ = delta;
+    *p++ = events_[i].key;
+    *p++ = events_[i].down ? 0x80 : 0;
+  }
+  if(fs->GetFileSize(filename) != 0)
+    fs->DeleteFile(filename);
+  int fstatus = fs->OpenFile(0,filename,FILEACCESSMODE_CREATE);
+  if(fstatus == FILE_STATUS_OK)
+  {
+    fstatus = fs->WriteFileBlock(0,buf,p - buf);
+    fs->CloseFile(0);
+  }
+  delete [] buf;
+  return fstatus;
+}
+
+/**
+ * @brief reads a log, the file is checked before the old log is lost
+ */
+int InputLog::load(Fat32 *fs, uint8_t *filename)
+{
+  uint32_t size = fs->GetFileSize(filename);
+  if(size == 0)
+    return FILE_STATUS_NOTFOUND;
+  if(size < kHeaderSize || size > kHeaderSize + kMaxEvents * kMaxEventSize)
+    return kBadFormat;
+  if(!allocate())
+    return kBadFormat;
+  int fstatus = fs->OpenFile(0,filename,FILEACCESSMODE_READ);
+  if(fstatus != FILE_STATUS_OK)
+    return fstatus;
+  uint8_t *buf = new uint8_t[size];
+  uint32_t n = fs->ReadFileBlock(0,buf,size);
+  fs->CloseFile(0);
+  uint8_t *p = buf + sizeof(kMagic);
+  uint8_t *end = buf + n;
+  uint16_t version = p[0] | (p[1] << 8);
+  uint32_t count = p[2] | (p[3] << 8) | (p[4] << 16) | (p[5] << 24);
+  p += 6;
+  if(n != size || memcmp(buf,kMagic,sizeof(kMagic)) != 0 ||
+     version != kVersion || count > kMaxEvents)
+    fstatus = kBadFormat;
+  else
+  {
+    mode_ = kOff;
+    uint32_t cycle = 0;
+    unsigned int i = 0;
+    for( ; i < count ; i++)
+    {
+      uint32_t delta = 0;
+      int shift = 0;
+      while(p < end && (*p & 0x80) && shift < 28)
+      {
+        delta |= (*p++ & 0x7f) << shift;
+        shift += 7;
+      }
+      if(end - p < 3)
+        break;
+      delta |= *p++ << shift;
+      cycle += delta;
+      events_[i].cycle = cycle;
+      events_[i].key = *p++;
+      events_[i].down = (*p++ & 0x80) != 0;
+    }
+    count_ = i;
+    next_ = 0;
+    if(i != count)
+    {
+      count_ = 0;
+      fstatus = kBadFormat;
+    }
+  }
+  delete [] buf;
+  return fstatus;
+}
+
+// results ///////////////////////////////////////////////////////////////////
+
+void InputLog::report()
+{
+  printf("\ninput %s, %u events", mode_ == kRecord ? "recording" :
+         mode_ == kReplay ? "replaying" : "off", count_);
+  if(mode_ == kReplay)
+    printf(", %u left", count_ - next_);
+  if(count_ > 0)
+    printf(", cycles %u to %u", events_[0].cycle, events_[count_-1].cycle);
+}
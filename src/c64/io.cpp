@@ -17,7 +17,9 @@
 
 #include <c64/io.h>
 #include <c64/vic.h>
+#include <c64/tokenizer.h>
 #include <lib/vga.h>
+#include <hardwarecommunication/port.h>
 
 // The 64 has only 64 keys. This matrix represents the keyboard
 // to the CIA1 chip. PC keys must supply the same code for a keypress
@@ -57,7 +59,6 @@ const uint8_t IO::kbd[8][8] = {
 
 IO::IO()
 {  
-  init_color_palette();
   init_keyboard();
   shift = 0;
   mode = 0;
@@ -65,11 +66,48 @@ IO::IO()
   
   cols_ = Vic::kVisibleScreenWidth;
   rows_ = Vic::kVisibleScreenHeight;
+  
+  bus_device_ = 0;
+  bus_secondary_ = 0;
+  bus_name_length_ = 0;
+  for(int i=0; i < kDriveChannels; i++)
+  {
+    channel_mode_[i] = FILEACCESSMODE_CLOSED;
+    channel_next_[i] = -1;
+  }
+  drive_status_ = "73,CBM DOS V2.6 1541,00,00";
+  drive_status_ptr_ = 0;
+  memset(drive_ram_, 0, sizeof(drive_ram_));
+  drive_memory_length_ = 0;
+  drive_memory_ptr_ = 0;
+  drive_loader_ = kLoaderNone;
+  d64_ = 0;
+  fat32_ = 0;
+  key_head_ = 0;
+  key_tail_ = 0;
+  stats_ = 0;
+  flip_ = 0;
+  back_page_ = 1;
+  worker_ = 0;
+  pscreen_ = 0;
+  input_ = 0;
+  console_seen_ = console_epoch_;
+  skip_ctr_ = 0;
+  for(int y=0; y < VIRT_HEIGHT; y++)
+    border_lines_[y] = 0;
 }
 
 IO::~IO()
 {
-  delete [] frame_;
+  /* open files hold Fat32 buffers beyond this machine */
+  if(fat32_ != 0)
+  {
+    for(int i=0; i < kDriveChannels; i++)
+      file_close(i);
+  }
+  delete d64_;
+  /* the console lives on the first page */
+  show_console();
 }
 
 // init io devices  ////////////////////////////////////////////////////////////
@@ -77,10 +115,7 @@ IO::~IO()
 void IO::init_keyboard()
 {
   /* init keyboard matrix state */
-  for(size_t i=0 ; i < sizeof(keyboard_matrix_) ; i++)
-  {
-    keyboard_matrix_[i] = 0xff;
-  }
+  memset(keyboard_matrix_, 0xff, sizeof(keyboard_matrix_));
   
   joy1 = 0;
   joy2 = 0;
@@ -93,59 +128,374 @@ void IO::init_display(uint32_t* vgaMemAddress, uint32_t width, uint32_t height,
   screen_height_ = height;
   screen_pitch_ = pitch;
   screen_bpp_ = bpp;
-  pixel_width_ = bpp/8;
+  pixel_width_ = (bpp+7)/8;
+  
+  init_color_palette();
+  switch(pixel_width_)
+  {
+  case 1: present_ = &IO::present_dirty_lines<1>; break;
+  case 3: present_ = &IO::present_dirty_lines<3>; break;
+  case 4: present_ = &IO::present_dirty_lines<4>; break;
+  default: present_ = &IO::present_dirty_lines<2>; break;
+  }
   
-  vscreen_ = new uint16_t[VIRT_WIDTH  * VIRT_HEIGHT];
-  pscreen_ = new uint16_t[screen_pitch_ * screen_height_];
+  vscreen_ = new(arena_) uint16_t[VIRT_WIDTH  * VIRT_HEIGHT];
+  fscreen_ = new(arena_) uint16_t[VIRT_WIDTH  * VIRT_HEIGHT];
+  present_src_ = vscreen_;
+  backbuf_ = new(arena_) uint8_t[screen_pitch_ * screen_height_];
+  screen_invalidate();
+  next_frame_milli_ = current_milli;
+  warp_present_milli_ = current_milli;
+  next_frame_rem_ = 0;
 
-  scaleWidth =  (double)screen_pitch_ / (double)VIRT_WIDTH;
-  scaleHeight = (double)screen_height_ / (double)VIRT_HEIGHT;
+  /**
+   * a mode that is an integer multiple of the virtual screen, as the
+   * bga driver sets, is pure pixel replication. The width may be
+   * rounded up by a few pixels, those repeat the last column.
+   */
+  scale_ = screen_height_ / VIRT_HEIGHT;
+  if(scale_ == 0 || screen_height_ != scale_ * VIRT_HEIGHT ||
+     screen_width_ < scale_ * VIRT_WIDTH || screen_width_ >= scale_ * VIRT_WIDTH + 8)
+    scale_ = 0;
+
+  /* nearest neighbour scaling, source indices are computed once */
+  col_src_ = new(arena_) uint16_t[screen_width_];
+  row_src_ = new(arena_) uint16_t[screen_height_];
+  for(uint32_t cx = 0; cx < screen_width_; cx++)
+    col_src_[cx] = scale_ ? (cx / scale_ < VIRT_WIDTH ? cx / scale_ : VIRT_WIDTH - 1) :
+      cx * VIRT_WIDTH / screen_width_;
+  for(uint32_t cy = 0; cy < screen_height_; cy++)
+    row_src_[cy] = cy * VIRT_HEIGHT / screen_height_;
 }
 
-void IO::init_color_palette()
+/**
+ * @brief host rows left black, odd rows or the last row of each
+ * replicated line, none when the lines are not replicated at all
+ */
+inline bool IO::scanline(uint32_t cy)
 {
- color_palette[0] = ((0x00>>3)<<11) | ((0x00>>2)<<5) | (0x00>>3);
- color_palette[1] = ((0xff>>3)<<11) | ((0xff>>2)<<5) | (0xff>>3);
- color_palette[2] = ((0x88>>3)<<11) | ((0x00>>2)<<5) | (0x00>>3);
- color_palette[3] = ((0xAA>>3)<<11) | ((0xFF>>2)<<5) | (0xEE>>3);
- color_palette[4] = ((0xCC>>3)<<11) | ((0x44>>2)<<5) | (0xCC>>3);
- color_palette[5] = ((0x00>>3)<<11) | ((0xCC>>2)<<5) | (0x55>>3);
- color_palette[6] = ((0x00>>3)<<11) | ((0x00>>2)<<5) | (0xAA>>3);
- color_palette[7] = ((0xEE>>3)<<11) | ((0xEE>>2)<<5) | (0x77>>3);
- color_palette[8] = ((0xDD>>3)<<11) | ((0x88>>2)<<5) | (0x55>>3);
- color_palette[9] = ((0x66>>3)<<11) | ((0x44>>2)<<5) | (0x00>>3);
- color_palette[10] = ((0xFF>>3)<<11) | ((0x77>>2)<<5) | (0x77>>3);
- color_palette[11] = ((0x33>>3)<<11) | ((0x33>>2)<<5) | (0x33>>3);
- color_palette[12] = ((0x77>>3)<<11) | ((0x77>>2)<<5) | (0x77>>3);
- color_palette[13] = ((0xAAa>>3)<<11) | ((0xFF>>2)<<5) | (0x66>>3);
- color_palette[14] = ((0x00>>3)<<11) | ((0x88>>2)<<5) | (0xFF>>3);
- color_palette[15] = ((0xBB>>3)<<11) | ((0xBB>>2)<<5) | (0xBB>>3);
+  if(scale_ == 0)
+    return (cy & 1) != 0;
+  return scale_ > 1 && cy % scale_ == scale_ - 1;
 }
 
-// emulation /////////////////////////////////////////////////////////////////// 
+/**
+ * @brief stores one pixel in the framebuffer native format
+ *
+ * BPP is the framebuffer depth in bytes, 24bpp pixels are written as 
+ * a word and a byte.
+ */
+template<int BPP> static inline void store_pixel(uint8_t *dst, uint32_t c);
 
-bool IO::emulate()
+template<> inline void store_pixel<1>(uint8_t *dst, uint32_t c)
+{
+  *dst = c;
+}
+
+template<> inline void store_pixel<2>(uint8_t *dst, uint32_t c)
+{
+  *(uint16_t*)dst = c;
+}
+
+template<> inline void store_pixel<3>(uint8_t *dst, uint32_t c)
+{
+  *(uint16_t*)dst = c;
+  dst[2] = c >> 16;
+}
+
+template<> inline void store_pixel<4>(uint8_t *dst, uint32_t c)
+{
+  *(uint32_t*)dst = c;
+}
+
+/**
+ * @brief scales virtual line src into host row cy
+ *
+ * Scaling, palette lookup and the pixel store are done in a single
+ * pass. Rows picked by scanline() are left black.
+ */
+template<int BPP> void IO::scale_row(uint8_t *dst, uint32_t cy, const uint16_t *src)
+{
+  if(scanline(cy))
+  {
+    for(uint32_t cx = 0; cx < screen_width_; cx++, dst += BPP)
+      store_pixel<BPP>(dst, color_palette[0]);
+  }
+  else if(scale_ != 0)
+  {
+    /* integer scale, one palette lookup per source pixel */
+    uint8_t *end = dst + screen_width_ * BPP;
+    for(uint32_t sx = 0; sx < VIRT_WIDTH; sx++)
+    {
+      uint32_t c = color_palette[src[sx]];
+      for(uint32_t i = 0; i < scale_; i++, dst += BPP)
+        store_pixel<BPP>(dst, c);
+    }
+    uint32_t c = color_palette[src[VIRT_WIDTH - 1]];
+    for(; dst < end; dst += BPP)
+      store_pixel<BPP>(dst, c);
+  }
+  else
+  {
+    for(uint32_t cx = 0; cx < screen_width_; cx++, dst += BPP)
+      store_pixel<BPP>(dst, color_palette[src[col_src_[cx]]]);
+  }
+}
+
+/**
+ * @brief scales the changed lines and presents them
+ *
+ * The lines are composed in the RAM back buffer, the rows that 
+ * changed are then copied to video memory with one bulk copy. Video
+ * memory is mapped write-combining when the MTRR setup in the kernel
+ * succeeded, so the long run of aligned stores goes out in bursts.
+ */
+template<int BPP> void IO::present_dirty_lines()
 {
-  // FAT32 hook
-  uint8_t fat32cmd;
-  fat32cmd =  mem_->read_byte(0x02);
+  uint32_t first = screen_height_, last = 0;
+  for(uint32_t cy = 0; cy < screen_height_; cy++)
+  {
+    uint16_t sy = row_src_[cy];
+    if(!present_line(sy))
+      continue;
+    if(first > cy)
+      first = cy;
+    last = cy;
+    scale_row<BPP>(backbuf_ + cy * screen_pitch_, cy, present_src_ + sy * VIRT_WIDTH);
+  }
+  
+  if(first > last)
+    return;
+  uint32_t row_bytes = screen_width_ * BPP;
+  if(row_bytes == screen_pitch_)
+    memcpy(vgaMem_ + first * screen_pitch_, backbuf_ + first * screen_pitch_,
+	   (last - first + 1) * screen_pitch_);
+  else
+  {
+    /* a tile, the rest of each row belongs to other machines */
+    for(uint32_t cy = first; cy <= last; cy++)
+      if(present_line(row_src_[cy]))
+	memcpy(vgaMem_ + cy * screen_pitch_, backbuf_ + cy * screen_pitch_, row_bytes);
+  }
+}
+
+/**
+ * @brief scales straight into the hidden page and displays it
+ *
+ * The hidden page still shows the frame before the last one, so the
+ * lines that changed in either frame are redrawn. Presenting is then
+ * a single start offset write, nothing is copied.
+ */
+template<int BPP> void IO::present_flip()
+{
+  uint32_t changed = 0;
+  for(int i=0; i < (VIRT_HEIGHT + 31) / 32 ; i++)
+    changed |= present_lines_[i] | prev_dirty_lines_[i];
+  if(changed == 0)
+    return;
   
-  switch (fat32cmd)  
+  uint8_t *page = vgaMem_ + back_page_ * screen_height_ * screen_pitch_;
+  for(uint32_t cy = 0; cy < screen_height_; cy++)
+  {
+    uint16_t sy = row_src_[cy];
+    if(!present_line(sy) && (prev_dirty_lines_[sy >> 5] & (1 << (sy & 31))) == 0)
+      continue;
+    scale_row<BPP>(page + cy * screen_pitch_, cy, present_src_ + sy * VIRT_WIDTH);
+  }
+  flip_->ShowPage(back_page_);
+  back_page_ ^= 1;
+  
+  for(int i=0; i < (VIRT_HEIGHT + 31) / 32 ; i++)
+    prev_dirty_lines_[i] = present_lines_[i];
+}
+
+/**
+ * @brief runs the present on the worker processor
+ */
+void IO::present_job(void *io)
+{
+  IO *self = (IO*)io;
+  (self->*(self->present_))();
+}
+
+/**
+ * @brief presents by page flipping when the display allows it
+ */
+void IO::page_flip(BGADriver *v)
+{
+  if(v == 0 || !v->PageFlip())
+    return;
+  flip_ = v;
+  back_page_ = 1;
+  switch(pixel_width_)
+  {
+  case 1: present_ = &IO::present_flip<1>; break;
+  case 3: present_ = &IO::present_flip<3>; break;
+  case 4: present_ = &IO::present_flip<4>; break;
+  default: present_ = &IO::present_flip<2>; break;
+  }
+  screen_invalidate();
+}
+
+/**
+ * @brief shows the first page, where the monitor and the console print
+ *
+ * The next frame goes to the second page and redraws everything, the
+ * first one has been written over.
+ */
+void IO::show_console()
+{
+  present_wait();
+  console_epoch_++;
+  /* the frames drew over the console glyphs */
+  vga_invalidate();
+  if(flip_ == 0)
+    return;
+  flip_->ShowPage(0);
+  back_page_ = 1;
+  screen_invalidate();
+}
+
+/**
+ * @brief 3x5 glyphs for the overlay, one bit per pixel, top row first
+ */
+static uint16_t overlay_glyph(char c)
+{
+  static const uint16_t kDigits[10] = {
+    075557, 022222, 071747, 071717, 055711,
+    074717, 074757, 071111, 075757, 075717
+  };
+  if(c >= '0' && c <= '9')
+    return kDigits[c - '0'];
+  switch(c)
+  {
+  case 'C': return 074447;
+  case 'D': return 065556;
+  case 'F': return 074644;
+  case 'H': return 055755;
+  case 'I': return 072227;
+  case 'P': return 075744;
+  case 'S': return 074717;
+  case 'V': return 055552;
+  case '%': return 051245;
+  }
+  return 0;
+}
+
+/**
+ * @brief draws the frame statistics into the top border
+ *
+ * The text is put over the lines the vic just finished, changes
+ * are not tracked against fscreen_, so its lines are flagged
+ * dirty every time it is drawn.
+ */
+void IO::draw_overlay()
+{
+  static const int kX = 4;
+  static const int kY = 2;
+  static const int kHeight = 7;
+  char text[64];
+  int n = stats_->text(text);
+  int width = n * 4 + 1;
+  if(kX + width > VIRT_WIDTH)
+    width = VIRT_WIDTH - kX;
+  for(int y=0 ; y < kHeight ; y++)
+  {
+    uint16_t *line = screen_line(kY + y);
+    for(int x=0 ; x < width ; x++)
+      line[kX + x] = 0;
+    dirty_lines_[(kY + y) >> 5] |= 1 << ((kY + y) & 31);
+    screen_line_changed(kY + y);
+  }
+  for(int i=0 ; i < n && kX + i * 4 + 4 <= VIRT_WIDTH ; i++)
   {
-    case 0x04:
+    uint16_t g = overlay_glyph(text[i]);
+    for(int y=0 ; y < 5 ; y++)
     {
-      file_load();
-      break;
+      uint16_t *line = screen_line(kY + 1 + y) + kX + 1 + i * 4;
+      for(int x=0 ; x < 3 ; x++)
+	if(g & (1 << (14 - y * 3 - x)))
+	  line[x] = 1;
     }
-    case 0x05:
+  }
+}
+
+void IO::put_pixel(int x,int y, int color)
+{
+  uint8_t *pixel = vgaMem_ + y*screen_pitch_ + x*pixel_width_;
+  switch(pixel_width_)
+  {
+  case 1: store_pixel<1>(pixel, color_palette[color]); break;
+  case 3: store_pixel<3>(pixel, color_palette[color]); break;
+  case 4: store_pixel<4>(pixel, color_palette[color]); break;
+  default: store_pixel<2>(pixel, color_palette[color]); break;
+  }
+}
+
+/**
+ * @brief C64 colors as 0xRRGGBB
+ */
+/* bumped whenever the console took over the framebuffer */
+volatile uint32_t IO::console_epoch_ = 0;
+
+const uint32_t IO::kPalette[16] = {
+  0x000000, 0xFFFFFF, 0x880000, 0xAAFFEE, 
+  0xCC44CC, 0x00CC55, 0x0000AA, 0xEEEE77,
+  0xDD8855, 0x664400, 0xFF7777, 0x333333,
+  0x777777, 0xAAFF66, 0x0088FF, 0xBBBBBB
+};
+
+/**
+ * @brief builds the palette in the framebuffer native format
+ *
+ * 8bpp modes are indexed, the C64 colors are loaded into the first 
+ * 16 DAC entries and pixels hold the color number.
+ */
+void IO::init_color_palette()
+{
+  for(int i=0; i < 16; i++)
+  {
+    uint32_t rgb = kPalette[i];
+    uint8_t r = (rgb >> 16) & 0xff;
+    uint8_t g = (rgb >> 8) & 0xff;
+    uint8_t b = rgb & 0xff;
+    switch(screen_bpp_)
     {
-      file_save();
+    case 8:
+      color_palette[i] = i;
+      break;
+    case 24:
+    case 32:
+      color_palette[i] = rgb;
+      break;
+    case 15:
+      color_palette[i] = ((r>>3)<<10) | ((g>>3)<<5) | (b>>3);
       break;
-    }
     default:
+      color_palette[i] = ((r>>3)<<11) | ((g>>2)<<5) | (b>>3);
       break;
+    }
+  }
+  
+  if(screen_bpp_ == 8)
+  {
+    Port8Bit dacIndex(0x3C8);
+    Port8Bit dacData(0x3C9);
+    dacIndex.Write(0);
+    for(int i=0; i < 16; i++)
+    {
+      /* the DAC takes 6 bit components */
+      dacData.Write((kPalette[i] >> 18) & 0x3f);
+      dacData.Write((kPalette[i] >> 10) & 0x3f);
+      dacData.Write((kPalette[i] >> 2) & 0x3f);
+    }
   }
+}
+
+// emulation /////////////////////////////////////////////////////////////////// 
 
+bool IO::emulate()
+{
   /*static uint16_t waiter = 0;
   
   if(waiter == 100)
@@ -170,9 +520,51 @@ bool IO::emulate()
 }
 
 
+/**
+ * @brief applies the queued key events
+ *
+ * Called by the Vic at the end of every frame, so a key always
+ * reaches the matrix at the same point of emulated time. A release
+ * following a press is held back a frame, the KERNAL would miss a
+ * key that went down and up between two of its scans.
+ */
 void IO::process_events()
 {
-
+  bool replay = input_ != 0 && input_->replaying();
+  bool pressed = false;
+  while(key_tail_ != key_head_)
+  {
+    KeyEvent *e = &key_ring_[key_tail_ % kKeyRingSize];
+    if(replay)
+    {
+      /* the log drives the machine, the keyboard is not listened to */
+      key_tail_++;
+      continue;
+    }
+    if(!e->down && pressed)
+      break;
+    if(e->down)
+    {
+      key_down(e->key);
+      pressed = true;
+    }
+    else
+      key_up(e->key);
+    if(input_ != 0 && input_->recording())
+      input_->log(cpu_->cycles(),e->key,e->down);
+    /* done with the slot before handing it back */
+    asm volatile("" ::: "memory");
+    key_tail_++;
+  }
+  uint8_t key;
+  bool down;
+  while(replay && input_->next(cpu_->cycles(),&key,&down))
+  {
+    if(down)
+      key_down(key);
+    else
+      key_up(key);
+  }
 }
 
 uint8_t IO::getJoystick(uint8_t num)
@@ -198,6 +590,32 @@ void IO::SendSerial(uint8_t c)
 // keyboard handling /////////////////////////////////////////////////////////// 
 
 void IO::OnKeyDown(uint8_t c)
+{
+  queue_key(c,true);
+}
+
+void IO::OnKeyUp(uint8_t c)
+{
+  queue_key(c,false);
+}
+
+/**
+ * @brief IRQ side of the key ring, drops keys while it is full
+ */
+void IO::queue_key(uint8_t c, bool down)
+{
+  uint32_t head = key_head_;
+  if(head - key_tail_ >= kKeyRingSize)
+    return;
+  KeyEvent *e = &key_ring_[head % kKeyRingSize];
+  e->key = c;
+  e->down = down;
+  /* publish the slot before the index */
+  asm volatile("" ::: "memory");
+  key_head_ = head + 1;
+}
+
+void IO::key_down(uint8_t c)
 {
   if(c == 0x90)
   {
@@ -273,7 +691,7 @@ void IO::OnKeyDown(uint8_t c)
       }  
 }
     
-void IO::OnKeyUp(uint8_t c)
+void IO::key_up(uint8_t c)
 {
   joy2 = 0;
   
@@ -348,8 +766,6 @@ void IO::type_character(char c)
 
 void IO::file_load()
 {
-  mem_->write_byte(0x02,0);	// clear command byte
-  
   int fstatus = 0;
   
   uint8_t filenameLength = mem_->read_byte(0xB7);
@@ -363,33 +779,51 @@ void IO::file_load()
   uint16_t endAddress = (mem_->read_byte(0x2E) << 8) + (mem_->read_byte(0x2D) & 0xFF);
   uint16_t m = 0;
   uint8_t filenameBuffer[13]="        .PRG";
-  uint16_t size;
+  uint8_t cbmName[16];
   
-  for(int z=0;z<filenameLength; z++)
-    filenameBuffer[z] = mem_->read_byte(filenamePtr+z);
+  // FAT32 names are cut to 8 characters, images get the CBM name
+  for(int z=0;z<filenameLength && z<16; z++)
+    cbmName[z] = mem_->read_byte(filenamePtr+z);
+  for(int z=0;z<filenameLength && z<8; z++)
+    filenameBuffer[z] = cbmName[z];
   
   // if $ is filename, load directory
   if (filenameBuffer[0] == '$' && filenameLength == 1)
   {
-    int ctr=0;  
-    uint8_t dir[4000];
-    size = fat32_->GetCBMDir(dir);
+    CBMDirCursor dir;
+    uint8_t line[CBMDIR_MAX_LINE];
+    uint8_t n;
     
-    while (ctr <= size)
+    // the listing is generated a line at a time straight into RAM
+    if(d64_)
+      d64_->OpenCBMDir(&dir, startAddress);
+    else
+      fat32_->OpenCBMDir(&dir, startAddress);
+    while((n = d64_ ? d64_->ReadCBMDir(&dir, line) : fat32_->ReadCBMDir(&dir, line)) > 0)
     {
-      mem_->write_byte(startAddress + ctr, dir[ctr]);
-      ctr++;
+      uint16_t addr = dir.address - n;
+      if(addr + n > Memory::kMemSize)
+	break;
+      mem_->write_block_no_io(addr, line, n);
     }
     
-    // tell basic where program ends (after 3 zeros)
+    // tell basic where program ends (after the zero link)
     // regular kernel routines copy AE/AF to 2D/2E when done
-    mem_->write_byte(0xAE, (startAddress + size) & 0xFF); // poke low byte to 45  
-    mem_->write_byte(0xAF, (startAddress + size) >> 8); // poke hi byte to 46
+    mem_->write_byte(0xAE, dir.address & 0xFF);
+    mem_->write_byte(0xAF, dir.address >> 8);
+    mem_->write_byte(0x90,0x40);		// ST = $0x40 (64 dec)
     return;
   }
     
   
-  fstatus = fat32_->OpenFile(1, (uint8_t*)filenameBuffer, FILEACCESSMODE_READ);
+  if(d64_)
+    fstatus = d64_->OpenFile(1, cbmName, filenameLength < 16 ? filenameLength : 16);
+  else
+    fstatus = fat32_->OpenFile(1, (uint8_t*)filenameBuffer, FILEACCESSMODE_READ);
+  
+  // no program, a text listing of the same name is tokenized instead
+  if(fstatus == FILE_STATUS_NOTFOUND && !d64_ && listing_load(filenameBuffer, startAddress))
+    return;
   
   if(fstatus == FILE_STATUS_NOTFOUND)
   {
@@ -399,44 +833,75 @@ void IO::file_load()
   
   if(fstatus == FILE_STATUS_OK)
   {
-    uint8_t b;
-    size = 0;
+    uint32_t length = 0;
+    uint32_t n;
     
     if(secondaryAddr == 1)
     {
-      uint8_t lo = 0;
-      uint8_t hi = 0;
-      fstatus = fat32_->ReadNextFileByte(1, &lo);
-      fstatus = fat32_->ReadNextFileByte(1, &hi);
-      startAddress = (hi << 8) + (lo & 0xFF);	
+      uint8_t hdr[2] = {0, 0};
+      if(d64_)
+	d64_->ReadFileBlock(1, hdr, 2);
+      else
+	fat32_->ReadFileBlock(1, hdr, 2);
+      startAddress = (hdr[1] << 8) + (hdr[0] & 0xFF);	
     }
 
-    fstatus = fat32_->ReadNextFileByte(1, &b);
-    
-    while(fstatus != FILE_STATUS_EOF)
-    {     
-      mem_->write_byte(startAddress+size, b);
-      size++;
-      
-      fstatus = fat32_->ReadNextFileByte(1, &b);
-    }
-    fat32_->CloseFile(1);
-    
-    if (secondaryAddr == 0)
+    // copy the program in blocks straight to RAM, LOAD never sees I/O
+    while((n = d64_ ? d64_->ReadFileBlock(1, file_chunk_, kFileChunkSize)
+		    : fat32_->ReadFileBlock(1, file_chunk_, kFileChunkSize)) > 0)
     {
-      // tell basic where program ends (after 3 zeros)
-      mem_->write_byte(0xAE, (startAddress + size) & 0xFF); // poke low byte to 45  
-      mem_->write_byte(0xAF, (startAddress + size) >> 8); // poke hi byte to 46
+      mem_->write_block_no_io(startAddress + length, file_chunk_, n);
+      length += n;
+      if(startAddress + length >= Memory::kMemSize)
+      {
+	length = Memory::kMemSize - startAddress;
+	break;
+      }
     }
+    if(d64_)
+      d64_->CloseFile(1);
+    else
+      fat32_->CloseFile(1);
+    
+    // end address + 1, BASIC copies it from AE/AF to 2D/2E
+    uint16_t end = startAddress + length;
+    mem_->write_byte(0xAE, end & 0xFF);
+    mem_->write_byte(0xAF, end >> 8);
     
     mem_->write_byte(0x90,0x40);		// ST = $0x40 (64 dec)
   }
 }
 
-void IO::file_save()
+/**
+ * @brief LOADs NAME.BAS, a BASIC listing, as if it were NAME.PRG
+ *
+ * The text goes through Tokenizer into RAM at the BASIC start, no
+ * matter the secondary address, and AE/AF get the end as for a
+ * program file.
+ */
+bool IO::listing_load(uint8_t *filename, uint16_t start)
 {
-  mem_->write_byte(0x02,0);	// clear command byte
+  uint8_t name[13];
+  memcpy(name, filename, sizeof(name));
+  memcpy(name + 9, "BAS", 3);
+  if(fat32_->OpenFile(1, name, FILEACCESSMODE_READ) != FILE_STATUS_OK)
+    return false;
+  
+  uint32_t n;
+  Tokenizer tokenizer(mem_, start);
+  while((n = fat32_->ReadFileBlock(1, file_chunk_, kFileChunkSize)) > 0)
+    tokenizer.text(file_chunk_, n);
+  fat32_->CloseFile(1);
   
+  uint16_t end = tokenizer.finish();
+  mem_->write_byte(0xAE, end & 0xFF);
+  mem_->write_byte(0xAF, end >> 8);
+  mem_->write_byte(0x90,0x40);		// ST = $0x40 (64 dec)
+  return true;
+}
+
+void IO::file_save()
+{
   int fstatus = 0;
   
   uint8_t filenameLength = mem_->read_byte(0xB7);
@@ -452,57 +917,607 @@ void IO::file_save()
   uint16_t m = 0;
   uint8_t filenameBuffer[13]="        .PRG";
   
-  for(int z=0;z<filenameLength; z++)
+  for(int z=0;z<filenameLength && z<8; z++)
     filenameBuffer[z] = mem_->read_byte(filenamePtr+z);
   
+  // mounted images are read only
+  if(d64_)
+  {
+    drive_status_ = "26,WRITE PROTECT ON,00,00";
+    drive_status_ptr_ = 0;
+    return;
+  }
+  
   fstatus = fat32_->OpenFile(1, (uint8_t*)filenameBuffer, FILEACCESSMODE_CREATE);
 	  
   if(fstatus == FILE_STATUS_OK)
   {
-    uint8_t b;
-
-    while(startAddress <= endAddress)
+    // the end address is exclusive, hand the range over in blocks
+    while(fstatus == FILE_STATUS_OK && startAddress < endAddress)
     {
-	b = mem_->read_byte(startAddress++);
-	fstatus = fat32_->WriteNextFileByte(1, b);
+      uint32_t n = endAddress - startAddress;
+      if(n > kFileChunkSize)
+	n = kFileChunkSize;
+      for(uint32_t i=0; i < n; i++)
+	file_chunk_[i] = mem_->read_byte(startAddress + i);
+      fstatus = fat32_->WriteFileBlock(1, file_chunk_, n);
+      startAddress += n;
     }
     fat32_->CloseFile(1);
   }
 }
 
-void IO::file_open()
+// drive 8 //////////////////////////////////////////////////////////////////
+
+/**
+ * @brief called by the patched KERNAL, see RomSet::patch_kernal()
+ *
+ * The serial bus routines are replaced as a whole and end up in
+ * the bus_ calls below, their status bits go to ST. The trap is
+ * followed by an RTS.
+ */
+void IO::trap(uint8_t n)
 {
-  mem_->write_byte(0x02,0);	// clear command byte
+  uint8_t a = cpu_->a();
+  uint8_t status = 0;
   
-  int fstatus = 0;
+  /* the disk and its buffers are shared by all machines */
+  myos::TaskManager::DisablePreemption();
+  switch(n)
+  {
+  case kTrapLoad:
+    file_load();
+    break;
+  case kTrapSave:
+    file_save();
+    break;
+  case kTrapTalk:
+  case kTrapListen:
+    status = bus_address(a);
+    break;
+  case kTrapSecond:
+  case kTrapTksa:
+    bus_secondary(a);
+    break;
+  case kTrapCiout:
+    status = bus_put(a);
+    break;
+  case kTrapAcptr:
+    cpu_->a(bus_get(&status));
+    break;
+  case kTrapUnlsn:
+  case kTrapUntlk:
+    bus_release();
+    break;
+  default:
+    /* a $02 in a program jams a real cpu, here it's skipped */
+    break;
+  }
+  myos::TaskManager::EnablePreemption();
+  if(status != 0)
+    bus_status(status);
+  cpu_->cf(false);
+}
+
+// drive 8 bus primitives, the returned status bits are those of ST
+
+/**
+ * @brief TALK or LISTEN, 0 or $80 (device not present)
+ */
+uint8_t IO::bus_address(uint8_t device)
+{
+  bus_device_ = device == kDriveDevice ? device : 0;
+  bus_secondary_ = 0;
+  return bus_device_ == 0 ? 0x80 : 0;
+}
+
+/**
+ * @brief SECOND or TKSA, $60/$E0/$F0 | channel
+ *
+ * $E0 (close) is done right away, $F0 (open) collects the name
+ * until UNLISTEN.
+ */
+void IO::bus_secondary(uint8_t v)
+{
+  if(bus_device_ == 0)
+    return;
   
-  uint8_t filenameLength = mem_->read_byte(0xB7);
-  uint8_t secondaryAddr = mem_->read_byte(0xB9);
-  uint8_t deviceNum = mem_->read_byte(0xBA);
-  uint8_t filenamePtrLo = mem_->read_byte(0xBB);
-  uint8_t filenamePtrHi = mem_->read_byte(0xBC);
-	  
-  uint16_t filenamePtr = (filenamePtrHi << 8) + (filenamePtrLo & 0xFF);
-  uint8_t filenameBuffer[13]="        .PRG";
-  uint16_t size;
+  uint8_t channel = v & 0x0f;
+  bus_secondary_ = v;
+  if((v & 0xf0) == 0xe0)
+    file_close(channel);
+  else if((v & 0xf0) == 0xf0 || channel == kDriveCommandChannel)
+    bus_name_length_ = 0;
+}
+
+/**
+ * @brief CIOUT, a name, command or data byte to the listening drive
+ */
+uint8_t IO::bus_put(uint8_t b)
+{
+  uint8_t channel = bus_secondary_ & 0x0f;
   
-  for(int z=0;z<filenameLength; z++)
-    filenameBuffer[z] = mem_->read_byte(filenamePtr+z);
+  if(bus_device_ == 0 || bus_secondary_ == 0)
+    return 0x80;
+  if((bus_secondary_ & 0xf0) == 0xf0 || channel == kDriveCommandChannel)
+  {
+    if(bus_name_length_ < kDriveNameLength)
+      bus_name_[bus_name_length_++] = b;
+    return 0;
+  }
+  return file_put(channel, b);
+}
+
+/**
+ * @brief ACPTR, a byte from the talking drive, $40 flags the last one
+ */
+uint8_t IO::bus_get(uint8_t *status)
+{
+  if(bus_device_ == 0 || bus_secondary_ == 0)
+  {
+    *status |= 0x02;		// read timeout
+    return 0x0d;
+  }
+  return file_get(bus_secondary_ & 0x0f, status);
+}
+
+/**
+ * @brief UNLISTEN or UNTALK, completes an OPEN or drive command
+ */
+void IO::bus_release()
+{
+  uint8_t channel = bus_secondary_ & 0x0f;
+  
+  if(bus_device_ != 0 && bus_secondary_ != 0 && (bus_secondary_ & 0xf0) != 0xe0)
+  {
+    if(channel == kDriveCommandChannel && bus_name_length_ > 0)
+      drive_command();
+    else if((bus_secondary_ & 0xf0) == 0xf0 && channel != kDriveCommandChannel)
+      file_open(channel);
+    bus_name_length_ = 0;
+  }
+  bus_device_ = 0;
+  bus_secondary_ = 0;
+}
+
+void IO::bus_status(uint8_t v)
+{
+  mem_->write_byte(0x90, mem_->read_byte(0x90) | v);
+}
+
+/**
+ * @brief the name part of "[0:]NAME[,...]", returns its length
+ */
+static uint8_t cbm_name(const uint8_t *&src, uint8_t length)
+{
+  for(int i=0; i < length; i++)
+  {
+    if(src[i] == ':')
+    {
+      src += i + 1;
+      length -= i + 1;
+      break;
+    }
+  }
+  
+  uint8_t n = 0;
+  while(n < length && src[n] != ',' && src[n] != '=')
+    n++;
+  return n;
+}
+
+/**
+ * @brief CBM name to the 8.3 form OpenFile expects ("NAME    .EXT")
+ *
+ * Longer names are cut to 8 characters. Without a type the 
+ * extension is "*", matching any.
+ */
+bool IO::drive_filename(const uint8_t *src, uint8_t length, uint8_t *name, char type)
+{
+  uint8_t n = cbm_name(src, length);
+  if(n == 0)
+    return false;
+  
+  for(int i=0; i < 8; i++)
+    name[i] = i < n ? src[i] : ' ';
+  name[8] = '.';
+  name[9] = '*';
+  name[10] = ' ';
+  name[11] = ' ';
+  if(type == 'P')
+    { name[9] = 'P'; name[10] = 'R'; name[11] = 'G'; }
+  else if(type == 'S')
+    { name[9] = 'S'; name[10] = 'E'; name[11] = 'Q'; }
+  else if(type == 'U')
+    { name[9] = 'U'; name[10] = 'S'; name[11] = 'R'; }
+  else if(type == 'D')
+    { name[9] = 'D'; name[10] = '6'; name[11] = '4'; }
+  name[12] = 0;
+  return true;
+}
+
+/**
+ * @brief CD:NAME.D64 mounts an image, CD:_ or CD:.. goes back to FAT32
+ */
+void IO::drive_mount(const uint8_t *src, uint8_t length)
+{
+  const uint8_t *name = src;
+  uint8_t n = cbm_name(name, length);
+  
+  // files open on the old medium are gone
+  for(int i=0; i < kDriveChannels; i++)
+    file_close(i);
+  
+  if(n == 0 || name[0] == '_' || name[0] == '.')	// '_' is the PETSCII left arrow
+  {
+    delete d64_;
+    d64_ = 0;
+    return;
+  }
+  
+  // NAME.D64 or NAME
+  uint8_t base = 0;
+  while(base < n && name[base] != '.')
+    base++;
+  
+  uint8_t filename[13];
+  D64 *image = new D64(fat32_);
+  if(!drive_filename(name, base, filename, 'D') || image->Mount(filename) != FILE_STATUS_OK)
+  {
+    delete image;
+    drive_status_ = "62,FILE NOT FOUND,00,00";
+    return;
+  }
+  delete d64_;
+  d64_ = image;
+}
+
+/**
+ * @brief OPEN with a name, "[@][0:]NAME[,TYPE][,MODE]"
+ *
+ * Channel 0 reads and channel 1 writes a PRG like the 1541
+ * does, other channels read unless the mode is W.
+ */
+void IO::file_open(uint8_t channel)
+{
+  uint8_t name[13];
+  uint8_t *src = bus_name_;
+  uint8_t length = bus_name_length_;
+  bool write = channel == 1;
+  bool replace = false;
+  char type = channel < 2 ? 'P' : 0;
   
-  fstatus = fat32_->OpenFile(1, (uint8_t*)filenameBuffer, FILEACCESSMODE_READ);
+  file_close(channel);
+  
+  if(length > 0 && src[0] == '@')
+  {
+    replace = true;
+    src++;
+    length--;
+  }
+  
+  // ,TYPE and ,MODE in any order
+  for(int i=0; i < length; i++)
+  {
+    if(src[i] != ',' || i + 1 >= length)
+      continue;
+    uint8_t c = src[i+1];
+    if(c == 'W') write = true;
+    else if(c == 'R') write = false;
+    else if(c == 'P' || c == 'S' || c == 'U') type = c;
+  }
+  if(write && type == 0)
+    type = 'S';
+  
+  if(!drive_filename(src, length, name, type))
+  {
+    drive_status_ = "34,SYNTAX ERROR,00,00";
+    drive_status_ptr_ = 0;
+    return;
+  }
+  
+  int fstatus;
+  if(d64_)
+  {
+    const uint8_t *cbm = src;
+    uint8_t n = cbm_name(cbm, length);
+    fstatus = write ? FILE_STATUS_NODEVICE : d64_->OpenFile(channel, (uint8_t*)cbm, n);
+  }
+  else if(write)
+  {
+    if(replace)
+      fat32_->DeleteFile(name);
+    fstatus = fat32_->OpenFile(channel, name, FILEACCESSMODE_CREATE);
+  }
+  else
+    fstatus = fat32_->OpenFile(channel, name, FILEACCESSMODE_READ);
   
   if(fstatus == FILE_STATUS_NOTFOUND)
+    drive_status_ = "62,FILE NOT FOUND,00,00";
+  else if(fstatus == FILE_STATUS_FILEEXISTS)
+    drive_status_ = "63,FILE EXISTS,00,00";
+  else if(fstatus != FILE_STATUS_OK)
+    drive_status_ = d64_ ? "26,WRITE PROTECT ON,00,00" : "74,DRIVE NOT READY,00,00";
+  else
   {
-    mem_->write_byte(0x90,0x42);	// ST = $0x42 (66 dec)
+    drive_status_ = "00, OK,00,00";
+    channel_mode_[channel] = write ? FILEACCESSMODE_WRITE : FILEACCESSMODE_READ;
+    
+    uint8_t b;
+    if(!write && drive_read(channel, &b))
+      channel_next_[channel] = b;
+  }
+  drive_status_ptr_ = 0;
+}
+
+void IO::file_close(uint8_t channel)
+{
+  if(channel_mode_[channel] != FILEACCESSMODE_CLOSED)
+  {
+    if(d64_)
+      d64_->CloseFile(channel);
+    else
+      fat32_->CloseFile(channel);
+  }
+  channel_mode_[channel] = FILEACCESSMODE_CLOSED;
+  channel_next_[channel] = -1;
+}
+
+/**
+ * @brief next byte for ACPTR, EOI is flagged with the last one
+ */
+uint8_t IO::file_get(uint8_t channel, uint8_t *status)
+{
+  if(channel == kDriveCommandChannel)
+  {
+    if(drive_memory_ptr_ < drive_memory_length_)
+    {
+      if(++drive_memory_ptr_ == drive_memory_length_)
+	*status |= 0x40;
+      return drive_memory_[drive_memory_ptr_ - 1];
+    }
+    drive_memory_length_ = drive_memory_ptr_ = 0;
+    if(drive_status_[drive_status_ptr_] != 0)
+      return drive_status_[drive_status_ptr_++];
+    *status |= 0x40;
+    drive_status_ = "00, OK,00,00";
+    drive_status_ptr_ = 0;
+    return 0x0d;
+  }
+  
+  if(channel_next_[channel] < 0)
+  {
+    *status |= 0x42;		// EOI and read timeout, nothing to read
+    return 0x0d;
+  }
+  
+  uint8_t v = channel_next_[channel];
+  uint8_t b;
+  if(drive_read(channel, &b))
+    channel_next_[channel] = b;
+  else
+  {
+    channel_next_[channel] = -1;
+    *status |= 0x40;
+  }
+  return v;
+}
+
+bool IO::drive_read(uint8_t channel, uint8_t *b)
+{
+  if(d64_)
+    return d64_->ReadNextFileByte(channel, b) == FILE_STATUS_OK;
+  return fat32_->ReadNextFileByte(channel, b) == FILE_STATUS_OK;
+}
+
+uint8_t IO::file_put(uint8_t channel, uint8_t b)
+{
+  if(channel_mode_[channel] != FILEACCESSMODE_WRITE)
+    return 0x03;		// write timeout
+  if(fat32_->WriteNextFileByte(channel, b) != FILE_STATUS_OK)
+    drive_status_ = "72,DISK FULL,00,00";
+  return 0;
+}
+
+/**
+ * @brief command channel: Scratch, Rename, Initialize, CD and M-W/M-R/M-E
+ */
+void IO::drive_command()
+{
+  uint8_t *cmd = bus_name_;
+  uint8_t length = bus_name_length_;
+  uint8_t name[13];
+  
+  /* memory commands are binary, a trailing $0d may be data */
+  if(length >= 5 && cmd[0] == 'M' && cmd[1] == '-')
+  {
+    drive_status_ptr_ = 0;
+    drive_status_ = "00, OK,00,00";
+    drive_memory(cmd, length);
+    return;
+  }
+  // PRINT# sends a trailing return
+  while(length > 0 && cmd[length-1] == 0x0d)
+    length--;
+  if(length == 0)
+    return;
+  
+  drive_status_ptr_ = 0;
+  drive_status_ = "00, OK,00,00";
+  
+  if(length >= 2 && cmd[0] == 'C' && cmd[1] == 'D')
+  {
+    drive_mount(cmd + 2, length - 2);
+    return;
+  }
+  if(d64_ && (cmd[0] == 'S' || cmd[0] == 'R'))
+  {
+    drive_status_ = "26,WRITE PROTECT ON,00,00";
+    return;
+  }
+  
+  switch(cmd[0])
+  {
+  case 'S':
+  {
+    int n = 0;
+    if(!drive_filename(cmd, length, name, 0))
+    {
+      drive_status_ = "34,SYNTAX ERROR,00,00";
+      break;
+    }
+    while(n < 99 && fat32_->DeleteFile(name) == FILE_STATUS_OK)
+      n++;
+    memcpy(drive_scratched_, "01, FILES SCRATCHED,00,00", sizeof(drive_scratched_));
+    drive_scratched_[20] = '0' + n / 10;
+    drive_scratched_[21] = '0' + n % 10;
+    drive_status_ = drive_scratched_;
+    break;
+  }
+  case 'R':
+  {
+    // R:NEW=OLD
+    uint8_t newname[13];
+    int eq = 0;
+    while(eq < length && cmd[eq] != '=')
+      eq++;
+    if(eq + 1 >= length || !drive_filename(cmd, eq, newname, 0) ||
+       !drive_filename(cmd + eq + 1, length - eq - 1, name, 0))
+    {
+      drive_status_ = "34,SYNTAX ERROR,00,00";
+      break;
+    }
+    int status = fat32_->RenameFile(name, newname);
+    if(status == FILE_STATUS_NOTFOUND)
+      drive_status_ = "62,FILE NOT FOUND,00,00";
+    else if(status == FILE_STATUS_FILEEXISTS)
+      drive_status_ = "63,FILE EXISTS,00,00";
+    break;
+  }
+  case 'I':
+    break;
+  default:
+    drive_status_ = "31,SYNTAX ERROR,00,00";
+    break;
+  }
+}
+
+/**
+ * @brief M-W lo hi n data, M-R lo hi [n] and M-E lo hi
+ *
+ * Only the 2K of drive RAM is there, M-R of the ROM or the VIAs
+ * reads 0 and M-W to them is dropped.
+ */
+void IO::drive_memory(const uint8_t *cmd, uint8_t length)
+{
+  uint16_t address = cmd[3] | (cmd[4] << 8);
+  
+  switch(cmd[2])
+  {
+  case 'W':
+  {
+    if(length < 6)
+      break;
+    for(uint8_t i=0; i < cmd[5] && 6 + i < length; i++)
+      if(address + i < kDriveRamSize)
+	drive_ram_[address + i] = cmd[6 + i];
+    return;
+  }
+  case 'R':
+  {
+    uint8_t n = 1;
+    if(length >= 6 && cmd[5] != 0x0d)
+      n = cmd[5] != 0 ? cmd[5] : 1;
+    if(n > kDriveNameLength)
+      n = kDriveNameLength;
+    for(uint8_t i=0; i < n; i++)
+      drive_memory_[i] = address + i < kDriveRamSize ? drive_ram_[address + i] : 0;
+    drive_memory_length_ = n;
+    drive_memory_ptr_ = 0;
+    return;
+  }
+  case 'E':
+    drive_execute(address);
     return;
   }
+  drive_status_ = "31,SYNTAX ERROR,00,00";
 }
 
-void IO::file_get()
+/**
+ * Drive code signatures, byte fragments that must all be in the
+ * uploaded code, kAny matches any byte and kEnd closes a fragment.
+ *
+ * kLoaderAtn2Bit is the ATN clocked 2-bit sector server (see Iec):
+ * it polls ATN with BIT $1800, puts two bits at a time out with
+ * STA $1800 and reads the sectors through the job queue.
+ */
+static const uint16_t kAny = 0x100;
+static const uint16_t kEnd = 0x200;
+static const uint16_t kAtn2BitFragments[] = {
+  0x2c, 0x00, 0x18, kEnd,		// BIT $1800
+  0x8d, 0x00, 0x18, kEnd,		// STA $1800
+  0xa9, 0x80, 0x85, kAny, kEnd,		// LDA #$80 STA job
+  kEnd
+};
+static const struct
+{
+  uint8_t loader;
+  const uint16_t *fragments;
+} kLoaders[] = {
+  { IO::kLoaderAtn2Bit, kAtn2BitFragments },
+};
+
+static bool drive_code_has(const uint8_t *code, uint16_t length, const uint16_t *fragment, uint16_t n)
 {
+  for(uint16_t at=0; at + n <= length; at++)
+  {
+    uint16_t i = 0;
+    while(i < n && (fragment[i] == kAny || fragment[i] == code[at + i]))
+      i++;
+    if(i == n)
+      return true;
+  }
+  return false;
 }
 
-void IO::file_close()
+/**
+ * @brief M-E, starts a fast loader if the code is a known one
+ *
+ * Anything else would need a 1541 cpu, it's acknowledged and does
+ * nothing. Loaders are only served from a mounted D64.
+ */
+void IO::drive_execute(uint16_t address)
 {
+  if(d64_ == 0 || address >= kDriveRamSize)
+    return;
+  for(unsigned int l=0; l < sizeof(kLoaders) / sizeof(kLoaders[0]); l++)
+  {
+    const uint16_t *f = kLoaders[l].fragments;
+    bool match = true;
+    while(match && *f != kEnd)
+    {
+      uint16_t n = 0;
+      while(f[n] != kEnd)
+	n++;
+      match = drive_code_has(drive_ram_, kDriveRamSize, f, n);
+      f += n + 1;
+    }
+    if(match)
+    {
+      drive_loader_ = kLoaders[l].loader;
+      return;
+    }
+  }
+}
 
+/**
+ * @brief a whole sector of the mounted D64 for the fast loaders
+ */
+bool IO::drive_sector(uint8_t track, uint8_t sector, uint8_t *data)
+{
+  uint8_t *src = d64_ != 0 ? d64_->Sector(track, sector) : 0;
+  if(src == 0)
+    return false;
+  memcpy(data, src, D64_SECTOR_SIZE);
+  return true;
 }
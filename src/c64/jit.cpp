@@ -0,0 +1,249 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <memorymanagement.h>
+#include <c64/jit.h>
+
+/**
+ * @brief instruction lengths, 0 for unimplemented opcodes
+ */
+static const uint8_t kInsnLength[256] = {
+  1, 2, 2, 0, 0, 2, 2, 0, 1, 2, 1, 0, 0, 3, 3, 0, /* 00 */
+  2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0, /* 10 */
+  3, 2, 0, 0, 2, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0, /* 20 */
+  2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0, /* 30 */
+  1, 2, 0, 0, 0, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0, /* 40 */
+  2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0, /* 50 */
+  1, 2, 0, 0, 0, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0, /* 60 */
+  2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0, /* 70 */
+  0, 2, 0, 0, 2, 2, 2, 0, 1, 0, 1, 0, 3, 3, 3, 0, /* 80 */
+  2, 2, 0, 0, 2, 2, 2, 0, 1, 3, 1, 0, 0, 3, 0, 0, /* 90 */
+  2, 2, 2, 0, 2, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0, /* A0 */
+  2, 2, 0, 0, 2, 2, 2, 0, 1, 3, 1, 0, 3, 3, 3, 0, /* B0 */
+  2, 2, 0, 0, 2, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0, /* C0 */
+  2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0, /* D0 */
+  2, 2, 0, 0, 2, 2, 2, 0, 1, 2, 1, 0, 3, 3, 3, 0, /* E0 */
+  2, 2, 0, 0, 0, 2, 2, 0, 1, 3, 0, 0, 0, 3, 3, 0, /* F0 */
+};
+
+/**
+ * @brief opcodes that end a basic block
+ *
+ * Anything that changes the program counter, and instructions
+ * after which a pending interrupt may have to be serviced.
+ */
+static bool ends_block(uint8_t op)
+{
+  switch(op)
+  {
+  case 0x00: /* BRK */
+  case 0x02: /* TRAP */
+  case 0x20: /* JSR */
+  case 0x28: /* PLP */
+  case 0x40: /* RTI */
+  case 0x4C: /* JMP nnnn */
+  case 0x58: /* CLI */
+  case 0x60: /* RTS */
+  case 0x6C: /* JMP (nnnn) */
+  case 0x10: case 0x30: case 0x50: case 0x70: /* BPL BMI BVC BVS */
+  case 0x90: case 0xB0: case 0xD0: case 0xF0: /* BCC BCS BNE BEQ */
+    return true;
+  }
+  return false;
+}
+
+// ctor and dtor  ////////////////////////////////////////////////////////////
+
+Jit::Jit()
+{
+  cpu_ = 0;
+  mem_ = 0;
+  arena_ = 0;
+  blocks_ = 0;
+  opcode_map_ = 0;
+  code_ = 0;
+  code_used_ = 0;
+  Cpu::jit_handlers(handlers_);
+}
+
+Jit::~Jit()
+{
+  /* the buffers go away with the arena */
+  if(code_ != 0)
+    mem_->unwatch_code_pages();
+}
+
+// block cache  //////////////////////////////////////////////////////////////
+
+/**
+ * @brief runs the block at the current program counter
+ * @return returns false if something goes wrong (e.g. illegal instruction)
+ *
+ * Code that can't be translated (I/O pages, illegal opcodes) 
+ * falls back to the interpreter for one instruction.
+ */
+bool Jit::execute()
+{
+  uint16_t pc = cpu_->pc();
+  JitBlock *b = (blocks_ != 0) ? blocks_[pc] : 0;
+  /* bank switching may have mapped other memory in */
+  if(b != 0 && 
+     (b->first_base != mem_->page_base(pc >> 8) ||
+      b->last_base  != mem_->page_base(b->last >> 8)))
+    b = 0;
+  if(b == 0)
+    b = translate(pc);
+  if(b == 0)
+    return cpu_->emulate(false);
+  ((void (*)())b->code)();
+  return true;
+}
+
+/**
+ * @brief translated instruction check
+ */
+bool Jit::is_opcode(uint16_t addr)
+{
+  return (opcode_map_[addr >> 3] & (1 << (addr & 7))) != 0;
+}
+
+/**
+ * @brief memory write on a watched page
+ *
+ * Operands are fetched at run time so only writes over the
+ * first byte of a translated instruction matter. The blocks
+ * are dropped and the running batch ends, so the current 
+ * block stops right after the instruction doing the write.
+ */
+void Jit::invalidate(uint16_t addr)
+{
+  if(code_ == 0 || !is_opcode(addr))
+    return;
+  /* blocks starting on the previous page may run into this one */
+  int first = (addr & 0xff00) - 0x100;
+  if(first < 0)
+    first = 0;
+  for(int pc = first ; pc <= (addr | 0xff) ; pc++)
+    blocks_[pc] = 0;
+  cpu_->end_batch();
+}
+
+/**
+ * @brief drops every translated block
+ */
+void Jit::flush()
+{
+  if(code_ == 0)
+    return;
+  for(int i=0 ; i < 0x10000 ; i++)
+    blocks_[i] = 0;
+  for(int i=0 ; i < 0x10000 / 8 ; i++)
+    opcode_map_[i] = 0;
+  code_used_ = 0;
+  mem_->unwatch_code_pages();
+}
+
+// translation  //////////////////////////////////////////////////////////////
+
+void Jit::emit32(uint32_t v)
+{
+  emit8(v & 0xff);
+  emit8((v >> 8) & 0xff);
+  emit8((v >> 16) & 0xff);
+  emit8((v >> 24) & 0xff);
+}
+
+/**
+ * @brief translates the basic block starting at pc
+ *
+ * For every instruction we emit:
+ *
+ *  push cpu
+ *  call handler
+ *  add  esp,4
+ *  test al,al      ; handler reached the cycle deadline?
+ *  jnz  exit
+ *
+ * The prologue keeps the stack 16 byte aligned at each call.
+ */
+JitBlock *Jit::translate(uint16_t pc)
+{
+  uint8_t *base = mem_->page_base(pc >> 8);
+  /* I/O pages are left to the interpreter */
+  if(base == 0 || handlers_[mem_->read_byte(pc)] == 0)
+    return 0;
+  if(code_ == 0)
+  {
+    blocks_ = new(arena_) JitBlock*[0x10000]();
+    opcode_map_ = new(arena_) uint8_t[0x10000 / 8]();
+    code_ = new(arena_) uint8_t[kCodeSize];
+  }
+  if(code_used_ + kMaxBlockSize > kCodeSize)
+    flush();
+  /* align block headers */
+  code_used_ = (code_used_ + 3) & ~3;
+  JitBlock *b = (JitBlock *)(code_ + code_used_);
+  code_used_ += sizeof(JitBlock);
+  b->pc = pc;
+  b->first_base = base;
+  /* sub esp,8 */
+  emit8(0x83); emit8(0xEC); emit8(0x08);
+  uint32_t exits[kMaxBlockInsns];
+  int n = 0;
+  uint16_t addr = pc;
+  while(true)
+  {
+    uint8_t op = mem_->read_byte(addr);
+    b->last = addr;
+    /* push imm32 ; call rel32 ; add esp,4 */
+    emit8(0x68); emit32((uint32_t)cpu_);
+    emit8(0xE8); 
+    emit32((uint32_t)handlers_[op] - (uint32_t)(code_ + code_used_ + 4));
+    emit8(0x83); emit8(0xC4); emit8(0x04);
+    opcode_map_[addr >> 3] |= (1 << (addr & 7));
+    mem_->watch_code_page(addr >> 8);
+    if(++n == kMaxBlockInsns || ends_block(op))
+      break;
+    uint16_t next = addr + kInsnLength[op];
+    /* stop before crossing into a page with a different mapping */
+    if((next >> 8) != (addr >> 8) && mem_->page_base(next >> 8) != base)
+      break;
+    if(handlers_[mem_->read_byte(next)] == 0)
+      break;
+    /* test al,al ; jnz rel32 */
+    emit8(0x84); emit8(0xC0);
+    emit8(0x0F); emit8(0x85);
+    exits[n-1] = code_used_;
+    emit32(0);
+    addr = next;
+  }
+  b->last_base = mem_->page_base(b->last >> 8);
+  /* exit: add esp,8 ; ret */
+  uint32_t exit = code_used_;
+  for(int i=0 ; i < n-1 ; i++)
+  {
+    uint32_t rel = exit - (exits[i] + 4);
+    code_[exits[i]]   = rel & 0xff;
+    code_[exits[i]+1] = (rel >> 8) & 0xff;
+    code_[exits[i]+2] = (rel >> 16) & 0xff;
+    code_[exits[i]+3] = (rel >> 24) & 0xff;
+  }
+  emit8(0x83); emit8(0xC4); emit8(0x08);
+  emit8(0xC3);
+  blocks_[pc] = b;
+  return b;
+}
@@ -15,29 +15,53 @@
  * limitations under the License.
  */
 #include <memorymanagement.h>
-#include <c64/c64rom.h>
-#include <c64/customrom.h>
 #include <c64/memory.h>
+#include <c64/romset.h>
 #include <c64/vic.h>
 #include <c64/cia1.h>
 #include <c64/cia2.h>
 #include <c64/sid.h>
+#include <c64/cpu.h>
+#include <c64/reu.h>
+#include <c64/cartridge.h>
+#include <c64/debugger.h>
+#include <c64/io.h>
+#include <c64/snapshot.h>
+#include <lib/string.h>
 
-Memory::Memory()
+Memory::Memory(myos::MemoryArena *arena)
 {
   /**
-   * 64 kB memory buffers, zeroed.
+   * 64 kB of RAM, zeroed, owned by the machine's arena.
    *
-   * We use two buffers to handle special circumstances, for instance,
-   * any write to a ROM-mapped location will in turn store data on the 
+   * The ROMs are shared by every machine and only ever read, any
+   * write to a ROM-mapped location will in turn store data on the 
    * hidden RAM, this trickery is used in certain graphic modes.
    */
-  mem_ram_ = new uint8_t[kMemSize]();
-  mem_rom_ = new uint8_t[kMemSize]();
+  mem_ram_ = new(arena) uint8_t[kMemSize]();
+  roms_ = RomSet::shared();
+  cpu_ = 0;
+  reu_ = 0;
+  cart_ = 0;
+  debugger_ = 0;
+  reu_trigger_ = false;
+  watching_ = false;
   
   // initialize RAM
   for (int i=0;i<kMemSize;mem_ram_[i] = (i>>1)<<1==i ? 0 : 0xFF, i++);
   
+  /* page tables for every bank layout */
+  for(int page=0 ; page < 256 ; page++)
+  {
+    code_pages_[page] = false;
+    watch_pages_[page] = 0;
+  }
+  for(int layout=0 ; layout < kLayouts ; layout++)
+  {
+    setup_banks(layout);
+    setup_page_tables(read_pages_[layout],write_pages_[layout]);
+  }
+  layout_ = 0xff;
   /* configure memory layout */
   setup_memory_banks(kLORAM|kHIRAM|kCHAREN);
   /* configure data directional bits */
@@ -47,8 +71,6 @@ Memory::Memory()
 
 Memory::~Memory()
 {
-  delete [] mem_ram_;
-  delete [] mem_rom_;
 }
 
 /**
@@ -57,29 +79,49 @@ Memory::~Memory()
  * There are five latch bits that control the configuration allowing
  * for a total of 32 different memory layouts, for now we only take
  * in count three bits : HIRAM/LORAM/CHAREN
+ *
+ * The page tables for every layout are built once by the ctor, 
+ * switching banks only selects the matching pair of tables.
  */
 void Memory::setup_memory_banks(uint8_t v)
+{
+  uint8_t layout = v & (kLORAM|kHIRAM|kCHAREN);
+  if(layout != layout_)
+  {
+    layout_ = layout;
+    setup_banks(layout);
+    select_tables();
+    if(cpu_)
+      cpu_->memory_layout_changed();
+  }
+  /* write the config to the zero page */
+  write_byte_no_io(kAddrMemoryLayout, v);
+}
+
+/**
+ * @brief computes the bank configuration for the given layout bits
+ *
+ * A cartridge adds its EXROM/GAME lines like the PLA does: ROML at
+ * $8000 with LORAM and HIRAM, ROMH instead of BASIC with HIRAM in 
+ * 16K mode, and a fixed map in ultimax mode.
+ */
+void Memory::setup_banks(uint8_t v)
 {
   /* get config bits */
   bool hiram  = ((v&kHIRAM) != 0);
   bool loram  = ((v&kLORAM) != 0);
   bool charen = ((v&kCHAREN)!= 0);
+  int cart = cart_ ? cart_->mode() : Cartridge::kOff;
   /* init everything to ram */
   for(size_t i=0 ; i < sizeof(banks_) ; i++)
     banks_[i] = kRAM;
-  
-   /* load ROMs */
-  for(uint16_t i=0; i < 8192; i++)
-    mem_rom_[kBaseAddrBasic+i] = basicRomC64[i];
-  
-  for(uint16_t i=0; i < 4096; i++)
-    mem_rom_[kBaseAddrChars+i] = charRomC64[i];
-  
-  for(uint16_t i=0; i < 8192; i++)
-    mem_rom_[kBaseAddrKernal+i] = kernalRomC64[i];
-  
-  patch_roms();
-  
+  if (cart == Cartridge::kUltimax)
+  {
+    banks_[kBankRoml] = kCart;
+    banks_[kBankKernal] = kCart;
+    banks_[kBankCharen] = kIO;
+    return;
+  }
   /* kernal */
   if (hiram) 
     banks_[kBankKernal] = kROM;
@@ -93,25 +135,224 @@ void Memory::setup_memory_banks(uint8_t v)
     banks_[kBankCharen] = kRAM;
   else 
     banks_[kBankCharen] = kROM;
-  /* write the config to the zero page */
-  write_byte_no_io(kAddrMemoryLayout, v);
-
+  /* cartridge */
+  if (cart != Cartridge::kOff && loram && hiram)
+    banks_[kBankRoml] = kCart;
+  if (cart == Cartridge::k16K && hiram)
+    banks_[kBankBasic] = kCart;
+  if (cart == Cartridge::k16K && loram && !hiram && !charen)
+    banks_[kBankCharen] = kRAM;
 }
 
 /**
  * @brief writes a byte to RAM without performing I/O
+ *
+ * Like write_block_no_io() a page holding recompiled code is still
+ * reported to the cpu, natives and the tokenizer patch RAM this way.
  */
 void Memory::write_byte_no_io(uint16_t addr, uint8_t v)
 {
   mem_ram_[addr] = v;
+  if(code_pages_[addr >> 8])
+    cpu_->code_written(addr);
 }
 
 /**
- * @brief writes a byte to RAM handling I/O
+ * @brief copies a block straight into RAM
+ *
+ * Bypasses the bank and I/O dispatch of write_byte(), the block is
+ * clipped at the end of the address space. Pages holding recompiled
+ * code are still reported to the cpu.
  */
-void Memory::write_byte(uint16_t addr, uint8_t v)
+void Memory::write_block_no_io(uint16_t addr, const uint8_t *src, uint32_t len)
+{
+  if(len > kMemSize - addr)
+    len = kMemSize - addr;
+  memcpy(mem_ram_ + addr, src, len);
+  for(uint32_t a=addr ; a < addr + len ; a++)
+  {
+    if(code_pages_[a >> 8])
+      cpu_->code_written(a);
+  }
+}
+
+/**
+ * @brief saves or restores the RAM
+ *
+ * Colour RAM lives in mem_ram_ at $D800 so it travels with the
+ * rest of the pages. base keeps a copy of the RAM as of the last
+ * snapshot taken or restored, a delta only stores the pages that
+ * differ from it. Comparing against a copy keeps write_byte() free
+ * of any dirty page bookkeeping.
+ */
+void Memory::snapshot(Snapshot *s, uint8_t *base, bool delta)
+{
+  uint8_t map[256 / 8];
+  if(s->saving())
+  {
+    memset(map,0,sizeof(map));
+    for(int page=0 ; page < 256 ; page++)
+    {
+      if(!delta || base == 0 || memcmp(mem_ram_ + (page << 8), base + (page << 8), 256) != 0)
+        map[page >> 3] |= 1 << (page & 7);
+    }
+  }
+  s->bytes(map,sizeof(map));
+  for(int page=0 ; page < 256 && s->ok() ; page++)
+  {
+    if((map[page >> 3] & (1 << (page & 7))) == 0)
+      continue;
+    s->bytes(mem_ram_ + (page << 8),256);
+    if(base != 0)
+      memcpy(base + (page << 8), mem_ram_ + (page << 8), 256);
+  }
+  if(!s->saving())
+    setup_memory_banks(mem_ram_[kAddrMemoryLayout]);
+}
+
+/**
+ * @brief saves or reads back the undo pages of a rewind record
+ *
+ * base is RAM as of the newest record. Saving stores the old
+ * contents of the pages that changed since and brings base up to
+ * date, without undo only base is updated. Reading writes the pages
+ * into base, which then holds RAM as of the record before.
+ */
+void Memory::rewind(Snapshot *s, uint8_t *base, bool undo)
+{
+  uint8_t map[256 / 8];
+  if(s->saving())
+  {
+    memset(map,0,sizeof(map));
+    for(int page=0 ; page < 256 && undo ; page++)
+    {
+      if(memcmp(mem_ram_ + (page << 8), base + (page << 8), 256) != 0)
+        map[page >> 3] |= 1 << (page & 7);
+    }
+  }
+  s->bytes(map,sizeof(map));
+  for(int page=0 ; page < 256 && s->ok() ; page++)
+  {
+    if((map[page >> 3] & (1 << (page & 7))) == 0)
+      continue;
+    s->bytes(base + (page << 8),256);
+  }
+  if(s->saving())
+    memcpy(base,mem_ram_,kMemSize);
+}
+
+/**
+ * @brief replaces RAM with a copy, e.g. a rewind base
+ */
+void Memory::restore_ram(const uint8_t *base)
+{
+  memcpy(mem_ram_,base,kMemSize);
+  setup_memory_banks(mem_ram_[kAddrMemoryLayout]);
+}
+
+/**
+ * @brief builds the per-page access tables for the current banks
+ *
+ * Every page gets a read and a write base pointer (mem_ram_ or a
+ * ROM image less its base address) which read_byte() and 
+ * write_byte() index directly with the full address. Pages that need special handling (I/O 
+ * registers, bank switching at $01, the DOS command at $02) have 
+ * a null entry and go through read_io()/write_io() instead.
+ */
+void Memory::setup_page_tables(uint8_t **read_page, uint8_t **write_page)
+{
+  for(int page=0 ; page < 256 ; page++)
+  {
+    read_page[page]  = mem_ram_;
+    write_page[page] = mem_ram_;
+  }
+  /* recompiled code */
+  for(int page=0 ; page < 256 ; page++)
+  {
+    if(code_pages_[page])
+      write_page[page] = 0;
+  }
+  /* REU command waiting for $FF00 */
+  if(reu_trigger_)
+    write_page[Reu::kAddrTrigger >> 8] = 0;
+  /* bank switching and DOS hooks */
+  write_page[kAddrZeroPage >> 8] = 0;
+  /* patch_ram() trigger */
+  write_page[kBaseAddrStack >> 8] = 0;
+  /* cartridge ROML, null for reads the cartridge has to see */
+  if(banks_[kBankRoml] == kCart)
+  {
+    uint8_t *roml = cart_->roml();
+    for(int page=kAddrRomlFirstPage>>8 ; page <= kAddrRomlLastPage>>8 ; page++)
+      read_page[page] = roml ? roml - kAddrRomlFirstPage : 0;
+  }
+  /* cartridge ROMH */
+  if(banks_[kBankBasic] == kCart)
+  {
+    uint8_t *romh = cart_->romh();
+    for(int page=kAddrBasicFirstPage>>8 ; page <= kAddrBasicLastPage>>8 ; page++)
+      read_page[page] = romh ? romh - kBaseAddrBasic : 0;
+  }
+  if(banks_[kBankKernal] == kCart)
+  {
+    uint8_t *romh = cart_->romh();
+    for(int page=kAddrKernalFirstPage>>8 ; page <= kAddrKernalLastPage>>8 ; page++)
+      read_page[page] = romh ? romh - kBaseAddrKernal : 0;
+  }
+  /* BASIC */
+  if(banks_[kBankBasic] == kROM)
+  {
+    uint8_t *basic = roms_->rom(RomSet::kBasic) - kBaseAddrBasic;
+    for(int page=kAddrBasicFirstPage>>8 ; page <= kAddrBasicLastPage>>8 ; page++)
+      read_page[page] = basic;
+  }
+  /* KERNAL */
+  if(banks_[kBankKernal] == kROM)
+  {
+    uint8_t *kernal = roms_->rom(RomSet::kKernal) - kBaseAddrKernal;
+    for(int page=kAddrKernalFirstPage>>8 ; page <= kAddrKernalLastPage>>8 ; page++)
+      read_page[page] = kernal;
+  }
+  /* I/O or character ROM */
+  if(banks_[kBankCharen] == kIO)
+  {
+    for(int page=kAddrVicFirstPage>>8 ; page <= kAddrVicLastPage>>8 ; page++)
+      read_page[page] = write_page[page] = 0;
+    read_page[kAddrCIA1Page >> 8] = write_page[kAddrCIA1Page >> 8] = 0;
+    read_page[kAddrCIA2Page >> 8] = write_page[kAddrCIA2Page >> 8] = 0;
+    read_page[kAddrSIDPage >> 8] = write_page[kAddrSIDPage >> 8] = 0;
+    read_page[kAddrIO1Page >> 8] = write_page[kAddrIO1Page >> 8] = 0;
+    read_page[kAddrREUPage >> 8] = write_page[kAddrREUPage >> 8] = 0;
+  }
+  else if(banks_[kBankCharen] == kROM)
+  {
+    uint8_t *chars = roms_->rom(RomSet::kChars) - kBaseAddrChars;
+    for(int page=kAddrVicFirstPage>>8 ; page <= kAddrVicLastPage>>8 ; page++)
+      read_page[page] = chars;
+  }
+}
+
+/**
+ * @brief writes a byte to a page that needs special handling
+ */
+void Memory::write_io(uint16_t addr, uint8_t v)
 {
   uint16_t page = addr&0xff00;
+  bool io = (banks_[kBankCharen] == kIO);
+  /* watched page, plain memory unless the page needs handling anyway */
+  if (watching_ && (watch_pages_[page >> 8] & Debugger::kWatchWrite))
+  {
+    debugger_->access(addr,true);
+    uint8_t *p = write_pages_[layout_][page >> 8];
+    if (p)
+    {
+      p[addr] = v;
+      return;
+    }
+  }
+  /* recompiled code might get overwritten */
+  if (code_pages_[page >> 8])
+    cpu_->code_written(addr);
   /* ZP */
   if (page == kAddrZeroPage)
   {
@@ -121,41 +362,36 @@ void Memory::write_byte(uint16_t addr, uint8_t v)
     else
       mem_ram_[addr] = v;
   }
-  /* VIC-II DMA or Character ROM */
-  else if (page >= kAddrVicFirstPage && page <= kAddrVicLastPage)
+  /* VIC-II DMA */
+  else if (io && page >= kAddrVicFirstPage && page <= kAddrVicLastPage)
   {
-    if(banks_[kBankCharen] == kIO)
-      vic_->write_register(addr&0x7f,v);
-    else
-      mem_ram_[addr] = v;
+    /* the accelerator registers sit among the unused VIC ones */
+    if ((addr == kAddrTurboOff || addr == kAddrTurboOn) && cpu_->accelerator())
+      cpu_->speed(addr == kAddrTurboOn ? cpu_->accelerator() : 1);
+    vic_->write_register(addr&0x7f,v);
   }
   /* CIA1 */
-  else if (page == kAddrCIA1Page)
-  {
-    if(banks_[kBankCharen] == kIO)
-      cia1_->write_register(addr&0x0f,v);
-    else
-      mem_ram_[addr] = v;
-  }
-  else if (page == kAddrCIA2Page)
-  {
-    if(banks_[kBankCharen] == kIO)
-      cia2_->write_register(addr&0x0f,v);
-    else
-      mem_ram_[addr] = v;
-  }
-  else if (page == kAddrSIDPage)
-  {
-    if(banks_[kBankCharen] == kIO)
-      sid_->write_register(addr&0xff,v);
-    else
-      mem_ram_[addr] = v;
-  }
+  else if (io && page == kAddrCIA1Page)
+    cia1_->write_register(addr&0x0f,v);
+  /* CIA2 */
+  else if (io && page == kAddrCIA2Page)
+    cia2_->write_register(addr&0x0f,v);
+  /* SID */
+  else if (io && page == kAddrSIDPage)
+    sid_->write_register(addr&0xff,v);
+  /* REU, or the cartridge I/O areas */
+  else if (io && page == kAddrREUPage && reu_ && reu_->attached())
+    reu_->write_register(addr&0x1f,v);
+  else if (io && page == kAddrREUPage && cart_ && cart_->inserted())
+    cart_->write_io2(addr,v);
+  else if (io && page == kAddrIO1Page && cart_ && cart_->inserted())
+    cart_->write_io1(addr,v);
   /* default */
   else
   {   
     mem_ram_[addr] = v;
-    
+    if(addr == Reu::kAddrTrigger && reu_trigger_)
+      reu_->trigger();
     if(addr==313 && v==255)
       // install custom applications to RAM
       patch_ram();
@@ -163,59 +399,166 @@ void Memory::write_byte(uint16_t addr, uint8_t v)
 }
 
 /**
- * @brief reads a byte from RAM or ROM (depending on bank config)
+ * @brief route writes to a page through write_io()
+ *
+ * Used by the recompiler to get notified about writes
+ * to pages it has translated code from.
  */
-uint8_t Memory::read_byte(uint16_t addr)
+void Memory::watch_code_page(uint8_t page)
 {
-  uint8_t  retval = 0;
-  uint16_t page   = addr&0xff00;
-  /* VIC-II DMA or Character ROM */
-  if (page >= kAddrVicFirstPage && page <= kAddrVicLastPage)
+  if(code_pages_[page])
+    return;
+  code_pages_[page] = true;
+  for(int layout=0 ; layout < kLayouts ; layout++)
+    write_pages_[layout][page] = 0;
+  update_traps();
+}
+
+/**
+ * @brief stop watching pages for the recompiler
+ */
+void Memory::unwatch_code_pages()
+{
+  for(int page=0 ; page < 256 ; page++)
+    code_pages_[page] = false;
+  for(int layout=0 ; layout < kLayouts ; layout++)
   {
-    if(banks_[kBankCharen] == kIO)
-      retval = vic_->read_register(addr&0x7f);
-    else if(banks_[kBankCharen] == kROM)
-      retval = mem_rom_[addr];
-    else
-      retval = mem_ram_[addr];
+    setup_banks(layout);
+    setup_page_tables(read_pages_[layout],write_pages_[layout]);
   }
-  /* CIA1 */
-  else if (page == kAddrCIA1Page)
+  setup_banks(layout_);
+  update_traps();
+}
+
+/**
+ * @brief routes writes to the $FF00 page through write_io() while
+ * an REU command waits for its trigger
+ */
+void Memory::watch_reu_trigger(bool v)
+{
+  if(v == reu_trigger_)
+    return;
+  reu_trigger_ = v;
+  uint8_t page = Reu::kAddrTrigger >> 8;
+  for(int layout=0 ; layout < kLayouts ; layout++)
+    write_pages_[layout][page] = (v || code_pages_[page]) ? 0 : mem_ram_;
+  update_traps();
+}
+
+/**
+ * @brief the cartridge switched banks or EXROM/GAME
+ *
+ * Only base pointers change, the tables for every layout are built
+ * again and the cpu drops what it cached about the old ones.
+ */
+void Memory::cartridge_changed()
+{
+  for(int layout=0 ; layout < kLayouts ; layout++)
   {
-    if(banks_[kBankCharen] == kIO)
-      retval = cia1_->read_register(addr&0x0f);
-    else
-      retval = mem_ram_[addr];
+    setup_banks(layout);
+    setup_page_tables(read_pages_[layout],write_pages_[layout]);
   }
-  /* CIA2 */
-  else if (page == kAddrCIA2Page)
+  setup_banks(layout_);
+  update_traps();
+  if(cpu_)
+    cpu_->memory_layout_changed();
+}
+
+// watchpoints ///////////////////////////////////////////////////////////////
+
+/**
+ * @brief traps reads and/or writes to pages for the debugger
+ *
+ * kinds holds a Debugger::kWatchRead/kWatchWrite mask per page, all
+ * zero goes back to the plain tables.
+ */
+void Memory::watch_pages(const uint8_t *kinds)
+{
+  watching_ = false;
+  for(int page=0 ; page < 256 ; page++)
   {
-    if(banks_[kBankCharen] == kIO)
-      retval = cia2_->read_register(addr&0x0f);
-    else
-      retval = mem_ram_[addr];
-  }       
-  /* BASIC or RAM */
-  else if (page >= kAddrBasicFirstPage && page <= kAddrBasicLastPage)
+    watch_pages_[page] = kinds[page];
+    if(kinds[page] != 0)
+      watching_ = true;
+  }
+  update_traps();
+  select_tables();
+  if(cpu_)
+    cpu_->memory_layout_changed();
+}
+
+/**
+ * @brief builds the trap tables from the plain ones
+ */
+void Memory::update_traps()
+{
+  if(!watching_)
+    return;
+  for(int layout=0 ; layout < kLayouts ; layout++)
   {
-    if (banks_[kBankBasic] == kROM)
-      retval = mem_rom_[addr];
-    else
-      retval = mem_ram_[addr];
+    for(int page=0 ; page < 256 ; page++)
+    {
+      uint8_t kind = watch_pages_[page];
+      trap_read_pages_[layout][page] = 
+        (kind & Debugger::kWatchRead) ? 0 : read_pages_[layout][page];
+      trap_write_pages_[layout][page] = 
+        (kind & Debugger::kWatchWrite) ? 0 : write_pages_[layout][page];
+    }
   }
-  /* KERNAL */
-  else if (page >= kAddrKernalFirstPage && page <= kAddrKernalLastPage)
+}
+
+/**
+ * @brief points read_byte()/write_byte() at the tables for layout_
+ */
+void Memory::select_tables()
+{
+  read_page_  = watching_ ? trap_read_pages_[layout_] : read_pages_[layout_];
+  write_page_ = watching_ ? trap_write_pages_[layout_] : write_pages_[layout_];
+}
+
+/**
+ * @brief reads a byte from a page mapped to I/O
+ */
+uint8_t Memory::read_io(uint16_t addr)
+{
+  uint8_t  retval = 0;
+  uint16_t page   = addr&0xff00;
+  /* watched page */
+  if (watching_ && (watch_pages_[page >> 8] & Debugger::kWatchRead))
   {
-    if (banks_[kBankKernal] == kROM)
-      retval = mem_rom_[addr];
-    else 
-      retval = mem_ram_[addr];
+    debugger_->access(addr,false);
+    uint8_t *p = read_pages_[layout_][page >> 8];
+    if (p)
+      return p[addr];
   }
+  /* VIC-II DMA */
+  if (page >= kAddrVicFirstPage && page <= kAddrVicLastPage)
+    retval = vic_->read_register(addr&0x7f);
+  /* CIA1 */
+  else if (page == kAddrCIA1Page)
+    retval = cia1_->read_register(addr&0x0f);
+  /* CIA2 */
+  else if (page == kAddrCIA2Page)
+    retval = cia2_->read_register(addr&0x0f);
+  /* SID */
+  else if (page == kAddrSIDPage)
+    retval = sid_->read_register(addr&0xff);
+  /* REU, or the cartridge I/O areas */
+  else if (page == kAddrREUPage && reu_ && reu_->attached())
+    retval = reu_->read_register(addr&0x1f);
+  else if (page == kAddrREUPage && cart_ && cart_->inserted())
+    retval = cart_->read_io2(addr);
+  else if (page == kAddrIO1Page && cart_ && cart_->inserted())
+    retval = cart_->read_io1(addr);
+  /* cartridge banks without a direct mapping */
+  else if (page >= kAddrRomlFirstPage && page <= kAddrRomlLastPage && cart_)
+    retval = cart_->read_roml(addr);
+  else if (cart_ && ((page >= kAddrBasicFirstPage && page <= kAddrBasicLastPage) ||
+                     page >= kAddrKernalFirstPage))
+    retval = cart_->read_romh(addr);
   /* default */
   else
-  {
     retval = mem_ram_[addr];
-  }
   return retval;
 }
 
@@ -283,122 +626,41 @@ uint8_t Memory::vic_read_byte(uint16_t addr)
   uint16_t vic_addr = cia2_->vic_base_address() + (addr & 0x3fff);
   if((vic_addr >= 0x1000 && vic_addr <  0x2000) ||
      (vic_addr >= 0x9000 && vic_addr <  0xa000))
-    v = mem_rom_[kBaseAddrChars + (vic_addr & 0xfff)];
+    v = roms_->rom(RomSet::kChars)[vic_addr & 0xfff];
   else
     v = read_byte_no_io(vic_addr);
   return v;
 }
 
-//#define ML_MON_C000
-#define ML_MON_9000
-
+/**
+ * @brief installs the optional programs, POKE 313,255 from BASIC
+ *
+ * MICROMON.PRG goes to its load address and takes the BRK vector,
+ * PAKU.PRG is loaded as the BASIC program so it can be saved to 
+ * disk (remember to do a CLR before running it). Both are read 
+ * from the disk the first time they are asked for, a missing one 
+ * is skipped.
+ */
 void Memory::patch_ram()
 {
-#ifdef ML_MON_C000
-  // ML monitor loaded to $C000
-  for(uint16_t i=2; i < 4099; i++)
-    mem_ram_[49152+(i-2)] = monitorC000[i];
-  
-  // BRK vector to ML monitor
-  mem_ram_[0x0316] = 0x00;
-  mem_ram_[0x0317] = 0xC0;
-#endif
-   
-  // rem raster test sys2064
-  //for(int x=0; x<34;x++)
-  //  mem_ram_[0x0810 + x] = prg[x];
-
-#ifdef ML_MON_9000  
-  for(uint16_t i=2; i < 4225; i++)
-    mem_ram_[0x9000+(i-2)] = micromon[i];
-  
-  // BRK vector to ML monitor
-  mem_ram_[0x0316] = 0x00;
-  mem_ram_[0x0317] = 0x90;
-#endif
-  
-  // Used to load a PRG file into RAM so it can be saved to disk
-  
-  uint16_t sz = paku_prg_size;
-  uint16_t loadAddr = (paku_prg[1] << 8) + paku_prg[0];
-  for(uint16_t i=2;i<sz;i++)
-    mem_ram_[loadAddr++] = paku_prg[i];
-  
-  mem_ram_[0x2D] = (0x0801 + sz-2) & 0xFF; // poke low byte to 45  
-  mem_ram_[0x2E] = (0x0801 + sz-2) >> 8; // poke hi byte to 46
-  
-  // remember to do a CLR before running program
-}
-
-void Memory::patch_roms()
-{
-  // keyboard modifications for keycode to match PC keyboard
-  uint16_t hack = 0xEB81;	// std keys
-  mem_rom_[hack+46] = 0x5B;	// PETSCII for [
-  mem_rom_[hack+49] = 0x5D;	// PETSCII for ]
-  mem_rom_[hack+50] = 0x27;	// PETSCII for '
-  mem_rom_[hack+45] = 0x3B;	// PETSCII for ;
-
-  
-  hack = 0xEBC2;		// shifted keys
-  mem_rom_[hack+59] = 0x40;	// PETSCII @ for SHIFT-2
-  mem_rom_[hack+19] = 0x5E;	// PETSCII & for SHIFT-6
-  mem_rom_[hack+24] = 0x26;	// PETSCII & for SHIFT-7
-  mem_rom_[hack+27] = 0x2A;	// PETSCII & for SHIFT-8
-  mem_rom_[hack+32] = 0x28;	// PETSCII & for SHIFT-9
-  mem_rom_[hack+35] = 0x29;	// PETSCII & for SHIFT-0
-  mem_rom_[hack+50] = 0x22;	// PETSCII for "
-  mem_rom_[hack+45] = 0x3A;	// PETSCII for :
-  mem_rom_[hack+53] = 0x2B;	// PETSCII for +
-  
-  //hack = 0x28A;
-  //mem_ram_[hack] = 64;		// Disable key repeat (for fast machines)
-
-#define DOS_PATCH
-  
-#ifdef DOS_PATCH
-  //kernel hack for ide drive access
-  hack = 0xF4C4;	// KERNEL LOAD FROM SERIAL BUS (Starts at $F4B8)
-    
-  // Tell FAT32 driver to load a program
-  mem_rom_[hack++] = 0xA9; mem_rom_[hack++] = 0x04;				// LDA #$04
-  mem_rom_[hack++] = 0x8D; mem_rom_[hack++] = 0x02; mem_rom_[hack++] = 0x00;	// STA $0002
-  
-  // Check the STATUS byte.  Print FILE NOT FOUND if not found
-  mem_rom_[hack++] = 0xA5; mem_rom_[hack++] = 0x90;				// LDA $90
-  mem_rom_[hack++] = 0x4A;							// LSR
-  mem_rom_[hack++] = 0x4A;							// LSR
-  mem_rom_[hack++] = 0xB0; mem_rom_[hack++] = 0x61;				// BCS $F530 <=
-  
-  // Print LOADING
-  mem_rom_[hack++] = 0x20; mem_rom_[hack++] = 0xD2; mem_rom_[hack++] = 0xF5;	// JSR $F5D2
-  
-  // END
-  mem_rom_[hack++] = 0x18;							// CLC
-  mem_rom_[hack++] = 0xA6; mem_rom_[hack++] = 0xAE;				// LDX $AE
-  mem_rom_[hack++] = 0xA4; mem_rom_[hack++] = 0xAF;				// LDY $AF
-  mem_rom_[hack++] = 0x60;							// RTS
-  
-  
-  hack = 0xF605;	// KERNEL SAVE TO SERIAL BUS (Starts at $F4B8)
-    
-  // Tell FAT32 driver to load a program
-  mem_rom_[hack++] = 0xA9; mem_rom_[hack++] = 0x05;				// LDA #$05
-  mem_rom_[hack++] = 0x8D; mem_rom_[hack++] = 0x02; mem_rom_[hack++] = 0x00;	// STA $0002
-  
-  // Check the STATUS byte.  Print FILE NOT FOUND if not found
-  /*mem_rom_[hack++] = 0xA5; mem_rom_[hack++] = 0x90;				// LDA $90
-  mem_rom_[hack++] = 0x4A;							// LSR
-  mem_rom_[hack++] = 0x4A;							// LSR
-  mem_rom_[hack++] = 0xB0; mem_rom_[hack++] = 0x61;				// BCS $F530 <=
-  
-  // Print LOADING
-  mem_rom_[hack++] = 0x20; mem_rom_[hack++] = 0xD2; mem_rom_[hack++] = 0xF5;	// JSR $F5D2*/
-  
-  // END
-  mem_rom_[hack++] = 0x18;							// CLC
-  mem_rom_[hack++] = 0x60;							// RTS
+  uint32_t size;
+  const uint8_t *prg = roms_->optional(RomSet::kMicromon,&size);
+  if(prg != 0)
+  {
+    uint16_t addr = prg[0] | (prg[1] << 8);
+    write_block_no_io(addr,prg+2,size-2);
+    // BRK vector to ML monitor
+    mem_ram_[0x0316] = addr & 0xFF;
+    mem_ram_[0x0317] = addr >> 8;
+  }
   
-#endif
+  prg = roms_->optional(RomSet::kPaku,&size);
+  if(prg != 0)
+  {
+    uint16_t addr = prg[0] | (prg[1] << 8);
+    write_block_no_io(addr,prg+2,size-2);
+    uint16_t end = addr + size - 2;
+    mem_ram_[0x2D] = end & 0xFF; // poke low byte to 45  
+    mem_ram_[0x2E] = end >> 8; // poke hi byte to 46
+  }
 }
-
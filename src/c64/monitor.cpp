@@ -6,10 +6,20 @@
 #include <c64/io.h>
 #include <c64/cpu.h>
 #include <c64/memory.h>
+#include <c64/c64.h>
+#include <c64/tokenizer.h>
 #include <lib/string.h>
 #include <lib/stdlib.h>
 #include <lib/vga.h>
 
+/**
+ * @brief Trace::Sink printing to the console
+ */
+static void print_line(const char *line, void *arg)
+{
+  printf((char*)line);
+}
+
 Monitor::Monitor()
 {
   bufPtr = 0;
@@ -29,6 +39,7 @@ void Monitor::Start()
   printf("OS/64 v0.10 - Debugging:\n\n");
   printf("====================================================\n");
   
+  c64_->debugger_->report_hit();
   help();
   
   prompt();
@@ -102,8 +113,23 @@ void Monitor::help()
   printf("D - Directory (ATA FAT32 Harddisk Master 0)\n");
   printf("E - Erase (delete) file\n");
   printf("N - ReName a file\n");
-  printf("L - Load file to RAM (L FILENAME.EXT C000)\n");
+  printf("L - Load file to RAM (L FILENAME.EXT C000, a .BAS listing is tokenized)\n");
   printf("W - Write RAM to file (W FILENAME.EXT C000 C1FF)\n");
+  printf("K - Snapshot machine (K FILENAME.SNP [D] - D for delta)\n");
+  printf("Y - Restore snapshot (Y FILENAME.SNP)\n");
+  printf("H - Heap statistics (H T toggles the allocation trace)\n");
+  printf("O - Profiler (O E exact, O S sampling, O X off, O C clear, O W FILE)\n");
+  printf("V - Frame timing (V O toggles the overlay, V C clears)\n");
+  printf("U - Rewind (U seconds, also PAGE UP) or history\n");
+  printf("I - Input log (I R FILE.INP record, I S FILE.INP save, I P FILE.INP replay)\n");
+  printf("C - Cartridge (C FILE.CRT inserts it and resets, C alone removes it)\n");
+  printf("B - Breakpoint (B C000 toggles, B X clears all, B alone lists)\n");
+  printf("Z - Watchpoint (Z R|W|RW C000 [C0FF], Z X clears all)\n");
+  printf("G - Go (G [C000] runs from the address, or where it stopped)\n");
+  printf("T - Trace (T E records, T X stops, T W FILE.TRC, T [lines] lists)\n");
+  printf("A - Accelerator (A 20 fits one and runs 20x, A 1 normal speed, A 0 removes it)\n");
+  printf("X - Toggle 6510 recompiler\n");
+  printf("Q - Toggle warp mode (also F11)\n");
   printf("ESC - Return to system\n");
   printf("====================================================\n");
   printf("Built in ML monitor activated via SYS 36864\n");
@@ -217,7 +243,22 @@ void Monitor::process_cmd()
     {
 	int fstatus = 0;
 	fstatus = fat32_->OpenFile(1, (uint8_t*)param1, FILEACCESSMODE_READ);
-	if(fstatus == FILE_STATUS_OK)
+	unsigned int length = strlen(param1);
+	if(fstatus == FILE_STATUS_OK && length > 4 && strcmp(param1 + length - 4, ".BAS") == 0)
+	{
+	  // a listing becomes the program in memory, as if typed in
+	  Tokenizer tokenizer(mem_, Tokenizer::kAddrBasicStart);
+	  uint8_t b;
+	  while(fat32_->ReadNextFileByte(1, &b) != FILE_STATUS_EOF)
+	    tokenizer.text(&b, 1);
+	  fat32_->CloseFile(1);
+	  uint16_t end = tokenizer.finish();
+	  tokenizer.set_pointers();
+	  printf("\n%d lines tokenized to %04X - %04X", tokenizer.lines(), Tokenizer::kAddrBasicStart, end);
+	  if(!tokenizer.ok())
+	    printf(", stopped at a bad line number or out of memory");
+	}
+	else if(fstatus == FILE_STATUS_OK)
 	{
 	  uint16_t m = htoi(param2);
 	  
@@ -302,8 +343,9 @@ void Monitor::process_cmd()
       uint8_t eobLo = mem_->read_byte(45);
       uint8_t eobHi = mem_->read_byte(46);
       
+      // end of BASIC is exclusive, the command line end is inclusive
       if(mEnd ==0)
-	mEnd = (eobHi << 8) + eobLo;
+	mEnd = (eobHi << 8) + eobLo - 1;
       
       fstatus = fat32_->OpenFile(1, (uint8_t*)param1, FILEACCESSMODE_CREATE);
       
@@ -358,6 +400,250 @@ void Monitor::process_cmd()
   
       break;
     }
+    case 'K':
+    {
+      if(p1 == 0)
+      {
+	printf("?");
+	return;
+      }
+      bool delta = (p2 > 0 && param2[0] == 'D');
+      int fstatus = c64_->save_snapshot(fat32_, (uint8_t*)param1, delta);
+      printf("\nstatus=%d",fstatus);
+      break;
+    }
+    case 'Y':
+    {
+      if(p1 == 0)
+      {
+	printf("?");
+	return;
+      }
+      int fstatus = c64_->load_snapshot(fat32_, (uint8_t*)param1);
+      printf("\nstatus=%d",fstatus);
+      break;
+    }
+    case 'H':
+    {
+      myos::MemoryManager *mm = myos::MemoryManager::activeMemoryManager;
+      if(p1 > 0 && param1[0] == 'T')
+      {
+	mm->Trace(!mm->Tracing());
+	printf("\ntrace %s", mm->Tracing() ? "on" : "off");
+	break;
+      }
+      myos::MemoryStats st;
+      mm->GetStats(&st);
+      printf("\nin use   %u bytes, peak %u", st.used, st.peak);
+      printf("\nfree     %u bytes, largest %u, %u%% fragmented", st.freeBytes, st.largestFree, st.fragmentation);
+      printf("\nchunks   %u", st.chunks);
+      printf("\nslabs    %u of %u pages", st.slabPages, st.slabPagesTotal);
+      printf("\nallocs   %u, %u failed", st.allocations, st.failures);
+      if(mm->Tracing())
+      {
+	printf("\n CALLER   PTR      SIZE");
+	myos::MemoryTraceEntry *e;
+	for(int age=0 ; age < 16 && (e = mm->GetTraceEntry(age)) != 0 ; age++)
+	{
+	  if(e->size != 0)
+	    printf("\n %08X %08X %u", (uint32_t)e->caller, (uint32_t)e->ptr, e->size);
+	  else
+	    printf("\n %08X %08X free", (uint32_t)e->caller, (uint32_t)e->ptr);
+	}
+      }
+      break;
+    }
+    case 'O':
+    {
+      Profiler *prof = cpu_->profiler();
+      char sub = p1 > 0 ? param1[0] : 0;
+      if(sub == 'E')
+	prof->mode(Profiler::kExact, cpu_->cycles());
+      else if(sub == 'S')
+	prof->mode(Profiler::kSample, cpu_->cycles());
+      else if(sub == 'X')
+	prof->mode(Profiler::kOff, cpu_->cycles());
+      else if(sub == 'C')
+	prof->clear();
+      else if(sub == 'W' && p2 > 0)
+      {
+	int fstatus = prof->save(fat32_, (uint8_t*)param2);
+	printf("\nstatus=%d", fstatus);
+	break;
+      }
+      prof->report(10);
+      break;
+    }
+    case 'V':
+    {
+      FrameStats *stats = c64_->stats_;
+      char sub = p1 > 0 ? param1[0] : 0;
+      if(sub == 'O')
+      {
+	stats->overlay(!stats->overlay());
+	printf("\noverlay %s", stats->overlay() ? "on" : "off");
+	break;
+      }
+      if(sub == 'C')
+	stats->clear();
+      stats->report();
+      break;
+    }
+    case 'U':
+    {
+      if(p1 > 0)
+      {
+	unsigned int steps = c64_->rewind(atoi(param1) * Rewind::kPerSecond);
+	printf("\nrewound %u records", steps);
+      }
+      c64_->rewind_->report();
+      break;
+    }
+    case 'I':
+    {
+      char sub = p1 > 0 ? param1[0] : 0;
+      if(sub != 0 && p2 == 0)
+      {
+	printf("?");
+	return;
+      }
+      int fstatus = FILE_STATUS_OK;
+      if(sub == 'R')
+	fstatus = c64_->record_input(fat32_, (uint8_t*)param2);
+      else if(sub == 'S')
+	fstatus = c64_->save_input(fat32_, (uint8_t*)param2);
+      else if(sub == 'P')
+	fstatus = c64_->replay_input(fat32_, (uint8_t*)param2);
+      if(sub != 0)
+	printf("\nstatus=%d",fstatus);
+      c64_->input_->report();
+      break;
+    }
+    case 'C':
+    {
+      CartridgeImage *image = 0;
+      if(p1 > 0)
+      {
+	int fstatus;
+	image = CartridgeImage::load(fat32_, (uint8_t*)param1, &fstatus);
+	printf("\nstatus=%d",fstatus);
+	if(image == 0)
+	  break;
+	printf(" %s type %d, %d banks", image->name(), image->type(), image->banks());
+      }
+      // the machine built on reset gets it
+      c64_->cart_->insert(image);
+      c64_->reset = true;
+      break;
+    }
+    case 'B':
+    {
+      Debugger *dbg = c64_->debugger_;
+      if(p1 > 0 && param1[0] == 'X')
+	dbg->clear_breakpoints();
+      else if(p1 > 0)
+      {
+	uint16_t addr = htoi(param1);
+	printf("\n%04X %s", addr, dbg->toggle_breakpoint(addr) ? "set" : "cleared");
+	break;
+      }
+      dbg->report();
+      break;
+    }
+    case 'Z':
+    {
+      Debugger *dbg = c64_->debugger_;
+      if(p1 > 0 && param1[0] == 'X')
+      {
+	dbg->clear_watches();
+	dbg->report();
+	break;
+      }
+      uint8_t kind = 0;
+      for(int c=0 ; c < p1 ; c++)
+      {
+	if(param1[c] == 'R')
+	  kind |= Debugger::kWatchRead;
+	else if(param1[c] == 'W')
+	  kind |= Debugger::kWatchWrite;
+      }
+      if(kind == 0 || p2 == 0)
+      {
+	printf("?");
+	return;
+      }
+      uint16_t first = htoi(param2);
+      uint16_t last = p3 > 0 ? htoi(param3) : first;
+      if(!dbg->watch(first, last, kind))
+      {
+	printf("?");
+	return;
+      }
+      dbg->report();
+      break;
+    }
+    case 'G':
+    {
+      if(p1 > 0)
+	cpu_->pc(htoi(param1));
+      Stop();
+      break;
+    }
+    case 'T':
+    {
+      Trace *trace = c64_->trace_;
+      char sub = p1 > 0 ? param1[0] : 0;
+      if(sub == 'E')
+      {
+	if(!trace->start(cpu_->cycles()))
+	  printf("\nno room for the trace");
+      }
+      else if(sub == 'X')
+	trace->stop();
+      else if(sub == 'W' && p2 > 0)
+      {
+	int fstatus = trace->save(fat32_, (uint8_t*)param2);
+	printf("\nstatus=%d", fstatus);
+	break;
+      }
+      else if(p1 > 0)
+      {
+	printf("\n");
+	trace->report(atoi(param1), print_line, 0);
+      }
+      printf("\ntrace %s, %u instructions", trace->recording() ? "on" : "off", trace->records());
+      break;
+    }
+    case 'A':
+    {
+      if(p1 > 0)
+      {
+	unsigned int n = atoi(param1);
+	if(n > Cpu::kMaxSpeed)
+	  n = Cpu::kMaxSpeed;
+	/* 1 keeps it fitted, $D07B turns it on again */
+	if(n != 1)
+	  cpu_->accelerator(n);
+	cpu_->speed(n);
+      }
+      if(cpu_->accelerator() == 0)
+	printf("\nno accelerator");
+      else
+	printf("\naccelerator %ux, running at %ux", cpu_->accelerator(), cpu_->speed());
+      break;
+    }
+    case 'X':
+    {
+      cpu_->jit_enabled(!cpu_->jit_enabled());
+      printf("\nrecompiler %s", cpu_->jit_enabled() ? "on" : "off");
+      break;
+    }
+    case 'Q':
+    {
+      io_->Warp = !io_->Warp;
+      printf("\nwarp %s", io_->Warp ? "on" : "off");
+      break;
+    }
     default:
       printf("?");
       break;
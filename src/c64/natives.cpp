@@ -0,0 +1,500 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <c64/natives.h>
+#include <c64/cpu.h>
+#include <c64/memory.h>
+
+/**
+ * The routines below follow the ROM listings line by line, the
+ * cycles of each instruction are added as it is done. Flags are
+ * only set where a later instruction or the caller can see them.
+ */
+
+Natives::Natives()
+{
+  cpu_ = 0;
+  mem_ = 0;
+  enabled_ = false;
+  cost_ = 100;
+}
+
+Natives::~Natives()
+{
+}
+
+// 6510 helpers ////////////////////////////////////////////////////////////
+
+static inline void nz(bool &n, bool &z, uint8_t v)
+{
+  n = (v & 0x80) != 0;
+  z = v == 0;
+}
+
+#define NZ(v) nz(s.n,s.z,(v))
+
+static inline uint8_t adc(bool &n, bool &v, bool &z, bool &c, uint8_t a, uint8_t b)
+{
+  unsigned int r = a + b + (c ? 1 : 0);
+  v = (~(a ^ b) & (a ^ r) & 0x80) != 0;
+  c = r > 0xff;
+  nz(n,z,r);
+  return r;
+}
+
+#define ADC(a,b) adc(s.n,s.v,s.z,s.c,(a),(b))
+#define SBC(a,b) adc(s.n,s.v,s.z,s.c,(a),(uint8_t)~(b))
+
+static inline uint8_t ror(bool &n, bool &z, bool &c, uint8_t v)
+{
+  uint8_t r = (v >> 1) | (c ? 0x80 : 0);
+  c = (v & 1) != 0;
+  nz(n,z,r);
+  return r;
+}
+
+static inline uint8_t rol(bool &n, bool &z, bool &c, uint8_t v)
+{
+  uint8_t r = (v << 1) | (c ? 1 : 0);
+  c = (v & 0x80) != 0;
+  nz(n,z,r);
+  return r;
+}
+
+#define ROR(v) ror(s.n,s.z,s.c,(v))
+#define ROL(v) rol(s.n,s.z,s.c,(v))
+#define ASL(v) (s.c = false, rol(s.n,s.z,s.c,(v)))
+#define LSR(v) (s.c = false, ror(s.n,s.z,s.c,(v)))
+#define CMP(r,m) (s.c = (r) >= (m), NZ((uint8_t)((r) - (m))))
+
+/* zero page, always RAM */
+#define ZP(a) mem_->read_byte_no_io(a)
+#define SET_ZP(a,v) mem_->write_byte_no_io((a),(v))
+#define ZP_ROR(a) SET_ZP(a,ROR(ZP(a)))
+#define ZP_ROL(a) SET_ZP(a,ROL(ZP(a)))
+#define ZP_ASL(a) SET_ZP(a,ASL(ZP(a)))
+
+/* LDA (zp),Y cycles */
+static inline unsigned int indirect_y(uint16_t base, uint8_t y)
+{
+  return (base & 0xff) + y > 0xff ? 6 : 5;
+}
+
+// dispatch ////////////////////////////////////////////////////////////////
+
+/**
+ * @brief runs the routine for trap n, or the instruction it replaced
+ *
+ * The TRAP opcode has already been charged its 2 cycles.
+ */
+void Natives::trap(uint8_t n)
+{
+  static const uint16_t entries[] = {
+    kAddrFmult, kAddrFdiv, kAddrConupk, kAddrMovfm, kAddrMovlin
+  };
+  /* only the TRAPs install_natives() put in, a $02 in a program
+     jams a real cpu, here it's skipped */
+  unsigned int i = n - kFirstTrap;
+  if(i >= sizeof(entries) / sizeof(entries[0]) ||
+     (uint16_t)(cpu_->pc() - 2) != entries[i])
+    return;
+  State s;
+  s.a = cpu_->a();
+  s.x = cpu_->x();
+  s.y = cpu_->y();
+  s.sp = cpu_->sp();
+  s.n = cpu_->nf();
+  s.v = cpu_->of();
+  s.z = cpu_->zf();
+  s.c = cpu_->cf();
+  s.cycles = 0;
+  bool native = enabled_ && !cpu_->dmf();
+  uint16_t next = cpu_->pc();
+  switch(n)
+  {
+  case kTrapFmult:
+    if(native)
+    {
+      fmult(s);
+      next = kAddrMovfr;
+    }
+    else
+    {
+      s.a = 0x00; NZ(s.a); s.cycles += 2;      /* LDA #$00 */
+    }
+    break;
+  case kTrapFdiv:
+    if(native)
+    {
+      fdiv(s);
+      next = kAddrMovfr;
+    }
+    else
+    {
+      s.x = 0xfc; NZ(s.x); s.cycles += 2;      /* LDX #$FC */
+    }
+    break;
+  case kTrapConupk:
+  case kTrapMovfm:
+    if(native && n == kTrapConupk)
+    {
+      conupk(s);
+      next = rts(s);
+    }
+    else if(native)
+    {
+      movfm(s);
+      next = rts(s);
+    }
+    else
+    {
+      SET_ZP(0x22,s.a); s.cycles += 3;         /* STA $22 */
+    }
+    break;
+  case kTrapMovlin:
+    if(native)
+    {
+      movlin(s);
+      next = rts(s);
+    }
+    else
+    {
+      s.y = 0x27; NZ(s.y); s.cycles += 2;      /* LDY #$27 */
+    }
+    break;
+  default:
+    return;
+  }
+  cpu_->a(s.a);
+  cpu_->x(s.x);
+  cpu_->y(s.y);
+  cpu_->sp(s.sp);
+  cpu_->nf(s.n);
+  cpu_->of(s.v);
+  cpu_->zf(s.z);
+  cpu_->cf(s.c);
+  cpu_->pc(next);
+  unsigned int cycles = native ? s.cycles * cost_ / 100 : s.cycles;
+  if(cycles > 2)
+    cpu_->spend(cycles - 2);
+}
+
+/**
+ * @brief RTS, returns the new pc
+ */
+uint16_t Natives::rts(State &s)
+{
+  uint16_t lo = mem_->read_byte(Memory::kBaseAddrStack + (uint8_t)(s.sp + 1));
+  uint16_t hi = mem_->read_byte(Memory::kBaseAddrStack + (uint8_t)(s.sp + 2));
+  s.sp += 2;
+  s.cycles += 6;
+  return ((hi << 8) | lo) + 1;
+}
+
+/**
+ * @brief the status byte PHP pushes for s
+ */
+uint8_t Natives::stack_flags(State &s)
+{
+  uint8_t p = Cpu::kFlagB | Cpu::kFlagU;
+  p |= s.n ? Cpu::kFlagN : 0;
+  p |= s.v ? Cpu::kFlagV : 0;
+  p |= s.z ? Cpu::kFlagZ : 0;
+  p |= s.c ? Cpu::kFlagC : 0;
+  p |= cpu_->idf() ? Cpu::kFlagI : 0;
+  p |= cpu_->dmf() ? Cpu::kFlagD : 0;
+  return p;
+}
+
+// BASIC floating point ////////////////////////////////////////////////////
+
+/**
+ * @brief FMULT after the exponents are added, $BA33-$BA58
+ *
+ * RES ($26-$29) = mantissa of FAC times ARG, one FAC byte at a
+ * time from the rounding byte up. Continues at MOVFR.
+ */
+void Natives::fmult(State &s)
+{
+  static const uint8_t bytes[] = {0x70,0x65,0x64,0x63};
+  s.a = 0x00; NZ(s.a); s.cycles += 2;          /* LDA #$00 */
+  SET_ZP(0x26,s.a);                            /* STA $26 */
+  SET_ZP(0x27,s.a);                            /* STA $27 */
+  SET_ZP(0x28,s.a);                            /* STA $28 */
+  SET_ZP(0x29,s.a); s.cycles += 12;            /* STA $29 */
+  for(int i=0 ; i < 4 ; i++)
+  {
+    s.a = ZP(bytes[i]); NZ(s.a); s.cycles += 3;  /* LDA byte */
+    s.cycles += 6;                             /* JSR $BA59 */
+    mltply(s,true);
+  }
+  s.a = ZP(0x62); NZ(s.a); s.cycles += 3;      /* LDA $62 */
+  s.cycles += 6;                               /* JSR $BA5E */
+  mltply(s,false);
+  /* the return address of the last JSR stays below the stack */
+  mem_->write_byte(Memory::kBaseAddrStack + s.sp,0xba);
+  mem_->write_byte(Memory::kBaseAddrStack + (uint8_t)(s.sp - 1),0x55);
+  s.cycles += 3;                               /* JMP $BB8F */
+}
+
+/**
+ * @brief MLTPLY $BA59, or $BA5E without the zero check
+ */
+void Natives::mltply(State &s, bool check)
+{
+  if(check)
+  {
+    if(s.z)
+    {
+      s.cycles += 2 + 3;                       /* BNE, JMP $B983 */
+      mulshf(s);
+      return;
+    }
+    s.cycles += 3;                             /* BNE $BA5E */
+  }
+  s.a = LSR(s.a); s.cycles += 2;               /* LSR A */
+  s.a |= 0x80; NZ(s.a); s.cycles += 2;         /* ORA #$80 */
+  do
+  {
+    s.y = s.a; NZ(s.y); s.cycles += 2;         /* TAY */
+    if(s.c)
+    {
+      s.cycles += 2;                           /* BCC */
+      s.c = false; s.cycles += 2;              /* CLC */
+      SET_ZP(0x29,ADC(ZP(0x29),ZP(0x6d)));     /* LDA $29 ADC $6D STA $29 */
+      SET_ZP(0x28,ADC(ZP(0x28),ZP(0x6c)));     /* LDA $28 ADC $6C STA $28 */
+      SET_ZP(0x27,ADC(ZP(0x27),ZP(0x6b)));     /* LDA $27 ADC $6B STA $27 */
+      s.a = ADC(ZP(0x26),ZP(0x6a));            /* LDA $26 ADC $6A STA $26 */
+      SET_ZP(0x26,s.a); s.cycles += 36;
+    }
+    else
+      s.cycles += 3;                           /* BCC $BA7D */
+    ZP_ROR(0x26);                              /* ROR $26 */
+    ZP_ROR(0x27);                              /* ROR $27 */
+    ZP_ROR(0x28);                              /* ROR $28 */
+    ZP_ROR(0x29);                              /* ROR $29 */
+    ZP_ROR(0x70); s.cycles += 25;              /* ROR $70 */
+    s.a = s.y; NZ(s.a); s.cycles += 2;         /* TYA */
+    s.a = LSR(s.a); s.cycles += 2;             /* LSR A */
+    s.cycles += s.z ? 2 : 3;                   /* BNE $BA61 */
+  }
+  while(!s.z);
+  s.cycles += 6;                               /* RTS */
+}
+
+/**
+ * @brief MULSHF $B983 entered with A = 0, RES shifted right a byte
+ *
+ * From the shift loop only the paths A = 0 can take are left. With
+ * carry clear it shifts one more bit, the rounding byte keeps the
+ * value of the byte shift.
+ */
+void Natives::mulshf(State &s)
+{
+  s.x = 0x25; NZ(s.x); s.cycles += 2;          /* LDX #$25 */
+  SET_ZP(0x70,ZP(0x29));                       /* LDY $04,X STY $70 */
+  SET_ZP(0x29,ZP(0x28));                       /* LDY $03,X STY $04,X */
+  SET_ZP(0x28,ZP(0x27));                       /* LDY $02,X STY $03,X */
+  SET_ZP(0x27,ZP(0x26));                       /* LDY $01,X STY $02,X */
+  s.y = ZP(0x68); NZ(s.y);                     /* LDY $68 */
+  SET_ZP(0x26,s.y); s.cycles += 38;            /* STY $01,X */
+  s.a = ADC(s.a,0x08); s.cycles += 2;          /* ADC #$08 */
+  s.cycles += 2 + 2;                           /* BMI, BEQ */
+  s.a = SBC(s.a,0x08); s.cycles += 2;          /* SBC #$08 */
+  s.y = s.a; NZ(s.y); s.cycles += 2;           /* TAY */
+  s.a = ZP(0x70); NZ(s.a); s.cycles += 3;      /* LDA $70 */
+  if(s.c)
+    s.cycles += 3;                             /* BCS $B9BA */
+  else
+  {
+    s.cycles += 2;                             /* BCS */
+    do
+    {
+      uint8_t b = ASL(ZP(0x26)); s.cycles += 6;  /* ASL $01,X */
+      if(s.c)
+      {
+        s.cycles += 2;                         /* BCC */
+        b++; NZ(b); s.cycles += 6;             /* INC $01,X */
+      }
+      else
+        s.cycles += 3;                         /* BCC $B9AC */
+      b = ROR(b);                              /* ROR $01,X */
+      SET_ZP(0x26,ROR(b));                     /* ROR $01,X */
+      ZP_ROR(0x27);                            /* ROR $02,X */
+      ZP_ROR(0x28);                            /* ROR $03,X */
+      ZP_ROR(0x29); s.cycles += 30;            /* ROR $04,X */
+      s.a = ROR(s.a); s.cycles += 2;           /* ROR A */
+      s.y++; NZ(s.y); s.cycles += 2;           /* INY */
+      s.cycles += s.z ? 2 : 3;                 /* BNE $B9A6 */
+    }
+    while(!s.z);
+  }
+  s.c = false; s.cycles += 2;                  /* CLC */
+  s.cycles += 6;                               /* RTS */
+}
+
+/**
+ * @brief FDIV mantissa division, $BB25-$BB87
+ *
+ * Quotient bits go to RES ($26-$29) and two more to the rounding
+ * byte, ARG is shifted up as the remainder. Continues at MOVFR.
+ */
+void Natives::fdiv(State &s)
+{
+  State saved;
+  s.x = 0xfc; NZ(s.x); s.cycles += 2;          /* LDX #$FC */
+  s.a = 0x01; NZ(s.a); s.cycles += 2;          /* LDA #$01 */
+compare:
+  s.y = ZP(0x6a); CMP(s.y,ZP(0x62)); s.cycles += 6;  /* LDY $6A CPY $62 */
+  if(!s.z) { s.cycles += 3; goto push; }       /* BNE $BB3F */
+  s.cycles += 2;
+  s.y = ZP(0x6b); CMP(s.y,ZP(0x63)); s.cycles += 6;  /* LDY $6B CPY $63 */
+  if(!s.z) { s.cycles += 3; goto push; }       /* BNE $BB3F */
+  s.cycles += 2;
+  s.y = ZP(0x6c); CMP(s.y,ZP(0x64)); s.cycles += 6;  /* LDY $6C CPY $64 */
+  if(!s.z) { s.cycles += 3; goto push; }       /* BNE $BB3F */
+  s.cycles += 2;
+  s.y = ZP(0x6d); CMP(s.y,ZP(0x65)); s.cycles += 6;  /* LDY $6D CPY $65 */
+push:
+  saved = s; s.cycles += 3;                    /* PHP */
+  s.a = ROL(s.a); s.cycles += 2;               /* ROL A */
+  if(!s.c) { s.cycles += 3; goto pull; }       /* BCC $BB4C */
+  s.cycles += 2;
+  s.x++; NZ(s.x); s.cycles += 2;               /* INX */
+  SET_ZP((uint8_t)(0x29 + s.x),s.a); s.cycles += 4;  /* STA $29,X */
+  if(s.z) { s.cycles += 3; goto last; }        /* BEQ $BB7A */
+  s.cycles += 2;
+  if(!s.n) { s.cycles += 3; goto done; }       /* BPL $BB7E */
+  s.cycles += 2;
+  s.a = 0x01; NZ(s.a); s.cycles += 2;          /* LDA #$01 */
+pull:
+  s.n = saved.n; s.v = saved.v;                /* PLP */
+  s.z = saved.z; s.c = saved.c; s.cycles += 4;
+  if(s.c) { s.cycles += 3; goto subtract; }    /* BCS $BB5D */
+  s.cycles += 2;
+shift:
+  ZP_ASL(0x6d);                                /* ASL $6D */
+  ZP_ROL(0x6c);                                /* ROL $6C */
+  ZP_ROL(0x6b);                                /* ROL $6B */
+  ZP_ROL(0x6a); s.cycles += 20;                /* ROL $6A */
+  if(s.c) { s.cycles += 3; goto push; }        /* BCS $BB3F */
+  s.cycles += 2;
+  if(s.n) { s.cycles += 3; goto compare; }     /* BMI $BB29 */
+  s.cycles += 2 + 3;                           /* BPL $BB3F */
+  goto push;
+subtract:
+  s.y = s.a; NZ(s.y); s.cycles += 2;           /* TAY */
+  SET_ZP(0x6d,SBC(ZP(0x6d),ZP(0x65)));         /* LDA $6D SBC $65 STA $6D */
+  SET_ZP(0x6c,SBC(ZP(0x6c),ZP(0x64)));         /* LDA $6C SBC $64 STA $6C */
+  SET_ZP(0x6b,SBC(ZP(0x6b),ZP(0x63)));         /* LDA $6B SBC $63 STA $6B */
+  SET_ZP(0x6a,SBC(ZP(0x6a),ZP(0x62)));         /* LDA $6A SBC $62 STA $6A */
+  s.cycles += 36;
+  s.a = s.y; NZ(s.a); s.cycles += 2;           /* TYA */
+  s.cycles += 3;                               /* JMP $BB4F */
+  goto shift;
+last:
+  s.a = 0x40; NZ(s.a); s.cycles += 2;          /* LDA #$40 */
+  s.cycles += 3;                               /* BNE $BB4C */
+  goto pull;
+done:
+  for(int i=0 ; i < 6 ; i++)
+    s.a = ASL(s.a);                            /* ASL A x6 */
+  s.cycles += 12;
+  SET_ZP(0x70,s.a); s.cycles += 3;             /* STA $70 */
+  s.n = saved.n; s.v = saved.v;                /* PLP */
+  s.z = saved.z; s.c = saved.c; s.cycles += 4;
+  /* what the last PHP left below the stack */
+  mem_->write_byte(Memory::kBaseAddrStack + s.sp,stack_flags(saved));
+  s.cycles += 3;                               /* JMP $BB8F */
+}
+
+/**
+ * @brief CONUPK $BA8C, ARG from the 5 bytes at A/Y
+ */
+void Natives::conupk(State &s)
+{
+  uint16_t ptr = s.a | (s.y << 8);
+  SET_ZP(0x22,s.a);                            /* STA $22 */
+  SET_ZP(0x23,s.y); s.cycles += 3 + 3;         /* STY $23 */
+  s.y = 0x04; s.cycles += 2;                   /* LDY #$04 */
+  SET_ZP(0x6d,mem_->read_byte(ptr + 4));       /* LDA ($22),Y STA $6D DEY */
+  s.cycles += indirect_y(ptr,4) + 3 + 2;
+  SET_ZP(0x6c,mem_->read_byte(ptr + 3));       /* LDA ($22),Y STA $6C DEY */
+  s.cycles += indirect_y(ptr,3) + 3 + 2;
+  SET_ZP(0x6b,mem_->read_byte(ptr + 2));       /* LDA ($22),Y STA $6B DEY */
+  s.cycles += indirect_y(ptr,2) + 3 + 2;
+  uint8_t b = mem_->read_byte(ptr + 1);        /* LDA ($22),Y STA $6E */
+  SET_ZP(0x6e,b);
+  SET_ZP(0x6f,b ^ ZP(0x66));                   /* EOR $66 STA $6F */
+  SET_ZP(0x6a,b | 0x80);                       /* LDA $6E ORA #$80 STA $6A DEY */
+  s.cycles += indirect_y(ptr,1) + 3 + 3 + 3 + 3 + 2 + 3 + 2;
+  SET_ZP(0x69,mem_->read_byte(ptr));           /* LDA ($22),Y STA $69 */
+  s.cycles += indirect_y(ptr,0) + 3;
+  s.y = 0;
+  s.a = ZP(0x61); NZ(s.a); s.cycles += 3;      /* LDA $61 */
+}
+
+/**
+ * @brief MOVFM $BBA2, FAC from the 5 bytes at A/Y
+ */
+void Natives::movfm(State &s)
+{
+  uint16_t ptr = s.a | (s.y << 8);
+  SET_ZP(0x22,s.a);                            /* STA $22 */
+  SET_ZP(0x23,s.y); s.cycles += 3 + 3;         /* STY $23 */
+  s.cycles += 2;                               /* LDY #$04 */
+  SET_ZP(0x65,mem_->read_byte(ptr + 4));       /* LDA ($22),Y STA $65 DEY */
+  s.cycles += indirect_y(ptr,4) + 3 + 2;
+  SET_ZP(0x64,mem_->read_byte(ptr + 3));       /* LDA ($22),Y STA $64 DEY */
+  s.cycles += indirect_y(ptr,3) + 3 + 2;
+  SET_ZP(0x63,mem_->read_byte(ptr + 2));       /* LDA ($22),Y STA $63 DEY */
+  s.cycles += indirect_y(ptr,2) + 3 + 2;
+  uint8_t b = mem_->read_byte(ptr + 1);        /* LDA ($22),Y STA $66 */
+  SET_ZP(0x66,b);
+  SET_ZP(0x62,b | 0x80);                       /* ORA #$80 STA $62 DEY */
+  s.cycles += indirect_y(ptr,1) + 3 + 2 + 3 + 2;
+  s.a = mem_->read_byte(ptr); NZ(s.a);         /* LDA ($22),Y STA $61 */
+  SET_ZP(0x61,s.a);
+  s.cycles += indirect_y(ptr,0) + 3;
+  s.y = 0;
+  SET_ZP(0x70,s.y); s.cycles += 3;             /* STY $70 */
+}
+
+// screen editor ///////////////////////////////////////////////////////////
+
+/**
+ * @brief line move $E9D2, 40 characters and colors from ($AC)/($AE)
+ * to ($D1)/($F3), used for every line of a scroll
+ */
+void Natives::movlin(State &s)
+{
+  s.cycles += 2;                               /* LDY #$27 */
+  for(int y=0x27 ; y >= 0 ; y--)
+  {
+    /* the pointers are read every time, a line may be moved over them */
+    uint16_t src = ZP(0xac) | (ZP(0xad) << 8);
+    s.a = mem_->read_byte(src + y);            /* LDA ($AC),Y */
+    mem_->write_byte((ZP(0xd1) | (ZP(0xd2) << 8)) + y,s.a);  /* STA ($D1),Y */
+    uint16_t src_color = ZP(0xae) | (ZP(0xaf) << 8);
+    s.a = mem_->read_byte(src_color + y);      /* LDA ($AE),Y */
+    mem_->write_byte((ZP(0xf3) | (ZP(0xf4) << 8)) + y,s.a);  /* STA ($F3),Y */
+    s.cycles += indirect_y(src,y) + 6 + indirect_y(src_color,y) + 6;
+    s.cycles += 2 + (y ? 3 : 2);               /* DEY, BPL $E9D4 */
+  }
+  s.y = 0xff; NZ(s.y);
+}
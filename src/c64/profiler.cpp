@@ -0,0 +1,329 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <c64/profiler.h>
+#include <lib/stdio.h>
+#include <lib/stdlib.h>
+
+using namespace myos::filesystem;
+
+// ctor  /////////////////////////////////////////////////////////////////////
+
+Profiler::Profiler()
+{
+  arena_ = 0;
+  mode_ = kOff;
+  pc_cycles_ = pc_count_ = 0;
+  stack_ = 0;
+  edges_ = 0;
+  last_sample_ = 0;
+  clear();
+}
+
+/**
+ * @brief switches mode, the tables are allocated on first use
+ */
+void Profiler::mode(kMode m, unsigned int now)
+{
+  if(m != kOff && pc_cycles_ == 0)
+  {
+    pc_cycles_ = new(arena_) uint32_t[0x10000];
+    pc_count_  = new(arena_) uint32_t[0x10000];
+    stack_     = new(arena_) Frame[kMaxDepth];
+    edges_     = new(arena_) Edge[kMaxEdges];
+    clear();
+  }
+  /* frames do not survive a mode change, they could not be closed */
+  depth_ = 0;
+  irq_frames_ = nmi_frames_ = 0;
+  last_sample_ = now;
+  mode_ = m;
+}
+
+void Profiler::clear()
+{
+  if(pc_cycles_ != 0)
+  {
+    for(int i=0 ; i < 0x10000 ; i++)
+      pc_cycles_[i] = pc_count_[i] = 0;
+    for(unsigned int i=0 ; i < kMaxEdges ; i++)
+      edges_[i].calls = 0;
+  }
+  depth_ = 0;
+  edge_count_ = 0;
+  irq_frames_ = nmi_frames_ = 0;
+  total_ = irq_cycles_ = nmi_cycles_ = 0;
+}
+
+// recording /////////////////////////////////////////////////////////////////
+
+/**
+ * @brief sampling mode, charges the cycles since the last sample to pc
+ */
+void Profiler::sample(uint16_t pc, unsigned int now)
+{
+  unsigned int cycles = now - last_sample_;
+  last_sample_ = now;
+  pc_cycles_[pc] += cycles;
+  pc_count_[pc]++;
+  total_ += cycles;
+}
+
+/**
+ * @brief exact mode, called after every instruction
+ *
+ * sp and next_pc are the values after the instruction ran.
+ */
+void Profiler::instruction(uint16_t pc, uint8_t op, unsigned int cycles,
+                           uint8_t sp, uint16_t next_pc, unsigned int now)
+{
+  pc_cycles_[pc] += cycles;
+  pc_count_[pc]++;
+  total_ += cycles;
+  if(nmi_frames_)
+    nmi_cycles_ += cycles;
+  else if(irq_frames_)
+    irq_cycles_ += cycles;
+  switch(op)
+  {
+  /* JSR */
+  case 0x20:
+    push(next_pc, sp, kCall, now - cycles);
+    break;
+  /* RTS, RTI */
+  case 0x60:
+  case 0x40:
+    unwind(sp, now);
+    break;
+  }
+}
+
+/**
+ * @brief exact mode, an interrupt was taken
+ */
+void Profiler::interrupt(uint16_t handler, uint8_t sp, bool nmi,
+                         unsigned int cycles, unsigned int now)
+{
+  if(mode_ != kExact)
+    return;
+  total_ += cycles;
+  if(nmi)
+    nmi_cycles_ += cycles;
+  else
+    irq_cycles_ += cycles;
+  push(handler, sp, nmi ? kNmi : kIrq, now - cycles);
+}
+
+void Profiler::push(uint16_t callee, uint8_t sp, kFrameKind kind, unsigned int now)
+{
+  /* anything deeper is not tracked, unwind() copes with it */
+  if(depth_ == kMaxDepth)
+    return;
+  Frame &f = stack_[depth_];
+  f.caller = function();
+  f.callee = callee;
+  f.sp = sp;
+  f.kind = kind;
+  f.start = now;
+  depth_++;
+  if(kind == kIrq) irq_frames_++;
+  if(kind == kNmi) nmi_frames_++;
+}
+
+/**
+ * @brief closes the frames whose return address was pulled
+ *
+ * A frame is gone once the stack pointer moved above the one it
+ * was entered with.
+ */
+void Profiler::unwind(uint8_t sp, unsigned int now)
+{
+  while(depth_)
+  {
+    Frame &f = stack_[depth_-1];
+    uint8_t above = sp - f.sp;
+    if(above == 0 || above >= 0x80)
+      break;
+    Edge *e = edge(f.caller,f.callee);
+    if(e != 0)
+    {
+      e->calls++;
+      e->cycles += now - f.start;
+    }
+    if(f.kind == kIrq) irq_frames_--;
+    if(f.kind == kNmi) nmi_frames_--;
+    depth_--;
+  }
+}
+
+/**
+ * @brief caller/callee pair, open addressing, null once the table is full
+ */
+Profiler::Edge *Profiler::edge(uint16_t caller, uint16_t callee)
+{
+  unsigned int h = ((caller * 31) ^ callee) & (kMaxEdges - 1);
+  for(unsigned int i=0 ; i < kMaxEdges ; i++)
+  {
+    Edge *e = &edges_[(h + i) & (kMaxEdges - 1)];
+    if(e->calls == 0 || (e->caller == caller && e->callee == callee))
+    {
+      if(e->calls == 0)
+      {
+        /* keep a slot free so lookups terminate */
+        if(edge_count_ == kMaxEdges - 1)
+          return 0;
+        edge_count_++;
+        e->caller = caller;
+        e->callee = callee;
+        e->cycles = 0;
+      }
+      return e;
+    }
+  }
+  return 0;
+}
+
+// results ///////////////////////////////////////////////////////////////////
+
+static uint32_t percent(uint32_t part, uint32_t total)
+{
+  if(total < 100)
+    return total ? part * 100 / total : 0;
+  return part / (total / 100);
+}
+
+/**
+ * @brief prints totals, the busiest pcs and call pairs
+ */
+void Profiler::report(unsigned int lines)
+{
+  if(pc_cycles_ == 0)
+  {
+    printf("\nprofiler off");
+    return;
+  }
+  if(lines > 16)
+    lines = 16;
+  printf("\nprofiler %s, %u cycles", mode_ == kExact ? "exact" :
+         mode_ == kSample ? "sampling" : "off", total_);
+  if(mode_ != kSample)
+    printf(", irq %u%% nmi %u%%", percent(irq_cycles_,total_), percent(nmi_cycles_,total_));
+  /* top pcs by cycles */
+  uint16_t top[16];
+  unsigned int n = 0;
+  for(uint32_t pc=0 ; pc < 0x10000 ; pc++)
+  {
+    if(pc_cycles_[pc] == 0)
+      continue;
+    unsigned int i = n < lines ? n++ : lines;
+    if(i == lines && pc_cycles_[pc] <= pc_cycles_[top[lines-1]])
+      continue;
+    if(i == lines)
+      i--;
+    while(i > 0 && pc_cycles_[top[i-1]] < pc_cycles_[pc])
+    {
+      top[i] = top[i-1];
+      i--;
+    }
+    top[i] = pc;
+  }
+  printf("\n PC CYCLES %% %s", mode_ == kSample ? "SAMPLES" : "COUNT");
+  for(unsigned int i=0 ; i < n ; i++)
+    printf("\n %04X %u %u%% %u", top[i], pc_cycles_[top[i]],
+           percent(pc_cycles_[top[i]],total_), pc_count_[top[i]]);
+  if(edge_count_ == 0)
+    return;
+  /* top call pairs by inclusive cycles */
+  Edge *etop[16];
+  n = 0;
+  for(unsigned int k=0 ; k < kMaxEdges ; k++)
+  {
+    Edge *e = &edges_[k];
+    if(e->calls == 0)
+      continue;
+    unsigned int i = n < lines ? n++ : lines;
+    if(i == lines && e->cycles <= etop[lines-1]->cycles)
+      continue;
+    if(i == lines)
+      i--;
+    while(i > 0 && etop[i-1]->cycles < e->cycles)
+    {
+      etop[i] = etop[i-1];
+      i--;
+    }
+    etop[i] = e;
+  }
+  printf("\n FROM TO CYCLES CALLS");
+  for(unsigned int i=0 ; i < n ; i++)
+    printf("\n %04X %04X %u %u", etop[i]->caller, etop[i]->callee,
+           etop[i]->cycles, etop[i]->calls);
+}
+
+/**
+ * @brief writes the histogram and call graph as text
+ *
+ * One "P pc cycles count" line per pc that ran, one
+ * "C caller callee cycles calls" line per call pair and a final
+ * "T total irq nmi" line, all numbers in hex. Caller 0000 is
+ * code outside any tracked call.
+ */
+int Profiler::save(Fat32 *fs, uint8_t *filename)
+{
+  if(pc_cycles_ == 0)
+    return FILE_STATUS_OK;
+  if(fs->GetFileSize(filename) != 0)
+    fs->DeleteFile(filename);
+  int fstatus = fs->OpenFile(0,filename,FILEACCESSMODE_CREATE);
+  if(fstatus != FILE_STATUS_OK)
+    return fstatus;
+  char line[40];
+  for(uint32_t pc=0 ; pc < 0x10000 && fstatus == FILE_STATUS_OK ; pc++)
+  {
+    if(pc_count_[pc] == 0)
+      continue;
+    char *p = line;
+    *p++ = 'P'; *p++ = ' ';
+    p = utoh(pc,p,4); *p++ = ' ';
+    p = utoh(pc_cycles_[pc],p,8); *p++ = ' ';
+    p = utoh(pc_count_[pc],p,8); *p++ = '\n';
+    fstatus = fs->WriteFileBlock(0,(uint8_t*)line,p - line);
+  }
+  for(unsigned int k=0 ; k < kMaxEdges && fstatus == FILE_STATUS_OK ; k++)
+  {
+    Edge *e = &edges_[k];
+    if(e->calls == 0)
+      continue;
+    char *p = line;
+    *p++ = 'C'; *p++ = ' ';
+    p = utoh(e->caller,p,4); *p++ = ' ';
+    p = utoh(e->callee,p,4); *p++ = ' ';
+    p = utoh(e->cycles,p,8); *p++ = ' ';
+    p = utoh(e->calls,p,8); *p++ = '\n';
+    fstatus = fs->WriteFileBlock(0,(uint8_t*)line,p - line);
+  }
+  if(fstatus == FILE_STATUS_OK)
+  {
+    char *p = line;
+    *p++ = 'T'; *p++ = ' ';
+    p = utoh(total_,p,8); *p++ = ' ';
+    p = utoh(irq_cycles_,p,8); *p++ = ' ';
+    p = utoh(nmi_cycles_,p,8); *p++ = '\n';
+    fstatus = fs->WriteFileBlock(0,(uint8_t*)line,p - line);
+  }
+  fs->CloseFile(0);
+  return fstatus;
+}
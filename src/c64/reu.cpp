@@ -0,0 +1,299 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <c64/reu.h>
+#include <lib/string.h>
+
+Reu::Reu()
+{
+  cpu_ = 0;
+  mem_ = 0;
+  arena_ = 0;
+  ram_ = 0;
+  size_ = 0;
+  status_ = 0;
+  command_ = kCommandNoFF00;
+  c64_addr_ = c64_shadow_ = 0;
+  reu_addr_ = reu_shadow_ = 0;
+  length_ = length_shadow_ = 0xffff;
+  imr_ = 0;
+  acr_ = 0;
+  busy_ = false;
+}
+
+Reu::~Reu()
+{
+}
+
+/**
+ * @brief plugs in banks of 64KB, a power of two up to kMaxBanks
+ *
+ * 2 banks is a 1700, 4 a 1764 and 8 a 1750. The RAM comes from
+ * the machine's arena and goes away with it.
+ */
+bool Reu::attach(unsigned int banks)
+{
+  if(banks < 2 || banks > kMaxBanks || (banks & (banks - 1)) != 0)
+    return false;
+  ram_ = new(arena_) uint8_t[banks * 0x10000]();
+  if(ram_ == 0)
+    return false;
+  size_ = banks * 0x10000;
+  reu_addr_ &= size_ - 1;
+  reu_shadow_ &= size_ - 1;
+  return true;
+}
+
+// registers ///////////////////////////////////////////////////////////////
+
+/**
+ * @brief reads a register, the status bits 5-7 clear on read
+ *
+ * Bank bits past the installed RAM and the unused bits of the
+ * interrupt mask and address control read as 1.
+ */
+uint8_t Reu::read_register(uint8_t r)
+{
+  uint8_t retval = 0xff;
+  switch(r & kRegisterMask)
+  {
+  case kStatus:
+    retval = status_ | (size_ > 0x20000 ? kStatusSize : 0);
+    status_ &= ~(kStatusIrq|kStatusEndOfBlock|kStatusFault);
+    update_irq_line();
+    break;
+  case kCommand:
+    retval = command_;
+    break;
+  case kC64AddrLo:
+    retval = c64_addr_ & 0xff;
+    break;
+  case kC64AddrHi:
+    retval = c64_addr_ >> 8;
+    break;
+  case kReuAddrLo:
+    retval = reu_addr_ & 0xff;
+    break;
+  case kReuAddrHi:
+    retval = (reu_addr_ >> 8) & 0xff;
+    break;
+  case kReuBank:
+    retval = (reu_addr_ >> 16) | (~((size_ - 1) >> 16) & 0xff);
+    break;
+  case kLengthLo:
+    retval = length_ & 0xff;
+    break;
+  case kLengthHi:
+    retval = length_ >> 8;
+    break;
+  case kInterruptMask:
+    retval = imr_ | 0x1f;
+    break;
+  case kAddrControl:
+    retval = acr_ | 0x3f;
+    break;
+  }
+  return retval;
+}
+
+/**
+ * @brief writes a register, ignored while a transfer is running
+ */
+void Reu::write_register(uint8_t r, uint8_t v)
+{
+  if(busy_)
+    return;
+  switch(r & kRegisterMask)
+  {
+  case kCommand:
+    command_ = v;
+    if(!(v & kCommandExecute))
+      mem_->watch_reu_trigger(false);
+    else if(v & kCommandNoFF00)
+      execute();
+    else
+      mem_->watch_reu_trigger(true);
+    break;
+  case kC64AddrLo:
+    c64_addr_ = c64_shadow_ = (c64_shadow_ & 0xff00) | v;
+    break;
+  case kC64AddrHi:
+    c64_addr_ = c64_shadow_ = (c64_shadow_ & 0x00ff) | (v << 8);
+    break;
+  case kReuAddrLo:
+    reu_addr_ = reu_shadow_ = (reu_shadow_ & 0xffff00) | v;
+    break;
+  case kReuAddrHi:
+    reu_addr_ = reu_shadow_ = (reu_shadow_ & 0xff00ff) | (v << 8);
+    break;
+  case kReuBank:
+    reu_shadow_ = ((reu_shadow_ & 0x00ffff) | (v << 16)) & (size_ - 1);
+    reu_addr_ = reu_shadow_;
+    break;
+  case kLengthLo:
+    length_ = length_shadow_ = (length_shadow_ & 0xff00) | v;
+    break;
+  case kLengthHi:
+    length_ = length_shadow_ = (length_shadow_ & 0x00ff) | (v << 8);
+    break;
+  case kInterruptMask:
+    imr_ = v & 0xe0;
+    update_irq_line();
+    break;
+  case kAddrControl:
+    acr_ = v & 0xc0;
+    break;
+  }
+}
+
+/**
+ * @brief a write to $FF00 while a command waits for it
+ */
+void Reu::trigger()
+{
+  if(busy_)
+    return;
+  mem_->watch_reu_trigger(false);
+  if(command_ & kCommandExecute)
+    execute();
+}
+
+/**
+ * @brief raises the irq for the enabled end of block and fault bits
+ */
+void Reu::update_irq_line()
+{
+  if((imr_ & kImrEnable) && (status_ & imr_ & (kStatusEndOfBlock|kStatusFault)))
+    status_ |= kStatusIrq;
+  cpu_->irq_line(Cpu::kIrqSourceReu, (status_ & kStatusIrq) != 0);
+}
+
+// dma /////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief runs the transfer in the command register
+ *
+ * The c64 side is seen through the current bank layout like the
+ * cpu sees it, ROM is read and written through to RAM. Between
+ * fixed addresses every byte goes through read_byte()/write_byte(),
+ * otherwise a run within one page uses that page's base pointers
+ * directly unless it is null (I/O, recompiled code). A verify stops
+ * after the first byte that differs.
+ */
+void Reu::execute()
+{
+  uint8_t type = command_ & kCommandType;
+  uint32_t len = length_ ? length_ : 0x10000;
+  uint32_t mask = size_ - 1;
+  uint16_t c64 = c64_addr_;
+  uint32_t reu = reu_addr_ & mask;
+  bool fix_c64 = (acr_ & kAcrFixC64) != 0;
+  bool fix_reu = (acr_ & kAcrFixReu) != 0;
+  bool fault = false;
+  uint32_t done = 0;
+  busy_ = true;
+  while(done < len && !fault)
+  {
+    uint32_t n = 1;
+    uint8_t *rd = 0;
+    uint8_t *wr = 0;
+    if(!fix_c64 && !fix_reu)
+    {
+      n = len - done;
+      if(n > 0x100 - (c64 & 0xff))
+        n = 0x100 - (c64 & 0xff);
+      if(n > size_ - reu)
+        n = size_ - reu;
+      rd = mem_->page_base(c64 >> 8);
+      wr = mem_->write_base(c64 >> 8);
+    }
+    uint8_t *r = ram_ + reu;
+    switch(type)
+    {
+    case kStash:
+      if(rd != 0)
+        memcpy(r,rd + c64,n);
+      else
+        for(uint32_t i=0 ; i < n ; i++)
+          r[i] = mem_->read_byte(c64 + i);
+      break;
+    case kFetch:
+      if(wr != 0)
+        memcpy(wr + c64,r,n);
+      else
+        for(uint32_t i=0 ; i < n ; i++)
+          mem_->write_byte(c64 + i,r[i]);
+      break;
+    case kSwap:
+      for(uint32_t i=0 ; i < n ; i++)
+      {
+        uint8_t v;
+        if(rd != 0 && wr != 0)
+        {
+          v = rd[c64 + i];
+          wr[c64 + i] = r[i];
+        }
+        else
+        {
+          v = mem_->read_byte(c64 + i);
+          mem_->write_byte(c64 + i,r[i]);
+        }
+        r[i] = v;
+      }
+      break;
+    case kVerify:
+      for(uint32_t i=0 ; i < n ; i++)
+      {
+        uint8_t v = rd != 0 ? rd[c64 + i] : mem_->read_byte(c64 + i);
+        if(v != r[i])
+        {
+          n = i + 1;
+          fault = true;
+          break;
+        }
+      }
+      break;
+    }
+    done += n;
+    if(!fix_c64)
+      c64 += n;
+    if(!fix_reu)
+      reu = (reu + n) & mask;
+  }
+  busy_ = false;
+  /* the cpu is off the bus for the whole transfer */
+  cpu_->stall(type == kSwap ? done * 2 : done);
+  if(done == len)
+    status_ |= kStatusEndOfBlock;
+  if(fault)
+    status_ |= kStatusFault;
+  if(command_ & kCommandAutoload)
+  {
+    c64_addr_ = c64_shadow_;
+    reu_addr_ = reu_shadow_;
+    length_ = length_shadow_;
+  }
+  else
+  {
+    c64_addr_ = c64;
+    reu_addr_ = reu;
+    length_ = done == len ? 1 : len - done;
+  }
+  command_ = (command_ & ~kCommandExecute) | kCommandNoFF00;
+  update_irq_line();
+}
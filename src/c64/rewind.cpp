@@ -0,0 +1,135 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <c64/rewind.h>
+#include <c64/memory.h>
+#include <lib/stdio.h>
+
+// ctor  /////////////////////////////////////////////////////////////////////
+
+Rewind::Rewind()
+{
+  arena_ = 0;
+  buf_ = base_ = 0;
+  failed_ = false;
+  first_ = count_ = 0;
+  write_ = 0;
+  last_frame_ = 0;
+}
+
+// ring //////////////////////////////////////////////////////////////////////
+
+void Rewind::drop_oldest()
+{
+  first_ = (first_ + 1) % kMaxEntries;
+  count_--;
+}
+
+/**
+ * @brief room for a record of up to kMaxRecord bytes, null if
+ * rewinding is off
+ *
+ * Without a wrap the records fill [oldest, write_), after one the
+ * free space is [write_, oldest). A record never straddles the end,
+ * the tail of the buffer is left unused instead.
+ */
+uint8_t *Rewind::reserve()
+{
+  if(buf_ == 0)
+  {
+    if(failed_ || arena_ == 0)
+      return 0;
+    buf_ = new(arena_) uint8_t[kBufferSize];
+    base_ = new(arena_) uint8_t[Memory::kMemSize]();
+    if(buf_ == 0 || base_ == 0)
+    {
+      failed_ = true;
+      buf_ = 0;
+      return 0;
+    }
+  }
+  if(count_ == kMaxEntries)
+    drop_oldest();
+  while(count_ > 0)
+  {
+    uint32_t oldest = entries_[first_].offset;
+    if(write_ > oldest)
+    {
+      if(write_ + kMaxRecord <= kBufferSize)
+        break;
+      write_ = 0;
+      continue;
+    }
+    if(write_ + kMaxRecord <= oldest)
+      break;
+    drop_oldest();
+  }
+  if(count_ == 0)
+    write_ = 0;
+  return buf_ + write_;
+}
+
+/**
+ * @brief keeps the record written to the last reserve()
+ */
+void Rewind::commit(uint32_t length, unsigned int frame)
+{
+  Entry &e = entries_[(first_ + count_) % kMaxEntries];
+  e.offset = write_;
+  e.length = length;
+  e.frame = frame;
+  count_++;
+  write_ += (length + 3) & ~3;
+  last_frame_ = frame;
+}
+
+uint8_t *Rewind::newest(uint32_t *length)
+{
+  if(count_ == 0)
+    return 0;
+  Entry &e = entries_[(first_ + count_ - 1) % kMaxEntries];
+  *length = e.length;
+  return buf_ + e.offset;
+}
+
+void Rewind::drop_newest()
+{
+  if(count_ == 0)
+    return;
+  count_--;
+  write_ = entries_[(first_ + count_) % kMaxEntries].offset;
+}
+
+// results ///////////////////////////////////////////////////////////////////
+
+void Rewind::report()
+{
+  if(buf_ == 0)
+  {
+    printf("\nrewind %s", failed_ ? "off, no memory" : "empty");
+    return;
+  }
+  uint32_t used = 0;
+  for(unsigned int i=0 ; i < count_ ; i++)
+    used += entries_[(first_ + i) % kMaxEntries].length;
+  unsigned int span = 0;
+  if(count_ > 0)
+    span = entries_[(first_ + count_ - 1) % kMaxEntries].frame - entries_[first_].frame;
+  printf("\nrewind %u records, %u s, %u of %u KB", count_, span / 50,
+         used / 1024, kBufferSize / 1024);
+}
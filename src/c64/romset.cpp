@@ -0,0 +1,328 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <c64/romset.h>
+#include <c64/c64rom.h>
+#include <c64/memory.h>
+#include <c64/cpu.h>
+#include <c64/io.h>
+#include <c64/natives.h>
+#include <lib/string.h>
+
+using namespace myos::filesystem;
+
+RomSet *RomSet::shared_ = 0;
+
+static const char *kRomFiles[RomSet::kRoms] =
+{
+  "BASIC.ROM", "KERNAL.ROM", "CHAR.ROM"
+};
+
+static const uint32_t kRomSizes[RomSet::kRoms] =
+{
+  RomSet::kBasicSize, RomSet::kKernalSize, RomSet::kCharsSize
+};
+
+static const char *kOptionalFiles[RomSet::kOptionals] =
+{
+  "MICROMON.PRG", "PAKU.PRG"
+};
+
+/**
+ * @brief starts out with the built-in images
+ *
+ * BASIC and the character generator are used in place, only the
+ * KERNAL gets a copy because it is patched.
+ */
+RomSet::RomSet()
+{
+  roms_[kBasic] = (uint8_t *)basicRomC64;
+  roms_[kChars] = (uint8_t *)charRomC64;
+  roms_[kKernal] = new uint8_t[kKernalSize];
+  memcpy(roms_[kKernal],kernalRomC64,kKernalSize);
+  kernal_skipped_ = 0;
+  patch_kernal();
+  for(int r=0 ; r < kRoms ; r++)
+    disk_[r] = false;
+  fs_ = 0;
+  for(int o=0 ; o < kOptionals ; o++)
+  {
+    optionals_[o] = 0;
+    optional_sizes_[o] = 0;
+    optional_tried_[o] = false;
+  }
+}
+
+/**
+ * @brief the set every Memory maps, built-in until load() is called
+ */
+RomSet *RomSet::shared()
+{
+  if(shared_ == 0)
+    shared_ = new RomSet();
+  return shared_;
+}
+
+/**
+ * @brief reads a whole file, null if it is missing or not size bytes
+ */
+uint8_t *RomSet::read_file(const char *name, uint32_t size)
+{
+  if(fs_->GetFileSize((uint8_t *)name) != size)
+    return 0;
+  uint8_t *buf = new uint8_t[size];
+  fs_->ReadFile((uint8_t *)name,buf,size);
+  return buf;
+}
+
+/**
+ * @brief replaces the built-in images with the ones found on fs
+ *
+ * Has to run before any machine is built, they keep pointers to
+ * the images. Returns how many of them came from the disk.
+ */
+int RomSet::load(Fat32 *fs)
+{
+  int found = 0;
+  fs_ = fs;
+  for(int r=0 ; r < kRoms ; r++)
+  {
+    uint8_t *buf = read_file(kRomFiles[r],kRomSizes[r]);
+    if(buf == 0)
+      continue;
+    if(r == kKernal)
+      delete [] roms_[r];
+    roms_[r] = buf;
+    disk_[r] = true;
+    found++;
+  }
+  if(disk_[kKernal])
+    patch_kernal();
+  return found;
+}
+
+/**
+ * @brief a PRG file with its load address, read on the first call
+ *
+ * Returns null when there is no disk or no such file, the answer
+ * is remembered either way.
+ */
+const uint8_t *RomSet::optional(kOptional o, uint32_t *size)
+{
+  if(!optional_tried_[o] && fs_ != 0)
+  {
+    optional_tried_[o] = true;
+    uint32_t sz = fs_->GetFileSize((uint8_t *)kOptionalFiles[o]);
+    if(sz > 2 && sz <= Memory::kMemSize + 2)
+    {
+      optionals_[o] = read_file(kOptionalFiles[o],sz);
+      optional_sizes_[o] = sz;
+    }
+  }
+  *size = optional_sizes_[o];
+  return optionals_[o];
+}
+
+/**
+ * @brief puts the Natives traps in BASIC and the KERNAL
+ *
+ * A routine is only trapped when every byte Natives stands in for,
+ * subroutines included, is the one of the stock image, so a ROM set
+ * read from disk keeps its own code where it differs. The built-in
+ * BASIC is copied first, it is used in place otherwise. Returns how
+ * many routines were trapped.
+ */
+int RomSet::install_natives()
+{
+  static const struct
+  {
+    uint16_t entry, first, last;
+    uint8_t trap;
+  }
+  sites[] = {
+    {Natives::kAddrFmult,  0xba33,0xba8b,Natives::kTrapFmult},
+    {Natives::kAddrFmult,  0xb983,0xb9bb,Natives::kTrapFmult},
+    {Natives::kAddrFdiv,   0xbb25,0xbb89,Natives::kTrapFdiv},
+    {Natives::kAddrConupk, 0xba8c,0xbab6,Natives::kTrapConupk},
+    {Natives::kAddrMovfm,  0xbba2,0xbbc6,Natives::kTrapMovfm},
+    {Natives::kAddrMovlin, 0xe9d2,0xe9df,Natives::kTrapMovlin},
+  };
+  static const unsigned int kSites = sizeof(sites) / sizeof(sites[0]);
+  bool stock[kSites];
+  for(unsigned int i=0 ; i < kSites ; i++)
+  {
+    bool basic = sites[i].first < Memory::kBaseAddrKernal;
+    const uint8_t *rom = basic ? roms_[kBasic] - Memory::kBaseAddrBasic
+                               : roms_[kKernal] - Memory::kBaseAddrKernal;
+    const uint8_t *orig = basic ? basicRomC64 - Memory::kBaseAddrBasic
+                                : kernalRomC64 - Memory::kBaseAddrKernal;
+    stock[i] = memcmp(rom + sites[i].first,orig + sites[i].first,
+                      sites[i].last - sites[i].first + 1) == 0;
+    /* a routine spread over several ranges needs all of them */
+    for(unsigned int j=0 ; j < i ; j++)
+      if(sites[j].entry == sites[i].entry)
+        stock[j] = stock[i] = stock[j] && stock[i];
+  }
+  if(roms_[kBasic] == basicRomC64)
+  {
+    roms_[kBasic] = new uint8_t[kBasicSize];
+    memcpy(roms_[kBasic],basicRomC64,kBasicSize);
+  }
+  int installed = 0;
+  for(unsigned int i=0 ; i < kSites ; i++)
+  {
+    /* the first range of a routine holds its entry */
+    if(!stock[i] || sites[i].first != sites[i].entry)
+      continue;
+    bool basic = sites[i].first < Memory::kBaseAddrKernal;
+    uint8_t *rom = basic ? roms_[kBasic] - Memory::kBaseAddrBasic
+                         : roms_[kKernal] - Memory::kBaseAddrKernal;
+    rom[sites[i].entry] = Cpu::kOpTrap;
+    rom[sites[i].entry + 1] = sites[i].trap;
+    installed++;
+  }
+  return installed;
+}
+
+const char *RomSet::file_name(kRom r)
+{
+  return kRomFiles[r];
+}
+
+/**
+ * @brief true if first to last of the KERNAL are the stock bytes
+ */
+bool RomSet::kernal_stock(uint16_t first, uint16_t last)
+{
+  const uint8_t *rom = roms_[kKernal] - Memory::kBaseAddrKernal;
+  const uint8_t *orig = kernalRomC64 - Memory::kBaseAddrKernal;
+  return memcmp(rom + first,orig + first,last - first + 1) == 0;
+}
+
+/**
+ * @brief PC keyboard layout and the traps for IO::trap()
+ *
+ * Addresses are the ones of the stock KERNAL, rom points at $0000
+ * so they index it directly. A KERNAL.ROM such as JiffyDOS has other
+ * code there, each patch is only made where the bytes it replaces
+ * and the code it calls are stock, kernal_skipped() counts the rest.
+ */
+void RomSet::patch_kernal()
+{
+  uint8_t *rom = roms_[kKernal] - Memory::kBaseAddrKernal;
+  uint16_t hack;
+  kernal_skipped_ = 0;
+  
+  // keyboard modifications for keycode to match PC keyboard
+  if(!kernal_stock(0xEB81+45,0xEB81+50))
+    kernal_skipped_++;
+  else
+  {
+    hack = 0xEB81;	// std keys
+    rom[hack+46] = 0x5B;	// PETSCII for [
+    rom[hack+49] = 0x5D;	// PETSCII for ]
+    rom[hack+50] = 0x27;	// PETSCII for '
+    rom[hack+45] = 0x3B;	// PETSCII for ;
+  }
+  
+  if(!kernal_stock(0xEBC2+19,0xEBC2+59))
+    kernal_skipped_++;
+  else
+  {
+    hack = 0xEBC2;		// shifted keys
+    rom[hack+59] = 0x40;	// PETSCII @ for SHIFT-2
+    rom[hack+19] = 0x5E;	// PETSCII & for SHIFT-6
+    rom[hack+24] = 0x26;	// PETSCII & for SHIFT-7
+    rom[hack+27] = 0x2A;	// PETSCII & for SHIFT-8
+    rom[hack+32] = 0x28;	// PETSCII & for SHIFT-9
+    rom[hack+35] = 0x29;	// PETSCII & for SHIFT-0
+    rom[hack+50] = 0x22;	// PETSCII for "
+    rom[hack+45] = 0x3A;	// PETSCII for :
+    rom[hack+53] = 0x2B;	// PETSCII for +
+  }
+  
+#define DOS_PATCH
+  
+#ifdef DOS_PATCH
+  //kernel hack for ide drive access, it calls the stock messages
+  if(!kernal_stock(0xF4C4,0xF4D4) || !kernal_stock(0xF530,0xF532) ||
+     !kernal_stock(0xF5D2,0xF5D4))
+    kernal_skipped_++;
+  else
+  {
+    hack = 0xF4C4;	// KERNEL LOAD FROM SERIAL BUS (Starts at $F4B8)
+    
+    // Tell FAT32 driver to load a program
+    rom[hack++] = Cpu::kOpTrap; rom[hack++] = IO::kTrapLoad;		// TRAP LOAD
+  
+    // Check the STATUS byte.  Print FILE NOT FOUND if not found
+    rom[hack++] = 0xA5; rom[hack++] = 0x90;				// LDA $90
+    rom[hack++] = 0x4A;							// LSR
+    rom[hack++] = 0x4A;							// LSR
+    rom[hack++] = 0xB0; rom[hack] = 0xF530 - (hack + 1); hack++;	// BCS $F530 <=
+  
+    // Print LOADING
+    rom[hack++] = 0x20; rom[hack++] = 0xD2; rom[hack++] = 0xF5;	// JSR $F5D2
+  
+    // END
+    rom[hack++] = 0x18;							// CLC
+    rom[hack++] = 0xA6; rom[hack++] = 0xAE;				// LDX $AE
+    rom[hack++] = 0xA4; rom[hack++] = 0xAF;				// LDY $AF
+    rom[hack++] = 0x60;							// RTS
+  }
+  
+  if(!kernal_stock(0xF605,0xF608))
+    kernal_skipped_++;
+  else
+  {
+    hack = 0xF605;	// KERNEL SAVE TO SERIAL BUS (Starts at $F4B8)
+    
+    // Tell FAT32 driver to save a program
+    rom[hack++] = Cpu::kOpTrap; rom[hack++] = IO::kTrapSave;		// TRAP SAVE
+  
+    // END
+    rom[hack++] = 0x18;							// CLC
+    rom[hack++] = 0x60;							// RTS
+  }
+  
+  // Serial bus routines, OPEN/CLOSE/CHKIN/CHKOUT/CHRIN/CHROUT on
+  // drive 8 end up here and are served by IO::trap()
+  static const uint16_t serial[][2] = {
+    {0xED09, IO::kTrapTalk},	// TALK
+    {0xED0C, IO::kTrapListen},	// LISTEN
+    {0xEDB9, IO::kTrapSecond},	// SECOND
+    {0xEDC7, IO::kTrapTksa},	// TKSA
+    {0xEDDD, IO::kTrapCiout},	// CIOUT
+    {0xEDEF, IO::kTrapUntlk},	// UNTLK
+    {0xEDFE, IO::kTrapUnlsn},	// UNLSN
+    {0xEE13, IO::kTrapAcptr},	// ACPTR
+  };
+  for(unsigned int i=0; i < sizeof(serial) / sizeof(serial[0]); i++)
+  {
+    hack = serial[i][0];
+    if(!kernal_stock(hack,hack+2))
+    {
+      kernal_skipped_++;
+      continue;
+    }
+    rom[hack++] = Cpu::kOpTrap; rom[hack++] = serial[i][1];		// TRAP nn
+    rom[hack++] = 0x60;							// RTS
+  }
+  
+#endif
+}
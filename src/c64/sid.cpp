@@ -1,8 +1,37 @@
 #include <c64/sid.h>
+#include <c64/snapshot.h>
 
-Sid::Sid()
+/* cycles per envelope step for the 16 attack, decay and release rates */
+const uint16_t Sid::kRatePeriods[16] =
 {
+  9, 32, 63, 95, 149, 220, 267, 313,
+  392, 977, 1954, 3126, 3907, 11720, 19532, 31251
+};
 
+Sid::Sid()
+{
+  speaker_ = 0;
+  audio_ = 0;
+  cpu_ = 0;
+  volume = freqLo = freqHi = 0;
+  frequency = 0;
+  for(int i=0 ; i < 0x20 ; i++)
+    regs_[i] = 0;
+  for(int n=0 ; n < 3 ; n++)
+  {
+    voices_[n].acc = 0;
+    voices_[n].noise = 0x7ffff8;
+    voices_[n].rate_counter = 0;
+    voices_[n].env = 0;
+    voices_[n].env_state = kRelease;
+    voices_[n].exp_counter = 0;
+    voices_[n].gate = false;
+    voices_[n].msb_rose = false;
+  }
+  low_ = band_ = 0;
+  prev_cpu_cycles_ = 0;
+  sample_cycles_ = 0;
+  block_len_ = 0;
 }
 
 Sid::~Sid()
@@ -10,57 +39,291 @@ Sid::~Sid()
 
 }
 
+// DMA register access  //////////////////////////////////////////////////////
+
 void Sid::write_register(uint8_t r, uint8_t v)
 {
+  /* registers are mirrored every 32 bytes */
+  r &= 0x1f;
+  if(r >= 0x19)
+    return;
+  regs_[r] = v;
+  /* control registers, the gate bit starts attack or release */
+  if(r == 0x04 || r == 0x0b || r == 0x12)
+  {
+    Voice &voice = voices_[r / 7];
+    bool gate = (v & 0x01) != 0;
+    if(gate && !voice.gate)
+      voice.env_state = kAttack;
+    else if(!gate && voice.gate)
+      voice.env_state = kRelease;
+    voice.gate = gate;
+    /* test bit holds the oscillator and noise generator in reset */
+    if(v & 0x08)
+    {
+      voice.acc = 0;
+      voice.noise = 0x7ffff8;
+    }
+  }
+  if(audio_ != 0)
+    return;
+  /* no audio device, approximate with the pc speaker */
   switch(r)
   {
     case 0x00:
+    case 0x07:
+    case 0x0e:
     {
       freqLo = v;
       play();
       break;
     }
     case 0x01:
+    case 0x08:
+    case 0x0f:
     {
       freqHi = v;
       play();
       break;
     }
-    case 0x07:
-    {
-      freqLo = v;
-      play();
-      break;
-    }
-    case 0x08:
+    case 0x18:	// volume
     {
-      freqHi = v;
+      volume = v;
       play();
       break;
     }
-    case 0x0e:
+  }
+}
+
+uint8_t Sid::read_register(uint8_t r)
+{
+  uint8_t retval = 0;
+  switch(r & 0x1f)
+  {
+  /* paddles, none connected */
+  case 0x19:
+  case 0x1a:
+    retval = 0xff;
+    break;
+  /* oscillator 3 output */
+  case 0x1b:
+    retval = waveform(2) >> 4;
+    break;
+  /* envelope 3 output */
+  case 0x1c:
+    retval = voices_[2].env;
+    break;
+  }
+  return retval;
+}
+
+// synthesis /////////////////////////////////////////////////////////////////
+
+/**
+ * @brief advances oscillator n by one sample
+ *
+ * The accumulator keeps 8 fraction bits so the 20.5 cycles per
+ * sample add up exactly, the noise register is clocked on each
+ * rising edge of accumulator bit 19.
+ */
+void Sid::clock_voice(int n)
+{
+  Voice &v = voices_[n];
+  uint8_t ctrl = regs_[n*7 + 4];
+  v.msb_rose = false;
+  if(ctrl & 0x08)
+    return;
+  uint32_t freq = regs_[n*7] | (regs_[n*7 + 1] << 8);
+  uint32_t prev = v.acc;
+  uint32_t delta = freq * kSampleCycles;
+  v.acc += delta;
+  v.msb_rose = !(prev & 0x80000000) && (v.acc & 0x80000000);
+  uint32_t phase = (prev >> 8) + 0x80000;
+  uint32_t clocks = ((phase + (delta >> 8)) >> 20) - (phase >> 20);
+  while(clocks--)
+  {
+    uint32_t bit = ((v.noise >> 22) ^ (v.noise >> 17)) & 1;
+    v.noise = ((v.noise << 1) | bit) & 0x7fffff;
+  }
+  clock_envelope(n);
+}
+
+/**
+ * @brief advances the envelope of voice n by one sample
+ *
+ * Attack is linear, decay and release step slower as the level
+ * drops to approximate the exponential curve of the chip.
+ */
+void Sid::clock_envelope(int n)
+{
+  Voice &v = voices_[n];
+  uint8_t ad = regs_[n*7 + 5];
+  uint8_t sr = regs_[n*7 + 6];
+  uint8_t rate;
+  if(v.env_state == kAttack)
+    rate = ad >> 4;
+  else if(v.env_state == kDecaySustain)
+    rate = ad & 0x0f;
+  else
+    rate = sr & 0x0f;
+  uint32_t period = kRatePeriods[rate] << 8;
+  v.rate_counter += kSampleCycles;
+  while(v.rate_counter >= period)
+  {
+    v.rate_counter -= period;
+    if(v.env_state == kAttack)
     {
-      freqLo = v;
-      play();
-      break;
+      if(v.env < 0xff)
+        v.env++;
+      if(v.env == 0xff)
+        v.env_state = kDecaySustain;
+      continue;
     }
-    case 0x0f:
+    uint8_t divider;
+    if(v.env >= 93)      divider = 1;
+    else if(v.env >= 54) divider = 2;
+    else if(v.env >= 26) divider = 4;
+    else if(v.env >= 14) divider = 8;
+    else if(v.env >= 6)  divider = 16;
+    else                 divider = 30;
+    if(++v.exp_counter < divider)
+      continue;
+    v.exp_counter = 0;
+    if(v.env_state == kDecaySustain)
     {
-      freqHi = v;
-      play();
-      break;
+      if(v.env > (sr >> 4) * 17)
+        v.env--;
     }
-    case 0x18:	// volume
+    else if(v.env > 0)
+      v.env--;
+  }
+}
+
+/**
+ * @brief 12-bit waveform output of voice n
+ *
+ * Selecting several waveforms ANDs them together, which is close
+ * to what the chip does for most combinations.
+ */
+uint16_t Sid::waveform(int n)
+{
+  Voice &v = voices_[n];
+  uint8_t ctrl = regs_[n*7 + 4];
+  uint32_t out = 0xfff;
+  if(!(ctrl & 0xf0))
+    return 0x800;
+  /* triangle, ring modulation swaps in the msb of the source voice */
+  if(ctrl & 0x10)
+  {
+    uint32_t msb = v.acc & 0x80000000;
+    if(ctrl & 0x04)
+      msb ^= voices_[(n + 2) % 3].acc & 0x80000000;
+    out &= ((msb ? ~v.acc : v.acc) >> 19) & 0xfff;
+  }
+  /* sawtooth */
+  if(ctrl & 0x20)
+    out &= v.acc >> 20;
+  /* pulse */
+  if(ctrl & 0x40)
+  {
+    uint32_t pw = regs_[n*7 + 2] | ((regs_[n*7 + 3] & 0x0f) << 8);
+    if(!(ctrl & 0x08) && (v.acc >> 20) < pw)
+      out = 0;
+  }
+  /* noise, eight of the shift register bits */
+  if(ctrl & 0x80)
+  {
+    uint32_t r = v.noise;
+    out &= ((r >> 11) & 0x800) | ((r >> 10) & 0x400) | ((r >> 7) & 0x200) |
+           ((r >> 5) & 0x100) | ((r >> 4) & 0x080) | ((r >> 1) & 0x040) |
+           ((r << 1) & 0x020) | ((r << 2) & 0x010);
+  }
+  return out;
+}
+
+/**
+ * @brief renders one output sample
+ *
+ * Voices routed to the filter go through a state variable filter
+ * in 16.16 fixed point, a Chamberlin approximation of the 6581
+ * with the cutoff mapped linearly to roughly 30Hz-6kHz. The mixer
+ * DC offset makes writes to the volume register audible, which is
+ * how samples are played back on the real chip.
+ */
+int16_t Sid::render_sample()
+{
+  for(int n=0 ; n < 3 ; n++)
+    clock_voice(n);
+  /* hard sync */
+  for(int n=0 ; n < 3 ; n++)
+  {
+    if((regs_[n*7 + 4] & 0x02) && voices_[(n + 2) % 3].msb_rose)
+      voices_[n].acc = 0;
+  }
+  uint8_t routing = regs_[0x17];
+  uint8_t mode = regs_[0x18];
+  int32_t direct = 0;
+  int32_t filtered = 0;
+  for(int n=0 ; n < 3 ; n++)
+  {
+    int32_t o = ((int32_t)waveform(n) - 0x800) * voices_[n].env;
+    if(routing & (1 << n))
+      filtered += o;
+    else if(n != 2 || !(mode & 0x80))
+      direct += o;
+  }
+  uint32_t fc = (regs_[0x15] & 0x07) | (regs_[0x16] << 3);
+  int32_t f = 257 + fc * 25;
+  int32_t q = 92682 - (routing >> 4) * 4800;
+  low_ += (int32_t)(((int64_t)f * band_) >> 16);
+  int32_t high = filtered - low_ - (int32_t)(((int64_t)q * band_) >> 16);
+  band_ += (int32_t)(((int64_t)f * high) >> 16);
+  int32_t mix = direct + kMixerDc;
+  if(mode & 0x10)
+    mix += low_;
+  if(mode & 0x20)
+    mix += band_;
+  if(mode & 0x40)
+    mix += high;
+  int32_t out = (mix * (mode & 0x0f)) >> 10;
+  if(out > 32767)
+    out = 32767;
+  else if(out < -32768)
+    out = -32768;
+  return out;
+}
+
+/**
+ * @brief renders the samples due since the last call
+ *
+ * Full blocks go to the audio driver. After long pauses (monitor,
+ * disk access) at most kMaxCatchUp cycles are rendered.
+ */
+bool Sid::emulate()
+{
+  unsigned int elapsed = cpu_->cycles() - prev_cpu_cycles_;
+  prev_cpu_cycles_ = cpu_->cycles();
+  if(elapsed > kMaxCatchUp)
+    elapsed = kMaxCatchUp;
+  sample_cycles_ += elapsed << 8;
+  while(sample_cycles_ >= kSampleCycles)
+  {
+    sample_cycles_ -= kSampleCycles;
+    block_[block_len_++] = render_sample();
+    if(block_len_ == kBlockSamples)
     {
-      volume = v;
-      play();
-      break;
+      if(audio_ != 0)
+        audio_->Write(block_, block_len_);
+      block_len_ = 0;
     }
   }
+  return true;
 }
 
 void Sid::play()
 {
+  if(speaker_ == 0 || audio_ != 0)
+    return;
   if(volume == 0)
     speaker_->Nosound();
   else
@@ -176,3 +439,24 @@ if (v== 0xF467) return 3729310;
   
 return 0;
 }
+
+/**
+ * @brief saves or restores registers, voices and filter
+ */
+void Sid::snapshot(Snapshot *s)
+{
+  s->value(volume);
+  s->value(freqLo);
+  s->value(freqHi);
+  s->bytes(regs_,sizeof(regs_));
+  s->bytes(voices_,sizeof(voices_));
+  s->value(low_);
+  s->value(band_);
+  s->value(sample_cycles_);
+  if(!s->saving())
+  {
+    prev_cpu_cycles_ = cpu_->cycles();
+    block_len_ = 0;
+    play();
+  }
+}
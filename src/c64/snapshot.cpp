@@ -0,0 +1,47 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <c64/snapshot.h>
+#include <lib/string.h>
+
+const char Snapshot::kMagic[8] = {'O','S','6','4','S','N','A','P'};
+
+Snapshot::Snapshot(uint8_t *buf, uint32_t size, bool saving)
+{
+  buf_ = buf;
+  size_ = size;
+  pos_ = 0;
+  saving_ = saving;
+  ok_ = true;
+}
+
+/**
+ * @brief copies n bytes to (saving) or from (restoring) the stream
+ */
+void Snapshot::bytes(void *p, uint32_t n)
+{
+  if(!ok_ || n > size_ - pos_)
+  {
+    ok_ = false;
+    return;
+  }
+  if(saving_)
+    memcpy(buf_ + pos_, p, n);
+  else
+    memcpy(p, buf_ + pos_, n);
+  pos_ += n;
+}
@@ -0,0 +1,195 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <c64/tod.h>
+#include <c64/snapshot.h>
+
+extern uint32_t current_milli;
+
+// ctor  /////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief powers up running at 1:00:00.0 AM
+ */
+Tod::Tod()
+{
+  base_ = 60 * 60 * 10;
+  base_milli_ = current_milli;
+  running_ = true;
+  latch_ = 0;
+  latched_ = false;
+  alarm_ = 0;
+  last_ = base_;
+}
+
+// helpers ///////////////////////////////////////////////////////////////////
+
+uint32_t Tod::now()
+{
+  if(!running_)
+    return base_;
+  return (base_ + (current_milli - base_milli_) / 100) % kDay;
+}
+
+static uint8_t to_bcd(uint32_t v)
+{
+  return ((v / 10) << 4) | (v % 10);
+}
+
+static uint32_t from_bcd(uint8_t v)
+{
+  return (v >> 4) * 10 + (v & 0x0f);
+}
+
+/**
+ * @brief register r (0-3) of time t
+ */
+uint8_t Tod::field(uint32_t t, uint8_t r)
+{
+  switch(r)
+  {
+  case 0:
+    return t % 10;
+  case 1:
+    return to_bcd((t / 10) % 60);
+  case 2:
+    return to_bcd((t / 600) % 60);
+  default:
+  {
+    uint32_t h = t / 36000;
+    uint8_t pm = h >= 12 ? 0x80 : 0;
+    h %= 12;
+    return pm | to_bcd(h == 0 ? 12 : h);
+  }
+  }
+}
+
+/**
+ * @brief time t with register r (0-3) replaced by v
+ */
+uint32_t Tod::set_field(uint32_t t, uint8_t r, uint8_t v)
+{
+  uint32_t tenths = t % 10;
+  uint32_t s = (t / 10) % 60;
+  uint32_t m = (t / 600) % 60;
+  uint32_t h = t / 36000;
+  switch(r)
+  {
+  case 0:
+    tenths = v & 0x0f;
+    break;
+  case 1:
+    s = from_bcd(v & 0x7f);
+    break;
+  case 2:
+    m = from_bcd(v & 0x7f);
+    break;
+  default:
+    h = from_bcd(v & 0x1f) % 12 + ((v & 0x80) ? 12 : 0);
+    break;
+  }
+  return ((h * 60 + m) * 60 + s) * 10 % kDay + tenths % 10;
+}
+
+// register access ///////////////////////////////////////////////////////////
+
+uint8_t Tod::read(uint8_t r)
+{
+  uint32_t t = latched_ ? latch_ : now();
+  if(r == 3)
+  {
+    latch_ = t;
+    latched_ = true;
+  }
+  else if(r == 0)
+    latched_ = false;
+  return field(t, r);
+}
+
+void Tod::write(uint8_t r, uint8_t v, bool alarm)
+{
+  if(alarm)
+  {
+    alarm_ = set_field(alarm_, r, v);
+    return;
+  }
+  base_ = set_field(now(), r, v);
+  base_milli_ = current_milli;
+  if(r == 3)
+    running_ = false;
+  else if(r == 0)
+    running_ = true;
+  last_ = base_;
+}
+
+// alarm  ////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief true once when the time passed the alarm since the last call
+ */
+bool Tod::alarm()
+{
+  uint32_t t = now();
+  if(t == last_)
+    return false;
+  uint32_t to_alarm = (alarm_ + kDay - last_) % kDay;
+  uint32_t passed = (t + kDay - last_) % kDay;
+  last_ = t;
+  return to_alarm != 0 && to_alarm <= passed;
+}
+
+/**
+ * @brief approximate cpu cycles until the alarm is due
+ *
+ * The clock runs on host time, the cia checks again when this
+ * many cycles have been emulated.
+ */
+unsigned int Tod::cycles_to_alarm()
+{
+  if(!running_)
+    return 0xffffffff;
+  uint32_t t = now();
+  uint32_t left = (alarm_ + kDay - t) % kDay;
+  /* the alarm was seen for this tenth, it is due again in a day */
+  if(left == 0 && t == last_)
+    left = kDay;
+  if(left > 0xffffffff / kCyclesPerTenth)
+    return 0xffffffff;
+  return left * kCyclesPerTenth;
+}
+
+/**
+ * @brief saves or restores the time, it keeps running from the restore
+ */
+void Tod::snapshot(Snapshot *s)
+{
+  if(s->saving())
+  {
+    base_ = now();
+    base_milli_ = current_milli;
+  }
+  s->value(base_);
+  s->value(running_);
+  s->value(latch_);
+  s->value(latched_);
+  s->value(alarm_);
+  if(!s->saving())
+  {
+    base_milli_ = current_milli;
+    last_ = base_;
+  }
+}
@@ -0,0 +1,237 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <c64/tokenizer.h>
+#include <c64/memory.h>
+
+/* BASIC V2 keywords in token order, the first one is $80 */
+static const char *kKeywords[] =
+{
+  "END", "FOR", "NEXT", "DATA", "INPUT#", "INPUT", "DIM", "READ", "LET",
+  "GOTO", "RUN", "IF", "RESTORE", "GOSUB", "RETURN", "REM", "STOP", "ON",
+  "WAIT", "LOAD", "SAVE", "VERIFY", "DEF", "POKE", "PRINT#", "PRINT",
+  "CONT", "LIST", "CLR", "CMD", "SYS", "OPEN", "CLOSE", "GET", "NEW",
+  "TAB(", "TO", "FN", "SPC(", "THEN", "NOT", "STEP", "+", "-", "*", "/",
+  "^", "AND", "OR", ">", "=", "<", "SGN", "INT", "ABS", "USR", "FRE",
+  "POS", "SQR", "RND", "LOG", "EXP", "COS", "SIN", "TAN", "ATN", "PEEK",
+  "LEN", "STR$", "VAL", "ASC", "CHR$", "LEFT$", "RIGHT$", "MID$", "GO"
+};
+static const unsigned int kNumKeywords = sizeof(kKeywords) / sizeof(kKeywords[0]);
+
+static const uint8_t kTokenData  = 0x83;
+static const uint8_t kTokenRem   = 0x8f;
+static const uint8_t kTokenPrint = 0x99;
+
+/* zero page pointers BASIC keeps */
+static const uint16_t kAddrTxtTab = 0x002b;
+static const uint16_t kAddrVarTab = 0x002d;
+static const uint16_t kAddrAryTab = 0x002f;
+static const uint16_t kAddrStrEnd = 0x0031;
+static const uint16_t kAddrFreTop = 0x0033;
+static const uint16_t kAddrMemSiz = 0x0037;
+static const uint16_t kAddrDatPtr = 0x0041;
+
+/**
+ * @brief starts an empty program at start
+ */
+Tokenizer::Tokenizer(Memory *mem, uint16_t start)
+{
+  mem_ = mem;
+  start_ = start;
+  addr_ = start;
+  lines_ = 0;
+  last_ = -1;
+  ok_ = true;
+  length_ = 0;
+}
+
+/**
+ * @brief takes the next piece of the listing
+ */
+void Tokenizer::text(const uint8_t *text, uint32_t length)
+{
+  for(uint32_t i=0 ; i < length ; i++)
+  {
+    uint8_t c = text[i];
+    if(c == '\r' || c == '\n')
+    {
+      line();
+      continue;
+    }
+    if(c == '\t')
+      c = ' ';
+    else if(c >= 'a' && c <= 'z')
+      c -= 'a' - 'A';
+    else if(c < 0x20 || c > 0x7e)
+      continue;
+    /* longer than the ROM takes anyway */
+    if(length_ < sizeof(text_))
+      text_[length_++] = c;
+  }
+}
+
+/**
+ * @brief stores the line received so far
+ *
+ * Lines without a number, READY. or a RUN pasted along, are left
+ * out, as is a line with a number only.
+ */
+void Tokenizer::line()
+{
+  unsigned int length = length_;
+  length_ = 0;
+  unsigned int i = 0;
+  while(i < length && text_[i] == ' ')
+    i++;
+  if(!ok_ || i == length || text_[i] < '0' || text_[i] > '9')
+    return;
+  /* LINGET, spaces between the digits are skipped too */
+  unsigned int number = 0;
+  while(i < length && ((text_[i] >= '0' && text_[i] <= '9') || text_[i] == ' '))
+  {
+    if(text_[i] != ' ')
+      number = number * 10 + text_[i] - '0';
+    if(number > kMaxLineNumber)
+    {
+      ok_ = false;
+      return;
+    }
+    i++;
+  }
+  if(i == length)
+    return;
+  if((int)number <= last_)
+  {
+    ok_ = false;
+    return;
+  }
+  uint8_t tokens[sizeof(text_) + 1];
+  unsigned int n = crunch(text_ + i, length - i, tokens);
+  tokens[n++] = 0;
+  /* link, number and the tokens, then room for the end link */
+  uint32_t next = addr_ + 4 + n;
+  if(next + 2 > kAddrBasicEnd)
+  {
+    ok_ = false;
+    return;
+  }
+  mem_->write_word_no_io(addr_, next);
+  mem_->write_word_no_io(addr_ + 2, number);
+  mem_->write_block_no_io(addr_ + 4, tokens, n);
+  addr_ = next;
+  last_ = number;
+  lines_++;
+}
+
+/**
+ * @brief CRUNCH, text after the line number to tokens
+ *
+ * Follows the ROM: spaces are kept, strings are copied as they
+ * are, so is DATA up to the next colon and REM up to the end of the
+ * line. Digits and : ; are never the start of a keyword, ? is PRINT
+ * and the first keyword in token order that matches wins.
+ */
+unsigned int Tokenizer::crunch(const uint8_t *text, unsigned int length, uint8_t *out)
+{
+  unsigned int i = 0;
+  unsigned int n = 0;
+  bool data = false;
+  while(i < length)
+  {
+    uint8_t c = text[i];
+    if(c == '"')
+    {
+      out[n++] = text[i++];
+      while(i < length && text[i] != '"')
+	out[n++] = text[i++];
+      if(i == length)
+	break;
+      c = text[i++];
+    }
+    else if(c == ' ' || data)
+      i++;
+    else if(c == '?')
+    {
+      c = kTokenPrint;
+      i++;
+    }
+    else if(c >= '0' && c < '<')
+      i++;
+    else
+    {
+      unsigned int k = 0;
+      unsigned int l = 0;
+      for( ; k < kNumKeywords ; k++)
+      {
+	const char *w = kKeywords[k];
+	for(l=0 ; w[l] != 0 && i + l < length && text[i + l] == (uint8_t)w[l] ; l++)
+	  ;
+	if(w[l] == 0)
+	  break;
+      }
+      if(k < kNumKeywords)
+      {
+	c = 0x80 + k;
+	i += l;
+      }
+      else
+	i++;
+    }
+    out[n++] = c;
+    if(c == ':')
+      data = false;
+    else if(c == kTokenData)
+      data = true;
+    else if(c == kTokenRem)
+    {
+      while(i < length)
+	out[n++] = text[i++];
+    }
+  }
+  return n;
+}
+
+/**
+ * @brief stores a last line without CR/LF and the end link
+ *
+ * Returns the end of the program, where the variables begin.
+ */
+uint16_t Tokenizer::finish()
+{
+  if(length_ > 0)
+    line();
+  mem_->write_word_no_io(addr_, 0);
+  return addr_ + 2;
+}
+
+/**
+ * @brief sets BASIC's pointers as NEW, LOAD and CLR leave them
+ *
+ * For a program put in while BASIC waits at READY, a LOAD sets
+ * them itself.
+ */
+void Tokenizer::set_pointers()
+{
+  uint16_t end = addr_ + 2;
+  mem_->write_word_no_io(kAddrTxtTab, start_);
+  mem_->write_word_no_io(kAddrVarTab, end);
+  mem_->write_word_no_io(kAddrAryTab, end);
+  mem_->write_word_no_io(kAddrStrEnd, end);
+  mem_->write_word_no_io(kAddrFreTop, mem_->read_word_no_io(kAddrMemSiz));
+  mem_->write_word_no_io(kAddrDatPtr, start_ - 1);
+}
@@ -0,0 +1,212 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <c64/trace.h>
+#include <lib/string.h>
+#include <lib/stdlib.h>
+
+using namespace myos::filesystem;
+
+Trace::Trace()
+{
+  arena_ = 0;
+  ring_ = 0;
+  recording_ = false;
+  seg_cycles_ = 0;
+  seg_records_ = 0;
+  seg_length_ = 0;
+  head_ = 0;
+  filled_ = 0;
+  pos_ = 0;
+  last_pc_ = 0;
+  memset(last_,0,sizeof(last_));
+}
+
+/**
+ * @brief starts recording from an empty ring
+ *
+ * The ring is allocated the first time, false if the arena has no
+ * room for it.
+ */
+bool Trace::start(unsigned int now)
+{
+  if(ring_ == 0)
+  {
+    ring_ = new(arena_) uint8_t[kSegments * kSegmentSize];
+    seg_cycles_ = new(arena_) uint32_t[kSegments];
+    seg_records_ = new(arena_) uint32_t[kSegments];
+    seg_length_ = new(arena_) uint16_t[kSegments];
+    if(ring_ == 0 || seg_cycles_ == 0 || seg_records_ == 0 || seg_length_ == 0)
+    {
+      ring_ = 0;
+      return false;
+    }
+  }
+  head_ = 0;
+  filled_ = 1;
+  pos_ = 0;
+  seg_cycles_[0] = now;
+  seg_records_[0] = 0;
+  last_pc_ = 0;
+  memset(last_,0,sizeof(last_));
+  recording_ = true;
+  return true;
+}
+
+/**
+ * @brief closes the current segment and takes the next (or oldest) one
+ */
+void Trace::next_segment(unsigned int now)
+{
+  seg_length_[head_] = pos_;
+  head_ = (head_ + 1) % kSegments;
+  if(filled_ < kSegments)
+    filled_++;
+  pos_ = 0;
+  seg_cycles_[head_] = now;
+  seg_records_[head_] = 0;
+  last_pc_ = 0;
+  memset(last_,0,sizeof(last_));
+}
+
+unsigned int Trace::oldest()
+{
+  return (head_ + kSegments - filled_ + 1) % kSegments;
+}
+
+uint32_t Trace::records()
+{
+  uint32_t n = 0;
+  for(unsigned int i=0 ; i < filled_ ; i++)
+    n += seg_records_[(oldest() + i) % kSegments];
+  return n;
+}
+
+// decoding ////////////////////////////////////////////////////////////////
+
+/**
+ * @brief decodes one segment, the first skip records are not shown
+ */
+void Trace::decode(unsigned int seg, uint32_t skip, Sink sink, void *arg)
+{
+  static const char names[kRegs] = {'A','X','Y','S','P'};
+  const uint8_t *p = ring_ + seg * kSegmentSize;
+  const uint8_t *end = p + (seg == head_ ? pos_ : seg_length_[seg]);
+  uint16_t pc = 0;
+  uint8_t regs[kRegs] = {0,0,0,0,0};
+  for(uint32_t n=0 ; p < end ; n++)
+  {
+    uint8_t header = *p++;
+    uint8_t op = *p++;
+    uint8_t code = header >> kDeltaShift;
+    if(code == kLongDelta)
+    {
+      uint16_t z = 0;
+      int shift = 0;
+      uint8_t b;
+      do
+      {
+        b = *p++;
+        z |= (uint16_t)(b & 0x7f) << shift;
+        shift += 7;
+      }
+      while(b & 0x80);
+      pc += (uint16_t)((z >> 1) ^ -(z & 1));
+    }
+    else
+      pc += code;
+    for(int i=0 ; i < kRegs ; i++)
+    {
+      if(header & (1 << i))
+        regs[i] = *p++;
+    }
+    if(n < skip)
+      continue;
+    char line[40];
+    char *l = line;
+    l = utoh(pc,l,4); *l++ = ' ';
+    l = utoh(op,l,2);
+    for(int i=0 ; i < kRegs ; i++)
+    {
+      *l++ = ' '; *l++ = names[i]; *l++ = '=';
+      l = utoh(regs[i],l,2);
+    }
+    *l++ = '\n';
+    *l = 0;
+    sink(line,arg);
+  }
+}
+
+/**
+ * @brief hands the last lines records to sink, oldest first
+ */
+void Trace::report(uint32_t lines, Sink sink, void *arg)
+{
+  if(ring_ == 0)
+    return;
+  /* walk back from the newest segment to the first one needed */
+  unsigned int first = filled_;
+  uint32_t n = 0;
+  while(first > 0 && n < lines)
+  {
+    first--;
+    n += seg_records_[(oldest() + first) % kSegments];
+  }
+  uint32_t skip = n > lines ? n - lines : 0;
+  for(unsigned int i=first ; i < filled_ ; i++)
+  {
+    decode((oldest() + i) % kSegments,skip,sink,arg);
+    skip = 0;
+  }
+}
+
+/**
+ * @brief writes the ring as it is, oldest segment first
+ *
+ * "TRC1", the number of segments, then for each one its starting
+ * cycle, record count and length (32, 32 and 16 bits little endian)
+ * followed by the records.
+ */
+int Trace::save(Fat32 *fs, uint8_t *filename)
+{
+  if(ring_ == 0)
+    return FILE_STATUS_OK;
+  seg_length_[head_] = pos_;
+  if(fs->GetFileSize(filename) != 0)
+    fs->DeleteFile(filename);
+  int fstatus = fs->OpenFile(0,filename,FILEACCESSMODE_CREATE);
+  if(fstatus != FILE_STATUS_OK)
+    return fstatus;
+  uint32_t segments = filled_;
+  fstatus = fs->WriteFileBlock(0,(uint8_t*)"TRC1",4);
+  if(fstatus == FILE_STATUS_OK)
+    fstatus = fs->WriteFileBlock(0,(uint8_t*)&segments,sizeof(segments));
+  for(unsigned int i=0 ; i < filled_ && fstatus == FILE_STATUS_OK ; i++)
+  {
+    unsigned int seg = (oldest() + i) % kSegments;
+    fstatus = fs->WriteFileBlock(0,(uint8_t*)&seg_cycles_[seg],4);
+    if(fstatus == FILE_STATUS_OK)
+      fstatus = fs->WriteFileBlock(0,(uint8_t*)&seg_records_[seg],4);
+    if(fstatus == FILE_STATUS_OK)
+      fstatus = fs->WriteFileBlock(0,(uint8_t*)&seg_length_[seg],2);
+    if(fstatus == FILE_STATUS_OK && seg_length_[seg] != 0)
+      fstatus = fs->WriteFileBlock(0,ring_ + seg * kSegmentSize,seg_length_[seg]);
+  }
+  fs->CloseFile(0);
+  return fstatus;
+}
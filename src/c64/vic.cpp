@@ -16,6 +16,11 @@
  */
 
 #include <c64/vic.h>
+#include <hardwarecommunication/processor.h>
+#include <lib/string.h>
+#include <c64/snapshot.h>
+
+using myos::hardwarecommunication::Processor;
 
 // ctor and emulate()  ///////////////////////////////////////////////////////
 
@@ -33,6 +38,7 @@ Vic::Vic()
   msbx_ = sprite_double_height_ = sprite_double_width_ = 0;
   sprite_enabled_ = sprite_priority_ = sprite_multicolor_ = 0;       
   sprite_shared_colors_[0] = sprite_shared_colors_[1] = 0;
+  sprite_sprite_collision_ = sprite_bg_collision_ = 0;
   /* colors */
   border_color_ = 0;
   bgcolor_[0] = bgcolor_[1] = bgcolor_[2] = bgcolor_[3] = 0;
@@ -49,21 +55,27 @@ Vic::Vic()
   /* current graphic mode */
   graphic_mode_ = kCharMode;
   vscrollPtr_ = 0;
+  /* scanline renderer */
+  init_expand_lut();
+  simd_ = Processor::SSEEnabled();
+  vm_row_ = -1;
+  /* sprite pipeline */
+  sprites_dirty_ = true;
+  sprite_line_ = 0;
+  fg_valid_ = false;
+  /* line engine unless picked at boot */
+  cycle_exact_ = false;
+  dma_done_ = true;
+  collisions_ = true;
+  drawn_x_ = 0;
 }
 
 bool Vic::emulate()
 {
-  
-  /** 
-   * if there are unacknowledged interrupts 
-   * raise an interrupt again
-   **/
-  if((read_register(0x19) & 0x80) != 0)
-  {
-    cpu_->irq();
-  }
-  /* are we at the next raster line? */
-  if (cpu_->cycles() >= next_raster_at_)
+  if(cycle_exact_)
+    return emulate_cycles();
+  /* are we at the next raster line? a DMA stall can span several */
+  while (cpu_->cycles() >= next_raster_at_)
   {
     int rstr = raster_counter();
 
@@ -73,52 +85,218 @@ bool Vic::emulate()
       /* set interrupt origin (raster) */
       irq_status_ |= (1<<0);
       /* raise interrupt */
-      cpu_->irq();
+      update_irq_line();
     }
     
     if (rstr >= kFirstVisibleLine && rstr < kLastVisibleLine)
     {
-      // draw border
-      int screen_y = rstr - kFirstVisibleLine;
-#ifndef _NO_BORDER_
-      io_->screen_draw_border(screen_y,border_color_);
-#endif     
-      // draw raster on current graphic mode
-      switch(graphic_mode_)
-      {
-      case kCharMode:
-      case kMCCharMode:
-      case kExtBgMode:
-        draw_raster_char_mode();
-        break;
-      case kBitmapMode:
-      case kMCBitmapMode:
-        draw_raster_bitmap_mode();
-        break;
-      default:
-        //D("unsupported graphic mode: %d\n",graphic_mode_);
+      if(!draw_line(rstr))
         return false;
-      }
-      // draw sprites
-      draw_raster_sprites();
     }
     /* next raster */
     if(is_bad_line())
       next_raster_at_+= kBadLineCycles;
     else
       next_raster_at_+= kLineCycles;
-    /* update raster */
-    raster_counter(++rstr);
-    if (rstr >= kScreenLines)
+    next_line();
+  }
+  return true;
+}
+
+/**
+ * @brief draws border, graphics and sprites of a visible line
+ */
+bool Vic::draw_line(int rstr)
+{
+  int screen_y = rstr - kFirstVisibleLine;
+  sprite_line_ = sprites_on_line(rstr);
+  fg_valid_ = false;
+#ifndef _NO_BORDER_
+  if(graphic_mode_ != kIllegalMode && is_border_line(rstr))
+  {
+    /* sprites are hidden, only their collisions count */
+    if(io_->screen_border_line(screen_y,border_color_))
+      io_->screen_line_done(screen_y);
+    draw_raster_sprites();
+    return true;
+  }
+  io_->screen_draw_border(screen_y,border_color_);
+#endif     
+  // draw raster on current graphic mode
+  switch(graphic_mode_)
+  {
+  case kCharMode:
+  case kMCCharMode:
+  case kExtBgMode:
+    draw_raster_char_mode();
+    break;
+  case kBitmapMode:
+  case kMCBitmapMode:
+    draw_raster_bitmap_mode();
+    break;
+  default:
+    //D("unsupported graphic mode: %d\n",graphic_mode_);
+    return false;
+  }
+  // draw sprites
+  draw_raster_sprites();
+  // flag the line for the next screen refresh if it changed
+  io_->screen_line_done(screen_y);
+  return true;
+}
+
+/**
+ * @brief true if line rstr shows nothing but the border color
+ *
+ * That is the upper and lower border, the lines the 24 row mode
+ * covers, and the whole screen while it is blanked.
+ */
+bool Vic::is_border_line(int rstr)
+{
+  if(is_screen_off() || rstr < kGFirstLine || rstr >= kGLastLine)
+    return true;
+  int y = rstr - kFirstVisibleLine;
+  return !ISSET_BIT(cr1_,3) && (y<=kGFirstLine-12 || y>=kGLastLine-18);
+}
+
+/**
+ * @brief advances the raster counter, presents the frame after the last line
+ */
+void Vic::next_line()
+{
+  int rstr = raster_counter() + 1;
+  raster_counter(rstr);
+  if (rstr >= kScreenLines)
+  {
+    io_->screen_refresh();
+    /* host keys reach the matrix at the same point of every frame */
+    io_->process_events();
+    frame_c_++;
+    raster_counter(0);
+    vm_row_ = -1;
+  }
+}
+
+// cycle exact engine ////////////////////////////////////////////////////////
+
+/**
+ * @brief lockstep with the cpu
+ *
+ * next_raster_at_ is the end of the current line here. The badline
+ * DMA halts the cpu by moving its clock past the stolen cycles, as
+ * seen from the cycle the batch stopped at.
+ */
+bool Vic::emulate_cycles()
+{
+  unsigned int now = cpu_->cycles();
+  unsigned int line_start = next_raster_at_ - kLineCycles;
+  if(!dma_done_ && now - line_start >= (unsigned int)kBaCycle)
+  {
+    dma_done_ = true;
+    if(is_bad_line())
+    {
+      unsigned int resume = line_start + kDmaEndCycle;
+      if((int)(resume - now) > 0)
+        cpu_->stall(resume - now);
+    }
+  }
+  while(cpu_->cycles() >= next_raster_at_)
+  {
+    int rstr = raster_counter();
+    if (rstr >= kFirstVisibleLine && rstr < kLastVisibleLine)
     {
-      io_->screen_refresh();
-      frame_c_++;
-      raster_counter(0);
+      if(!render_line(kVisibleScreenWidth))
+        return false;
     }
+    next_raster_at_ += kLineCycles;
+    next_line();
+    start_line();
   }
   return true;
 }
 
+/**
+ * @brief a new line begins: raster irq and sprite DMA
+ */
+void Vic::start_line()
+{
+  int rstr = raster_counter();
+  if (raster_irq_enabled() && rstr == raster_irq_)
+  {
+    irq_status_ |= (1<<0);
+    update_irq_line();
+  }
+  drawn_x_ = 0;
+  dma_done_ = false;
+  /* two cycles per sprite fetched plus the BA lead time */
+  uint8_t sprites = sprites_on_line(rstr);
+  if(sprites != 0)
+  {
+    int n = 0;
+    for(int i=0 ; i < 8 ; i++)
+      n += (sprites >> i) & 1;
+    cpu_->stall(n * kSpriteDmaCycles + kSpriteBaCycles);
+  }
+}
+
+/**
+ * @brief draws the pixels the beam passed so far with the registers
+ * as they are, before a write changes them
+ */
+void Vic::catch_up()
+{
+  int rstr = raster_counter();
+  if (rstr < kFirstVisibleLine || rstr >= kLastVisibleLine)
+    return;
+  unsigned int line_start = next_raster_at_ - kLineCycles;
+  int x = (int)(cpu_->cycles() - line_start) * 8 + kCyclePixelOffset;
+  if(x > kVisibleScreenWidth)
+    x = kVisibleScreenWidth;
+  if(x <= drawn_x_)
+    return;
+  collisions_ = false;
+  render_line(x);
+  collisions_ = true;
+}
+
+/**
+ * @brief renders the line, pixels left of drawn_x_ keep what older
+ * register values drew there, then drawn_x_ moves to x
+ */
+bool Vic::render_line(int x)
+{
+  int rstr = raster_counter();
+  int y = rstr - kFirstVisibleLine;
+  uint16_t *line = io_->screen_line(y);
+  bool retval;
+  if(drawn_x_ == 0)
+    retval = draw_line(rstr);
+  else
+  {
+    memcpy(line_save_, line, drawn_x_);
+    retval = draw_line(rstr);
+    memcpy(line, line_save_, drawn_x_);
+    io_->screen_line_changed(y);
+    /* draw_line() compared the line before the prefix went back */
+    if(x == kVisibleScreenWidth)
+      io_->screen_line_done(y);
+  }
+  drawn_x_ = x;
+  return retval;
+}
+
+/**
+ * @brief cycles left until the next raster line starts, or the 
+ * badline DMA in the cycle exact engine
+ */
+unsigned int Vic::cycles_to_next_event()
+{
+  int d = next_raster_at_ - cpu_->cycles();
+  if(cycle_exact_ && !dma_done_)
+    d -= kLineCycles - kBaCycle;
+  return d > 0 ? d : 0;
+}
+
 // DMA register access  //////////////////////////////////////////////////////
 
 uint8_t Vic::read_register(uint8_t r)
@@ -182,7 +360,7 @@ uint8_t Vic::read_register(uint8_t r)
    */
   case 0x19:
     retval = (0xf & irq_status_);
-    if(retval!=0) retval |= 0x80; // IRQ bit 
+    if((retval & irq_enabled_) != 0) retval |= 0x80; // IRQ bit 
     retval |= 0x70; // non-connected bits (always set)
     break;
   /** 
@@ -204,10 +382,14 @@ uint8_t Vic::read_register(uint8_t r)
   case 0x1d:
     retval = sprite_double_width_;
     break;
-  // Always returns zero
+  /* collision registers, cleared by reading */
   case 0x1e:
+    retval = sprite_sprite_collision_;
+    sprite_sprite_collision_ = 0;
+    break;
   case 0x1f:
-    retval = 0;
+    retval = sprite_bg_collision_;
+    sprite_bg_collision_ = 0;
     break;
   /* border color */
   case 0x20:
@@ -262,6 +444,8 @@ uint8_t Vic::read_register(uint8_t r)
 
 void Vic::write_register(uint8_t r, uint8_t v)
 {
+  if(cycle_exact_)
+    catch_up();
   switch(r % 64)	// VIC registers repeat every 64 bytes
   {
   /* store X coord of sprite n*/
@@ -274,6 +458,7 @@ void Vic::write_register(uint8_t r, uint8_t v)
   case 0xc:
   case 0xe:
     mx_[r >> 1] = v;
+    sprites_dirty_ = true;
     break;
   /* store Y coord of sprite n */
   case 0x1:
@@ -285,10 +470,12 @@ void Vic::write_register(uint8_t r, uint8_t v)
   case 0xd:
   case 0xf:
     my_[r >> 1] = v;
+    sprites_dirty_ = true;
     break;
   /* MSBs of X coordinates */
   case 0x10:
     msbx_ = v;
+    sprites_dirty_ = true;
     break;
   /* control register 1 */
   case 0x11:
@@ -304,6 +491,7 @@ void Vic::write_register(uint8_t r, uint8_t v)
   /* sprite enable register */
   case 0x15:
     sprite_enabled_ = v;
+    sprites_dirty_ = true;
     break;
   /* control register 2 */
   case 0x16:
@@ -313,6 +501,7 @@ void Vic::write_register(uint8_t r, uint8_t v)
   /* sprite double height */
   case 0x17:
     sprite_double_height_ = v;
+    sprites_dirty_ = true;
     break;
   /* memory pointers  */
   case 0x18:
@@ -329,22 +518,27 @@ void Vic::write_register(uint8_t r, uint8_t v)
   case 0x19:
     /* acknowledge interrupts by mask */
     irq_status_ &= ~(v&0xf);
+    update_irq_line();
     break;
   /* interrupt enable register */
   case 0x1a:
     irq_enabled_= v;
+    update_irq_line();
     break;
   /* sprite priority register */
   case 0x1b:
     sprite_priority_ = v;
+    sprites_dirty_ = true;
     break;
   /* sprite multicolor mode */
   case 0x1c:
     sprite_multicolor_ = v;
+    sprites_dirty_ = true;
     break;
   /* sprite double width */
   case 0x1d:
     sprite_double_width_ = v;
+    sprites_dirty_ = true;
     break;
   /* border color */
   case 0x20:
@@ -361,6 +555,7 @@ void Vic::write_register(uint8_t r, uint8_t v)
   case 0x25:
   case 0x26:
     sprite_shared_colors_[r-0x25] = v & 0xF;
+    sprites_dirty_ = true;
     break;
   case 0x27:
   case 0x28:
@@ -371,6 +566,7 @@ void Vic::write_register(uint8_t r, uint8_t v)
   case 0x2d:
   case 0x2e:
     sprite_colors_[r-0x27] = v & 0xF;
+    sprites_dirty_ = true;
     break;
   /* unused */
   case 0x2f:
@@ -443,15 +639,12 @@ uint8_t Vic::get_char_color(int column, int row)
  */
 uint8_t Vic::get_char_data(int chr, int line)
 {
+  /* only 64 characters in extended background mode */
   if(graphic_mode_ == kExtBgMode)
-  {
-    if(chr >= 64 && chr <= 127) chr = chr - 64;
-    else if(chr >= 128 && chr <= 191) chr = chr - 128;
-    else if(chr >= 192 && chr <= 255) chr = chr - 192;
-  }
+    chr &= 0x3f;
 
   uint16_t addr = char_mem_ + (chr * 8) + line;
-  uint8_t b = mem_->vic_read_byte(addr);
+  return mem_->vic_read_byte(addr);
 }
 
 /**
@@ -476,247 +669,196 @@ uint16_t Vic::get_sprite_ptr(int n)
  
 // raster drawing  ///////////////////////////////////////////////////////////
 
-void Vic::draw_char(int x, int y, uint8_t data, uint8_t color)
+/**
+ * @brief bit to pixel mask expansion table
+ *
+ * expand_lut[b][i] is 0xffff if pixel i (leftmost first) of the byte
+ * b is set, so one entry masks a whole 8 pixel row.
+ */
+static uint16_t expand_lut[256][8] __attribute__((aligned(16)));
+
+/**
+ * @brief every bit of a byte doubled, for double width sprites
+ */
+static uint16_t double_lut[256];
+
+void Vic::init_expand_lut()
 {
-  for(int i=0 ; i < 8 ; i++)
+  for(int b=0 ; b < 256 ; b++)
   {
-    int xoffs = x + 8 - i + horizontal_scroll();
-    /* don't draw outside (due to horizontal scroll) */
-    if(xoffs > kGFirstCol + kGResX)
-      continue;
-    
-    // 38 column mode    
-    if(!ISSET_BIT(cr2_,3))
-    {
-      if ((xoffs <= kGFirstCol+8) || (xoffs >= kGFirstCol+8 +kGResX-16)) 
-      {
-	io_->screen_update_pixel(xoffs,y,border_color_);
-	continue;
-      }
-    }
-    
-    // 24 line mode
-    if(!ISSET_BIT(cr1_,3))
-    {
-      if (y<=kGFirstLine-12 || y>=kGLastLine-18)
-      {
-	io_->screen_update_pixel(xoffs,y,border_color_);
-	continue;
-      }
-    }
-    
-    /* draw pixel */
-    if(ISSET_BIT(data,i))
+    double_lut[b] = 0;
+    for(int i=0 ; i < 8 ; i++)
     {
-      io_->screen_update_pixel(xoffs,y,color);
+      expand_lut[b][i] = ISSET_BIT(b,7-i) ? 0xffff : 0;
+      if(ISSET_BIT(b,i))
+        double_lut[b] |= 3 << (i * 2);
     }
   }
 }
 
-void Vic::draw_ext_backcolor_char(int x, int y, uint8_t data, uint8_t color, uint8_t c)
+/**
+ * @brief hires character or bitmap row
+ */
+void Vic::hires_cell(int column, uint8_t data, uint8_t fg, uint8_t bg)
+{
+  RasterCell *cell = &cells_[column];
+  cell->hi = cell->lo = data;
+  cell->color[0] = bg;
+  cell->color[3] = fg;
+}
+
+/**
+ * @brief multicolor character or bitmap row
+ *
+ * Each bit pair covers two pixels, so the high and low bit of every 
+ * pair are duplicated into the two masks.
+ */
+void Vic::mc_cell(int column, uint8_t data, uint8_t c0, uint8_t c1, uint8_t c2, uint8_t c3)
 {
-  for(int i=0 ; i < 8 ; i++)
+  RasterCell *cell = &cells_[column];
+  cell->hi = (data & 0xaa) | ((data & 0xaa) >> 1);
+  cell->lo = (data & 0x55) | ((data & 0x55) << 1);
+  cell->color[0] = c0;
+  cell->color[1] = c1;
+  cell->color[2] = c2;
+  cell->color[3] = c3;
+}
+
+void Vic::expand_cells(uint16_t *dst, const RasterCell *cell, int n)
+{
+  for(int i=0 ; i < n ; i++, cell++)
   {
-    int xoffs = x + 8 - i + horizontal_scroll();
-    /* don't draw outside (due to horizontal scroll) */
-    if(xoffs > kGFirstCol + kGResX)
-      continue;
-    
-    // 38 column mode    
-    if(!ISSET_BIT(cr2_,3))
-    {
-      if ((xoffs <= kGFirstCol+8) || (xoffs >= kGFirstCol+8 +kGResX-16)) 
-      {
-	io_->screen_update_pixel(xoffs,y,border_color_);
-	continue;
-      }
-    }
-    
-    // 24 line mode
-    if(!ISSET_BIT(cr1_,3))
-    {
-      if (y<=kGFirstLine-12 || y>=kGLastLine-18)
-      {
-	io_->screen_update_pixel(xoffs,y,border_color_);
-	continue;
-      }
-    }
-       
-    /* draw pixel */
-    if(ISSET_BIT(data,i))
+    const uint16_t *h = expand_lut[cell->hi];
+    const uint16_t *l = expand_lut[cell->lo];
+    for(int j=0 ; j < 8 ; j++)
     {
-      io_->screen_update_pixel(xoffs,y,color);
-    }
-    else
-    {
-      if(c >=64 && c <= 127)
-	io_->screen_update_pixel(xoffs,y,bgcolor_[1]);
-      if(c >=128 && c <= 191)
-	io_->screen_update_pixel(xoffs,y,bgcolor_[2]);
-      if(c >=192 && c <= 255)
-	io_->screen_update_pixel(xoffs,y,bgcolor_[3]);
+      uint16_t fg = (l[j] & cell->color[3]) | (~l[j] & cell->color[2]);
+      uint16_t bg = (l[j] & cell->color[1]) | (~l[j] & cell->color[0]);
+      *dst++ = (h[j] & fg) | (~h[j] & bg);
     }
   }
 }
 
+typedef uint16_t v8hi __attribute__((vector_size(16)));
+typedef uint16_t v8hi_u __attribute__((vector_size(16), aligned(2)));
 
-void Vic::draw_mcchar(int x, int y, uint8_t data, uint8_t color)
+__attribute__((target("sse2"), always_inline))
+static inline v8hi splat(uint16_t c)
 {
-  for(int i=0 ; i < 4 ; i++)
+  v8hi v = {c, c, c, c, c, c, c, c};
+  return v;
+}
+
+/**
+ * @brief same as expand_cells(), 8 pixels per SSE2 register
+ *
+ * Only called once Processor::EnableSSE() has succeeded.
+ */
+__attribute__((target("sse2")))
+void Vic::expand_cells_sse2(uint16_t *dst, const RasterCell *cell, int n)
+{
+  for(int i=0 ; i < n ; i++, cell++, dst+=8)
   {
-    /* color */
-    uint8_t c;
-    /* color source */
-    uint8_t cs = ((data >> i*2) & 0x3);
-    switch(cs)
-    {
-    case 0:
-      c = bgcolor_[0]; 
-      break;
-    case 1:
-      c = bgcolor_[1];
-      break;
-    case 2:
-      c = bgcolor_[2];
-      break;
-    case 3:
-      c = color;
-      break;
-    }
-    
-    int xoffs = x + 8 - i * 2 + horizontal_scroll();
-    
-    // 38 column mode    
-    if(!ISSET_BIT(cr2_,3))
-    {
-      if ((xoffs <= kGFirstCol+8) || (xoffs >= kGFirstCol+8 +kGResX-16)) 
-      {
-	io_->screen_update_pixel(xoffs,y,border_color_);
-	continue;
-      }
-    }
-    
-    // 24 line mode
-    if(!ISSET_BIT(cr1_,3))
-    {
-      if (y<=kGFirstLine-12 || y>=kGLastLine-18)
-      {
-	io_->screen_update_pixel(xoffs,y,border_color_);
-	continue;
-      }
-    }
-    
-    io_->screen_update_pixel(xoffs,y,c);
-    io_->screen_update_pixel(xoffs + 1,y,c);
+    v8hi h = *(const v8hi *)expand_lut[cell->hi];
+    v8hi l = *(const v8hi *)expand_lut[cell->lo];
+    v8hi fg = (l & splat(cell->color[3])) | (~l & splat(cell->color[2]));
+    v8hi bg = (l & splat(cell->color[1])) | (~l & splat(cell->color[0]));
+    *(v8hi_u *)dst = (h & fg) | (~h & bg);
   }
 }
 
-void Vic::draw_raster_char_mode()
+static inline void fill_pixels(uint16_t *dst, int n, uint16_t color)
 {
-  int rstr = raster_counter();
-  int y = rstr - kFirstVisibleLine;
+  for(int i=0 ; i < n ; i++)
+    dst[i] = color;
+}
 
-  if((rstr >= kGFirstLine) && (rstr < kGLastLine) && !is_screen_off())
+/**
+ * @brief expands the cell row and writes it to screen line y
+ *
+ * Pixels pushed past the right edge by the horizontal scroll are 
+ * dropped, the gap it opens on the left shows the background.
+ */
+void Vic::draw_raster_cells(int y)
+{
+  uint16_t *dst = io_->screen_line(y) + kGFirstCol + 1;
+  int hs = horizontal_scroll();
+  if(simd_)
+    expand_cells_sse2(line_,cells_,kGCols);
+  else
+    expand_cells(line_,cells_,kGCols);
+  fill_pixels(dst,hs,bgcolor_[0]);
+  memcpy(dst + hs,line_,kGResX - hs);
+  if(sprite_line_)
+    build_fg_mask();
+  // 38 column mode
+  if(!ISSET_BIT(cr2_,3))
   {
-    /* draw background */
-    if(!ISSET_BIT(cr2_,3)) // 38 columns
-      io_->screen_draw_rect(kGFirstCol+8,y,kGResX-16,bgcolor_[0]);
-    else
-      io_->screen_draw_rect(kGFirstCol,y,kGResX,bgcolor_[0]);
-    
-    /* draw characters */
-    for(int column=0; column < kGCols ; column++)
-    {  
-      vscrollPtr_  = (cr1_ & 7)-3;
-
-      int x = kGFirstCol + column * 8;
-      int line = rstr - kGFirstLine - vscrollPtr_;
-      //if(line >= 0 && line <=200) 
-      //{
-	int row = line/8;
-	int char_row = line % 8;
-	/* retrieve screen character */
-	uint8_t c = get_screen_char(column,row);
-	/* retrieve character bitmap data */
-	uint8_t data = get_char_data(c,char_row);
-	/* retrieve color data */
-	uint8_t color  = get_char_color(column,row);
-	
-	/* draw character */
-	if(graphic_mode_ == kMCCharMode && ISSET_BIT(color,3))
-	  draw_mcchar(x,y,data,(color&0x7));
-	else if(graphic_mode_ == kCharMode)
-	  draw_char(x,y,data,color);
-	else if(graphic_mode_ == kExtBgMode)
-	  draw_ext_backcolor_char(x,y,data,color,c);
-      //}
-    }
+    fill_pixels(dst,8,border_color_);
+    fill_pixels(dst + kGResX - 9,9,border_color_);
   }
+  // 24 line mode
+  if(!ISSET_BIT(cr1_,3) && (y<=kGFirstLine-12 || y>=kGLastLine-18))
+    fill_pixels(dst,kGResX,border_color_);
 }
 
-void Vic::draw_bitmap(int x, int y, uint8_t data, uint8_t color)
+/**
+ * @brief badline fetch of screen codes and colors for a character row
+ */
+void Vic::fetch_video_matrix(int row)
 {
-  uint8_t forec   = (color >> 4) & 0xf;
-  uint8_t bgc =  color & 0xf;
-  for(int i=0 ; i < 8 ; i++)
+  if(row == vm_row_)
+    return;
+  for(int column=0; column < kGCols ; column++)
   {
-    int xoffs = x + 8 - i + horizontal_scroll();
-    /* don't draw outside (due to horizontal scroll) */
-    if(xoffs > kGFirstCol + kGResX)
-      continue;
-    /* draw pixel */
-    if(ISSET_BIT(data,i))
-    {
-      io_->screen_update_pixel(
-        xoffs, 
-        y,
-        forec);
-    }
-    else
-    {
-      io_->screen_update_pixel(
-        xoffs, 
-        y,
-        bgc);
-    }
+    vm_codes_[column] = get_screen_char(column,row);
+    vm_colors_[column] = get_char_color(column,row);
   }
+  vm_row_ = row;
 }
 
-void Vic::draw_mcbitmap(int x, int y, uint8_t data, uint8_t scolor, uint8_t rcolor)
+void Vic::draw_raster_char_mode()
 {
-  for(int i=0 ; i < 4 ; i++)
+  int rstr = raster_counter();
+  int y = rstr - kFirstVisibleLine;
+
+  if((rstr >= kGFirstLine) && (rstr < kGLastLine) && !is_screen_off())
   {
-    /* color */
-    uint8_t c;
-    /* color source */
-    uint8_t cs = ((data >> i*2) & 0x3);
-    switch(cs)
-    {
-    case 0:
-      c = bgcolor_[0]; 
-      break;
-    case 1:
-      c = (scolor >> 4) & 0xf;
-      break;
-    case 2:
-      c = scolor & 0xf;
-      break;
-    case 3:
-      c = rcolor;
-      break;
+    vscrollPtr_  = (cr1_ & 7)-3;
+    int line = rstr - kGFirstLine - vscrollPtr_;
+    int row = line/8;
+    int char_row = line % 8;
+    fetch_video_matrix(row);
+    /* fetch characters */
+    for(int column=0; column < kGCols ; column++)
+    {  
+      /* screen character and color from the badline cache */
+      uint8_t c = vm_codes_[column];
+      uint8_t color = vm_colors_[column];
+      /* retrieve character bitmap data */
+      uint8_t data = get_char_data(c,char_row);
+      switch(graphic_mode_)
+      {
+      case kMCCharMode:
+        /* color bit 3 clear draws a hires character */
+        if(ISSET_BIT(color,3))
+          mc_cell(column,data,bgcolor_[0],bgcolor_[1],bgcolor_[2],color&0x7);
+        else
+          hires_cell(column,data,color&0x7,bgcolor_[0]);
+        break;
+      case kExtBgMode:
+        /* the two upper bits of the character select the background */
+        hires_cell(column,data,color,bgcolor_[c >> 6]);
+        break;
+      default:
+        hires_cell(column,data,color,bgcolor_[0]);
+        break;
+      }
     }
-    int xoffs = x + 8 - i * 2 + horizontal_scroll();
-    io_->screen_update_pixel(
-      xoffs,
-      y,
-      c);
-    io_->screen_update_pixel(
-      xoffs + 1,
-      y,
-      c);
-  }  
+    draw_raster_cells(y);
+  }
 }
- 
+
 void Vic::draw_raster_bitmap_mode()
 {
   int rstr = raster_counter();
@@ -725,184 +867,300 @@ void Vic::draw_raster_bitmap_mode()
      (rstr < kGLastLine) && 
      !is_screen_off())
   {
-    /* draw background */
-    io_->screen_draw_rect(kGFirstCol,y,kGResX,bgcolor_[0]);
-    /* draw bitmaps */
+    int line = rstr - kGFirstLine;
+    int row = line/8;
+    int bitmap_row = line % 8;
+    fetch_video_matrix(row);
+    /* fetch bitmaps */
     for(int column=0; column < kGCols ; column++)
     {
-      int x = kGFirstCol + column * 8;
-      int line = rstr - kGFirstLine;
-      int row = line/8;
-      int bitmap_row = line % 8;
       /* retrieve bitmap data */
       uint8_t data = get_bitmap_data(column,row,bitmap_row);
-      /* retrieve color data */
-      uint8_t scolor = get_screen_char(column,row);
-      uint8_t rcolor = get_char_color(column,row); 
-      /* draw bitmap */
+      /* color data from the badline cache */
+      uint8_t scolor = vm_codes_[column];
       if(graphic_mode_ == kBitmapMode)
-        draw_bitmap(x,y,data,scolor);
+        hires_cell(column,data,(scolor >> 4) & 0xf,scolor & 0xf);
       else
-        draw_mcbitmap(x,y,data,scolor,rcolor);
+        mc_cell(column,data,bgcolor_[0],(scolor >> 4) & 0xf,scolor & 0xf,
+                vm_colors_[column]);
     }
+    draw_raster_cells(y);
   }
 }
 
-void Vic::draw_mcsprite(int x, int y, int sprite, int row)
+/**
+ * @brief refreshes the sprite descriptors after a register write
+ */
+void Vic::update_sprites()
 {
-  uint8_t swid = is_double_width_sprite(sprite) == true ? 2 : 1;
-  uint16_t addr = get_sprite_ptr(sprite);
-  
-  uint8_t side_border_offset = 0;
-  uint8_t top_border_offset=0;
-  uint8_t btm_border_offset=0;
-  
-  // 38 col mode
-  if(!ISSET_BIT(cr2_,3)) 
-    side_border_offset = 8;
-  
-  // 24 line mode
-  if(!ISSET_BIT(cr1_,3)) 
+  for(int n=0 ; n < 8 ; n++)
   {
-    top_border_offset=2;
-    btm_border_offset=4;
+    SpriteDesc *s = &sprites_[n];
+    s->double_width = is_double_width_sprite(n);
+    s->double_height = is_double_height_sprite(n);
+    s->multicolor = is_multicolor_sprite(n);
+    s->behind = is_background_sprite(n);
+    s->x = kSpritesFirstCol + sprite_x(n) + 1;
+    s->y = my_[n];
+    s->width = s->double_width ? kSpriteWidth * 2 : kSpriteWidth;
+    s->height = s->double_height ? kSpriteHeight * 2 : kSpriteHeight;
+    s->color[0] = 0;
+    s->color[1] = sprite_shared_colors_[0];
+    s->color[2] = sprite_colors_[n];
+    s->color[3] = sprite_shared_colors_[1];
   }
-  uint16_t minX = kGFirstCol+side_border_offset;
-  uint16_t maxX = kGResX+kGFirstCol-side_border_offset;
-  uint16_t minY = kGFirstCol + top_border_offset;
-  uint16_t maxY = kGResY+kGFirstCol - btm_border_offset;
-
-  for(int w=0;w<swid;w++)
-  {    
-    for (int i=0; i < 3 ; i++)
-    {
-      uint8_t  data = mem_->vic_read_byte(addr + row * 3 + i);
-      for (int j=0; j < 4; j++)
-      {
-	/* color */
-	uint8_t c = 0;
-	/* color source */
-	uint8_t cs = ((data >> j*2) & 0x3);
-	switch(cs)
-	{
-	/* transparent */
-	case 0:
-	  break;
-	case 1:
-	  c = sprite_shared_colors_[0];
-	  break;
-	case 2:
-	  c = sprite_colors_[sprite];
-	  break;
-	case 3:
-	  c = sprite_shared_colors_[1]; 
-	  break;
-	}
-	/* draw if not transparent */
-	if(cs != 0)
-	{
-	  uint16_t newX = (x+w+(i*8*swid) + (8*swid) - (j*swid*2));
-	  
-	  if(newX > minX && y >= minY && newX <= maxX && y < maxY)
-	    io_->screen_update_pixel(newX,y,c);
-	  
-	  newX++;
-	  if(newX > minX && y >= minY && newX <= maxX && y < maxY)
-	    io_->screen_update_pixel(newX,y,c);
-	  
-	  newX++;
-	  if(is_double_width_sprite(sprite) && newX > minX && y >= minY && newX <= maxX && y < maxY)
-	    io_->screen_update_pixel(newX,y,c);
-	}
-      }
-    }
-  }      
+  sprites_dirty_ = false;
 }
 
-void Vic::draw_sprite(int x, int y, int sprite, int row)
+/**
+ * @brief bit n set for every enabled sprite crossing raster line rstr
+ */
+uint8_t Vic::sprites_on_line(int rstr)
 {
-  uint8_t swid = is_double_width_sprite(sprite) == true ? 2 : 1;
-  uint16_t addr = get_sprite_ptr(sprite);
+  if(sprite_enabled_ == 0)
+    return 0;
+  if(sprites_dirty_)
+    update_sprites();
+  int sp_y = rstr - kSpritesFirstLine;
+  uint8_t mask = 0;
+  for(int n=0 ; n < 8 ; n++)
+  {
+    if(is_sprite_enabled(n) &&
+       (unsigned int)(sp_y - sprites_[n].y) < (unsigned int)sprites_[n].height)
+      mask |= 1 << n;
+  }
+  return mask;
+}
 
-  uint8_t side_border_offset = 0;
-  uint8_t top_border_offset=0;
-  uint8_t btm_border_offset=0;
-  
-  uint16_t minX = kGFirstCol+side_border_offset;
-  uint16_t maxX = kGResX+kGFirstCol-side_border_offset;
-  uint16_t minY = kGFirstCol + top_border_offset;
-  uint16_t maxY = kGResY+kGFirstCol - btm_border_offset;
-  
-  // 38 col mode
-  if(!ISSET_BIT(cr2_,3)) 
-    side_border_offset = 8;
-  
-  // 24 line mode
-  if(!ISSET_BIT(cr1_,3)) 
+/**
+ * @brief foreground pixels of the cells just drawn, as a bitmap
+ *
+ * Hires pixels that are set and multicolor pairs %10 and %11 are
+ * foreground, in both cases that is the hi mask of the cell.
+ */
+void Vic::build_fg_mask()
+{
+  for(int i=0 ; i < kFgWords ; i++)
+    fg_mask_[i] = 0;
+  int x = kGFirstCol + 1 + horizontal_scroll();
+  for(int column=0 ; column < kGCols ; column++, x += 8)
   {
-    top_border_offset=2;
-    btm_border_offset=4;
+    uint32_t b = cells_[column].hi;
+    int w = x >> 5;
+    int sh = x & 31;
+    fg_mask_[w] |= (b << 24) >> sh;
+    if(sh > 24)
+      fg_mask_[w + 1] |= b << (56 - sh);
   }
-  
-  for(int w=0;w<swid;w++)
+  fg_valid_ = true;
+}
+
+/**
+ * @brief 64 foreground pixels from screen column x, x first
+ */
+uint64_t Vic::fg_bits(int x)
+{
+  if(!fg_valid_ || x >= kVisibleScreenWidth)
+    return 0;
+  int w = x >> 5;
+  int sh = x & 31;
+  uint64_t v = ((uint64_t)fg_mask_[w] << 32) | fg_mask_[w + 1];
+  v <<= sh;
+  if(sh)
+    v |= fg_mask_[w + 2] >> (32 - sh);
+  return v;
+}
+
+static inline uint64_t double_bits(uint32_t v)
+{
+  return ((uint64_t)double_lut[(v >> 16) & 0xff] << 32) |
+         ((uint32_t)double_lut[(v >> 8) & 0xff] << 16) | double_lut[v & 0xff];
+}
+
+/**
+ * @brief fetches the line of sprite n and returns its opaque pixels
+ *
+ * hi and lo receive the color select bits: %01 shared color 1, %10
+ * the sprite color, %11 shared color 2. Hires sprites select the 
+ * sprite color for every pixel.
+ */
+uint64_t Vic::sprite_row(int n, int sp_y, uint64_t *hi, uint64_t *lo)
+{
+  const SpriteDesc *s = &sprites_[n];
+  int row = sp_y - s->y;
+  if(s->double_height)
+    row >>= 1;
+  uint16_t addr = get_sprite_ptr(n) + row * 3;
+  uint32_t data = (mem_->vic_read_byte(addr) << 16) |
+                  (mem_->vic_read_byte(addr + 1) << 8) |
+                   mem_->vic_read_byte(addr + 2);
+  uint32_t h, l;
+  if(s->multicolor)
   {
-    for (int i=0; i < 3 ; i++)
-    { 
-      uint8_t data = mem_->vic_read_byte(addr + row * 3 + i);
-      
-      for (int j=0; j < 8; j++)
-      {  
-	if(ISSET_BIT(data,j))
-	{
-	  uint16_t newX = (x+w + (i*8*swid) + (8*swid) - (j*swid)) ;
-	  
-	  if(newX > minX && y >= minY && newX <= maxX && y < maxY)
-	    io_->screen_update_pixel(newX,y,sprite_colors_[sprite]);
-	}
-      }
+    h = (data & 0xaaaaaa) | ((data & 0xaaaaaa) >> 1);
+    l = (data & 0x555555) | ((data & 0x555555) << 1);
+  }
+  else
+  {
+    h = data;
+    l = 0;
+  }
+  uint64_t o = h | l;
+  uint64_t hh = h;
+  uint64_t ll = l;
+  if(s->double_width)
+  {
+    o = double_bits(o);
+    hh = double_bits(h);
+    ll = double_bits(l);
+  }
+  int shift = 64 - s->width;
+  *hi = hh << shift;
+  *lo = ll << shift;
+  return o << shift;
+}
+
+/**
+ * @brief writes the visible pixels of a sprite line, 8 at a time
+ */
+void Vic::paint_sprite(uint16_t *dst, const SpriteDesc *s,
+                       uint64_t vis, uint64_t hi, uint64_t lo)
+{
+  for(int k=0 ; k < s->width ; k += 8, dst += 8)
+  {
+    uint8_t v = vis >> (56 - k);
+    if(v == 0)
+      continue;
+    const uint16_t *vm = expand_lut[v];
+    const uint16_t *h = expand_lut[(uint8_t)(hi >> (56 - k))];
+    const uint16_t *l = expand_lut[(uint8_t)(lo >> (56 - k))];
+    for(int j=0 ; j < 8 ; j++)
+    {
+      uint16_t hc = (l[j] & s->color[3]) | (~l[j] & s->color[2]);
+      uint16_t c = (h[j] & hc) | (~h[j] & s->color[1]);
+      dst[j] = (vm[j] & c) | (~vm[j] & dst[j]);
     }
   }
 }
 
-void Vic::draw_raster_sprites()
+/**
+ * @brief pixels [a,b) of a mask, pixel 0 in the top bit
+ */
+static inline uint64_t pixel_range(int a, int b, int width)
+{
+  if(a < 0)
+    a = 0;
+  if(b > width)
+    b = width;
+  if(a >= b)
+    return 0;
+  return (~0ULL >> a) & ~(~0ULL >> b);
+}
+
+/**
+ * @brief sets the collision registers from the opaque masks
+ *
+ * Sprites collide wherever their masks overlap, including the border,
+ * and with the foreground wherever the graphics were drawn. The IRQ
+ * source is raised when a register goes from no collision to any.
+ */
+void Vic::sprite_collisions(const uint64_t *opaque)
 {
-  if(sprite_enabled_ != 0)
+  uint8_t mm = 0, mb = 0;
+  for(int a=0 ; a < 8 ; a++)
   {
-    int rstr = raster_counter();
-    int y = rstr - kFirstVisibleLine;
-    int sp_y = rstr - kSpritesFirstLine;
-    /* loop over sprites reverse order */
-    for(int n=7; n >= 0 ; n--)
+    if(!ISSET_BIT(sprite_line_,a))
+      continue;
+    if(opaque[a] & fg_bits(sprites_[a].x))
+      mb |= 1 << a;
+    for(int b=a+1 ; b < 8 ; b++)
     {
-      int height = is_double_height_sprite(n) ? kSpriteHeight * 2 : kSpriteHeight;
-      /* check if the sprite is visible */
-      if(is_sprite_enabled(n) && 
-         sp_y >= my_[n] && 
-         sp_y < my_[n] + height)
-      {
-        int row = 0;  //sp_y - my_[n];
-	
-	if(is_double_height_sprite(n))
-	  row = (int)(sp_y-my_[n]) / 2;
-	else
-	  row = sp_y - my_[n];
-	
-        int x = kSpritesFirstCol + sprite_x(n);
-        if(is_multicolor_sprite(n))
-        {
-          draw_mcsprite(x,y,n,row);
-        }
-        else
-        {
-	  draw_sprite(x,y,n,row);
-        }
-      }
+      if(!ISSET_BIT(sprite_line_,b))
+        continue;
+      int dx = sprites_[b].x - sprites_[a].x;
+      uint64_t overlap;
+      if(dx >= 0)
+        overlap = dx < 64 ? opaque[a] & (opaque[b] >> dx) : 0;
+      else
+        overlap = dx > -64 ? (opaque[a] >> -dx) & opaque[b] : 0;
+      if(overlap)
+        mm |= (1 << a) | (1 << b);
     }
   }
+  if(mm != 0)
+  {
+    if(sprite_sprite_collision_ == 0)
+      irq_status_ |= (1<<2);
+    sprite_sprite_collision_ |= mm;
+  }
+  if(mb != 0)
+  {
+    if(sprite_bg_collision_ == 0)
+      irq_status_ |= (1<<1);
+    sprite_bg_collision_ |= mb;
+  }
+  if(mm != 0 || mb != 0)
+    update_irq_line();
+}
+
+void Vic::draw_raster_sprites()
+{
+  if(sprite_line_ == 0)
+    return;
+  int rstr = raster_counter();
+  int y = rstr - kFirstVisibleLine;
+  int sp_y = rstr - kSpritesFirstLine;
+  uint64_t opaque[8], hi[8], lo[8];
+  for(int n=0 ; n < 8 ; n++)
+  {
+    if(ISSET_BIT(sprite_line_,n))
+      opaque[n] = sprite_row(n,sp_y,&hi[n],&lo[n]);
+  }
+  if(collisions_)
+    sprite_collisions(opaque);
+  /* sprites do not show over the border */
+  if(is_screen_off() || rstr < kGFirstLine || rstr >= kGLastLine)
+    return;
+  if(!ISSET_BIT(cr1_,3) && (y<=kGFirstLine-12 || y>=kGLastLine-18))
+    return;
+  int left = kGFirstCol + 1;
+  int right = kGFirstCol + 1 + kGResX;
+  // 38 column mode
+  if(!ISSET_BIT(cr2_,3))
+  {
+    left += 8;
+    right -= 9;
+  }
+  uint16_t *line = io_->screen_line(y);
+  /* sprite 0 has the highest priority, so it is drawn last */
+  for(int n=7; n >= 0 ; n--)
+  {
+    if(!ISSET_BIT(sprite_line_,n))
+      continue;
+    const SpriteDesc *s = &sprites_[n];
+    uint64_t vis = opaque[n] & pixel_range(left - s->x, right - s->x, s->width);
+    if(vis == 0)
+      continue;
+    if(s->behind)
+      vis &= ~fg_bits(s->x);
+    paint_sprite(line + s->x, s, vis, hi[n], lo[n]);
+  }
 }
 
 // helpers ///////////////////////////////////////////////////////////////////
 
+/**
+ * @brief drive the cpu irq line
+ *
+ * The VIC keeps its IRQ output asserted for as long as there
+ * are unacknowledged, enabled interrupts in the status register.
+ * Collisions latch their status bit even while disabled.
+ */
+void Vic::update_irq_line()
+{
+  cpu_->irq_line(Cpu::kIrqSourceVic, (irq_status_ & irq_enabled_ & 0xf) != 0);
+}
+
 void Vic::raster_counter(int v)
 {
   // For PAL machines, raster can be between 0-319
@@ -1025,3 +1283,45 @@ int Vic::sprite_x(int n)
     x |= 1 << 8;
   return x;
 }
+
+/**
+ * @brief saves or restores registers, raster position and pointers
+ */
+void Vic::snapshot(Snapshot *s)
+{
+  s->bytes(mx_,sizeof(mx_));
+  s->bytes(my_,sizeof(my_));
+  s->value(msbx_);
+  s->value(sprite_enabled_);
+  s->value(sprite_priority_);
+  s->value(sprite_multicolor_);
+  s->value(sprite_double_width_);
+  s->value(sprite_double_height_);
+  s->bytes(sprite_shared_colors_,sizeof(sprite_shared_colors_));
+  s->bytes(sprite_colors_,sizeof(sprite_colors_));
+  s->value(sprite_sprite_collision_);
+  s->value(sprite_bg_collision_);
+  s->value(border_color_);
+  s->bytes(bgcolor_,sizeof(bgcolor_));
+  s->value(next_raster_at_);
+  s->value(frame_c_);
+  s->value(cr1_);
+  s->value(cr2_);
+  s->value(raster_c_);
+  s->value(raster_irq_);
+  s->value(irq_status_);
+  s->value(irq_enabled_);
+  s->value(screen_mem_);
+  s->value(char_mem_);
+  s->value(bitmap_mem_);
+  s->value(mem_pointers_);
+  s->value(vscrollPtr_);
+  if(!s->saving())
+  {
+    set_graphic_mode();
+    vm_row_ = -1;
+    sprites_dirty_ = true;
+    drawn_x_ = 0;
+    dma_done_ = true;
+  }
+}
@@ -0,0 +1,161 @@
+#include <drivers/ac97.h>
+
+using namespace myos;
+using namespace myos::drivers;
+using namespace myos::hardwarecommunication;
+
+// The codec comes up at 48kHz stereo, the rate every AC'97 codec has to
+// support, so the variable rate registers are left alone.
+
+AC97BufferDescriptor AC97Driver::descriptors[AC97_BUFFERS] __attribute__((aligned(8)));
+int16_t AC97Driver::ring[AC97_RING_FRAMES * 2] __attribute__((aligned(8)));
+
+AC97Driver::AC97Driver()
+:   mixerBase(0),
+    busMasterBase(0),
+    active(false),
+    writeFrame(0),
+    clearFrame(0)
+{
+}
+
+AC97Driver::~AC97Driver()
+{
+    if(active)
+    {
+        Port8Bit control(busMasterBase + AC97_PO_CR);
+        control.Write(0);
+    }
+}
+
+// Looks for the PCI audio controller, resets the codec and starts the
+// PCM out DMA looping over a silent ring
+bool AC97Driver::Initialize(PeripheralComponentInterconnectController* pci)
+{
+    PeripheralComponentInterconnectDeviceDescriptor dev;
+
+    if(!pci->FindDevice(0x04, 0x01, &dev))
+        return false;
+
+    BaseAddressRegister nam = pci->GetBaseAddressRegister(dev.bus, dev.device, dev.function, 0);
+    BaseAddressRegister nabm = pci->GetBaseAddressRegister(dev.bus, dev.device, dev.function, 1);
+    if(nam.type != InputOutput || nam.address == 0 || nabm.type != InputOutput || nabm.address == 0)
+        return false;		// HD audio controllers only have a memory BAR
+
+    uint32_t command = pci->Read(dev.bus, dev.device, dev.function, 0x04);
+    pci->Write(dev.bus, dev.device, dev.function, 0x04, (command & 0xFFFF) | 0x05);	// I/O space + bus master
+
+    mixerBase = (uint32_t)nam.address;
+    busMasterBase = (uint32_t)nabm.address;
+
+    Port32Bit globalControl(busMasterBase + AC97_GLOBAL_CONTROL);
+    Port32Bit globalStatus(busMasterBase + AC97_GLOBAL_STATUS);
+    globalControl.Write(AC97_GC_COLD_RESET);
+    uint32_t timeout = 1000000;
+    while(!(globalStatus.Read() & AC97_GS_CODEC_READY))
+        if(--timeout == 0)
+            return false;
+
+    Port16Bit mixerReset(mixerBase + AC97_NAM_RESET);
+    Port16Bit masterVolume(mixerBase + AC97_NAM_MASTER_VOLUME);
+    Port16Bit pcmVolume(mixerBase + AC97_NAM_PCM_VOLUME);
+    mixerReset.Write(0);
+    masterVolume.Write(0x0000);		// 0dB, unmuted
+    pcmVolume.Write(0x0808);		// 0dB, unmuted
+
+    Port8Bit control(busMasterBase + AC97_PO_CR);
+    control.Write(AC97_CR_RESET);
+    timeout = 1000000;
+    while(control.Read() & AC97_CR_RESET)
+        if(--timeout == 0)
+            return false;
+
+    // no paging, the addresses are physical
+    for(int i = 0; i < AC97_BUFFERS; i++)
+    {
+        descriptors[i].address = (uint32_t)&ring[i * AC97_BUFFER_FRAMES * 2];
+        descriptors[i].samples = AC97_BUFFER_FRAMES * 2;
+        descriptors[i].flags = 0;
+    }
+    for(int i = 0; i < AC97_RING_FRAMES * 2; i++)
+        ring[i] = 0;
+
+    Start();
+    active = true;
+    return true;
+}
+
+// (re)starts the DMA at the current index, the last valid index is kept
+// one behind it so the controller never runs out of buffers
+void AC97Driver::Start()
+{
+    Port32Bit bdbar(busMasterBase + AC97_PO_BDBAR);
+    Port8Bit civ(busMasterBase + AC97_PO_CIV);
+    Port8Bit lvi(busMasterBase + AC97_PO_LVI);
+    Port8Bit control(busMasterBase + AC97_PO_CR);
+
+    bdbar.Write((uint32_t)descriptors);
+    lvi.Write((civ.Read() - 1) & (AC97_BUFFERS - 1));
+    control.Write(AC97_CR_RUN);
+
+    writeFrame = (PlayFrame() + AC97_LEAD_BUFFERS * AC97_BUFFER_FRAMES) & (AC97_RING_FRAMES - 1);
+}
+
+// stereo frame the DMA is reading
+uint32_t AC97Driver::PlayFrame()
+{
+    Port8Bit civ(busMasterBase + AC97_PO_CIV);
+    Port16Bit picb(busMasterBase + AC97_PO_PICB);
+
+    uint32_t index = civ.Read() & (AC97_BUFFERS - 1);
+    uint32_t left = (picb.Read() / 2) & (AC97_BUFFER_FRAMES * 2 - 1);
+    if(left > AC97_BUFFER_FRAMES)
+        left = AC97_BUFFER_FRAMES;
+    return (index * AC97_BUFFER_FRAMES + AC97_BUFFER_FRAMES - left) & (AC97_RING_FRAMES - 1);
+}
+
+// Queues count mono samples, played on both channels. When the writer has
+// fallen behind the DMA it starts over a little ahead of it, samples that
+// would end up too far ahead (warp mode) are dropped.
+void AC97Driver::Write(const int16_t* samples, uint32_t count)
+{
+    if(!active)
+        return;
+
+    Port8Bit civ(busMasterBase + AC97_PO_CIV);
+    Port8Bit lvi(busMasterBase + AC97_PO_LVI);
+    Port16Bit status(busMasterBase + AC97_PO_SR);
+
+    uint16_t sr = status.Read();
+    status.Write(AC97_SR_CLEAR);
+    if(sr & AC97_SR_HALTED)
+        Start();
+    lvi.Write((civ.Read() - 1) & (AC97_BUFFERS - 1));
+
+    // silence what has been played since the last call
+    uint32_t play = PlayFrame();
+    while(clearFrame != play)
+    {
+        ring[clearFrame * 2] = 0;
+        ring[clearFrame * 2 + 1] = 0;
+        clearFrame = (clearFrame + 1) & (AC97_RING_FRAMES - 1);
+    }
+
+    uint32_t lead = (writeFrame - play) & (AC97_RING_FRAMES - 1);
+    if(lead > AC97_RING_FRAMES / 2)		// underrun, the DMA has passed us
+    {
+        lead = AC97_LEAD_BUFFERS * AC97_BUFFER_FRAMES;
+        writeFrame = (play + lead) & (AC97_RING_FRAMES - 1);
+    }
+    if(lead >= AC97_MAX_LEAD_BUFFERS * AC97_BUFFER_FRAMES)
+        return;
+    if(lead + count > AC97_MAX_LEAD_BUFFERS * AC97_BUFFER_FRAMES)
+        count = AC97_MAX_LEAD_BUFFERS * AC97_BUFFER_FRAMES - lead;
+
+    for(uint32_t i = 0; i < count; i++)
+    {
+        ring[writeFrame * 2] = samples[i];
+        ring[writeFrame * 2 + 1] = samples[i];
+        writeFrame = (writeFrame + 1) & (AC97_RING_FRAMES - 1);
+    }
+}
@@ -0,0 +1,388 @@
+#include <drivers/ahci.h>
+#include <drivers/pit.h>
+#include <lib/stdio.h>
+#include <lib/string.h>
+
+using namespace myos;
+using namespace myos::drivers;
+using namespace myos::hardwarecommunication;
+
+// no paging, so every address handed to the HBA is physical
+AHCICommandHeader AHCIDriver::commandList[AHCI_MAX_SLOTS] __attribute__((aligned(1024)));
+uint8_t AHCIDriver::receivedFis[256] __attribute__((aligned(256)));
+AHCICommandTable AHCIDriver::commandTables[AHCI_MAX_SLOTS] __attribute__((aligned(128)));
+uint8_t AHCIDriver::bounce[AHCI_BOUNCE_SECTORS * 512] __attribute__((aligned(16)));
+
+AHCIDriver::AHCIDriver()
+:   hba(0),
+    port(0),
+    portNumber(-1),
+    slots(1),
+    ncq(false),
+    issued(0),
+    pendingWrites(0),
+    sizeSectors(0)
+{
+    model[0] = 0;
+}
+
+AHCIDriver::~AHCIDriver()
+{
+}
+
+// Finds the controller and the first port with a disk, BAR5 holds the
+// HBA registers
+bool AHCIDriver::Initialize(PeripheralComponentInterconnectController* pci)
+{
+    PeripheralComponentInterconnectDeviceDescriptor dev;
+
+    if(!pci->FindDevice(0x01, 0x06, &dev))
+        return false;
+
+    uint32_t abar = pci->Read(dev.bus, dev.device, dev.function, 0x24) & ~0xF;
+    if(abar == 0)
+        return false;
+
+    uint32_t command = pci->Read(dev.bus, dev.device, dev.function, 0x04);
+    pci->Write(dev.bus, dev.device, dev.function, 0x04, (command & 0xFFFF) | 0x06);	// memory space + bus master
+
+    hba = (volatile uint32_t*)abar;
+    hba[AHCI_GHC / 4] |= AHCI_GHC_AE;
+    uint32_t cap = hba[AHCI_CAP / 4];
+    uint32_t implemented = hba[AHCI_PI / 4];
+
+    for(int p = 0; p < 32 && port == 0; p++)
+    {
+        if(!(implemented & (1 << p)))
+            continue;
+        volatile uint32_t* px = hba + (AHCI_PORT_BASE + p * AHCI_PORT_SIZE) / 4;
+        if((px[AHCI_PX_SSTS / 4] & AHCI_PX_SSTS_DET) != AHCI_PX_SSTS_DET_PRESENT)
+            continue;
+        if(px[AHCI_PX_SIG / 4] != AHCI_SIG_ATA)
+            continue;			// ATAPI, port multiplier or enclosure
+        port = px;
+        portNumber = p;
+    }
+    if(port == 0)
+        return false;
+
+    slots = ((cap >> AHCI_CAP_NCS_SHIFT) & 0x1F) + 1;
+    if(!StartPort())
+        return false;
+
+    // one slot until the drive said how deep its queue is
+    int hbaSlots = slots;
+    slots = 1;
+    int depth = Identify();
+    if(depth < 0)
+        return false;
+
+    ncq = ncq && (cap & AHCI_CAP_SNCQ);
+    slots = ncq && depth < hbaSlots ? depth : hbaSlots;
+    return true;
+}
+
+void AHCIDriver::PrintIdentify()
+{
+    printf("SATA port %d", portNumber);
+    printf("\n        Model : %s", model);
+    printf("\n    Size (MB) : %d - ", sizeSectors / 2048);
+    if(ncq)
+        printf("NCQ, %d tags", slots);
+    else
+        printf("DMA, %d slots", slots);
+}
+
+// Clears ST and FRE and waits for the engines to stop, which also
+// drops every issued command
+void AHCIDriver::StopPort()
+{
+    Write(AHCI_PX_CMD, Read(AHCI_PX_CMD) & ~AHCI_PX_CMD_ST);
+    uint32_t start = PITDriver::Microseconds();
+    while((Read(AHCI_PX_CMD) & AHCI_PX_CMD_CR) && PITDriver::Microseconds() - start < 500000)
+        ;
+    Write(AHCI_PX_CMD, Read(AHCI_PX_CMD) & ~AHCI_PX_CMD_FRE);
+    start = PITDriver::Microseconds();
+    while((Read(AHCI_PX_CMD) & AHCI_PX_CMD_FR) && PITDriver::Microseconds() - start < 500000)
+        ;
+}
+
+bool AHCIDriver::StartPort()
+{
+    StopPort();
+
+    memset(commandList, 0, sizeof(commandList));
+    memset(receivedFis, 0, sizeof(receivedFis));
+    Write(AHCI_PX_CLB, (uint32_t)commandList);
+    Write(AHCI_PX_CLBU, 0);
+    Write(AHCI_PX_FB, (uint32_t)receivedFis);
+    Write(AHCI_PX_FBU, 0);
+    Write(AHCI_PX_SERR, 0xFFFFFFFF);	// write one to clear
+    Write(AHCI_PX_IS, 0xFFFFFFFF);
+    Write(AHCI_PX_IE, 0);		// polled
+    Write(AHCI_PX_CMD, Read(AHCI_PX_CMD) | AHCI_PX_CMD_FRE);
+
+    uint32_t start = PITDriver::Microseconds();
+    while(Read(AHCI_PX_TFD) & (AHCI_TFD_BSY | AHCI_TFD_DRQ))
+        if(PITDriver::Microseconds() - start >= AHCI_TIMEOUT)
+            return false;
+
+    Write(AHCI_PX_CMD, Read(AHCI_PX_CMD) | AHCI_PX_CMD_ST);
+    issued = 0;
+    return true;
+}
+
+// Restarts the port after an error, whatever was in flight is lost
+int AHCIDriver::Recover()
+{
+    issued = 0;
+    pendingWrites = 0;
+    StartPort();
+    return 2;
+}
+
+// A slot no command occupies, finished ones are reaped first. Waits
+// when all are busy, -1 on an error or timeout.
+int AHCIDriver::FreeSlot()
+{
+    uint32_t start = PITDriver::Microseconds();
+    while(1)
+    {
+        if(Read(AHCI_PX_IS) & AHCI_PX_IS_TFES)
+        {
+            Recover();
+            return -1;
+        }
+        issued &= Read(AHCI_PX_CI) | Read(AHCI_PX_SACT);
+        for(int s = 0; s < slots; s++)
+            if(!(issued & (1 << s)))
+                return s;
+        if(PITDriver::Microseconds() - start >= AHCI_TIMEOUT)
+        {
+            Recover();
+            return -1;
+        }
+    }
+}
+
+// Builds the FIS and PRDs for one command in a free slot and starts it.
+// With NCQ the sector count moves to the feature register and the
+// slot number is the tag. Returns the slot, -1 on failure.
+int AHCIDriver::Issue(uint8_t command, uint32_t sectorNum, uint8_t* buffer, uint32_t sectors, bool write)
+{
+    int slot = FreeSlot();
+    if(slot < 0)
+        return -1;
+
+    bool queued = command == AHCI_CMD_READ_FPDMA || command == AHCI_CMD_WRITE_FPDMA;
+    bool lba = command != AHCI_CMD_IDENTIFY && command != AHCI_CMD_FLUSH_EXT;
+    AHCICommandTable* table = &commandTables[slot];
+    uint8_t* fis = table->fis;
+    memset(fis, 0, sizeof(table->fis));
+    fis[0] = AHCI_FIS_REG_H2D;
+    fis[1] = AHCI_FIS_COMMAND;
+    fis[2] = command;
+    fis[4] = sectorNum & 0xFF;
+    fis[5] = (sectorNum >> 8) & 0xFF;
+    fis[6] = (sectorNum >> 16) & 0xFF;
+    fis[7] = lba ? 0x40 : 0;		// LBA mode
+    fis[8] = (sectorNum >> 24) & 0xFF;
+    if(queued)
+    {
+        fis[3] = sectors & 0xFF;
+        fis[11] = (sectors >> 8) & 0xFF;
+        fis[12] = slot << 3;
+    }
+    else
+    {
+        fis[12] = sectors & 0xFF;
+        fis[13] = (sectors >> 8) & 0xFF;
+    }
+
+    // the buffer is contiguous, it is only cut to descriptor size
+    uint32_t address = (uint32_t)buffer;
+    uint32_t left = sectors * 512;
+    int n = 0;
+    while(left > 0)
+    {
+        uint32_t chunk = left > AHCI_PRD_BYTES ? AHCI_PRD_BYTES : left;
+        table->prd[n].address = address;
+        table->prd[n].addressHigh = 0;
+        table->prd[n].reserved = 0;
+        table->prd[n].byteCount = chunk - 1;
+        address += chunk;
+        left -= chunk;
+        n++;
+    }
+
+    AHCICommandHeader* header = &commandList[slot];
+    header->flags = 5 | (write ? 0x40 : 0);	// 5 dword FIS
+    header->prdtLength = n;
+    header->prdByteCount = 0;
+    header->tableAddress = (uint32_t)table;
+    header->tableAddressHigh = 0;
+
+    issued |= 1 << slot;
+    __sync_synchronize();
+    if(queued)
+        Write(AHCI_PX_SACT, 1 << slot);
+    Write(AHCI_PX_CI, 1 << slot);
+    return slot;
+}
+
+// Waits for the slots in mask, queued ones are done once their SACT
+// bit clears, the others once CI does
+int AHCIDriver::Complete(uint32_t mask)
+{
+    uint32_t start = PITDriver::Microseconds();
+    while((Read(AHCI_PX_CI) | Read(AHCI_PX_SACT)) & mask)
+    {
+        if(Read(AHCI_PX_IS) & AHCI_PX_IS_TFES)
+            return Recover();
+        if(PITDriver::Microseconds() - start >= AHCI_TIMEOUT)
+            return Recover() + 1;
+    }
+    if(Read(AHCI_PX_TFD) & AHCI_TFD_ERR)
+        return Recover();
+    issued &= ~mask;
+    return 0;
+}
+
+// Cuts the request into commands, issues all of them and then waits.
+// Buffers at odd addresses, which a PRD cannot describe, are moved
+// through the bounce buffer one command at a time.
+int AHCIDriver::Transfer(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors, bool write)
+{
+    uint8_t command;
+    if(ncq)
+        command = write ? AHCI_CMD_WRITE_FPDMA : AHCI_CMD_READ_FPDMA;
+    else
+        command = write ? AHCI_CMD_WRITE_DMA_EXT : AHCI_CMD_READ_DMA_EXT;
+
+    if((uint32_t)buffer & 1)
+    {
+        while(sectors > 0)
+        {
+            uint32_t n = sectors > AHCI_BOUNCE_SECTORS ? AHCI_BOUNCE_SECTORS : sectors;
+            if(write)
+                memcpy(bounce, buffer, n * 512);
+            int slot = Issue(command, sectorNum, bounce, n, write);
+            if(slot < 0)
+                return 2;
+            int result = Complete(1 << slot);
+            if(result != 0)
+                return result;
+            if(!write)
+                memcpy(buffer, bounce, n * 512);
+            sectorNum += n;
+            buffer += n * 512;
+            sectors -= n;
+        }
+        return 0;
+    }
+
+    uint32_t mask = 0;
+    while(sectors > 0)
+    {
+        uint32_t n = sectors > AHCI_MAX_SECTORS_PER_COMMAND ? AHCI_MAX_SECTORS_PER_COMMAND : sectors;
+        int slot = Issue(command, sectorNum, buffer, n, write);
+        if(slot < 0)
+            return 2;
+        mask |= 1 << slot;
+        sectorNum += n;
+        buffer += n * 512;
+        sectors -= n;
+    }
+    return Complete(mask);
+}
+
+// IDENTIFY DEVICE, keeps model, size and NCQ support. Returns the queue
+// depth, -1 when the drive does not answer.
+int AHCIDriver::Identify()
+{
+    int slot = Issue(AHCI_CMD_IDENTIFY, 0, bounce, 1, false);
+    if(slot < 0 || Complete(1 << slot) != 0)
+        return -1;
+
+    uint16_t* words = (uint16_t*)bounce;
+    for(int x = 0; x < 20; x++)
+    {
+        model[x * 2] = words[27 + x] >> 8;
+        model[x * 2 + 1] = words[27 + x] & 0xFF;
+    }
+    model[40] = 0;
+
+    if(words[83] & (1 << 10))		// 48 bit addressing
+        sizeSectors = words[100] | ((uint32_t)words[101] << 16);
+    else
+        sizeSectors = words[60] | ((uint32_t)words[61] << 16);
+
+    ncq = (words[76] & (1 << 8)) != 0;
+    return (words[75] & 0x1F) + 1;
+}
+
+int AHCIDriver::ReadSectors(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors)
+{
+    // queued commands may be reordered, so no read overtakes a write
+    if(issued != 0)
+    {
+        int result = Complete(issued);
+        if(result != 0)
+            return result;
+    }
+    return Transfer(sectorNum, buffer, sectors, false);
+}
+
+// Like the ATA driver, a write is on the disk with the cache flushed
+// when this returns
+int AHCIDriver::WriteSectors(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors)
+{
+    int result = Transfer(sectorNum, buffer, sectors, true);
+    pendingWrites += sectors;
+    int flush = Sync();
+    return result != 0 ? result : flush;
+}
+
+// Takes slots for the write and returns without waiting
+int AHCIDriver::QueueWrite(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors)
+{
+    if((uint32_t)buffer & 1)
+    {
+        int result = Transfer(sectorNum, buffer, sectors, true);
+        pendingWrites += sectors;
+        return result;
+    }
+
+    uint8_t command = ncq ? AHCI_CMD_WRITE_FPDMA : AHCI_CMD_WRITE_DMA_EXT;
+    while(sectors > 0)
+    {
+        uint32_t n = sectors > AHCI_MAX_SECTORS_PER_COMMAND ? AHCI_MAX_SECTORS_PER_COMMAND : sectors;
+        if(Issue(command, sectorNum, buffer, n, true) < 0)
+            return 2;
+        pendingWrites += n;
+        sectorNum += n;
+        buffer += n * 512;
+        sectors -= n;
+    }
+    return 0;
+}
+
+// Waits for everything in flight, then flushes the drive cache if
+// anything was written. FLUSH is not queued, so it goes out alone.
+int AHCIDriver::Sync()
+{
+    if(issued != 0)
+    {
+        int result = Complete(issued);
+        if(result != 0)
+            return result;
+    }
+    if(pendingWrites == 0)
+        return 0;
+
+    pendingWrites = 0;
+    int slot = Issue(AHCI_CMD_FLUSH_EXT, 0, 0, 0, false);
+    if(slot < 0)
+        return 5;
+    return Complete(1 << slot);
+}
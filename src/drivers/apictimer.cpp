@@ -0,0 +1,126 @@
+#include <drivers/apictimer.h>
+#include <drivers/pit.h>
+
+using namespace myos;
+using namespace myos::drivers;
+using namespace myos::hardwarecommunication;
+
+extern uint32_t current_milli;
+
+static void ReadMSR(uint32_t msr, uint32_t* lo, uint32_t* hi)
+{
+    __asm__ volatile("rdmsr" : "=a" (*lo), "=d" (*hi) : "c" (msr));
+}
+
+static void WriteMSR(uint32_t msr, uint32_t lo, uint32_t hi)
+{
+    __asm__ volatile("wrmsr" : : "c" (msr), "a" (lo), "d" (hi));
+}
+
+APICTimerDriver::APICTimerDriver(InterruptManager* manager)
+:   InterruptHandler(manager, manager->HardwareInterruptOffset() + APIC_TIMER_INTERRUPT),
+    localApic(0),
+    deadlineMode(false),
+    countPerWindow(0),
+    armed(false),
+    armedMilli(0)
+{
+}
+
+APICTimerDriver::~APICTimerDriver()
+{
+}
+
+// Needs the TSC calibrated by the PIT driver, the PIT stays the timer
+// when this fails
+bool APICTimerDriver::Initialize()
+{
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (1), "c" (0));
+    if((edx & (1 << 9)) == 0 || PITDriver::TSCFrequencyKHz() == 0)
+        return false;
+
+    uint32_t lo, hi;
+    ReadMSR(IA32_APIC_BASE, &lo, &hi);
+    if((lo & IA32_APIC_BASE_ENABLE) == 0)
+        return false;
+    localApic = (volatile uint32_t*)(lo & 0xFFFFF000);
+    deadlineMode = (ecx & (1 << 24)) != 0;
+
+    Write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    Write(LAPIC_LVT_LINT0, LAPIC_LVT_EXTINT);
+    Write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+    Write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_BY_1);
+    if(!deadlineMode)
+    {
+        Calibrate();
+        if(countPerWindow == 0)
+            return false;
+    }
+    Write(LAPIC_LVT_TIMER, InterruptNumber | (deadlineMode ? LAPIC_LVT_TSC_DEADLINE : 0));
+
+    interruptManager->SetEventTimer(InterruptNumber, this);
+    return true;
+}
+
+// Counts the timer down, masked, for a power of two of TSC cycles so the
+// conversion in Program() is a shift
+void APICTimerDriver::Calibrate()
+{
+    uint32_t flags;
+    __asm__ volatile("pushfl; popl %0; cli" : "=r" (flags));
+    Write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    uint64_t start = PITDriver::ReadTSC();
+    Write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    while(PITDriver::ReadTSC() - start < (1ULL << APIC_TIMER_CALIBRATION_SHIFT))
+        __asm__ volatile("pause");
+    countPerWindow = 0xFFFFFFFF - Read(LAPIC_TIMER_CURRENT);
+    Write(LAPIC_TIMER_INITIAL, 0);
+    if(flags & 0x200)
+        __asm__ volatile("sti");
+}
+
+uint32_t APICTimerDriver::HandleInterrupt(uint32_t esp)
+{
+    armed = false;
+    Write(LAPIC_EOI, 0);
+    return esp;
+}
+
+// forward only, the PIT ticks counted until the switch may be ahead
+void APICTimerDriver::Update()
+{
+    uint32_t now = PITDriver::Milliseconds();
+    if((int32_t)(now - current_milli) > 0)
+        current_milli = now;
+}
+
+// Arms the interrupt for the next event unless an earlier one is armed
+// already, the register write is a VM exit under a hypervisor. Something
+// due now, e.g. a slice that ran out while preemption is held off, waits
+// for the next millisecond like it would for a tick.
+void APICTimerDriver::Program(TaskManager* taskManager)
+{
+    uint32_t next = taskManager->NextEvent(current_milli + APIC_TIMER_MAX_IDLE);
+    if((int32_t)(next - current_milli) <= 0)
+        next = current_milli + 1;
+    if(armed && (int32_t)(next - armedMilli) >= 0)
+        return;
+    armed = true;
+    armedMilli = next;
+
+    uint64_t deadline = PITDriver::TSCAtMillisecond(next);
+    if(deadlineMode)
+    {
+        WriteMSR(IA32_TSC_DEADLINE, (uint32_t)deadline, (uint32_t)(deadline >> 32));
+        return;
+    }
+    uint64_t now = PITDriver::ReadTSC();
+    uint64_t count = deadline > now
+        ? ((deadline - now) * countPerWindow) >> APIC_TIMER_CALIBRATION_SHIFT : 0;
+    if(count == 0)
+        count = 1;
+    if(count > 0xFFFFFFFF)
+        count = 0xFFFFFFFF;
+    Write(LAPIC_TIMER_INITIAL, (uint32_t)count);
+}
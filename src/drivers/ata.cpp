@@ -1,9 +1,10 @@
 #include <drivers/ata.h>
+#include <drivers/pit.h>
 
 using namespace myos;
 using namespace myos::drivers;
 
-// Uses PiO (Programmed IO) (slower than DMA)
+// Uses PiO (Programmed IO), or PCI bus master DMA once EnableDMA() found the controller
 // Standard IO is 0x01 and 0x06 port and interrupt.  Should get from PCI, but this is mostly standard
 // PiO has 28 and 48 bit modes (this driver supports both)
 // Sector is 512 bytes  - 512 x 2^28 = 4GB
@@ -27,7 +28,15 @@ AdvancedTechnologyAttachment::AdvancedTechnologyAttachment(bool master, uint16_t
     regAltStatus(portBase + 0xC),
     regDevAddress(portBase + 0xD),
     controlPort(portBase + 0x206),		// status messages
-    lastError(0)
+    lastError(0),
+    portBase(portBase),
+    busMasterBase(0),
+    present(false),
+    type(IDE_ATA),
+    lba48(false),
+    sizeSectors(0),
+    probeState(ATA_PROBE_IDLE),
+    probeStart(0)
 {
     this->master = master;
 }
@@ -36,85 +45,64 @@ AdvancedTechnologyAttachment::~AdvancedTechnologyAttachment()
 {
 }
             
-void AdvancedTechnologyAttachment::Identify()
+// Selects the drive and sends IDENTIFY, false when the bus floats
+bool AdvancedTechnologyAttachment::BeginIdentify()
 {
-    devicePort.Write(master ? 0xA0 : 0xB0);	
+    present = false;
+    devicePort.Write(master ? 0xA0 : 0xB0);		// Select which drive to talk to
     controlPort.Write(0);				// clears HOB bit
+    for(int i=0; i < 4; i++)				// 400ns for the select to settle
+      controlPort.Read();
     
-    devicePort.Write(0xA0);				// Reading status from master (not slave)
     uint8_t status = commandPort.Read();
     if(status == 0xFF || status == 0x00)		// If 255, no device is on this bus
-    {
-      printf("no device\n");
-      return;
-    }
+      return false;
     
-    devicePort.Write(master ? 0xA0 : 0xB0);		// Select which drive to talk to
     sectorCountPort.Write(0);				// How many sectors to read or write
     lbaLowPort.Write(0);				// The sector number
     lbaMidPort.Write(0);				// The sector number
     lbaHiPort.Write(0);					// The sector number
     commandPort.Write(ATA_CMD_IDENTIFY); 		// Send command (Identify in this case)
-   
-    // Wait until device is ready
+    
     status = commandPort.Read();
     if(status == 0x00)					// If no device, return
-    {
-      printf("No device");
-      return;
-    }
-
-    //while(((status & ATA_SR_BSY) == ATA_SR_BSY) && ((status & ATA_SR_ERR) != ATA_SR_ERR))
-    //    status = commandPort.Read();
-    uint8_t err = 0;
+      return false;
     
-    while(1) 
-    {
-      status = commandPort.Read();
-      if ((status & ATA_SR_ERR)) {err = 1; break;} // If Err, Device is not ATA.
-      if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRQ)) break; // Everything is right.
-    }
-    
-    // Get device type
-    uint8_t type = IDE_ATA;
-    
-    if (err != 0) {
-      unsigned char cl = lbaMidPort.Read(); //ide_read(i, ATA_REG_LBA1);
-      unsigned char ch = lbaHiPort.Read(); //ide_read(i, ATA_REG_LBA2);
-
-      if (cl == 0x14 && ch ==0xEB)
-	  type = IDE_ATAPI;
-      else if (cl == 0x69 && ch == 0x96)
-	  type = IDE_ATAPI;
-    }
+    type = IDE_ATA;
+    return true;
+}
 
-    // Read the command respose
-    status = commandPort.Read();
-    
-    uint8_t buffer[512];
-    for(int x=0;x<512;x++)
-      buffer[x] = 0;
-    
-    int ctr=0;
-    for(int i=0; i < 256; i++)
+// One look at the status, reads the identify block once DRQ is up.
+// A packet device aborts IDENTIFY and is asked again with IDENTIFY PACKET.
+uint8_t AdvancedTechnologyAttachment::PollIdentify()
+{
+    uint8_t status = commandPort.Read();
+    if(status & ATA_SR_ERR)
     {
-	uint16_t wdata = dataPort.Read();
-	uint16_t swap = (wdata << 8) | ((wdata >> 8) & 0x00ff); // swap endianess
-	buffer[ctr++] = (swap >> 8) & 0xFF;
-	buffer[ctr++] = swap & 0xFF;
+      unsigned char cl = lbaMidPort.Read();
+      unsigned char ch = lbaHiPort.Read();
+      if(type == IDE_ATA && ((cl == 0x14 && ch == 0xEB) || (cl == 0x69 && ch == 0x96)))
+      {
+	type = IDE_ATAPI;
+	commandPort.Write(ATA_CMD_IDENTIFY_PACKET);
+	return ATA_PROBE_PENDING;
+      }
+      return ATA_PROBE_DONE;
     }
+    if((status & ATA_SR_BSY) || !(status & ATA_SR_DRQ))
+      return ATA_PROBE_PENDING;
+    
+    uint16_t words[ATA_SECTOR_SIZE / 2];
+    dataPort.ReadString(words, ATA_SECTOR_SIZE / 2);
+    uint8_t* buffer = (uint8_t*)words;
     
-    // Get serial #
-    uint8_t serial[21];
+    // strings are stored with the bytes of each word swapped
     for(int x=0;x<20;x+=2)
     {
       serial[x] = buffer[ATA_IDENT_SERIAL+x+1];
       serial[x+1] = buffer[ATA_IDENT_SERIAL+x];
     }
     serial[20] = 0;
-
-    // Get model #
-    uint8_t model[41];
     for(int x=0;x<40;x+=2)
     {
       model[x] = buffer[ATA_IDENT_MODEL+x+1];
@@ -122,188 +110,369 @@ void AdvancedTechnologyAttachment::Identify()
     }
     model[40] = 0;
     
-    // Get size
     uint32_t commandSets  = *((uint32_t *)(buffer + ATA_IDENT_COMMANDSETS));
-    uint32_t size = 0;
-        
-    if (commandSets & (1 << 26))
-      size   = *((uint32_t *)(buffer + ATA_IDENT_MAX_LBA_EXT));  //48-Bit Addressing
+    lba48 = (commandSets & (1 << 26)) != 0;
+    if (lba48)
+      sizeSectors = *((uint32_t *)(buffer + ATA_IDENT_MAX_LBA_EXT));  //48-Bit Addressing
     else
-      size   = *((uint32_t *)(buffer + ATA_IDENT_MAX_LBA));	// CHS or 28-Bit Addressing
+      sizeSectors = *((uint32_t *)(buffer + ATA_IDENT_MAX_LBA));	// CHS or 28-Bit Addressing
+    
+    present = true;
+    return ATA_PROBE_DONE;
+}
+
+// Identifies the drives together. Master and slave share a channel, so
+// one command is out per channel at a time, while the channels work in
+// parallel. A drive that does not answer in ATA_IDENTIFY_TIMEOUT counts
+// as absent.
+void AdvancedTechnologyAttachment::Probe(AdvancedTechnologyAttachment** drives, int count)
+{
+    for(int i=0; i < count; i++)
+      drives[i]->probeState = ATA_PROBE_IDLE;
+    
+    bool busy = true;
+    while(busy)
+    {
+      busy = false;
+      for(int i=0; i < count; i++)
+      {
+	AdvancedTechnologyAttachment* d = drives[i];
+	if(d->probeState == ATA_PROBE_DONE)
+	  continue;
+	busy = true;
+	
+	if(d->probeState == ATA_PROBE_IDLE)
+	{
+	  bool channelBusy = false;
+	  for(int j=0; j < count; j++)
+	    if(drives[j]->portBase == d->portBase && drives[j]->probeState == ATA_PROBE_PENDING)
+	      channelBusy = true;
+	  if(channelBusy)
+	    continue;
+	  d->probeStart = PITDriver::Microseconds();
+	  d->probeState = d->BeginIdentify() ? ATA_PROBE_PENDING : ATA_PROBE_DONE;
+	}
+	else if(d->PollIdentify() == ATA_PROBE_DONE) 
+	  d->probeState = ATA_PROBE_DONE;
+	else if(PITDriver::Microseconds() - d->probeStart >= ATA_IDENTIFY_TIMEOUT)
+	{
+	  d->present = false;
+	  d->probeState = ATA_PROBE_DONE;
+	}
+      }
+    }
+}
+
+void AdvancedTechnologyAttachment::Identify()
+{
+    AdvancedTechnologyAttachment* self = this;
+    Probe(&self, 1);
+    PrintIdentify();
+}
+
+void AdvancedTechnologyAttachment::PrintIdentify()
+{
+    if(!present)
+    {
+      printf("no device");
+      return;
+    }
     
     if (type == IDE_ATA) printf("ATA");
     if (type == IDE_ATAPI) printf("ATAPI");
       
-    printf("\n       Serial : %s ", &serial);
-    printf("\n        Model : %s", &model);
-    printf("\n    Size (MB) : %d - ", size*512/1024/1024);
+    printf("\n       Serial : %s ", serial);
+    printf("\n        Model : %s", model);
+    printf("\n    Size (MB) : %d - ", sizeSectors / 2048);
     
-    if (commandSets & (1 << 26)) 
+    if (lba48) 
       printf("LBA48");
     else 
       printf("LBA28");
-    
-    //displayMemory(buffer, 256);
 }
 
-void AdvancedTechnologyAttachment::ReadSector(uint32_t sectorNum, uint8_t* sector, int count)
+PhysicalRegionDescriptor AdvancedTechnologyAttachment::prdTable[2][4] __attribute__((aligned(64)));
+
+// Waits for BSY to clear and returns the status register
+uint8_t AdvancedTechnologyAttachment::WaitReady()
 {
-  uint8_t lbamode, head;
+  // reading the alternate status 4 times gives the drive its 400ns
+  for(int i=0; i < 4; i++)
+    controlPort.Read();
   
-  if(sectorNum > 0x0FFFFFFF)
-  {
-    // LBA48
-    lbamode = 2;
-    head = 0;
-  }
-  else
-  {
-    // LBA28
-    lbamode = 1;
-    head = ((sectorNum & 0x0F000000) >> 24);
-  }
+  uint8_t status = commandPort.Read();
+  while(((status & ATA_SR_BSY) == ATA_SR_BSY) && ((status & ATA_SR_ERR) != ATA_SR_ERR))
+    status = commandPort.Read();
+  return status;
+}
+
+// Programs drive, LBA and sector count for the next command
+void AdvancedTechnologyAttachment::SelectSectors(uint32_t sectorNum, uint16_t sectors, bool lba48)
+{
+  uint8_t head = lba48 ? 0 : ((sectorNum & 0x0F000000) >> 24);
     
   devicePort.Write((master ? 0xE0 : 0xF0) | head);
   errorPort.Write(0);
   
-  if(lbamode == 2)
+  if(lba48)
   {
-    //printf("\nLBA48");
-    // LBA48 mode  
-    sectorCountPort.Write(0);  // numsectors >> 8
+    // LBA48 mode, high bytes first
+    sectorCountPort.Write(sectors >> 8);
     lbaLowPort.Write((sectorNum & 0xFF000000) >> 24); 
     lbaMidPort.Write(0);
     lbaHiPort.Write(0);
   }
     
-  sectorCountPort.Write(1);					// read one sector
+  sectorCountPort.Write(sectors & 0xFF);			// 0 means 256 in LBA28 mode
   lbaLowPort.Write(sectorNum & 0x000000FF);
   lbaMidPort.Write((sectorNum & 0x0000FF00) >> 8);
   lbaHiPort.Write((sectorNum & 0x00FF0000) >> 16);
+}
 
-  if(lbamode ==2)
-    commandPort.Write(ATA_CMD_READ_PIO_EXT);			// Send read command
+// One READ/WRITE SECTORS command, the drive asks for every sector with DRQ
+int AdvancedTechnologyAttachment::TransferPIO(uint32_t sectorNum, uint8_t* buffer, uint16_t sectors, bool write)
+{
+  bool lba48 = (sectorNum + sectors - 1) > 0x0FFFFFFF;
+    
+  SelectSectors(sectorNum, sectors, lba48);
+  
+  if(write)
+    commandPort.Write(lba48 ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO);
   else
-    commandPort.Write(ATA_CMD_READ_PIO);			// Send read command
-     
-  // Wait until device is ready
-  uint8_t status = commandPort.Read();
-  while(((status & ATA_SR_BSY) == ATA_SR_BSY) && ((status & ATA_SR_ERR) != ATA_SR_ERR))
-      status = commandPort.Read();
-      
-  if(status & ATA_SR_ERR)
+    commandPort.Write(lba48 ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO);
+  
+  for(int s=0; s < sectors; s++)
   {
-      printf("ERROR");
-      return;
+    uint8_t status = WaitReady();
+    if(status & (ATA_SR_ERR | ATA_SR_DF))
+    {
+      lastError = errorPort.Read();
+      return 2;
+    }
+    if(!(status & ATA_SR_DRQ))
+      return 3;
+    
+    uint16_t* words = (uint16_t*)(buffer + s * ATA_SECTOR_SIZE);
+    if(write)
+      dataPort.WriteString(words, ATA_SECTOR_SIZE / 2);
+    else
+      dataPort.ReadString(words, ATA_SECTOR_SIZE / 2);
   }
-
-  int ctr=0;
-  for(int i=0; i < 256; i++)
+  
+  if(write)
   {
-      uint16_t wdata = dataPort.Read();
-      uint16_t swap = (wdata << 8) | ((wdata >> 8) & 0x00ff); // swap endianess
-      sector[ctr++] = (swap >> 8) & 0xFF;
-      sector[ctr++] = swap & 0xFF;
+    // Wait while device is writing the last sector
+    uint8_t status = WaitReady();
+    if(status & (ATA_SR_ERR | ATA_SR_DF))
+      return 2;
+    return Flush(lba48);
   }
   
   lastError = 0;
-  return;
-
+  return 0;
 }
 
-int AdvancedTechnologyAttachment::WriteSector(uint32_t sectorNum, uint8_t* data, uint32_t count)
-{ 
-  
-  uint8_t lbamode, head;
+// One READ/WRITE DMA command through the bus master, polled for completion
+int AdvancedTechnologyAttachment::TransferDMA(uint32_t sectorNum, uint8_t* buffer, uint16_t sectors, bool write)
+{
+  bool lba48 = (sectorNum + sectors - 1) > 0x0FFFFFFF;
+  hardwarecommunication::Port8Bit bmCommand(busMasterBase + ATA_BM_COMMAND);
+  hardwarecommunication::Port8Bit bmStatus(busMasterBase + ATA_BM_STATUS);
+  hardwarecommunication::Port32Bit bmPRDT(busMasterBase + ATA_BM_PRDT);
   
-  if(sectorNum > 0x0FFFFFFF)
+  // split the buffer at 64KB boundaries, no paging so addresses are physical
+  PhysicalRegionDescriptor* prd = prdTable[portBase == _ATA_SECOND ? 1 : 0];
+  uint32_t address = (uint32_t)buffer;
+  uint32_t left = sectors * ATA_SECTOR_SIZE;
+  int n = 0;
+  while(left > 0)
   {
-    // LBA48
-    lbamode = 2;
-    head = 0;
+    uint32_t chunk = 0x10000 - (address & 0xFFFF);
+    if(chunk > left)
+      chunk = left;
+    prd[n].address = address;
+    prd[n].byteCount = chunk & 0xFFFF;
+    prd[n].flags = 0;
+    address += chunk;
+    left -= chunk;
+    n++;
   }
+  prd[n-1].flags = 0x8000;
+  
+  uint8_t direction = write ? 0 : ATA_BM_CMD_READ;
+  bmCommand.Write(0);
+  bmPRDT.Write((uint32_t)prd);
+  bmStatus.Write(bmStatus.Read() | ATA_BM_SR_ERR | ATA_BM_SR_IRQ);	// write 1 to clear
+  bmCommand.Write(direction);
+  
+  SelectSectors(sectorNum, sectors, lba48);
+  
+  if(write)
+    commandPort.Write(lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA);
   else
-  {
-    // LBA28
-    lbamode = 1;
-    head = ((sectorNum & 0x0F000000) >> 24);
-  }
+    commandPort.Write(lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA);
   
-  if(count > 512)
-    return 1;
+  bmCommand.Write(direction | ATA_BM_CMD_START);
   
-  devicePort.Write((master ? 0xE0 : 0xF0) | head);
-  errorPort.Write(0);
+  uint8_t bm;
+  do
+    bm = bmStatus.Read();
+  while((bm & ATA_BM_SR_ACTIVE) && !(bm & (ATA_BM_SR_IRQ | ATA_BM_SR_ERR)));
   
-  if(lbamode == 2)
-  {
-    //printf("LBA48\n");
-    // LBA48 mode  
-    sectorCountPort.Write(0); // numsectors >> 8
-    lbaLowPort.Write((sectorNum & 0xFF000000) >> 24); 
-    lbaMidPort.Write(0);
-    lbaHiPort.Write(0);
-  }
-
-  sectorCountPort.Write(1);					// for now, write single sector
-  lbaLowPort.Write(  sectorNum & 0x000000FF );			// split sector # into these three ports. Low 8 bits
-  lbaMidPort.Write( (sectorNum & 0x0000FF00) >> 8);		// mid 8 bits
-  lbaHiPort.Write( (sectorNum & 0x00FF0000) >> 16 );		// high 8 bits
+  bmCommand.Write(direction);
+  uint8_t status = WaitReady();
+  bmStatus.Write(ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
   
-  if(lbamode ==2)
-    commandPort.Write(ATA_CMD_WRITE_PIO_EXT);			// Send write command
-  else
-    commandPort.Write(ATA_CMD_WRITE_PIO);			// Send write command
-
-  // Wait until device is ready
-  uint8_t status = commandPort.Read();
-  while(((status & ATA_SR_BSY) == ATA_SR_BSY) && ((status & ATA_SR_ERR) != ATA_SR_ERR))
-    status = commandPort.Read();
-      
-  if(status & ATA_SR_ERR)
-    return 2;
-   
-  // Write the bytes
-  for(int i = 0; i < count; i += 2)
+  if((bm & ATA_BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF)))
   {
-    // Write the data
-    uint16_t wdata = data[i];
-    if(i+1 < count)
-	wdata |= ((uint16_t)data[i+1]) << 8;
-    dataPort.Write(wdata);
-  }
-
-  // Device expects to always write a full sector, 
-  // otherwise will get an interrupt with an error message
-  for(int i = count + (count%2); i < 512; i += 2)
-  {
-    //printf("\nnot full sector!");
-    dataPort.Write(0x0000);
+    lastError = errorPort.Read();
+    return 2;
   }
   
-  status = commandPort.Read();
-  if(status == 0x00)
-    return 3;
-  
-  // Wait while device is flushing
-  while(((status & ATA_SR_BSY) == ATA_SR_BSY) && ((status & ATA_SR_ERR) != ATA_SR_ERR))
-    status = commandPort.Read();
+  if(write)
+    return Flush(lba48);
   
-  if(lbamode == 2)
+  lastError = 0;
+  return 0;
+}
+
+int AdvancedTechnologyAttachment::Flush(bool lba48)
+{
+  if(lba48)
     commandPort.Write(ATA_CMD_CACHE_FLUSH_EXT);			// flush command
   else
     commandPort.Write(ATA_CMD_CACHE_FLUSH);
     
-  status = commandPort.Read();
+  uint8_t status = commandPort.Read();
   if(status == 0x00)
     return 4;
   
   // Wait while device is flushing
-  while(((status & ATA_SR_BSY) == ATA_SR_BSY) && ((status & ATA_SR_ERR) != ATA_SR_ERR))
-      status = commandPort.Read();
-      
+  status = WaitReady();
   if(status & ATA_SR_ERR)
     return 5;
+  return 0;
+}
+
+// Reads whole sectors, large requests are split into 64KB commands.
+// DMA is used when available, a failing DMA transfer falls back to PIO.
+int AdvancedTechnologyAttachment::ReadSectors(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors)
+{
+  while(sectors > 0)
+  {
+    uint16_t n = sectors > ATA_MAX_SECTORS_PER_COMMAND ? ATA_MAX_SECTORS_PER_COMMAND : sectors;
+    int result = 1;
+    
+    if(busMasterBase != 0)
+    {
+      result = TransferDMA(sectorNum, buffer, n, false);
+      if(result != 0)
+      {
+	printf("\nATA DMA error %02X, using PIO", lastError);
+	busMasterBase = 0;
+      }
+    }
+    if(result != 0)
+      result = TransferPIO(sectorNum, buffer, n, false);
+    if(result != 0)
+      return result;
+    
+    sectorNum += n;
+    buffer += n * ATA_SECTOR_SIZE;
+    sectors -= n;
+  }
+  return 0;
+}
+
+int AdvancedTechnologyAttachment::WriteSectors(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors)
+{
+  while(sectors > 0)
+  {
+    uint16_t n = sectors > ATA_MAX_SECTORS_PER_COMMAND ? ATA_MAX_SECTORS_PER_COMMAND : sectors;
+    int result = 1;
+    
+    if(busMasterBase != 0)
+    {
+      result = TransferDMA(sectorNum, buffer, n, true);
+      if(result != 0)
+      {
+	printf("\nATA DMA error %02X, using PIO", lastError);
+	busMasterBase = 0;
+      }
+    }
+    if(result != 0)
+      result = TransferPIO(sectorNum, buffer, n, true);
+    if(result != 0)
+      return result;
+    
+    sectorNum += n;
+    buffer += n * ATA_SECTOR_SIZE;
+    sectors -= n;
+  }
+  return 0;
+}
+
+// Reads count bytes starting at sectorNum, a partial last sector
+// goes through a bounce buffer so only count bytes are stored
+void AdvancedTechnologyAttachment::ReadSector(uint32_t sectorNum, uint8_t* sector, int count)
+{
+  uint32_t full = count / ATA_SECTOR_SIZE;
+  uint32_t rest = count % ATA_SECTOR_SIZE;
+  
+  if(full > 0 && ReadSectors(sectorNum, sector, full) != 0)
+  {
+    printf("ERROR");
+    return;
+  }
+  
+  if(rest > 0)
+  {
+    uint8_t bounce[ATA_SECTOR_SIZE];
+    if(ReadSectors(sectorNum + full, bounce, 1) != 0)
+    {
+      printf("ERROR");
+      return;
+    }
+    for(uint32_t i=0; i < rest; i++)
+      sector[full * ATA_SECTOR_SIZE + i] = bounce[i];
+  }
+}
+
+// Writes count bytes (at most one sector), the rest of the sector is zero filled
+int AdvancedTechnologyAttachment::WriteSector(uint32_t sectorNum, uint8_t* data, uint32_t count)
+{ 
+  if(count > ATA_SECTOR_SIZE)
+    return 1;
+  
+  if(count == ATA_SECTOR_SIZE)
+    return WriteSectors(sectorNum, data, 1);
+  
+  // Device expects to always write a full sector
+  uint8_t bounce[ATA_SECTOR_SIZE];
+  for(uint32_t i=0; i < ATA_SECTOR_SIZE; i++)
+    bounce[i] = i < count ? data[i] : 0;
+  return WriteSectors(sectorNum, bounce, 1);
+}
+
+// Looks for the PCI IDE controller (class 01, subclass 01) and turns on
+// bus mastering, the bus master registers live in BAR4
+bool AdvancedTechnologyAttachment::EnableDMA(hardwarecommunication::PeripheralComponentInterconnectController* pci)
+{
+  hardwarecommunication::PeripheralComponentInterconnectDeviceDescriptor dev;
+  
+  if(!pci->FindDevice(0x01, 0x01, &dev))
+    return false;
+  
+  if(!(dev.interface_id & 0x80))				// no bus master support
+    return false;
+  
+  hardwarecommunication::BaseAddressRegister bar = pci->GetBaseAddressRegister(dev.bus, dev.device, dev.function, 4);
+  if(bar.type != hardwarecommunication::InputOutput || bar.address == 0)
+    return false;
+  
+  uint32_t command = pci->Read(dev.bus, dev.device, dev.function, 0x04);
+  pci->Write(dev.bus, dev.device, dev.function, 0x04, (command & 0xFFFF) | 0x05);	// I/O space + bus master
   
+  busMasterBase = (uint32_t)bar.address + (portBase == _ATA_SECOND ? 8 : 0);
+  return true;
 }
-        
\ No newline at end of file
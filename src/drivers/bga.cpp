@@ -0,0 +1,149 @@
+#include <drivers/bga.h>
+
+using namespace myos;
+using namespace myos::drivers;
+using namespace myos::hardwarecommunication;
+
+BGADriver* BGADriver::activeDriver = 0;
+
+// framebuffer is the linear framebuffer from BAR0, 0 if it is unknown
+BGADriver::BGADriver(uint32_t* framebuffer)
+:   Driver(),
+    indexPort(BGA_INDEX_PORT),
+    dataPort(BGA_DATA_PORT),
+    framebuffer(framebuffer),
+    width(0),
+    height(0),
+    pitch(0),
+    pageHeight(0),
+    pageFlip(false)
+{
+}
+
+BGADriver::~BGADriver()
+{
+    if(activeDriver == this)
+        activeDriver = 0;
+}
+
+void BGADriver::Activate()
+{
+    if(Detect())
+        activeDriver = this;
+}
+
+uint16_t BGADriver::ReadRegister(uint16_t index)
+{
+    indexPort.Write(index);
+    return dataPort.Read();
+}
+
+void BGADriver::WriteRegister(uint16_t index, uint16_t value)
+{
+    indexPort.Write(index);
+    dataPort.Write(value);
+}
+
+// Without the device the data port floats and reads back 0xFFFF
+bool BGADriver::Detect()
+{
+    uint16_t id = ReadRegister(BGA_INDEX_ID);
+    return id >= BGA_ID_MIN && id <= BGA_ID_MAX;
+}
+
+// Disables the display while the registers change, the device clears
+// video memory on enable. The mode is read back since the device
+// rounds or refuses what it can not do.
+bool BGADriver::SetMode(uint32_t width, uint32_t height, uint8_t bpp)
+{
+    if(!Detect())
+        return false;
+
+    WriteRegister(BGA_INDEX_ENABLE, 0);
+    WriteRegister(BGA_INDEX_XRES, width);
+    WriteRegister(BGA_INDEX_YRES, height);
+    WriteRegister(BGA_INDEX_BPP, bpp);
+    WriteRegister(BGA_INDEX_ENABLE, BGA_ENABLED | BGA_LFB_ENABLED);
+
+    pageFlip = false;
+    this->width = ReadRegister(BGA_INDEX_XRES);
+    this->height = ReadRegister(BGA_INDEX_YRES);
+    pitch = ReadRegister(BGA_INDEX_VIRT_WIDTH) * ((bpp + 7) / 8);
+    return this->width == width && this->height == height
+        && ReadRegister(BGA_INDEX_BPP) == bpp;
+}
+
+// Picks the smallest integer multiple of srcWidth x srcHeight that is
+// at least minWidth x minHeight, so the host only replicates pixels and
+// nothing drawn for the old mode, like the console, falls off screen.
+// The width is rounded up to 8 pixels as Bochs requires, the caller
+// fills the few extra columns. Returns false, keeping the old mode,
+// when no multiple fits the device limits.
+bool BGADriver::SetScaledMode(uint32_t srcWidth, uint32_t srcHeight,
+                              uint32_t minWidth, uint32_t minHeight, uint8_t bpp)
+{
+    if(!Detect())
+        return false;
+
+    uint16_t enable = ReadRegister(BGA_INDEX_ENABLE);
+    uint32_t oldWidth = ReadRegister(BGA_INDEX_XRES);
+    uint32_t oldHeight = ReadRegister(BGA_INDEX_YRES);
+    uint8_t oldBpp = ReadRegister(BGA_INDEX_BPP);
+
+    // with GETCAPS set the resolution registers read as the maximums
+    WriteRegister(BGA_INDEX_ENABLE, enable | BGA_GETCAPS);
+    uint32_t maxWidth = ReadRegister(BGA_INDEX_XRES);
+    uint32_t maxHeight = ReadRegister(BGA_INDEX_YRES);
+    WriteRegister(BGA_INDEX_ENABLE, enable);
+    if(maxWidth < oldWidth || maxHeight < oldHeight)
+    {
+        // older devices without GETCAPS
+        maxWidth = oldWidth;
+        maxHeight = oldHeight;
+    }
+
+    uint32_t scale = 1;
+    while(scale * srcWidth < minWidth || scale * srcHeight < minHeight)
+        scale++;
+    uint32_t modeWidth = (scale * srcWidth + 7) & ~7;
+    uint32_t modeHeight = scale * srcHeight;
+    if(modeWidth > maxWidth || modeHeight > maxHeight)
+        return false;
+
+    if(SetMode(modeWidth, modeHeight, bpp))
+        return true;
+    SetMode(oldWidth, oldHeight, oldBpp);
+    return false;
+}
+
+// Asks for a virtual screen twice the visible height. The device clamps
+// it to what fits in video memory, so the value read back tells whether
+// there is room for a second page. The mode has to be the one the
+// framebuffer was set up for, or the pages would not line up.
+bool BGADriver::EnablePageFlip(uint32_t width, uint32_t height)
+{
+    if(!Detect())
+        return false;
+    if((ReadRegister(BGA_INDEX_ENABLE) & BGA_ENABLED) == 0
+       || ReadRegister(BGA_INDEX_XRES) != width
+       || ReadRegister(BGA_INDEX_YRES) != height)
+        return false;
+
+    WriteRegister(BGA_INDEX_VIRT_HEIGHT, height * 2);
+    if(ReadRegister(BGA_INDEX_VIRT_HEIGHT) < height * 2)
+        return false;
+
+    pageHeight = height;
+    pageFlip = true;
+    ShowPage(0);
+    return true;
+}
+
+// Takes effect with the next scan out, only the start offset changes
+void BGADriver::ShowPage(uint8_t page)
+{
+    if(!pageFlip)
+        return;
+    WriteRegister(BGA_INDEX_X_OFFSET, 0);
+    WriteRegister(BGA_INDEX_Y_OFFSET, page * pageHeight);
+}
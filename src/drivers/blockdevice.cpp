@@ -0,0 +1,31 @@
+#include <drivers/blockdevice.h>
+
+using namespace myos::drivers;
+
+BlockDevice::BlockDevice()
+{
+}
+
+BlockDevice::~BlockDevice()
+{
+}
+
+int BlockDevice::ReadSectors(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors)
+{
+    return 1;
+}
+
+int BlockDevice::WriteSectors(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors)
+{
+    return 1;
+}
+
+int BlockDevice::QueueWrite(uint32_t sectorNum, uint8_t* buffer, uint32_t sectors)
+{
+    return WriteSectors(sectorNum, buffer, sectors);
+}
+
+int BlockDevice::Sync()
+{
+    return 0;
+}
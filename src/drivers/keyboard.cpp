@@ -63,12 +63,14 @@ uint32_t KeyboardDriver::HandleInterrupt(uint32_t esp)
 	case 0x47: handler->OnKeyDown(0xFC); break;  // Cursor Home
 	case 0x48: handler->OnKeyDown(0xFD); break;  // Cursor Up  
 	case 0x50: handler->OnKeyDown(0xFE); break;  // Cursor Down
+	case 0x49: handler->OnKeyDown(0x06); break;  // Page Up
 	
 	case 0xCB: handler->OnKeyUp(0xFA); break;  // Cursor Left 
 	case 0xCD: handler->OnKeyUp(0xFB); break;  // Cursor Right 
 	case 0xC7: handler->OnKeyUp(0xFC); break;  // Cursor Home
 	case 0xC8: handler->OnKeyUp(0xFD); break;  // Cursor Up  
 	case 0xD0: handler->OnKeyUp(0xFE); break;  // Cursor Down
+	case 0xC9: handler->OnKeyUp(0x06); break;  // Page Up
       }
       
       return esp;
@@ -160,7 +162,7 @@ uint32_t KeyboardDriver::HandleInterrupt(uint32_t esp)
 	case 0x46: newKey=0x90; break; // SCROLL LOCK
 	case 0x47: newKey=0xFC; break; // HOME
 	case 0x48: newKey=0xFD; break; // 8 - up
-	//case 0x49: newKey='9'; break;
+	case 0x49: newKey=0x06; break; // 9 - page up
 	//case 0x4A: newKey='-'; break;
 	case 0x4B: newKey=0xFA; break; // 4 - left
 	//case 0x4C: newKey='5'; break;
@@ -171,7 +173,7 @@ uint32_t KeyboardDriver::HandleInterrupt(uint32_t esp)
 	//case 0x51: newKey='3'; break;
 	//case 0x52: newKey='0'; break;
 	//case 0x53: newKey='.'; break;
-	//case 0x57: newKey=0x57; break; // F11
+	case 0x57: newKey=0x05; break; // F11
 	case 0x58: newKey=0x04; break; // F12
       }
       
@@ -18,6 +18,55 @@ using namespace myos::hardwarecommunication;
     }
 
 
+    uint32_t PITDriver::tscMult = 0;
+    uint32_t PITDriver::tscShift = 0;
+    uint32_t PITDriver::usMult = 0;
+    uint32_t PITDriver::usShift = 0;
+    uint64_t PITDriver::tscBase = 0;
+    uint32_t PITDriver::tscKHz = 0;
+    volatile uint32_t PITDriver::tickCount = 0;
+
+    // PIT input clock and the calibration window (~10ms)
+    static const uint32_t kPITHz = 1193182;
+    static const uint32_t kCalibrationTicks = 11932;
+
+    // 64/32 bit division without libgcc, the quotient may exceed 32 bits
+    static uint64_t Div64By32(uint64_t n, uint32_t d)
+    {
+        uint32_t hi = n >> 32;
+        uint32_t qhi = hi / d;
+        uint32_t r = hi % d;
+        uint32_t qlo;
+        asm("divl %4" : "=a" (qlo), "=d" (r) : "a" ((uint32_t)n), "d" (r), "rm" (d));
+        return ((uint64_t)qhi << 32) | qlo;
+    }
+
+    // mult/shift such that x * num / den == (x * mult) >> shift
+    static void ScaleFactor(uint32_t num, uint32_t den, uint32_t* mult, uint32_t* shift)
+    {
+        uint64_t q = Div64By32((uint64_t)num << 32, den);
+        uint32_t s = 32;
+        while((q >> 32) != 0)
+        {
+            q >>= 1;
+            s--;
+        }
+        *mult = (uint32_t)q;
+        *shift = s;
+    }
+
+    // (v * mult) >> shift with a 96 bit intermediate product
+    static inline uint64_t MulShift(uint64_t v, uint32_t mult, uint32_t shift)
+    {
+        uint64_t lo = (uint64_t)(uint32_t)v * mult;
+        uint64_t hi = (uint64_t)(uint32_t)(v >> 32) * mult;
+        hi += lo >> 32;
+        lo &= 0xffffffff;
+        if(shift == 0)
+            return (hi << 32) | lo;
+        return (hi << (32 - shift)) | (lo >> shift);
+    }
+
     PITDriver::PITDriver(InterruptManager* manager, PITEventHandler* handler)
     : InterruptHandler(manager, 0x20),
     commandport(0x43),
@@ -51,12 +100,89 @@ using namespace myos::hardwarecommunication;
 	// Send the frequency divisor.
 	outb(0x40, l);
 	outb(0x40, h);
-	     
+	
+	CalibrateTSC();
+    }
+    
+    uint64_t PITDriver::ReadTSC()
+    {
+        uint32_t lo, hi;
+        asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+        return ((uint64_t)hi << 32) | lo;
+    }
+    
+    // Counts TSC cycles while PIT channel 2 (one-shot, speaker gated off)
+    // runs down kCalibrationTicks.
+    void PITDriver::CalibrateTSC()
+    {
+        uint32_t eax, ebx, ecx, edx;
+        asm volatile("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (1), "c" (0));
+        if((edx & (1 << 4)) == 0)
+            return;
+        
+        uint8_t p61 = inb(0x61);
+        outb(0x61, (p61 & ~0x02) | 0x01);
+        
+        commandport.Write(0xB0);
+        channel2dataport.Write(kCalibrationTicks & 0xFF);
+        channel2dataport.Write(kCalibrationTicks >> 8);
+        
+        uint64_t start = ReadTSC();
+        while((inb(0x61) & 0x20) == 0) {};
+        uint64_t end = ReadTSC();
+        outb(0x61, p61);
+        
+        uint32_t delta = (uint32_t)(end - start);
+        if(delta == 0)
+            return;
+        
+        uint32_t windowNs = (uint32_t)Div64By32((uint64_t)kCalibrationTicks * 1000000000, kPITHz);
+        uint32_t windowUs = (uint32_t)Div64By32((uint64_t)kCalibrationTicks * 1000000, kPITHz);
+        ScaleFactor(windowNs, delta, &tscMult, &tscShift);
+        ScaleFactor(windowUs, delta, &usMult, &usShift);
+        tscKHz = (uint32_t)Div64By32((uint64_t)delta * 1000, windowUs);
+        tscBase = end;
+    }
+    
+    uint64_t PITDriver::Nanoseconds()
+    {
+        if(tscMult == 0)
+            return (uint64_t)tickCount * 1000000;
+        return MulShift(ReadTSC() - tscBase, tscMult, tscShift);
+    }
+    
+    uint32_t PITDriver::Microseconds()
+    {
+        if(usMult == 0)
+            return tickCount * 1000;
+        return (uint32_t)MulShift(ReadTSC() - tscBase, usMult, usShift);
+    }
+    
+    uint32_t PITDriver::Milliseconds()
+    {
+        if(tscKHz == 0)
+            return tickCount;
+        return (uint32_t)Div64By32(ReadTSC() - tscBase, tscKHz);
+    }
+    
+    // Whole kHz steps, so Milliseconds() equals milli from that TSC on.
+    // milli wraps with current_milli, it is taken relative to now.
+    uint64_t PITDriver::TSCAtMillisecond(uint32_t milli)
+    {
+        uint64_t now = Div64By32(ReadTSC() - tscBase, tscKHz);
+        uint64_t at = now + (int64_t)(int32_t)(milli - (uint32_t)now);
+        return tscBase + at * tscKHz;
+    }
+    
+    uint32_t PITDriver::TSCFrequencyKHz()
+    {
+        return tscKHz;
     }
     
     uint32_t PITDriver::HandleInterrupt(uint32_t esp)
     {
       //printf("tick...");
+      tickCount++;
       handler->OnTick();
 
       return esp;
@@ -35,6 +35,10 @@ using namespace myos::hardwarecommunication;
     scratchReg(SERIAL_PORT_A + 7)
     {
         this->handler = handler;
+	txHead = txTail = 0;
+	rxHead = rxTail = 0;
+	txActive = false;
+	rxDropped = 0;
     }
 
     SerialDriver::~SerialDriver()
@@ -55,15 +59,53 @@ using namespace myos::hardwarecommunication;
 	modemCtrlReg.Write(0x0B);    		// IRQs enabled, RTS/DSR set
 	  
 	
-	enblInterruptReg.Write(0x01);		// enable interrupts
+	enblInterruptReg.Write(0x01);		// enable interrupts (data available, THRE while sending)
     }
     
+    // queues one byte, only waits while the ring is full
     void SerialDriver::Send(uint8_t c)
     {
-      while(PortIsBusy())
+      while(txHead - txTail >= SERIAL_RING_SIZE)
       {};
       
-      dataReg.Write(c);
+      txRing[txHead % SERIAL_RING_SIZE] = c;
+      asm volatile("" ::: "memory");
+      txHead = txHead + 1;
+      
+      if(!txActive)
+      {
+	// the THRE interrupt fires right away while the FIFO is empty
+	uint32_t flags;
+	asm volatile("pushf; pop %0; cli" : "=r" (flags) :: "memory");
+	txActive = true;
+	enblInterruptReg.Write(0x03);
+	asm volatile("push %0; popf" :: "r" (flags) : "memory");
+      }
+    }
+    
+    uint32_t SerialDriver::Send(const uint8_t* data, uint32_t length)
+    {
+      for(uint32_t i = 0; i < length; i++)
+	Send(data[i]);
+      return length;
+    }
+    
+    // copies up to length received bytes, never waits
+    uint32_t SerialDriver::Receive(uint8_t* data, uint32_t length)
+    {
+      uint32_t n = 0;
+      while(n < length && rxTail != rxHead)
+      {
+	data[n++] = rxRing[rxTail % SERIAL_RING_SIZE];
+	asm volatile("" ::: "memory");
+	rxTail = rxTail + 1;
+      }
+      return n;
+    }
+    
+    uint32_t SerialDriver::Available()
+    {
+      return rxHead - rxTail;
     }
     
     int SerialDriver::PortIsBusy()
@@ -71,15 +113,61 @@ using namespace myos::hardwarecommunication;
       return (lineStatusReg.Read() & 0x20) == 0;
     }
     
+    // refills the transmit FIFO, called from the THRE interrupt
+    void SerialDriver::Transmit()
+    {
+      int n = 0;
+      while(n < SERIAL_FIFO_SIZE && txTail != txHead)
+      {
+	dataReg.Write(txRing[txTail % SERIAL_RING_SIZE]);
+	txTail = txTail + 1;
+	n++;
+      }
+      
+      if(txTail == txHead)
+      {
+	enblInterruptReg.Write(0x01);
+	txActive = false;
+      }
+    }
+    
     uint32_t SerialDriver::HandleInterrupt(uint32_t esp)
     {
-        uint8_t b = dataReg.Read();
-        //if (!(b & 0x24))
-        //    return esp;
-
-        handler->OnReceive(b);
-        
-        //printf("%c",b);
+        // serve every pending cause, bit 0 of IIR is clear while one is
+        uint8_t iir;
+	while(((iir = idCtrlReg.Read()) & 0x01) == 0)
+	{
+	  switch(iir & 0x0E)
+	  {
+	    case 0x04:			// data available
+	    case 0x0C:			// character timeout
+	      while(lineStatusReg.Read() & 0x01)
+	      {
+		uint8_t b = dataReg.Read();
+		if(rxHead - rxTail < SERIAL_RING_SIZE)
+		{
+		  rxRing[rxHead % SERIAL_RING_SIZE] = b;
+		  asm volatile("" ::: "memory");
+		  rxHead = rxHead + 1;
+		}
+		else
+		  rxDropped++;
+		
+		if(handler != 0)
+		  handler->OnReceive(b);
+	      }
+	      break;
+	    case 0x02:			// transmitter holding register empty
+	      Transmit();
+	      break;
+	    case 0x06:			// line status
+	      lineStatusReg.Read();
+	      break;
+	    default:			// modem status
+	      modemStatusReg.Read();
+	      break;
+	  }
+	}
         
         return esp;
     }
@@ -0,0 +1,231 @@
+#include <filesystem/blockcache.h>
+#include <lib/string.h>
+
+using namespace myos;
+using namespace myos::filesystem;
+using namespace myos::drivers;
+
+BlockCache::BlockCache(BlockDevice *hd)
+{
+  _hd = hd;
+  _clock = 0;
+  _lastHit = 0;
+  Invalidate();
+}
+
+BlockCache::~BlockCache()
+{
+}
+
+// drops every entry, dirty sectors are lost (call Flush first)
+void BlockCache::Invalidate()
+{
+  for(int x=0;x<BLOCKCACHE_ENTRIES;x++)
+  {
+    _entries[x].sector = 0;
+    _entries[x].lastUsed = 0;
+    _entries[x].valid = false;
+    _entries[x].dirty = false;
+  }
+}
+
+int BlockCache::Find(uint32_t sector)
+{
+  // chain walks hit the same FAT sector over and over
+  if(_entries[_lastHit].valid && _entries[_lastHit].sector == sector)
+  {
+    _entries[_lastHit].lastUsed = ++_clock;
+    return _lastHit;
+  }
+  
+  for(int x=0;x<BLOCKCACHE_ENTRIES;x++)
+  {
+    if(_entries[x].valid && _entries[x].sector == sector)
+    {
+      _entries[x].lastUsed = ++_clock;
+      _lastHit = x;
+      return x;
+    }
+  }
+  return -1;
+}
+
+// takes a free or the least recently used entry, a dirty victim is written first
+int BlockCache::Allocate(uint32_t sector)
+{
+  int victim = 0;
+  
+  for(int x=0;x<BLOCKCACHE_ENTRIES;x++)
+  {
+    if(!_entries[x].valid)
+    {
+      victim = x;
+      break;
+    }
+    if(_entries[x].lastUsed < _entries[victim].lastUsed)
+      victim = x;
+  }
+  
+  WriteBack(victim);
+  
+  _entries[victim].sector = sector;
+  _entries[victim].lastUsed = ++_clock;
+  _entries[victim].valid = true;
+  _entries[victim].dirty = false;
+  return victim;
+}
+
+// a queued write leaves the sector in flight until the device syncs
+int BlockCache::WriteBack(int entry, bool queued)
+{
+  if(!_entries[entry].valid || !_entries[entry].dirty)
+    return 0;
+  
+  _entries[entry].dirty = false;
+  if(queued)
+    return _hd->QueueWrite(_entries[entry].sector, _data[entry], 1);
+  return _hd->WriteSectors(_entries[entry].sector, _data[entry], 1);
+}
+
+// copies cached sectors of a range over data read from the disk, the
+// cached copy is never older than the one on disk
+void BlockCache::Overlay(uint32_t sector, uint8_t* buffer, uint32_t sectors)
+{
+  for(int x=0;x<BLOCKCACHE_ENTRIES;x++)
+  {
+    if(_entries[x].valid && _entries[x].sector - sector < sectors)
+      memcpy(buffer + (_entries[x].sector - sector) * ATA_SECTOR_SIZE, _data[x], ATA_SECTOR_SIZE);
+  }
+}
+
+int BlockCache::ReadSectors(uint32_t sector, uint8_t* buffer, uint32_t sectors)
+{
+  bool miss = false;
+  
+  for(uint32_t x=0;x<sectors && !miss;x++)
+    miss = Find(sector + x) < 0;
+  
+  if(miss)
+  {
+    int status = _hd->ReadSectors(sector, buffer, sectors);
+    if(status != 0)
+      return status;
+  }
+  
+  Overlay(sector, buffer, sectors);
+  
+  // big file reads would only flush out the directory and FAT sectors
+  if(sectors > BLOCKCACHE_MAX_RUN)
+    return 0;
+  
+  for(uint32_t x=0;x<sectors;x++)
+  {
+    if(Find(sector + x) < 0)
+      memcpy(_data[Allocate(sector + x)], buffer + x * ATA_SECTOR_SIZE, ATA_SECTOR_SIZE);
+  }
+  return 0;
+}
+
+int BlockCache::WriteSectors(uint32_t sector, uint8_t* buffer, uint32_t sectors)
+{
+  if(sectors > BLOCKCACHE_MAX_RUN)
+  {
+    // write through, keep cached copies in sync
+    for(int x=0;x<BLOCKCACHE_ENTRIES;x++)
+    {
+      if(_entries[x].valid && _entries[x].sector - sector < sectors)
+      {
+	memcpy(_data[x], buffer + (_entries[x].sector - sector) * ATA_SECTOR_SIZE, ATA_SECTOR_SIZE);
+	_entries[x].dirty = false;
+      }
+    }
+    return _hd->WriteSectors(sector, buffer, sectors);
+  }
+  
+  for(uint32_t x=0;x<sectors;x++)
+    WriteSector(sector + x, buffer + x * ATA_SECTOR_SIZE, ATA_SECTOR_SIZE);
+  return 0;
+}
+
+// returns the cached copy of a sector, reading it on a miss (0 on error)
+uint8_t* BlockCache::GetSector(uint32_t sector)
+{
+  int e = Find(sector);
+  if(e < 0)
+  {
+    e = Allocate(sector);
+    if(_hd->ReadSectors(sector, _data[e], 1) != 0)
+    {
+      _entries[e].valid = false;
+      return 0;
+    }
+  }
+  return _data[e];
+}
+
+void BlockCache::MarkDirty(uint32_t sector)
+{
+  int e = Find(sector);
+  if(e >= 0)
+    _entries[e].dirty = true;
+}
+
+void BlockCache::ReadSector(uint32_t sector, uint8_t* buffer, int count)
+{
+  uint32_t full = count / ATA_SECTOR_SIZE;
+  uint32_t rest = count % ATA_SECTOR_SIZE;
+  
+  if(full > 0 && ReadSectors(sector, buffer, full) != 0)
+    return;
+  
+  if(rest > 0)
+  {
+    uint8_t* data = GetSector(sector + full);
+    if(data != 0)
+      memcpy(buffer + full * ATA_SECTOR_SIZE, data, rest);
+  }
+}
+
+// Stores count bytes (at most one sector), the rest of the sector is zero filled.
+// The sector only reaches the disk when it is evicted or on Flush().
+int BlockCache::WriteSector(uint32_t sector, uint8_t* data, uint32_t count)
+{
+  if(count > ATA_SECTOR_SIZE)
+    return 1;
+  
+  int e = Find(sector);
+  if(e < 0)
+    e = Allocate(sector);
+  
+  for(uint32_t i=0; i < ATA_SECTOR_SIZE; i++)
+    _data[e][i] = i < count ? data[i] : 0;
+  _entries[e].dirty = true;
+  return 0;
+}
+
+// writes all dirty sectors back in ascending order, queued so a drive
+// with a command queue has them all in flight at once
+int BlockCache::Flush()
+{
+  int status = 0;
+  
+  while(1)
+  {
+    int next = -1;
+    for(int x=0;x<BLOCKCACHE_ENTRIES;x++)
+    {
+      if(_entries[x].valid && _entries[x].dirty &&
+	 (next < 0 || _entries[x].sector < _entries[next].sector))
+	next = x;
+    }
+    if(next < 0)
+    {
+      int result = _hd->Sync();
+      return status != 0 ? status : result;
+    }
+    
+    int result = WriteBack(next, true);
+    if(result != 0)
+      status = result;
+  }
+}
@@ -0,0 +1,315 @@
+#include <filesystem/d64.h>
+#include <lib/string.h>
+
+using namespace myos;
+using namespace myos::filesystem;
+
+D64::D64(Fat32 *fs)
+{
+  _fs = fs;
+  _image = 0;
+  _tracks = 0;
+  for(int x=0;x<=D64_MAX_TRACKS;x++)
+    _trackOffset[x] = 0;
+  for(int x=0;x<MAX_CBM_FILES_OPEN;x++)
+    openFilesList[x].open = false;
+}
+
+D64::~D64()
+{
+  delete [] _image;
+}
+
+uint8_t D64::SectorsPerTrack(uint8_t track)
+{
+  if(track <= 17) return 21;
+  if(track <= 24) return 19;
+  if(track <= 30) return 18;
+  return 17;
+}
+
+// Reads the whole image, uses Fat32 file number 0 so no files may be
+// open there. Error info appended to the image is ignored.
+int D64::Mount(uint8_t* filename)
+{
+  uint32_t size = _fs->GetFileSize(filename);
+  
+  if(size == D64_SIZE_35 || size == D64_SIZE_35_ERRORS)
+    _tracks = 35;
+  else if(size == D64_SIZE_40 || size == D64_SIZE_40_ERRORS)
+    _tracks = 40;
+  else
+    return FILE_STATUS_NOTFOUND;
+  
+  int fstatus = _fs->OpenFile(0, filename, FILEACCESSMODE_READ);
+  if(fstatus != FILE_STATUS_OK)
+    return fstatus;
+  
+  delete [] _image;
+  _image = new uint8_t[size];
+  uint32_t n = _fs->ReadFileBlock(0, _image, size);
+  _fs->CloseFile(0);
+  if(n != size)
+    return FILE_STATUS_NODEVICE;
+  
+  uint32_t offset = 0;
+  for(int t=1;t<=_tracks;t++)
+  {
+    _trackOffset[t] = offset;
+    offset += SectorsPerTrack(t) * D64_SECTOR_SIZE;
+  }
+  
+  for(int x=0;x<MAX_CBM_FILES_OPEN;x++)
+    openFilesList[x].open = false;
+  return FILE_STATUS_OK;
+}
+
+// 256 bytes of the image, 0 for a track or sector not on the disk
+uint8_t* D64::Sector(uint8_t track, uint8_t sector)
+{
+  if(_image == 0 || track < 1 || track > _tracks || sector >= SectorsPerTrack(track))
+    return 0;
+  return _image + _trackOffset[track] + sector * D64_SECTOR_SIZE;
+}
+
+// follows the link in the current sector, false at the end of the file
+bool D64::NextSector(D64FileStatus* file)
+{
+  uint8_t *data = Sector(file->track, file->sector);
+  if(data == 0 || data[0] == 0 || file->remaining == 0)
+    return false;
+  
+  uint8_t *next = Sector(data[0], data[1]);
+  if(next == 0)
+    return false;
+  
+  file->track = data[0];
+  file->sector = data[1];
+  file->position = 2;
+  file->last = next[0] == 0 ? next[1] : 255;
+  file->remaining--;
+  return true;
+}
+
+// Looks up a CBM name, '?' matches any character and '*' the rest.
+// Scratched entries are skipped, the first match in directory order wins.
+D64DirectoryEntry* D64::FindFile(uint8_t* filename, uint8_t length)
+{
+  D64FileStatus dir;
+  dir.track = D64_DIR_TRACK;
+  dir.sector = 1;
+  dir.remaining = SectorsPerTrack(D64_DIR_TRACK);
+  
+  uint8_t *data = Sector(dir.track, dir.sector);
+  while(data != 0)
+  {
+    for(int i=0;i<8;i++)
+    {
+      D64DirectoryEntry* entry = (D64DirectoryEntry*)(data + sizeof(D64DirectoryEntry) * i);
+      if((entry->type & 0x07) == 0)
+	continue;
+      
+      bool match = length <= 16;
+      for(int j=0;j<16 && match;j++)
+      {
+	uint8_t c = j < length ? filename[j] : 0xA0;
+	if(c == '*')
+	  break;
+	if(c != '?' && c != entry->name[j])
+	  match = false;
+      }
+      if(match)
+	return entry;
+    }
+    
+    if(!NextSector(&dir))
+      break;
+    data = Sector(dir.track, dir.sector);
+  }
+  return 0;
+}
+
+int D64::OpenFile(uint8_t filenumber, uint8_t* filename, uint8_t length)
+{
+  if(openFilesList[filenumber].open)
+    return FILE_STATUS_FILEOPEN;
+  
+  D64DirectoryEntry* entry = FindFile(filename, length);
+  if(entry == 0)
+    return FILE_STATUS_NOTFOUND;
+  
+  uint8_t *data = Sector(entry->track, entry->sector);
+  if(data == 0)
+    return FILE_STATUS_NOTFOUND;
+  
+  D64FileStatus* file = &openFilesList[filenumber];
+  file->open = true;
+  file->track = entry->track;
+  file->sector = entry->sector;
+  file->position = 2;
+  file->last = data[0] == 0 ? data[1] : 255;
+  file->remaining = _tracks * 21;
+  return FILE_STATUS_OK;
+}
+
+int D64::CloseFile(uint8_t filenumber)
+{
+  if(!openFilesList[filenumber].open)
+    return FILE_STATUS_FILECLSD;
+  openFilesList[filenumber].open = false;
+  return FILE_STATUS_OK;
+}
+
+int D64::ReadNextFileByte(uint8_t filenumber, uint8_t* b)
+{
+  D64FileStatus* file = &openFilesList[filenumber];
+  
+  if(!file->open)
+    return FILE_STATUS_FILECLSD;
+  
+  while(file->position > file->last)
+  {
+    if(!NextSector(file))
+      return FILE_STATUS_EOF;
+  }
+  
+  *b = Sector(file->track, file->sector)[file->position++];
+  return FILE_STATUS_OK;
+}
+
+// copies up to length bytes a sector at a time, returns the number of
+// bytes copied (0 at end of file)
+uint32_t D64::ReadFileBlock(uint8_t filenumber, uint8_t* data, uint32_t length)
+{
+  D64FileStatus* file = &openFilesList[filenumber];
+  uint32_t done = 0;
+  
+  if(!file->open)
+    return 0;
+  
+  while(done < length)
+  {
+    if(file->position > file->last && !NextSector(file))
+      break;
+    
+    uint32_t n = file->last + 1 - file->position;
+    if(n > length - done)
+      n = length - done;
+    memcpy(data + done, Sector(file->track, file->sector) + file->position, n);
+    file->position += n;
+    done += n;
+  }
+  return done;
+}
+
+// directory sectors are walked with cluster holding track << 8 | sector
+void D64::OpenCBMDir(CBMDirCursor* dir, uint16_t address)
+{
+  dir->address = address;
+  dir->cluster = (D64_DIR_TRACK << 8) | 1;
+  dir->sector = SectorsPerTrack(D64_DIR_TRACK);
+  dir->entry = 0;
+  dir->state = 0;
+}
+
+// the listing as the 1541 produces it, one BASIC line per call
+uint8_t D64::ReadCBMDir(CBMDirCursor* dir, uint8_t* line)
+{
+  static const char* types[] = {"DEL", "SEQ", "PRG", "USR", "REL", "???", "???", "???"};
+  uint8_t *bam = Sector(D64_DIR_TRACK, 0);
+  uint8_t n = 4;
+  
+  if(bam == 0)
+    return 0;
+  
+  if(dir->state == 0)
+  {
+    dir->state = 1;
+    
+    line[n++] = 0x12;	// reverse
+    line[n++] = 0x22;	// quote
+    for(int j=0;j<16;j++)
+      line[n++] = bam[0x90+j] == 0xA0 ? 0x20 : bam[0x90+j];
+    line[n++] = 0x22;	// quote
+    line[n++] = 0x20;	// space
+    for(int j=0;j<5;j++)	// id, $A0, dos type
+      line[n++] = bam[0xA2+j] == 0xA0 ? 0x20 : bam[0xA2+j];
+    return Fat32::CBMDirLine(dir, line, 0, n);
+  }
+  
+  while(dir->state == 1)
+  {
+    uint8_t *data = Sector(dir->cluster >> 8, dir->cluster & 0xff);
+    if(data == 0)
+    {
+      dir->state = 2;
+      break;
+    }
+    
+    while(dir->entry < 8)
+    {
+      D64DirectoryEntry* entry = (D64DirectoryEntry*)(data + sizeof(D64DirectoryEntry) * dir->entry++);
+      if(entry->type == 0)
+	continue;
+      
+      uint16_t blocks = entry->blocks;
+      line[n++] = 0x20;	// space
+      if(blocks < 100) line[n++] = 0x20;
+      if(blocks < 10) line[n++] = 0x20;
+      
+      int length = 0;
+      while(length < 16 && entry->name[length] != 0xA0)
+	length++;
+      line[n++] = 0x22;	// quote
+      for(int j=0;j<length;j++)
+	line[n++] = entry->name[j];
+      line[n++] = 0x22;	// quote
+      for(int j=length;j<16;j++)
+	line[n++] = 0x20;
+      
+      line[n++] = (entry->type & 0x80) ? 0x20 : 0x2A;	// * for a file left open
+      for(int j=0;j<3;j++)
+	line[n++] = types[entry->type & 0x07][j];
+      if(entry->type & 0x40)
+	line[n++] = 0x3C;	// < locked
+      return Fat32::CBMDirLine(dir, line, blocks, n);
+    }
+    
+    // linked like a file, sector counts down to stop a looping chain
+    dir->entry = 0;
+    if(data[0] == 0 || dir->sector-- == 0)
+      dir->state = 2;
+    else
+      dir->cluster = (data[0] << 8) | data[1];
+  }
+  
+  if(dir->state == 2)
+  {
+    dir->state = 3;
+    
+    uint16_t blocks = 0;
+    for(int t=1;t<=35;t++)
+    {
+      if(t != D64_DIR_TRACK)
+	blocks += bam[4*t];
+    }
+    
+    const char* text = "BLOCKS FREE.";
+    while(*text)
+      line[n++] = *text++;
+    return Fat32::CBMDirLine(dir, line, blocks, n);
+  }
+  
+  if(dir->state == 3)
+  {
+    dir->state = 4;
+    
+    // a zero link ends the program
+    line[0] = 0x00;
+    line[1] = 0x00;
+    dir->address += 2;
+    return 2;
+  }
+  
+  return 0;
+}
@@ -1,53 +1,87 @@
 
 #include <filesystem/fat.h>
+#include <lib/string.h>
 
 using namespace myos;
 using namespace myos::filesystem;
 using namespace myos::drivers;
 
-Fat32::Fat32(myos::drivers::AdvancedTechnologyAttachment *hd, uint8_t partition)
+Fat32::Fat32(myos::drivers::BlockDevice *hd, uint8_t partition)
+: _cache(hd)
 {
   _hd = hd;
   _partition = partition;
-  _hd->ReadSector(0, (uint8_t*)&_mbr, sizeof(MasterBootRecord));
+  _dirChain.buffer = 0;
+  _dirIndexFree = -1;
+  _dirIndexBuilt = false;
+  _clusterCount = 0;
+  _nextFree = 2;
+  _freeCount = 0;
+  _fsInfoSector = 0;
+  _mounted = false;
+  _valid = false;
+  
+  for(int x=0;x<MAX_CBM_FILES_OPEN;x++)
+  {
+    openFilesList[x].mode = FILEACCESSMODE_CLOSED;
+    memset(openFilesList[x].filename, 0, 8);
+    memset(openFilesList[x].ext, 0, 3);
+    openFilesList[x].size = 0;
+    openFilesList[x].locationPtr = 0;
+    openFilesList[x].startingCluster = 0;
+    openFilesList[x].lastCluster = 0;
+  }
+}
+
+// Reads the partition table and boot sector on the first access to
+// the volume. At boot that is RomSet::load() looking for the ROM
+// images, without a disk it finds no partition and stays cheap.
+// False when the partition does not exist.
+bool Fat32::Mount()
+{
+  if(_mounted)
+    return _valid;
+  _mounted = true;
+  
+  _cache.ReadSector(0, (uint8_t*)&_mbr, sizeof(MasterBootRecord));
   
     // if this partion is invalid, just exit
   if(_mbr.primaryPartition[_partition].partition_id == 0x00)
-    return;
+    return false;
   
   uint32_t partitionOffset = _mbr.primaryPartition[_partition].start_lba;
-  _hd->ReadSector(partitionOffset, (uint8_t*)&_bpb, sizeof(BiosParameterBlock32));
+  _cache.ReadSector(partitionOffset, (uint8_t*)&_bpb, sizeof(BiosParameterBlock32));
   
   _fatStart = partitionOffset + _bpb.reservedSectors;
   _dataStart = _fatStart + _bpb.sectorsPerFat * _bpb.fatCopies;
   _rootStart = _dataStart + _bpb.sectorsPerCluster * (_bpb.rootCluster-2);
   
-  _fatBuffer = new uint8_t[_bpb.sectorsPerFat * _bpb.bytesPerSector];  
-  _fat = &_fatBuffer[0];
+  // clusters past the end of the data area must never be allocated
+  uint32_t totalSectors = _bpb.totalSectorCount ? _bpb.totalSectorCount : _bpb.totalSectors;
+  _clusterCount = (totalSectors - (_dataStart - partitionOffset)) / _bpb.sectorsPerCluster + 2;
+  if(_clusterCount > _bpb.sectorsPerFat * (_bpb.bytesPerSector / 4))
+    _clusterCount = _bpb.sectorsPerFat * (_bpb.bytesPerSector / 4);
+  if(_bpb.fatInfo != 0 && _bpb.fatInfo != 0xFFFF)
+    _fsInfoSector = partitionOffset + _bpb.fatInfo;
   
-  for(int x=0;x<MAX_CBM_FILES_OPEN;x++)
-  {
-    openFilesList[x].mode = FILEACCESSMODE_CLOSED;
-    for(int x1=0;x1<8;x1++) openFilesList[x].filename[x1] = 0; 
-    for(int x1=0;x1<3;x1++) openFilesList[x].ext[x1] = 0;
-    openFilesList[x].size = 0;
-    openFilesList[x].locationPtr = 0;
-    openFilesList[x].startingCluster = 0;
-    openFilesList[x].buffer = 0;
-    //openFilesList[x].fileBuffer = Vector<uint8_t>(_bpb.sectorsPerCluster * _bpb.bytesPerSector);
-  }
   
-  LoadFAT();
+  _dirChain.buffer = new uint8_t[_bpb.sectorsPerCluster * _bpb.bytesPerSector];
+  _dirChain.loaded = false;
+  _dirChain.endOfChain = 1;
   
+  LoadFAT();
+  _valid = true;
+  return true;
 }
 
 Fat32::~Fat32()
 {
-  delete[] _fatBuffer;
+  delete[] _dirChain.buffer;
 }
 
 void Fat32::ReadPartitions()
 { 
+  Mount();
   printf("\n\nPartition table\n");
   printf("----------------------------------------------------------\n");
   printf("Part # | Bootable | Type |                                \n");
@@ -74,23 +108,74 @@ void Fat32::ReadPartitions()
   printf("\nRoot directory     : %06X", _rootStart); 
 }
 
+// FAT sectors are read on demand through the block cache, only the
+// allocation hint is set up here so boot time does not grow with the volume
 void Fat32::LoadFAT()
 {
-  // Read FAT (should be using placement new here?)
-  for(int counter = 0; counter < _bpb.sectorsPerFat; counter++)
+  _freeCount = 0xFFFFFFFF;	// unknown
+  _nextFree = 2;
+  
+  // next-free hint from FSInfo, scanning the FAT here would defeat the point
+  FSInfo32 info;
+  if(_fsInfoSector != 0)
   {
-    _hd->ReadSector(_fatStart + counter, &_fatBuffer[counter*_bpb.bytesPerSector], _bpb.bytesPerSector);
-    
-    // Dont bother reading more FAT entries if at end (0)
-    if(_fatBuffer[counter*_bpb.bytesPerSector] == 0)
+    _cache.ReadSector(_fsInfoSector, (uint8_t*)&info, sizeof(FSInfo32));
+    if(info.leadSignature != 0x41615252 || info.structSignature != 0x61417272)
+    {
+      _fsInfoSector = 0;
       return;
+    }
+    
+    _freeCount = info.freeCount;
+    if(info.nextFree >= 2 && info.nextFree < _clusterCount)
+      _nextFree = info.nextFree;
   }
 }
 
+// writes the free count and next-free hint back to the FSInfo sector
+void Fat32::UpdateFSInfo()
+{
+  if(_fsInfoSector == 0)
+    return;
+  
+  FSInfo32 info;
+  _cache.ReadSector(_fsInfoSector, (uint8_t*)&info, sizeof(FSInfo32));
+  info.freeCount = _freeCount;
+  info.nextFree = _nextFree;
+  _cache.WriteSector(_fsInfoSector, (uint8_t*)&info, sizeof(FSInfo32));
+}
+
+// the FSInfo count, or without one the free FAT entries counted once,
+// allocations keep the result up to date
+uint32_t Fat32::FreeClusters()
+{
+  if(_freeCount != 0xFFFFFFFF && _freeCount <= _clusterCount)
+    return _freeCount;
+  
+  uint32_t count = 0;
+  uint32_t perSector = _bpb.bytesPerSector / 4;
+  for(uint32_t first = 0; first < _clusterCount; first += perSector)
+  {
+    uint8_t* fat = _cache.GetSector(_fatStart + first / perSector);
+    if(fat == 0)
+      return 0;
+    for(uint32_t x = first < 2 ? 2 : first; x < first + perSector && x < _clusterCount; x++)
+    {
+      uint32_t ptr = 4 * (x - first);
+      if((((fat[ptr+3] << 24) | (fat[ptr+2] << 16) | (fat[ptr+1] << 8) | fat[ptr]) & 0x0FFFFFFF) == FREECLUSTER_FAT32)
+	count++;
+    }
+  }
+  _freeCount = count;
+  return count;
+}
+
 void Fat32::ReadDirectory(uint32_t startCluster)
 {
   char volumeLabel[13] = "           \0";
   
+  if(!Mount())
+    return;
   _endOfChain = 0;
 
   if(startCluster == 0)
@@ -168,150 +253,369 @@ void Fat32::ReadDirectory(uint32_t startCluster)
   }  
 }
 
+// Directory walks share one cursor, the sector handed out is left in
+// _lastSectorRead so callers can write a modified entry back
 uint8_t* Fat32::ReadNextSectorInChain(uint32_t startOfChain)
 { 
-  static uint8_t buffer[512];
-  static uint8_t sectorCtr=0;;
-  static uint32_t dataCluster;
-  
+  uint8_t* buffer = ReadNextSectorInChain(&_dirChain, startOfChain);
+  _endOfChain = _dirChain.endOfChain;
+  _lastSectorRead = _dirChain.sector;
+  return buffer;
+}
+
+// Hands out the sectors of a chain one by one, a whole cluster is read
+// with one multi-sector transfer. Returns 0 at the end of the chain.
+uint8_t* Fat32::ReadNextSectorInChain(ChainCursor* cursor, uint32_t startOfChain)
+{
   if (startOfChain != 0)
   {
-    _endOfChain = 0;
-    sectorCtr = 0;
-    dataCluster = startOfChain;
+    cursor->cluster = startOfChain;
+    cursor->index = 0;
+    cursor->loaded = false;
+    cursor->endOfChain = 0;
   }
-  //printf("\nFAT start sector = %d", _fatStart);
-  //printf("\nData start sector = %d", _dataStart);
-  //printf("\nRoot start sector = %d", _rootStart); 
-  //printf("\nReadNextSectorInChain: startOfChain: %d, sectorCtr: %d, dataCluster: %d\n",startOfChain,sectorCtr,dataCluster);
-  
-  uint32_t nextSectorofCluster =  ((dataCluster-2) * _bpb.sectorsPerCluster)+ _dataStart;
   
-  //printf("\n - nextSectorofCluster: %d", nextSectorofCluster);
-  
-  // read contiguous sectors until we reach the # of sectors per cluster
-  if (sectorCtr < _bpb.sectorsPerCluster-1)
-  {
-    _lastSectorRead = nextSectorofCluster + sectorCtr;
-    _hd->ReadSector(_lastSectorRead, buffer, sizeof(buffer));
-    //displayMemory(buffer, 512);
-    sectorCtr++;
-    return buffer;
-  }    
+  if (cursor->endOfChain)
+    return 0;
   
   // we are at the end of sectors per cluster.  
   // now we need to get the next cluster location from the fat chain
-  if (sectorCtr == _bpb.sectorsPerCluster-1)
+  if (cursor->loaded && cursor->index == _bpb.sectorsPerCluster)
   {
-    // Each FAT32 record is 4 bytes
-    dataCluster = (_fat[4 * dataCluster+3] << 24) | (_fat[4 * dataCluster+2] << 16) | 
-		  (_fat[4 * dataCluster+1] << 8) | _fat[4 * dataCluster];
-
-    //printf("\n new dataCluster : %d", dataCluster);
-
-    if (dataCluster >= ENDOFCLUSTER_FAT32)
+    cursor->cluster = NextCluster(cursor->cluster);
+    cursor->index = 0;
+    cursor->loaded = false;
+  }
+  
+  if (!cursor->loaded)
+  {
+    if (EndOfChain(cursor->cluster))
     {
-      //printf("\nEnd of cluster chain.");
-      _endOfChain = 1;
+      cursor->endOfChain = 1;
       return 0;
     }
+    _cache.ReadSectors(ClusterToSector(cursor->cluster), cursor->buffer, _bpb.sectorsPerCluster);
+    cursor->loaded = true;
+  }
+  
+  cursor->sector = ClusterToSector(cursor->cluster) + cursor->index;
+  return cursor->buffer + _bpb.bytesPerSector * cursor->index++;
+}
+
+// Each FAT32 record is 4 bytes, the top 4 bits are reserved.
+// A FAT sector that cannot be read ends the chain.
+uint32_t Fat32::NextCluster(uint32_t cluster)
+{
+  uint8_t* fat = _cache.GetSector(_fatStart + (4 * cluster) / _bpb.bytesPerSector);
+  if(fat == 0)
+    return 0x0FFFFFFF;
+  
+  uint32_t ptr = (4 * cluster) % _bpb.bytesPerSector;
+  return ((fat[ptr+3] << 24) | (fat[ptr+2] << 16) | 
+	  (fat[ptr+1] << 8) | fat[ptr]) & 0x0FFFFFFF;
+}
+
+// Updates a FAT entry (top 4 bits are kept) in every FAT copy, the
+// sectors are only marked dirty and reach the disk on the next flush
+void Fat32::SetCluster(uint32_t cluster, uint32_t value)
+{
+  uint32_t sector = _fatStart + (4 * cluster) / _bpb.bytesPerSector;
+  uint32_t ptr = (4 * cluster) % _bpb.bytesPerSector;
+  
+  for(int copy = 0; copy < _bpb.fatCopies; copy++, sector += _bpb.sectorsPerFat)
+  {
+    uint8_t* fat = _cache.GetSector(sector);
+    if(fat == 0)
+      continue;
+    
+    uint32_t v = (value & 0x0FFFFFFF) | ((uint32_t)(fat[ptr+3] & 0xF0) << 24);
+    fat[ptr+0] = v;
+    fat[ptr+1] = v >> 8;
+    fat[ptr+2] = v >> 16;
+    fat[ptr+3] = v >> 24;
+    _cache.MarkDirty(sector);
+  }
+}
+
+// Counts the contiguous clusters starting at cluster (at most maxClusters),
+// *next receives the cluster following the run
+uint32_t Fat32::ClusterRun(uint32_t cluster, uint32_t maxClusters, uint32_t* next)
+{
+  uint32_t run = 1;
+  uint32_t n = NextCluster(cluster);
+  
+  while (run < maxClusters && n == cluster + run)
+  {
+    run++;
+    n = NextCluster(n);
+  }
+  
+  *next = n;
+  return run;
+}
+
+// Walks a chain once and appends its runs of contiguous clusters.
+// False if the memory for them ran out.
+bool Fat32::BuildExtents(uint32_t startCluster, Vector<FileExtent>* extents)
+{
+  uint32_t cluster = startCluster;
+  
+  while (!EndOfChain(cluster))
+  {
+    uint32_t next;
+    FileExtent extent;
+    extent.cluster = cluster;
+    extent.count = ClusterRun(cluster, 0xFFFFFFFF, &next);
+    if (!extents->push_back(extent))
+      return false;
+    cluster = next;
+  }
+  return true;
+}
+
+// Reads size bytes of a file straight into data, one transfer per extent,
+// only the tail of the last cluster is partial
+uint32_t Fat32::ReadExtents(const Vector<FileExtent>& extents, uint8_t* data, uint32_t size)
+{
+  uint32_t clusterSize = _bpb.sectorsPerCluster * _bpb.bytesPerSector;
+  uint32_t done = 0;
+  
+  for (uint32_t e = 0; e < extents.size() && done < size; e++)
+  {
+    uint32_t left = size - done;
+    uint32_t whole = left / clusterSize;
     
-    sectorCtr = 0;
-    nextSectorofCluster =  ((dataCluster-2) * _bpb.sectorsPerCluster)+ _dataStart;
-    _lastSectorRead = nextSectorofCluster + sectorCtr;
+    if (whole > extents[e].count)
+      whole = extents[e].count;
     
-    _hd->ReadSector(_lastSectorRead, buffer, sizeof(buffer));
+    if (whole > 0)
+    {
+      _cache.ReadSectors(ClusterToSector(extents[e].cluster), data + done, whole * _bpb.sectorsPerCluster);
+      done += whole * clusterSize;
+    }
     
-    sectorCtr++;
-    return buffer;
+    if (whole < extents[e].count && done < size)
+    {
+      // last, partial cluster
+      _cache.ReadSector(ClusterToSector(extents[e].cluster + whole), data + done, size - done);
+      done = size;
+    }
   }
+  return done;
 }
 
-uint32_t Fat32::GetFileCluster(uint8_t* find)
+// directory index  ////////////////////////////////////////////////////////
+
+// FNV-1a over the 11 bytes of an 8.3 name
+uint32_t Fat32::HashName(const uint8_t* name)
 {
-  _endOfChain = 0;
+  uint32_t h = 2166136261u;
+  for(int x=0;x<11;x++)
+  {
+    h ^= name[x];
+    h *= 16777619u;
+  }
+  return h;
+}
 
-  // set this to filecluster to access a file or subdir
+// Walks the root directory once, every later lookup is a hash probe
+void Fat32::BuildDirectoryIndex()
+{
+  _dirIndexBuilt = true;
+  
+  memcpy(_volumeLabel, _bpb.volumeLabel, 11);
+  
   uint8_t *buffer = ReadNextSectorInChain(_bpb.rootCluster);
   
   while (_endOfChain == 0)
   { 
-    DirectoryEntryFat32 dirent[16];
-   
-    for(int entry=0;entry<16;entry++)
-	dirent[entry] = *(DirectoryEntryFat32*)(buffer+(sizeof(DirectoryEntryFat32)*entry));
-    
     for(int i=0;i<16;i++)
     {
-      if(dirent[i].name[0] == 0x00) continue;//return; 		// end of directory
-      if(dirent[i].name[0] == 0xE5) continue;			// deleted file, skip it     
-      if(dirent[i].name[0] == 0x05) dirent[i].name[0] = 0xE5;	// japanese char impacted by the delete byte
-      if((dirent[i].attributes & 0x08) == 0x08) continue;	// volume label
-      if((dirent[i].attributes & 0x10) == 0x10) continue;	// directory
-      
-      char filename[13];
-      filename[8] = '.';
-      filename[12] = 0;
-      
-      for(int j=0;j<8;j++) filename[j] = dirent[i].name[j];
-      for(int j=0;j<3;j++) filename[j+9] = dirent[i].ext[j]; 
+      DirectoryEntryFat32* dirent = (DirectoryEntryFat32*)(buffer + sizeof(DirectoryEntryFat32) * i);
       
-      if(!strcmp(filename, (char*)find))
+      if(dirent->name[0] == 0x00) return; 			// end of directory
+      if(dirent->name[0] == 0xE5) continue;			// deleted file, skip it     
+      if((dirent->attributes & 0x0F) == 0x08)			// volume label
       {
-	uint32_t retval = ((uint32_t)dirent[i].firstClusterHi) << 16 | ((uint32_t)dirent[i].firstClusterLow);
-	return retval;
+	memcpy(_volumeLabel, dirent->name, 11);
+	continue;
       }
+      if((dirent->attributes & 0x08) == 0x08) continue;	// long name
+      if((dirent->attributes & 0x10) == 0x10) continue;	// directory
+      
+      uint32_t cluster = ((uint32_t)dirent->firstClusterHi) << 16 | ((uint32_t)dirent->firstClusterLow);
+      if(AddIndexEntry(dirent->name, dirent->attributes, cluster, dirent->size, 
+		       _lastSectorRead, sizeof(DirectoryEntryFat32) * i) < 0)
+	return;						// out of memory, dropped
     }
 
     buffer = ReadNextSectorInChain(0);
   } 
+}
+
+// doubles the buckets, makes room for as many entries and relinks
+// every chain. The old tables stay as they are when memory runs out.
+bool Fat32::GrowDirectoryIndex()
+{
+  uint32_t capacity = _dirBuckets.size() ? _dirBuckets.size() * 2 : 64;
+  Vector<int32_t> buckets;
+  if(!_dirIndex.reserve(capacity) || !buckets.resize(capacity, -1))
+    return false;
   
-  return 0;
+  _dirIndexFree = -1;
+  for(uint32_t x=0;x<_dirIndex.size();x++)
+  {
+    int32_t* head = _dirIndex[x].name[0] ? &buckets[HashName(_dirIndex[x].name) & (capacity-1)] : &_dirIndexFree;
+    _dirIndex[x].next = *head;
+    *head = x;
+  }
+  _dirBuckets.swap(buckets);
+  return true;
 }
 
-uint32_t Fat32::GetFileSize(uint8_t* find)
+// an index missing an entry would hide the file, the next lookup
+// walks the directory again instead
+void Fat32::DropDirectoryIndex()
 {
-   _endOfChain = 0;
+  Vector<DirectoryIndexEntry> entries;
+  Vector<int32_t> buckets;
+  _dirIndex.swap(entries);
+  _dirBuckets.swap(buckets);
+  _dirIndexFree = -1;
+  _dirIndexBuilt = false;
+}
 
-  // set this to filecluster to access a file or subdir
-  uint8_t *buffer = ReadNextSectorInChain(_bpb.rootCluster);
+int32_t Fat32::AddIndexEntry(const uint8_t* name, uint8_t attributes, uint32_t cluster, uint32_t size, uint32_t sector, uint16_t offset)
+{
+  int32_t e = _dirIndexFree;
   
-  while (_endOfChain == 0)
-  { 
-    DirectoryEntryFat32 dirent[16];
-   
-    for(int entry=0;entry<16;entry++)
-	dirent[entry] = *(DirectoryEntryFat32*)(buffer+(sizeof(DirectoryEntryFat32)*entry));
+  if(e >= 0)
+    _dirIndexFree = _dirIndex[e].next;
+  else
+  {
+    // past the buckets the chains get longer, still correct
+    if(_dirIndex.size() == _dirBuckets.size() && !GrowDirectoryIndex() && _dirBuckets.empty())
+    {
+      DropDirectoryIndex();
+      return -1;
+    }
+    e = _dirIndex.size();
+    if(!_dirIndex.emplace_back())
+    {
+      DropDirectoryIndex();
+      return -1;
+    }
+  }
+  
+  memcpy(_dirIndex[e].name, name, 11);
+  _dirIndex[e].attributes = attributes;
+  _dirIndex[e].cluster = cluster;
+  _dirIndex[e].size = size;
+  _dirIndex[e].sector = sector;
+  _dirIndex[e].offset = offset;
+  
+  int32_t* head = &_dirBuckets[HashName(name) & (_dirBuckets.size()-1)];
+  _dirIndex[e].next = *head;
+  *head = e;
+  return e;
+}
+
+void Fat32::RemoveIndexEntry(int32_t entry)
+{
+  int32_t* link = &_dirBuckets[HashName(_dirIndex[entry].name) & (_dirBuckets.size()-1)];
+  
+  while(*link != entry)
+    link = &_dirIndex[*link].next;
+  *link = _dirIndex[entry].next;
+  
+  _dirIndex[entry].name[0] = 0;
+  _dirIndex[entry].next = _dirIndexFree;
+  _dirIndexFree = entry;
+}
+
+// Looks up an 8.3 name. CBM wildcards are honoured: '?' matches any
+// character and '*' the rest of the name (or extension), those fall back
+// to a prefix match over the entries in directory order.
+int32_t Fat32::FindIndexEntry(const uint8_t* name)
+{
+  if(!Mount())
+    return -1;
+  if(!_dirIndexBuilt)
+    BuildDirectoryIndex();
+  
+  if(_dirBuckets.empty())
+    return -1;
+  
+  bool wildcard = false;
+  for(int x=0;x<11;x++)
+    wildcard |= (name[x] == '*' || name[x] == '?');
+  
+  if(!wildcard)
+  {
+    for(int32_t e = _dirBuckets[HashName(name) & (_dirBuckets.size()-1)]; e >= 0; e = _dirIndex[e].next)
+    {
+      if(!memcmp(_dirIndex[e].name, name, 11))
+	return e;
+    }
+    return -1;
+  }
+  
+  int32_t best = -1;
+  for(uint32_t e = 0; e < _dirIndex.size(); e++)
+  {
+    if(_dirIndex[e].name[0] == 0)
+      continue;
     
-    for(int i=0;i<16;i++)
+    bool match = true;
+    for(int x=0; x<11 && match; x++)
     {
-      if(dirent[i].name[0] == 0x00) continue;//return; 		// end of directory
-      if(dirent[i].name[0] == 0xE5) continue;			// deleted file, skip it     
-      if(dirent[i].name[0] == 0x05) dirent[i].name[0] = 0xE5;	// japanese char impacted by the delete byte
-      if((dirent[i].attributes & 0x08) == 0x08) continue;	// volume label
-      if((dirent[i].attributes & 0x10) == 0x10) continue;	// directory
-      
-      char filename[13];
-      filename[8] = '.';
-      filename[12] = 0;
-      
-      for(int j=0;j<8;j++) filename[j] = dirent[i].name[j];
-      for(int j=0;j<3;j++) filename[j+9] = dirent[i].ext[j]; 
-      
-      if(!strcmp(filename, (char *)find))
-      {
-	return dirent[i].size;
-      }
+      if(name[x] == '*')
+	x = x < 8 ? 7 : 10;				// skip the rest of this part
+      else if(name[x] != '?' && name[x] != _dirIndex[e].name[x])
+	match = false;
     }
+    
+    // first match in directory order, like the 1541
+    if(match && (best < 0 || _dirIndex[e].sector < _dirIndex[best].sector ||
+       (_dirIndex[e].sector == _dirIndex[best].sector && _dirIndex[e].offset < _dirIndex[best].offset)))
+      best = e;
+  }
+  return best;
+}
 
-    buffer = ReadNextSectorInChain(0);
-  } 
+int32_t Fat32::FindFile(uint8_t* filename)
+{
+  uint8_t name[11];
   
-  return 0;
+  if(ParseFilename(filename, name, name + 8) != FILE_STATUS_OK)
+    return -1;
+  return FindIndexEntry(name);
+}
+
+// the on-disk entry, modify it and mark its sector dirty
+uint8_t* Fat32::IndexEntryData(int32_t entry)
+{
+  uint8_t* sector = _cache.GetSector(_dirIndex[entry].sector);
+  return sector ? sector + _dirIndex[entry].offset : 0;
+}
+
+uint32_t Fat32::GetFileCluster(uint8_t* find)
+{
+  int32_t e = FindFile(find);
+  return e < 0 ? 0 : _dirIndex[e].cluster;
+}
+
+uint32_t Fat32::GetFileSize(uint8_t* find)
+{
+  int32_t e = FindFile(find);
+  return e < 0 ? 0 : _dirIndex[e].size;
 }
 
 int Fat32::OpenFile(uint8_t filenumber, uint8_t* filename, uint8_t mode)
 {
+  if(!Mount())
+    return FILE_STATUS_NODEVICE;
+  
   if(mode == FILEACCESSMODE_READ)
   {
     if(openFilesList[filenumber].mode != FILEACCESSMODE_CLOSED)
@@ -323,22 +627,26 @@ int Fat32::OpenFile(uint8_t filenumber, uint8_t* filename, uint8_t mode)
       return FILE_STATUS_NOTFOUND; // file not found
       
     uint32_t size = GetFileSize(filename);
-    uint8_t* buffer = new uint8_t[size];
-    
-    ReadFile(filename, buffer, size);
+    FileStatus* file = &openFilesList[filenumber];
+    SmallVector<FileExtent, 8> extents;
+    if(!file->buffer.resize(size) || !BuildExtents(fileCluster, &extents))
+    {
+      ResetOpenFileListEntry(filenumber);
+      return FILE_STATUS_NOMEMORY;
+    }
+    ReadExtents(extents, file->buffer.data(), size);
     
     openFilesList[filenumber].mode = FILEACCESSMODE_READ;
     
     uint8_t file8[8];
     uint8_t ext[3];
     ParseFilename(filename, file8, ext);   
-    for(int x=0;x<8;x++) openFilesList[filenumber].filename[x] = file8[x]; 
-    for(int x=0;x<3;x++) openFilesList[filenumber].ext[x] = ext[x];
+    memcpy(openFilesList[filenumber].filename, file8, 8);
+    memcpy(openFilesList[filenumber].ext, ext, 3);
        
     openFilesList[filenumber].size = size;
     openFilesList[filenumber].locationPtr = 0;
     openFilesList[filenumber].startingCluster = fileCluster;
-    openFilesList[filenumber].buffer = buffer;
         
     return FILE_STATUS_OK;	// OK
   }
@@ -348,24 +656,26 @@ int Fat32::OpenFile(uint8_t filenumber, uint8_t* filename, uint8_t mode)
     if(openFilesList[filenumber].mode != FILEACCESSMODE_CLOSED)
       return FILE_STATUS_FILEOPEN; // file already open
   
-    uint32_t fileCluster = GetFileCluster(filename);
-    
-    if(fileCluster != 0)
+    if(FindFile(filename) >= 0)
       return FILE_STATUS_FILEEXISTS;
     
     openFilesList[filenumber].mode = FILEACCESSMODE_WRITE;
     
     uint8_t file8[8], ext[3];
     ParseFilename(filename, file8, ext);   
-    for(int x=0;x<8;x++) openFilesList[filenumber].filename[x] = file8[x]; 
-    for(int x=0;x<3;x++) openFilesList[filenumber].ext[x] = ext[x];
+    memcpy(openFilesList[filenumber].filename, file8, 8);
+    memcpy(openFilesList[filenumber].ext, ext, 3);
     
     openFilesList[filenumber].size = 0;
     openFilesList[filenumber].locationPtr = 0;
     openFilesList[filenumber].startingCluster = 0;
+    openFilesList[filenumber].lastCluster = 0;
     
-    uint8_t* buffer = new uint8_t[_bpb.sectorsPerCluster* _bpb.bytesPerSector];
-    openFilesList[filenumber].buffer = buffer;
+    if(!openFilesList[filenumber].buffer.resize(_bpb.sectorsPerCluster* _bpb.bytesPerSector))
+    {
+      ResetOpenFileListEntry(filenumber);
+      return FILE_STATUS_NOMEMORY;
+    }
 
     CreateDirectoryEntry(filename, ext, 0);
     
@@ -384,20 +694,33 @@ int Fat32::CloseFile(uint8_t filenumber)
   
   if(openFilesList[filenumber].mode == FILEACCESSMODE_WRITE)
   {
-    FlushWriteBuffer(filenumber);
+    // the FAT and the directory entry are only touched here, once per file
+    if(openFilesList[filenumber].locationPtr > 0)
+      FlushWriteBuffer(filenumber);
     
-    openFilesList[filenumber].size--;
-
     UpdateDirectoryEntry(openFilesList[filenumber].filename, openFilesList[filenumber].ext, 
 			 openFilesList[filenumber].size, openFilesList[filenumber].startingCluster);
     
     ResetOpenFileListEntry(filenumber);
+    UpdateFSInfo();
+    _cache.Flush();
     return FILE_STATUS_OK;
   }
   
   return FILE_STATUS_FILECLSD;
 }
 
+// links a freshly allocated run to the end of a file being written
+void Fat32::AppendClusters(uint8_t filenumber, uint32_t first, uint32_t count)
+{
+  if (openFilesList[filenumber].startingCluster == 0)
+    openFilesList[filenumber].startingCluster = first;
+  else
+    SetCluster(openFilesList[filenumber].lastCluster, first);
+  
+  openFilesList[filenumber].lastCluster = first + count - 1;
+}
+
 int Fat32::FlushWriteBuffer(uint8_t filenumber)
 {
   // Allocate a cluster, write it to disk, then reset the buffer for more data
@@ -409,16 +732,9 @@ int Fat32::FlushWriteBuffer(uint8_t filenumber)
   if(status != FILE_STATUS_OK)
     return status;
 
-  if (openFilesList[filenumber].startingCluster == 0)
-    openFilesList[filenumber].startingCluster = freeCluster;
-  
-  uint32_t sector = _dataStart + _bpb.sectorsPerCluster * (freeCluster-2);
-
-  //uint8_t* buf = &openFilesList[filenumber].fileBuffer[0];
-  uint8_t* buf = &openFilesList[filenumber].buffer[0];
+  AppendClusters(filenumber, freeCluster, 1);
   
-  for(int x=0;x<_bpb.sectorsPerCluster;x++)
-    _hd->WriteSector(sector+x, &buf[x*_bpb.bytesPerSector], _bpb.bytesPerSector);
+  _cache.WriteSectors(ClusterToSector(freeCluster), openFilesList[filenumber].buffer.data(), _bpb.sectorsPerCluster);
 
   // reset pointer to start of buffer
   openFilesList[filenumber].locationPtr = 0;
@@ -426,6 +742,56 @@ int Fat32::FlushWriteBuffer(uint8_t filenumber)
   return FILE_STATUS_OK;
 }
 
+// Appends length bytes to a file being written. Whole clusters go to
+// the disk straight from data, allocated as contiguous runs, only the
+// tail is kept in the cluster buffer until the next write or CloseFile.
+int Fat32::WriteFileBlock(uint8_t filenumber, uint8_t* data, uint32_t length)
+{
+  if(openFilesList[filenumber].mode != FILEACCESSMODE_WRITE)
+    return FILE_STATUS_FILECLSD;
+  
+  uint32_t clusterSize = _bpb.sectorsPerCluster * _bpb.bytesPerSector;
+  
+  while(length > 0)
+  {
+    if(openFilesList[filenumber].locationPtr == 0 && length >= clusterSize)
+    {
+      uint32_t first, count;
+      int status = AllocateRun(length / clusterSize, &first, &count);
+      if(status != FILE_STATUS_OK)
+	return status;
+      
+      AppendClusters(filenumber, first, count);
+      _cache.WriteSectors(ClusterToSector(first), data, count * _bpb.sectorsPerCluster);
+      
+      data += count * clusterSize;
+      length -= count * clusterSize;
+      openFilesList[filenumber].size += count * clusterSize;
+    }
+    else
+    {
+      uint32_t n = clusterSize - openFilesList[filenumber].locationPtr;
+      if(n > length)
+	n = length;
+      
+      memcpy(openFilesList[filenumber].buffer.data() + openFilesList[filenumber].locationPtr, data, n);
+      openFilesList[filenumber].locationPtr += n;
+      openFilesList[filenumber].size += n;
+      data += n;
+      length -= n;
+      
+      if(openFilesList[filenumber].locationPtr == clusterSize)
+      {
+	int status = FlushWriteBuffer(filenumber);
+	if(status != FILE_STATUS_OK)
+	  return status;
+      }
+    }
+  }
+  
+  return FILE_STATUS_OK;
+}
+
 int Fat32::ParseFilename(uint8_t* filename, uint8_t* file8, uint8_t* ext)
 {
   uint8_t ctr = 0;
@@ -433,8 +799,8 @@ int Fat32::ParseFilename(uint8_t* filename, uint8_t* file8, uint8_t* ext)
   if (strlen((char*)filename) > 12)
     return FILE_STATUS_NOTFOUND;
   
-  for(int x=0; x<8; x++) file8[x] = ' ';
-  for(int x=0; x<3; x++) ext[x] = ' ';
+  memset(file8, ' ', 8);
+  memset(ext, ' ', 3);
   
   const char *period = strchr((char*)filename, (int)'.');
   
@@ -446,25 +812,25 @@ int Fat32::ParseFilename(uint8_t* filename, uint8_t* file8, uint8_t* ext)
   if (ploc != strlen((char*)filename)-4 || ploc == 0)
     return FILE_STATUS_NOTFOUND;
  
-  for(int x=0; x<ploc; x++)
-    file8[x] = filename[x];
-  
-  for(int x=0; x<3; x++)
-    ext[x] = filename[ploc+1+x];
+  memcpy(file8, filename, ploc);
+  memcpy(ext, filename + ploc + 1, 3);
   
   //printf("\n%c%c%c%c%c%c%c%c!",file8[0],file8[1],file8[2],file8[3],file8[4],file8[5],file8[6],file8[7]);
   //printf("\n%c%c%c!",ext[0],ext[1],ext[2]);
+  return FILE_STATUS_OK;
 }
 
 void Fat32::ResetOpenFileListEntry(uint8_t filenumber)
 {
     openFilesList[filenumber].mode = FILEACCESSMODE_CLOSED;
-    for(int x=0;x<8;x++) openFilesList[filenumber].filename[x] = 0; 
-    for(int x=0;x<3;x++) openFilesList[filenumber].ext[x] = 0;
+    memset(openFilesList[filenumber].filename, 0, 8);
+    memset(openFilesList[filenumber].ext, 0, 3);
     openFilesList[filenumber].size = 0;
     openFilesList[filenumber].locationPtr = 0;
     openFilesList[filenumber].startingCluster = 0;
-    delete [] openFilesList[filenumber].buffer;
+    openFilesList[filenumber].lastCluster = 0;
+    openFilesList[filenumber].buffer.clear();
+    openFilesList[filenumber].buffer.shrink_to_fit();
 }
 
 int Fat32::ReadNextFileByte(uint8_t filenumber, uint8_t* b)
@@ -481,79 +847,87 @@ int Fat32::ReadNextFileByte(uint8_t filenumber, uint8_t* b)
   
 }
 
+// copies up to length bytes from the current position of an open file,
+// returns the number of bytes copied (0 at end of file)
+uint32_t Fat32::ReadFileBlock(uint8_t filenumber, uint8_t* data, uint32_t length)
+{
+  if(openFilesList[filenumber].mode != FILEACCESSMODE_READ)
+    return 0;
+  
+  uint32_t left = openFilesList[filenumber].size - openFilesList[filenumber].locationPtr;
+  if(length > left)
+    length = left;
+  
+  memcpy(data, openFilesList[filenumber].buffer.data() + openFilesList[filenumber].locationPtr, length);
+  openFilesList[filenumber].locationPtr += length;
+  
+  return length;
+}
+
 void Fat32::ReadFile(uint8_t *filename, uint8_t* data, uint32_t size)
 {
-  _endOfChain = 0;
   uint32_t startCluster = GetFileCluster(filename);
   
   if(startCluster == 0)
     return;
   
-  uint8_t *buffer = ReadNextSectorInChain(startCluster);
-  uint32_t byteCtr = 0;
-  
-  for(int x=0;x<512;x++)
-  {
-    *data++ = buffer[x];
-    byteCtr++;
-
-    if(byteCtr == size)
-      return;
-  }
-  
-  while (_endOfChain == 0)
-  { 
-    //displayMemory(buffer, 512);
-    buffer = ReadNextSectorInChain(0);
-    
-    for(int x=0;x<512;x++)
-    {
-      *data++ = buffer[x];
-      byteCtr++;
-      
-      if(byteCtr == size)
-	return;
-    }
-  }  
-   
+  // most files are a handful of runs, those stay off the heap
+  SmallVector<FileExtent, 8> extents;
+  if(BuildExtents(startCluster, &extents))
+    ReadExtents(extents, data, size);
 }	
 
 void Fat32::ReadSector(uint32_t sector, uint8_t *buffer)
 {
   _lastSectorRead = sector;
-  _hd->ReadSector(_lastSectorRead, buffer, 512);
+  _cache.ReadSector(_lastSectorRead, buffer, 512);
 }
 
 int Fat32::AllocateCluster(uint32_t* startingCluster)
 {
-    // Find a free cluster
-    // traverse entire FAT cluster, looking for free cluster
+  uint32_t count;
+  return AllocateRun(1, startingCluster, &count);
+}
 
-    for(int sectorCtr=0; sectorCtr < _bpb.sectorsPerFat; sectorCtr++)
+// Allocates up to wanted contiguous clusters, already chained and ending
+// with an end-of-chain marker. The search starts at the next-free hint
+// and wraps around once, so sequential allocation is amortized O(1).
+int Fat32::AllocateRun(uint32_t wanted, uint32_t* first, uint32_t* count)
+{
+  if(!Mount() || _clusterCount <= 2)
+    return FILE_STATUS_DISKFULL;
+  
+  uint32_t cluster = _nextFree;
+  for(uint32_t n = 2; n < _clusterCount; n++)
+  {
+    if(cluster >= _clusterCount)
+      cluster = 2;
+    
+    if(NextCluster(cluster) == FREECLUSTER_FAT32)
     {
-      for(int x=0;x<_bpb.bytesPerSector;x+=4)
-      {
-	int ptr = (sectorCtr * _bpb.bytesPerSector) + x;
-	
-	uint32_t i32 = _fatBuffer[ptr] | (_fatBuffer[ptr+1] << 8) | 
-			(_fatBuffer[ptr+2] << 16) | (_fatBuffer[ptr+3] << 24);
-	
-	if(i32 == FREECLUSTER_FAT32)
-	{
-	  // Mark this as the last cluster.  Expansion happens elsewhere
-	  _fatBuffer[ptr+0] = 0xFF;  _fatBuffer[ptr+1] = 0xFF;
-	  _fatBuffer[ptr+2] = 0xFF;  _fatBuffer[ptr+3] = 0xFF;
-	  
-	  *startingCluster = ptr/4;
-	  _hd->WriteSector(_fatStart + sectorCtr, &_fatBuffer[sectorCtr*_bpb.bytesPerSector], _bpb.bytesPerSector);
-	  
-	  return FILE_STATUS_OK;
-	}
-      }
-
+      uint32_t run = 1;
+      while(run < wanted && cluster + run < _clusterCount && 
+	    NextCluster(cluster + run) == FREECLUSTER_FAT32)
+	run++;
+      
+      for(uint32_t x = 0; x < run - 1; x++)
+	SetCluster(cluster + x, cluster + x + 1);
+      // Mark this as the last cluster.  Expansion happens elsewhere
+      SetCluster(cluster + run - 1, 0x0FFFFFFF);
+      
+      *first = cluster;
+      *count = run;
+      if(_freeCount != 0xFFFFFFFF)
+	_freeCount = _freeCount > run ? _freeCount - run : 0;
+      _nextFree = cluster + run;
+      if(_nextFree >= _clusterCount)
+	_nextFree = 2;
+      return FILE_STATUS_OK;
     }
-    
-    return FILE_STATUS_DISKFULL;
+    cluster++;
+  }
+  
+  return FILE_STATUS_DISKFULL;
 }
 
 int Fat32::WriteNextFileByte(uint8_t filenumber, uint8_t b)
@@ -561,183 +935,189 @@ int Fat32::WriteNextFileByte(uint8_t filenumber, uint8_t b)
   if(openFilesList[filenumber].mode != FILEACCESSMODE_WRITE)
     return FILE_STATUS_FILECLSD;
   
-  //int capacity = openFilesList[filenumber].fileBuffer.capacity();
-  
-  // Expand buffer to size of another cluster if needed
-  //if(openFilesList[filenumber].locationPtr == capacity)
-  //{
-  //  openFilesList[filenumber].fileBuffer.resize(capacity + _bpb.sectorsPerCluster * _bpb.bytesPerSector);
-  //}
-  
-  //openFilesList[filenumber].fileBuffer[openFilesList[filenumber].locationPtr] = b;
-  
   openFilesList[filenumber].buffer[openFilesList[filenumber].locationPtr]=b;
   
   
   openFilesList[filenumber].locationPtr++;
   openFilesList[filenumber].size++;
   
+  // cluster buffer full, hand it to the disk
+  if(openFilesList[filenumber].locationPtr == _bpb.sectorsPerCluster * _bpb.bytesPerSector)
+    return FlushWriteBuffer(filenumber);
+  
   return FILE_STATUS_OK;
 }
 
-uint16_t Fat32::GetCBMDir(uint8_t* buf)
-{ 
-  uint16_t startOfBasic = 0x0801;
-  uint16_t nextLinePtr = 30;
-  
-  buf[0] = (startOfBasic + nextLinePtr) & 0xff;		// next link lo
-  buf[1] = ((startOfBasic + nextLinePtr) >> 8) & 0xff;	// next link hi
-  
-  buf[2] = 0x00;	// line num lo
-  buf[3] = 0x00;	// line num hi
-  buf[4] = 0x12;	// reverse
-  buf[5] = 0x22;	// quote
-  buf[6] = 0x20;	// space
-  buf[7] = 0x20;	// space
-  buf[8] = 0x20;	// space
-  buf[9] = 0x20;	// space
-  buf[10] = 0x20;	// space
-  buf[11] = 0x20;	// space
-  buf[12] = 0x20;	// space
-  buf[13] = 0x20;	// space
-  buf[14] = 0x20;	// space
-  buf[15] = 0x20;	// space
-  buf[16] = 0x20;	// space
-  buf[17] = 0x20;	// space
-  buf[18] = 0x20;	// space
-  buf[19] = 0x20;	// space
-  buf[20] = 0x20;	// space
-  buf[21] = 0x20;	// space
-  buf[22] = 0x22;	// quote
-  buf[23] = 0x20;	// space
-  buf[24] = 0x30;	// zero
-  buf[25] = 0x30;	// zero
-  buf[26] = 0x20;	// space
-  buf[27] = 0x32;	// 2
-  buf[28] = 0x41;	// A
-  buf[29] = 0x00;	// EOL
- 
-  // set this to filecluster to access a file or subdir
-  uint8_t *buffer = ReadNextSectorInChain(_bpb.rootCluster);
+void Fat32::OpenCBMDir(CBMDirCursor* dir, uint16_t address)
+{
+  dir->address = address;
+  dir->sector = 0;
+  dir->entry = 0;
+  dir->state = 0;
   
-  while (_endOfChain == 0)
-  {  
-    DirectoryEntryFat32 dirent[16];
+  // without a volume the listing is empty
+  if(!Mount())
+  {
+    dir->cluster = 0;
+    dir->state = 4;
+    return;
+  }
+  
+  // the volume label is picked up with the index
+  if(!_dirIndexBuilt)
+    BuildDirectoryIndex();
+  
+  dir->cluster = _bpb.rootCluster;
+}
+
+// finishes a line started at line[4]: link and line number go in front,
+// the address moves past it
+uint8_t Fat32::CBMDirLine(CBMDirCursor* dir, uint8_t* line, uint16_t number, uint8_t length)
+{
+  line[length++] = 0x00;	// EOL
+  
+  uint16_t next = dir->address + length;
+  line[0] = next & 0xff;	// next link lo
+  line[1] = next >> 8;		// next link hi
+  line[2] = number & 0xff;	// line num lo
+  line[3] = number >> 8;	// line num hi
+  
+  dir->address = next;
+  return length;
+}
+
+// Hands out the directory as BASIC lines, line must hold CBMDIR_MAX_LINE
+// bytes. Returns the line length, 0 once the listing is complete. The
+// directory is walked through the block cache, nothing is buffered here.
+uint8_t Fat32::ReadCBMDir(CBMDirCursor* dir, uint8_t* line)
+{
+  uint8_t n = 4;
+  
+  if(dir->state == 0)
+  {
+    dir->state = 1;
     
-    for(int entry=0;entry<16;entry++)
-	dirent[entry] = *(DirectoryEntryFat32*)(buffer+(sizeof(DirectoryEntryFat32)*entry));
+    line[n++] = 0x12;	// reverse
+    line[n++] = 0x22;	// quote
+    for(int j=0;j<16;j++)
+      line[n++] = j < 11 ? _volumeLabel[j] : 0x20;
+    line[n++] = 0x22;	// quote
+    line[n++] = 0x20;	// space
+    line[n++] = 0x30;	// 0
+    line[n++] = 0x30;	// 0
+    line[n++] = 0x20;	// space
+    line[n++] = 0x32;	// 2
+    line[n++] = 0x41;	// A
+    return CBMDirLine(dir, line, 0, n);
+  }
+  
+  uint16_t entries = _bpb.bytesPerSector / sizeof(DirectoryEntryFat32);
+  
+  while(dir->state == 1)
+  {
+    if(EndOfChain(dir->cluster))
+    {
+      dir->state = 2;
+      break;
+    }
     
-    for(int i=0;i<16;i++)
+    uint8_t* sector = _cache.GetSector(ClusterToSector(dir->cluster) + dir->sector);
+    if(sector == 0)
     {
-      if(dirent[i].name[0] == 0x00) continue;//return; 			// end of directory
-      if(dirent[i].name[0] == 0xE5) continue;			// deleted file, skip it     
-      if(dirent[i].name[0] == 0x05) dirent[i].name[0] = 0xE5;	// japanese char impacted by the delete byte
+      dir->state = 2;
+      break;
+    }
+    
+    while(dir->entry < entries)
+    {
+      DirectoryEntryFat32* dirent = (DirectoryEntryFat32*)(sector + sizeof(DirectoryEntryFat32) * dir->entry++);
       
-      // bit 3 = volume label
-      if((dirent[i].attributes & 0x08) == 0x08)
+      if(dirent->name[0] == 0x00)			// end of directory
       {
-	char volumeLabel[12] = "           ";
-	for(int j=0;j<8;j++) volumeLabel[j] = dirent[i].name[j];
-	for(int j=0;j<3;j++) volumeLabel[j+8] = dirent[i].ext[j];
-	
-	for(int jz=6;jz<17;jz++)
-	  buf[jz]= volumeLabel[jz-6];
-	
-	continue;
+	dir->state = 2;
+	break;
       }
-
-      int tempNextLinePtr = nextLinePtr;
-      buf[nextLinePtr++] = 0x00; // next link lo
-      buf[nextLinePtr++] = 0x00; // next link hi
-      
-      // file size / line num 
-      int size = (dirent[i].size + 254) / 254;
-      buf[nextLinePtr++] = size & 0xff; // 0x01; // line num lo
-      buf[nextLinePtr++] = (size >> 8) & 0xff; //0x00; // line num hi
-
-      buf[nextLinePtr++] = 0x20; // space
-      buf[nextLinePtr++] = 0x20; // space
-      buf[nextLinePtr++] = 0x20; // space
+      if(dirent->name[0] == 0xE5) continue;		// deleted file, skip it
+      if((dirent->attributes & 0x08) == 0x08) continue;	// volume label or long name
       
-      if(size > 10) nextLinePtr--;
-      if(size > 100) nextLinePtr--;
+      // file size in 254 byte blocks is the line number
+      uint32_t blocks = (dirent->size + 253) / 254;
+      if(blocks > 0xFFFF) blocks = 0xFFFF;
       
-      // file name
-      buf[nextLinePtr++] = 0x22; // quote
+      line[n++] = 0x20;	// space
+      if(blocks < 100) line[n++] = 0x20;
+      if(blocks < 10) line[n++] = 0x20;
       
+      line[n++] = 0x22;	// quote
       for(int j=0;j<8;j++)
-	buf[nextLinePtr++] = dirent[i].name[j];
-      
-      buf[nextLinePtr++] = 0x22; // quote
-
-      buf[nextLinePtr++] = 0x20; // space
-      buf[nextLinePtr++] = 0x20; // space
-      buf[nextLinePtr++] = 0x20; // space
-      buf[nextLinePtr++] = 0x20; // space
-      buf[nextLinePtr++] = 0x20; // space
-      buf[nextLinePtr++] = 0x20; // space
-      buf[nextLinePtr++] = 0x20; // space
-      buf[nextLinePtr++] = 0x20; // space
-      buf[nextLinePtr++] = 0x20; // space
+	line[n++] = dirent->name[j] == 0x05 ? 0xE5 : dirent->name[j];	// first byte 0x05 stands for 0xE5
+      line[n++] = 0x22;	// quote
+      for(int j=0;j<9;j++)
+	line[n++] = 0x20;	// pad to the 16 character CBM name
       
-      if((dirent[i].attributes & 0x10) == 0x10)
+      if((dirent->attributes & 0x10) == 0x10)
       {
-	buf[nextLinePtr++] = 0x44; // D
-	buf[nextLinePtr++] = 0x49; // I
-	buf[nextLinePtr++] = 0x52; // R
+	line[n++] = 0x44;	// D
+	line[n++] = 0x49;	// I
+	line[n++] = 0x52;	// R
       }
       else
       {
-	for(int j=0;j<4;j++)
-	  buf[nextLinePtr++] = dirent[i].ext[j];
+	for(int j=0;j<3;j++)
+	  line[n++] = dirent->ext[j];
       }
-      
-      buf[nextLinePtr++] = 0x00; // EOL
-      
-      // fix next line link ptr
-      buf[tempNextLinePtr] = (startOfBasic + nextLinePtr) & 0xff;		// next link lo
-      buf[tempNextLinePtr+1] = ((startOfBasic + nextLinePtr+1) >> 8) & 0xff;	// next link hi
-      
+      return CBMDirLine(dir, line, blocks, n);
     }
-
-    buffer = ReadNextSectorInChain(0);
-  } 
+    
+    if(dir->state != 1)
+      break;
+    
+    // next sector, then the next cluster of the directory
+    dir->entry = 0;
+    if(++dir->sector == _bpb.sectorsPerCluster)
+    {
+      dir->sector = 0;
+      dir->cluster = NextCluster(dir->cluster);
+    }
+  }
   
-  int tempNextLinePtr = nextLinePtr;
-  
-  buf[nextLinePtr++] = 0x00; // next link lo
-  buf[nextLinePtr++] = 0x00; // next link hi
-  
-  buf[nextLinePtr++] = 0x00; // zero
-  buf[nextLinePtr++] = 0x00; // zero
-
-  buf[nextLinePtr++] = 0x42; // B
-  buf[nextLinePtr++] = 0x4C; // L
-  buf[nextLinePtr++] = 0x4F; // O
-  buf[nextLinePtr++] = 0x43; // C
-  buf[nextLinePtr++] = 0x4B; // K
-  buf[nextLinePtr++] = 0x53; // S
-  buf[nextLinePtr++] = 0x20; // space
-  buf[nextLinePtr++] = 0x46; // F
-  buf[nextLinePtr++] = 0x52; // R
-  buf[nextLinePtr++] = 0x45; // E
-  buf[nextLinePtr++] = 0x45; // E
-  buf[nextLinePtr++] = 0x2E; // .
-  buf[nextLinePtr++] = 0x00; // EOL
-  
-  // fix next line link ptr
-  buf[tempNextLinePtr] = (startOfBasic + nextLinePtr) & 0xff;		// next link lo
-  buf[tempNextLinePtr+1] = ((startOfBasic + nextLinePtr+1) >> 8) & 0xff;	// next link hi
-
-  buf[nextLinePtr++] = 0x00;
-  buf[nextLinePtr++] = 0x00;
-  buf[nextLinePtr++] = 0x00;
-	
-  return nextLinePtr;
+  if(dir->state == 2)
+  {
+    dir->state = 3;
+    
+    // free clusters in 254 byte blocks, as much as a line number holds
+    // in two steps, the product overflows with large clusters
+    uint32_t clusters = FreeClusters();
+    uint32_t clusterBytes = _bpb.sectorsPerCluster * _bpb.bytesPerSector;
+    uint32_t blocks = 0xFFFF;
+    if(clusters <= 0xFFFF)
+      blocks = clusters / 254 * clusterBytes + clusters % 254 * clusterBytes / 254;
+    if(blocks > 0xFFFF) blocks = 0xFFFF;
+    
+    const char* text = "BLOCKS FREE.";
+    while(*text)
+      line[n++] = *text++;
+    return CBMDirLine(dir, line, blocks, n);
+  }
+  
+  if(dir->state == 3)
+  {
+    dir->state = 4;
+    
+    // a zero link ends the program
+    line[0] = 0x00;
+    line[1] = 0x00;
+    dir->address += 2;
+    return 2;
+  }
+  
+  return 0;
 }
 
 void Fat32::WriteDir(uint8_t* filename, uint8_t* ext, uint32_t size)
 {
+  if(!Mount())
+    return;
   _endOfChain = 0;
 
   // set this to filecluster to access a file or subdir
@@ -813,7 +1193,7 @@ void Fat32::WriteDir(uint8_t* filename, uint8_t* ext, uint32_t size)
 	
 	//displayMemory(buffer, 256);
 	
-	_hd->WriteSector(_lastSectorRead, buffer, 512);
+	_cache.WriteSector(_lastSectorRead, buffer, 512);
 	return;
       }
 
@@ -825,60 +1205,38 @@ void Fat32::WriteDir(uint8_t* filename, uint8_t* ext, uint32_t size)
 
 int Fat32::UpdateDirectoryEntry(uint8_t* filename, uint8_t* ext, uint32_t size, uint32_t startingCluster)
 {
-  _endOfChain = 0;
-
-  // set this to filecluster to access a file or subdir
-  uint8_t *buffer = ReadNextSectorInChain(_bpb.rootCluster);
-
-  while (_endOfChain == 0)
-  {  
-    DirectoryEntryFat32 dirent[16];
-    
-    for(int entry=0;entry<16;entry++)
-	dirent[entry] = *(DirectoryEntryFat32*)(buffer+(sizeof(DirectoryEntryFat32)*entry));
-    
-    for(int i=0;i<16;i++)
-    {
-      if(dirent[i].name[0] == filename[0] 
-	&& dirent[i].name[1] == filename[1]
-	&& dirent[i].name[2] == filename[2] 
-	&& dirent[i].name[3] == filename[3]
-	&& dirent[i].name[4] == filename[4]
-	&& dirent[i].name[5] == filename[5]
-	&& dirent[i].name[6] == filename[6]
-	&& dirent[i].name[7] == filename[7]
-	&& dirent[i].ext[0] == ext[0]
-	&& dirent[i].ext[1] == ext[1]
-	&& dirent[i].ext[2] == ext[2]
-      )
-      {
-	uint8_t *ptr;
-	ptr = &buffer[i*sizeof(DirectoryEntryFat32)];
-		
-	ptr[21] = (startingCluster >> 16) & 0xff;	// file cluster hi
-	ptr[22] = (startingCluster >> 24) & 0xff;
-	ptr[26] = startingCluster & 0xff;		// file cluster lo
-	ptr[27] = (startingCluster >> 8) & 0xff;	
-	ptr[28] = (size >> (8*0)) & 0xff;	// Write file size
-	ptr[29] = (size >> (8*1)) & 0xff;
-	ptr[30] = (size >> (8*2)) & 0xff;
-	ptr[31] = (size >> (8*3)) & 0xff;
-
-	_hd->WriteSector(_lastSectorRead, buffer, 512);
-	
-	return FILE_STATUS_OK;
-      }
-
-    }
-
-    buffer = ReadNextSectorInChain(0);
-  } 
+  uint8_t name[11];
+  memcpy(name, filename, 8);
+  memcpy(name + 8, ext, 3);
   
-  return FILE_STATUS_NOTFOUND;
+  int32_t e = FindIndexEntry(name);
+  if(e < 0)
+    return FILE_STATUS_NOTFOUND;
+  
+  uint8_t *ptr = IndexEntryData(e);
+  if(ptr == 0)
+    return FILE_STATUS_NODEVICE;
+  
+  ptr[20] = (startingCluster >> 16) & 0xff;	// file cluster hi
+  ptr[21] = (startingCluster >> 24) & 0xff;
+  ptr[26] = startingCluster & 0xff;		// file cluster lo
+  ptr[27] = (startingCluster >> 8) & 0xff;	
+  ptr[28] = (size >> (8*0)) & 0xff;	// Write file size
+  ptr[29] = (size >> (8*1)) & 0xff;
+  ptr[30] = (size >> (8*2)) & 0xff;
+  ptr[31] = (size >> (8*3)) & 0xff;
+  _cache.MarkDirty(_dirIndex[e].sector);
+  
+  _dirIndex[e].cluster = startingCluster;
+  _dirIndex[e].size = size;
+  
+  return FILE_STATUS_OK;
 }
 
 void Fat32::CreateDirectoryEntry(uint8_t* filename, uint8_t* ext, uint32_t size)
 {
+  if(!Mount())
+    return;
   _endOfChain = 0;
 
   // set this to filecluster to access a file or subdir
@@ -947,7 +1305,15 @@ void Fat32::CreateDirectoryEntry(uint8_t* filename, uint8_t* ext, uint32_t size)
 	*ptr = (size >> (8*3)) & 0xff;
 	
 
-	_hd->WriteSector(_lastSectorRead, buffer, 512);
+	_cache.WriteSector(_lastSectorRead, buffer, 512);
+	
+	if(_dirIndexBuilt)
+	{
+	  uint8_t name[11];
+	  memcpy(name, filename, 8);
+	  memcpy(name + 8, ext, 3);
+	  AddIndexEntry(name, 0x20, 0, size, _lastSectorRead, i*sizeof(DirectoryEntryFat32));
+	}
 
 	return;
       }
@@ -960,107 +1326,53 @@ void Fat32::CreateDirectoryEntry(uint8_t* filename, uint8_t* ext, uint32_t size)
 
 int Fat32::DeleteFile(uint8_t* filename)
 {
-  _endOfChain = 0;
-
-  uint8_t file8[8], ext[3];
-  ParseFilename(filename, file8, ext);   
+  int32_t e = FindFile(filename);
+  if(e < 0)
+    return FILE_STATUS_NOTFOUND;
   
-  // set this to filecluster to access a file or subdir
-  uint8_t *buffer = ReadNextSectorInChain(_bpb.rootCluster);
-
-  while (_endOfChain == 0)
-  {  
-    DirectoryEntryFat32 dirent[16];
-    
-    for(int entry=0;entry<16;entry++)
-	dirent[entry] = *(DirectoryEntryFat32*)(buffer+(sizeof(DirectoryEntryFat32)*entry));
-    
-    for(int i=0;i<16;i++)
-    {
-      if(dirent[i].name[0] == file8[0] 
-	&& dirent[i].name[1] == file8[1]
-	&& dirent[i].name[2] == file8[2] 
-	&& dirent[i].name[3] == file8[3]
-	&& dirent[i].name[4] == file8[4]
-	&& dirent[i].name[5] == file8[5]
-	&& dirent[i].name[6] == file8[6]
-	&& dirent[i].name[7] == file8[7]
-	&& dirent[i].ext[0] == ext[0]
-	&& dirent[i].ext[1] == ext[1]
-	&& dirent[i].ext[2] == ext[2]
-      )
-      {
-	uint8_t *ptr;
-	ptr = &buffer[i*sizeof(DirectoryEntryFat32)];
-		
-	ptr[0] = 0xE5;	// First byte of filename set to 0xE5 to indicate deleted
-
-	_hd->WriteSector(_lastSectorRead, buffer, 512);
-	
-	return FILE_STATUS_OK;
-      }
-
-    }
-
-    buffer = ReadNextSectorInChain(0);
-  } 
+  uint8_t *ptr = IndexEntryData(e);
+  if(ptr == 0)
+    return FILE_STATUS_NODEVICE;
   
-  return FILE_STATUS_NOTFOUND;
+  ptr[0] = 0xE5;	// First byte of filename set to 0xE5 to indicate deleted
+  _cache.MarkDirty(_dirIndex[e].sector);
+  _cache.Flush();
+  
+  RemoveIndexEntry(e);
+  return FILE_STATUS_OK;
 }
 
 int Fat32::RenameFile(uint8_t* currentFilename, uint8_t* newFilename)
 {
-  _endOfChain = 0;
-
-  uint8_t file8[8], ext[3];
-  ParseFilename(currentFilename, file8, ext);   
+  uint8_t name[11];
   
-  uint8_t newfile8[8], newext[3];
-  ParseFilename(newFilename, newfile8, newext);  
+  if(ParseFilename(newFilename, name, name + 8) != FILE_STATUS_OK)
+    return FILE_STATUS_NOTFOUND;
   
-  // set this to filecluster to access a file or subdir
-  uint8_t *buffer = ReadNextSectorInChain(_bpb.rootCluster);
-
-  while (_endOfChain == 0)
-  {  
-    DirectoryEntryFat32 dirent[16];
-    
-    for(int entry=0;entry<16;entry++)
-	dirent[entry] = *(DirectoryEntryFat32*)(buffer+(sizeof(DirectoryEntryFat32)*entry));
-    
-    for(int i=0;i<16;i++)
-    {
-      if(dirent[i].name[0] == file8[0] 
-	&& dirent[i].name[1] == file8[1]
-	&& dirent[i].name[2] == file8[2] 
-	&& dirent[i].name[3] == file8[3]
-	&& dirent[i].name[4] == file8[4]
-	&& dirent[i].name[5] == file8[5]
-	&& dirent[i].name[6] == file8[6]
-	&& dirent[i].name[7] == file8[7]
-	&& dirent[i].ext[0] == ext[0]
-	&& dirent[i].ext[1] == ext[1]
-	&& dirent[i].ext[2] == ext[2]
-      )
-      {
-	uint8_t *ptr;
-	ptr = &buffer[i*sizeof(DirectoryEntryFat32)];
-		
-	for(int x=0;x<8;x++)
-	  *ptr++ = newfile8[x];
-	
-	for(int x=0;x<3;x++)
-	  *ptr++ = newext[x];
-
-	_hd->WriteSector(_lastSectorRead, buffer, 512);
-	
-	return FILE_STATUS_OK;
-      }
-
-    }
-
-    buffer = ReadNextSectorInChain(0);
-  } 
+  int32_t e = FindFile(currentFilename);
+  if(e < 0)
+    return FILE_STATUS_NOTFOUND;
   
-  return FILE_STATUS_NOTFOUND;
-}
\ No newline at end of file
+  // a "*" extension keeps the current one
+  if(name[8] == '*')
+  {
+    memcpy(name + 8, _dirIndex[e].name + 8, 3);
+  }
+  
+  if(FindIndexEntry(name) >= 0)
+    return FILE_STATUS_FILEEXISTS;
+  
+  uint8_t *ptr = IndexEntryData(e);
+  if(ptr == 0)
+    return FILE_STATUS_NODEVICE;
+  
+  memcpy(ptr, name, 11);
+  _cache.MarkDirty(_dirIndex[e].sector);
+  _cache.Flush();
+  
+  // the name is the key, file it under the new one
+  DirectoryIndexEntry old = _dirIndex[e];
+  RemoveIndexEntry(e);
+  AddIndexEntry(name, old.attributes, old.cluster, old.size, old.sector, old.offset);
+  return FILE_STATUS_OK;
+}
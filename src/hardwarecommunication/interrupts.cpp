@@ -22,6 +22,18 @@ uint32_t InterruptHandler::HandleInterrupt(uint32_t esp)
     return esp;
 }
 
+EventTimer::EventTimer()
+{
+}
+
+void EventTimer::Update()
+{
+}
+
+void EventTimer::Program(TaskManager* taskManager)
+{
+}
+
 void InterruptManager::SetInterruptDescriptorTableEntry(uint8_t interrupt,
     uint16_t CodeSegment, void (*handler)(), uint8_t DescriptorPrivilegeLevel, uint8_t DescriptorType)
 {
@@ -49,6 +61,8 @@ InterruptManager::InterruptManager(uint16_t hardwareInterruptOffset, GlobalDescr
 {
     this->taskManager = taskManager;
     this->hardwareInterruptOffset = hardwareInterruptOffset;
+    timerInterrupt = hardwareInterruptOffset;
+    eventTimer = 0;
     uint32_t CodeSegment = globalDescriptorTable->CodeSegmentSelector();
 
     const uint8_t IDT_INTERRUPT_GATE = 0xE;
@@ -97,6 +111,7 @@ InterruptManager::InterruptManager(uint16_t hardwareInterruptOffset, GlobalDescr
     SetInterruptDescriptorTableEntry(hardwareInterruptOffset + 0x0D, CodeSegment, &HandleInterruptRequest0x0D, 0, IDT_INTERRUPT_GATE);
     SetInterruptDescriptorTableEntry(hardwareInterruptOffset + 0x0E, CodeSegment, &HandleInterruptRequest0x0E, 0, IDT_INTERRUPT_GATE);
     SetInterruptDescriptorTableEntry(hardwareInterruptOffset + 0x0F, CodeSegment, &HandleInterruptRequest0x0F, 0, IDT_INTERRUPT_GATE);
+    SetInterruptDescriptorTableEntry(hardwareInterruptOffset + 0x10, CodeSegment, &HandleInterruptRequest0x10, 0, IDT_INTERRUPT_GATE);
 
     SetInterruptDescriptorTableEntry(                          0x80, CodeSegment, &HandleInterruptRequest0x80, 0, IDT_INTERRUPT_GATE);
 
@@ -132,6 +147,23 @@ uint16_t InterruptManager::HardwareInterruptOffset()
     return hardwareInterruptOffset;
 }
 
+// The scheduler moves from IRQ0 to the timer's interrupt and the PIT
+// line is masked. The first interrupt is armed here, from then on
+// every interrupt arms the next one.
+void InterruptManager::SetEventTimer(uint8_t interrupt, EventTimer* timer)
+{
+    uint32_t flags;
+    asm volatile("pushfl; popl %0; cli" : "=r" (flags));
+    programmableInterruptControllerMasterDataPort.Write(
+        programmableInterruptControllerMasterDataPort.Read() | 0x01);
+    timerInterrupt = interrupt;
+    eventTimer = timer;
+    timer->Update();
+    timer->Program(taskManager);
+    if(flags & 0x200)
+        asm volatile("sti");
+}
+
 void InterruptManager::Activate()
 {
     if(ActiveInterruptManager != 0)
@@ -160,6 +192,9 @@ uint32_t InterruptManager::HandleInterrupt(uint8_t interrupt, uint32_t esp)
 
 uint32_t InterruptManager::DoHandleInterrupt(uint8_t interrupt, uint32_t esp)
 {
+    if(eventTimer != 0)
+        eventTimer->Update();
+
     if(handlers[interrupt] != 0)
     {
         esp = handlers[interrupt]->HandleInterrupt(esp);
@@ -170,7 +205,7 @@ uint32_t InterruptManager::DoHandleInterrupt(uint8_t interrupt, uint32_t esp)
       //printfHex(interrupt);
     }
     
-    if(interrupt == hardwareInterruptOffset)
+    if(interrupt == timerInterrupt)
     {
         esp = (uint32_t)taskManager->Schedule((CPUState*)esp);
     }
@@ -183,6 +218,9 @@ uint32_t InterruptManager::DoHandleInterrupt(uint8_t interrupt, uint32_t esp)
             programmableInterruptControllerSlaveCommandPort.Write(0x20);
     }
 
+    if(eventTimer != 0)
+        eventTimer->Program(taskManager);
+
     return esp;
 }
 
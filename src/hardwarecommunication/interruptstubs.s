@@ -61,6 +61,7 @@ HandleInterruptRequest 0x0C
 HandleInterruptRequest 0x0D
 HandleInterruptRequest 0x0E
 HandleInterruptRequest 0x0F
+HandleInterruptRequest 0x10
 HandleInterruptRequest 0x31
 
 HandleInterruptRequest 0x80
@@ -84,8 +85,11 @@ int_bottom:
     pushl %ebx
     pushl %eax
 
+    # the C++ handlers expect DF clear, an interrupted backward copy
+    # (std; rep movs) gets its flag back from iret
+    cld
+
     # load ring 0 segment register
-    #cld
     #mov $0x10, %eax
     #mov %eax, %eds
     #mov %eax, %ees
@@ -122,3 +126,5 @@ _ZN4myos21hardwarecommunication16InterruptManager15InterruptIgnoreEv:
 
 .data
     interruptnumber: .byte 0
+
+.section .note.GNU-stack,"",@progbits
@@ -1,4 +1,5 @@
 #include <hardwarecommunication/pci.h>
+#include <drivers/bga.h>
 
 
 using namespace myos::drivers;
@@ -97,6 +98,33 @@ void PeripheralComponentInterconnectController::SelectDrivers(DriverManager* dri
 }
 
 
+// returns the first device of the given class/subclass
+bool PeripheralComponentInterconnectController::FindDevice(uint8_t class_id, uint8_t subclass_id, PeripheralComponentInterconnectDeviceDescriptor* dev)
+{
+  for(int bus = 0; bus < 8; bus++)
+  {
+    for(int device = 0; device < 32; device++)
+    {
+      int numFunctions = DeviceHasFunctions(bus, device) ? 8 : 1;
+      for(int function = 0; function < numFunctions; function++)
+      {
+	PeripheralComponentInterconnectDeviceDescriptor d = GetDeviceDescriptor(bus, device, function);
+	
+	if(d.vendor_id == 0x0000 || d.vendor_id == 0xFFFF)
+	  continue;
+	
+	if(d.class_id == class_id && d.subclass_id == subclass_id)
+	{
+	  *dev = d;
+	  return true;
+	}
+      }
+    }
+  }
+  return false;
+}
+
+
 BaseAddressRegister PeripheralComponentInterconnectController::GetBaseAddressRegister(uint16_t bus, uint16_t device, uint16_t function, uint16_t bar)
 {
     BaseAddressRegister result;
@@ -149,6 +177,17 @@ Driver* PeripheralComponentInterconnectController::GetDriver(PeripheralComponent
 
         case 0x8086: // Intel
             break;
+
+        case BGA_PCI_VENDOR_QEMU: // Bochs, QEMU std VGA
+        case BGA_PCI_VENDOR_VBOX: // VirtualBox VBoxVGA
+            if(dev.device_id == BGA_PCI_DEVICE_QEMU || dev.device_id == BGA_PCI_DEVICE_VBOX)
+            {
+                // BAR0 is the linear framebuffer
+                uint32_t bar0 = Read(dev.bus, dev.device, dev.function, 0x10);
+                driver = new BGADriver((bar0 & 0x1) ? 0 : (uint32_t*)(bar0 & ~0xF));
+                printf("BGA ");
+            }
+            break;
     }
     
     
@@ -77,6 +77,17 @@ uint16_t Port16Bit::Read()
     return Read16(portnumber);
 }
 
+// rep insw/outsw, moves count words without a loop per word
+void Port16Bit::ReadString(uint16_t* data, uint32_t count)
+{
+    __asm__ volatile("cld; rep insw" : "+D" (data), "+c" (count) : "d" (portnumber) : "memory");
+}
+
+void Port16Bit::WriteString(const uint16_t* data, uint32_t count)
+{
+    __asm__ volatile("cld; rep outsw" : "+S" (data), "+c" (count) : "d" (portnumber) : "memory");
+}
+
 
 
 
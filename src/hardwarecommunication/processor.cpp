@@ -0,0 +1,136 @@
+#include <hardwarecommunication/processor.h>
+
+using namespace myos::hardwarecommunication;
+
+
+bool Processor::sseEnabled = false;
+uint32_t Processor::writeCombiningBase = 0;
+uint32_t Processor::writeCombiningSize = 0;
+
+void Processor::CPUID(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx)
+{
+    __asm__ volatile("cpuid"
+        : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+        : "a" (leaf), "c" (0));
+}
+
+bool Processor::HasSSE2()
+{
+    uint32_t eax, ebx, ecx, edx;
+    CPUID(1, &eax, &ebx, &ecx, &edx);
+    
+    // FXSR (bit 24) is needed to set CR4.OSFXSR, SSE2 is bit 26
+    return (edx & (1 << 24)) && (edx & (1 << 26));
+}
+
+// Clears CR0.EM, sets CR0.MP and enables FXSAVE/FXRSTOR and SIMD
+// exceptions in CR4. Until this runs any SSE instruction faults with #UD.
+bool Processor::EnableSSE()
+{
+    if(!HasSSE2())
+        return false;
+    
+    uint32_t cr0, cr4;
+    __asm__ volatile("mov %%cr0, %0" : "=r" (cr0));
+    cr0 &= ~(1 << 2);
+    cr0 |= (1 << 1);
+    __asm__ volatile("mov %0, %%cr0" : : "r" (cr0));
+    
+    __asm__ volatile("mov %%cr4, %0" : "=r" (cr4));
+    cr4 |= (1 << 9) | (1 << 10);
+    __asm__ volatile("mov %0, %%cr4" : : "r" (cr4));
+    
+    sseEnabled = true;
+    return true;
+}
+
+bool Processor::SSEEnabled()
+{
+    return sseEnabled;
+}
+
+void Processor::ReadMSR(uint32_t msr, uint32_t* lo, uint32_t* hi)
+{
+    __asm__ volatile("rdmsr" : "=a" (*lo), "=d" (*hi) : "c" (msr));
+}
+
+void Processor::WriteMSR(uint32_t msr, uint32_t lo, uint32_t hi)
+{
+    __asm__ volatile("wrmsr" : : "c" (msr), "a" (lo), "d" (hi));
+}
+
+// Marks [base, base+size) write-combining with a free variable range MTRR.
+// There is no paging, so the PAT can't be used and the MTRR alone decides
+// the memory type. The range is rounded up to a power of two, base must be
+// aligned to it (linear framebuffers always are).
+bool Processor::SetWriteCombining(uint32_t base, uint32_t size)
+{
+    uint32_t eax, ebx, ecx, edx;
+    CPUID(1, &eax, &ebx, &ecx, &edx);
+    if((edx & (1 << 12)) == 0)          // no MTRRs
+        return false;
+    
+    uint32_t lo, hi;
+    ReadMSR(0xFE, &lo, &hi);             // IA32_MTRRCAP
+    if((lo & (1 << 10)) == 0)           // write-combining not supported
+        return false;
+    uint32_t count = lo & 0xff;
+    
+    uint32_t range = 4096;
+    while(range < size && range != 0x80000000)
+        range <<= 1;
+    if((base & (range - 1)) != 0)
+        return false;
+    
+    // mask covers the physical address bits above 4GB as well
+    uint32_t physBits = 36;
+    CPUID(0x80000000, &eax, &ebx, &ecx, &edx);
+    if(eax >= 0x80000008)
+    {
+        CPUID(0x80000008, &eax, &ebx, &ecx, &edx);
+        physBits = eax & 0xff;
+    }
+    uint32_t maskHi = physBits > 32 ? (1 << (physBits - 32)) - 1 : 0;
+    
+    int slot = -1;
+    for(uint32_t i = 0; i < count; i++)
+    {
+        ReadMSR(0x201 + 2*i, &lo, &hi);  // IA32_MTRR_PHYSMASKn
+        if((lo & (1 << 11)) == 0)
+        {
+            slot = i;
+            break;
+        }
+    }
+    if(slot < 0)
+        return false;
+    
+    // Intel SDM 11.11.7.2: caches off and flushed, MTRRs disabled while
+    // the range registers change
+    uint32_t flags, cr0, defLo, defHi;
+    __asm__ volatile("pushf; pop %0; cli" : "=r" (flags));
+    __asm__ volatile("mov %%cr0, %0" : "=r" (cr0));
+    __asm__ volatile("mov %0, %%cr0; wbinvd" : : "r" ((cr0 | (1 << 30)) & ~(1 << 29)));
+    ReadMSR(0x2FF, &defLo, &defHi);      // IA32_MTRR_DEF_TYPE
+    WriteMSR(0x2FF, defLo & ~(1 << 11), defHi);
+    
+    WriteMSR(0x200 + 2*slot, base | 0x01, 0);
+    WriteMSR(0x201 + 2*slot, ~(range - 1) | (1 << 11), maskHi);
+    
+    WriteMSR(0x2FF, defLo, defHi);
+    __asm__ volatile("wbinvd; mov %0, %%cr0" : : "r" (cr0));
+    __asm__ volatile("push %0; popf" : : "r" (flags));
+    
+    writeCombiningBase = base;
+    writeCombiningSize = size;
+    return true;
+}
+
+// MTRRs are per processor and have to agree on all of them, an
+// application processor repeats what the bootstrap one set up.
+bool Processor::ReplicateWriteCombining()
+{
+    if(writeCombiningSize == 0)
+        return false;
+    return SetWriteCombining(writeCombiningBase, writeCombiningSize);
+}
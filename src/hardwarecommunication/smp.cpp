@@ -0,0 +1,233 @@
+#include <hardwarecommunication/smp.h>
+#include <hardwarecommunication/processor.h>
+#include <drivers/pit.h>
+#include <lib/string.h>
+
+using namespace myos;
+using namespace myos::drivers;
+using namespace myos::hardwarecommunication;
+
+// real mode code in smpboot.s, copied to SMP_TRAMPOLINE
+extern "C" uint8_t smp_trampoline_start[];
+extern "C" uint8_t smp_trampoline_end[];
+extern "C" uint8_t smp_trampoline_stack[];
+extern "C" uint8_t smp_trampoline_entry[];
+
+// first byte of the loaded kernel, from linker.ld
+extern "C" uint8_t kernel_start[];
+
+volatile bool MultiprocessorController::workerRunning = false;
+volatile ProcessorJob MultiprocessorController::workerJob = 0;
+void* volatile MultiprocessorController::workerArg = 0;
+
+MultiprocessorController::MultiprocessorController()
+:   localApic((volatile uint32_t*)LAPIC_DEFAULT_BASE),
+    numProcessors(1),
+    workerStack(0)
+{
+}
+
+MultiprocessorController::~MultiprocessorController()
+{
+}
+
+static bool ValidChecksum(uint8_t* table, uint32_t length)
+{
+    uint8_t sum = 0;
+    for(uint32_t i = 0; i < length; i++)
+        sum += table[i];
+    return sum == 0;
+}
+
+uint8_t* MultiprocessorController::FindRSDP()
+{
+    uint32_t ebda = (uint32_t)(*(uint16_t*)ACPI_EBDA_SEGMENT_PTR) << 4;
+    for(uint32_t p = ebda; ebda != 0 && p < ebda + 1024; p += 16)
+        if(memcmp((void*)p, "RSD PTR ", 8) == 0 && ValidChecksum((uint8_t*)p, 20))
+            return (uint8_t*)p;
+    for(uint32_t p = ACPI_BIOS_AREA_START; p < ACPI_BIOS_AREA_END; p += 16)
+        if(memcmp((void*)p, "RSD PTR ", 8) == 0 && ValidChecksum((uint8_t*)p, 20))
+            return (uint8_t*)p;
+    return 0;
+}
+
+// Walks the RSDT, the 32 bit table is enough without paging
+uint8_t* MultiprocessorController::FindTable(uint8_t* rsdp, const char* signature)
+{
+    uint8_t* rsdt = (uint8_t*)*(uint32_t*)(rsdp + 16);
+    if(rsdt == 0 || memcmp(rsdt, "RSDT", 4) != 0)
+        return 0;
+    uint32_t length = *(uint32_t*)(rsdt + 4);
+    for(uint32_t i = ACPI_SDT_HEADER_SIZE; i + 4 <= length; i += 4)
+    {
+        uint8_t* table = (uint8_t*)*(uint32_t*)(rsdt + i);
+        if(memcmp(table, signature, 4) == 0
+           && ValidChecksum(table, *(uint32_t*)(table + 4)))
+            return table;
+    }
+    return 0;
+}
+
+// Collects the enabled processors from the MADT local APIC entries
+bool MultiprocessorController::Detect()
+{
+    uint8_t* rsdp = FindRSDP();
+    if(rsdp == 0)
+        return false;
+    uint8_t* madt = FindTable(rsdp, "APIC");
+    if(madt == 0)
+        return false;
+
+    localApic = (volatile uint32_t*)*(uint32_t*)(madt + ACPI_SDT_HEADER_SIZE);
+    uint32_t length = *(uint32_t*)(madt + 4);
+    numProcessors = 0;
+    for(uint32_t i = ACPI_SDT_HEADER_SIZE + 8; i + 2 <= length; )
+    {
+        uint8_t type = madt[i];
+        uint8_t entryLength = madt[i + 1];
+        if(entryLength < 2)
+            break;
+        if(type == ACPI_MADT_LAPIC_PROCESSOR && (madt[i + 4] & ACPI_MADT_ENABLED)
+           && numProcessors < SMP_MAX_PROCESSORS)
+            apicIds[numProcessors++] = madt[i + 3];
+        i += entryLength;
+    }
+    if(numProcessors == 0)
+        numProcessors = 1;
+    return numProcessors > 1;
+}
+
+void MultiprocessorController::Delay(uint32_t us)
+{
+    uint32_t start = PITDriver::Microseconds();
+    while(PITDriver::Microseconds() - start < us)
+        __asm__ volatile("pause");
+}
+
+void MultiprocessorController::WriteICR(uint8_t apicId, uint32_t command)
+{
+    localApic[LAPIC_ICR_HIGH / 4] = (uint32_t)apicId << 24;
+    localApic[LAPIC_ICR_LOW / 4] = command;
+    while(localApic[LAPIC_ICR_LOW / 4] & LAPIC_ICR_PENDING)
+        __asm__ volatile("pause");
+}
+
+static bool Overlaps(uint32_t start, uint32_t length)
+{
+    return start < SMP_TRAMPOLINE + SMP_TRAMPOLINE_SIZE && SMP_TRAMPOLINE < start + length;
+}
+
+// The trampoline page has to be free RAM in the boot loader's memory
+// map, below the kernel and clear of what the boot loader left there
+bool MultiprocessorController::TrampolineFree(const multiboot_info_t* boot)
+{
+    if(SMP_TRAMPOLINE + SMP_TRAMPOLINE_SIZE > (uint32_t)kernel_start
+       || (uint32_t)(smp_trampoline_end - smp_trampoline_start) > SMP_TRAMPOLINE_SIZE)
+        return false;
+    if(boot == 0 || (boot->flags & MULTIBOOT_INFO_MEM_MAP) == 0)
+        return false;
+    if(Overlaps((uint32_t)boot, sizeof(multiboot_info_t))
+       || Overlaps(boot->mmap_addr, boot->mmap_length))
+        return false;
+    if((boot->flags & MULTIBOOT_INFO_CMDLINE) && boot->cmdline != 0
+       && Overlaps(boot->cmdline, strlen((const char*)boot->cmdline) + 1))
+        return false;
+
+    bool available = false;
+    for(uint32_t p = boot->mmap_addr; p < boot->mmap_addr + boot->mmap_length; )
+    {
+        const multiboot_memory_map_t* entry = (const multiboot_memory_map_t*)p;
+        if(entry->addr <= SMP_TRAMPOLINE
+           && entry->addr + entry->len >= SMP_TRAMPOLINE + SMP_TRAMPOLINE_SIZE)
+        {
+            if(entry->type != MULTIBOOT_MEMORY_AVAILABLE)
+                return false;
+            available = true;
+        }
+        else if(entry->type != MULTIBOOT_MEMORY_AVAILABLE
+                && entry->addr < SMP_TRAMPOLINE + SMP_TRAMPOLINE_SIZE
+                && entry->addr + entry->len > SMP_TRAMPOLINE)
+            return false;
+        p += entry->size + sizeof(entry->size);
+    }
+    return available;
+}
+
+// INIT, then up to two STARTUP IPIs pointing at the trampoline page as
+// in the MultiProcessor Specification. Only the first processor other
+// than the bootstrap one is started, the others stay halted.
+bool MultiprocessorController::StartWorker(const multiboot_info_t* boot)
+{
+    if(numProcessors < 2 || workerRunning)
+        return workerRunning;
+    if(!TrampolineFree(boot))
+        return false;
+
+    uint8_t self = localApic[LAPIC_ID / 4] >> 24;
+    int worker = 0;
+    while(worker < numProcessors && apicIds[worker] == self)
+        worker++;
+    if(worker == numProcessors)
+        return false;
+
+    uint8_t* trampoline = (uint8_t*)SMP_TRAMPOLINE;
+    memcpy(trampoline, smp_trampoline_start, smp_trampoline_end - smp_trampoline_start);
+    workerStack = new uint8_t[SMP_STACK_SIZE];
+    *(uint32_t*)(trampoline + (smp_trampoline_stack - smp_trampoline_start)) =
+        (uint32_t)(workerStack + SMP_STACK_SIZE);
+    *(uint32_t*)(trampoline + (smp_trampoline_entry - smp_trampoline_start)) =
+        (uint32_t)&MultiprocessorController::WorkerMain;
+
+    WriteICR(apicIds[worker], LAPIC_ICR_INIT);
+    Delay(10000);
+    for(int i = 0; i < 2 && !workerRunning; i++)
+    {
+        WriteICR(apicIds[worker], LAPIC_ICR_STARTUP | (SMP_TRAMPOLINE >> 12));
+        Delay(200);
+    }
+    for(int i = 0; i < 100 && !workerRunning; i++)
+        Delay(1000);
+    return workerRunning;
+}
+
+// Posts a job once the previous one finished. Stores made by the job
+// are visible to the poster after Wait().
+bool MultiprocessorController::Submit(ProcessorJob job, void* arg)
+{
+    if(!workerRunning)
+        return false;
+    Wait();
+    workerArg = arg;
+    __sync_synchronize();
+    workerJob = job;
+    return true;
+}
+
+void MultiprocessorController::Wait()
+{
+    while(workerJob != 0)
+        __asm__ volatile("pause");
+    __sync_synchronize();
+}
+
+// Entered from the trampoline on the worker stack. Control registers
+// and MTRRs are per processor, so SSE and write-combining are set up
+// again here.
+void MultiprocessorController::WorkerMain()
+{
+    if(Processor::SSEEnabled())
+        Processor::EnableSSE();
+    Processor::ReplicateWriteCombining();
+
+    workerRunning = true;
+    while(true)
+    {
+        while(workerJob == 0)
+            __asm__ volatile("pause");
+        __sync_synchronize();
+        workerJob(workerArg);
+        // the locked store also drains write-combining buffers
+        __sync_synchronize();
+        workerJob = 0;
+    }
+}
@@ -0,0 +1,57 @@
+.set SMP_TRAMPOLINE, 0x8000
+
+# Application processor entry. It is copied to SMP_TRAMPOLINE and the
+# STARTUP IPI begins it in real mode at that page, so everything here
+# is addressed relative to the copy. A flat GDT of its own gets the
+# processor to protected mode, then it calls the entry point on the
+# stack the bootstrap processor stored in the two slots at the end.
+
+.section .text
+
+.global smp_trampoline_start
+.global smp_trampoline_end
+.global smp_trampoline_stack
+.global smp_trampoline_entry
+
+.code16
+smp_trampoline_start:
+    cli
+    cld
+    xor %ax, %ax
+    mov %ax, %ds
+    lgdtl (SMP_TRAMPOLINE + smp_trampoline_gdtr - smp_trampoline_start)
+    mov %cr0, %eax
+    or $1, %eax
+    mov %eax, %cr0
+    ljmpl $0x08, $(SMP_TRAMPOLINE + smp_trampoline_protected - smp_trampoline_start)
+
+.code32
+smp_trampoline_protected:
+    mov $0x10, %ax
+    mov %ax, %ds
+    mov %ax, %es
+    mov %ax, %fs
+    mov %ax, %gs
+    mov %ax, %ss
+    mov (SMP_TRAMPOLINE + smp_trampoline_stack - smp_trampoline_start), %esp
+    call *(SMP_TRAMPOLINE + smp_trampoline_entry - smp_trampoline_start)
+smp_trampoline_halt:
+    cli
+    hlt
+    jmp smp_trampoline_halt
+
+.align 8
+smp_trampoline_gdt:
+    .quad 0x0000000000000000
+    .quad 0x00CF9A000000FFFF     # code, base 0, 4GB
+    .quad 0x00CF92000000FFFF     # data, base 0, 4GB
+smp_trampoline_gdtr:
+    .word 3*8 - 1
+    .long (SMP_TRAMPOLINE + smp_trampoline_gdt - smp_trampoline_start)
+smp_trampoline_stack:
+    .long 0
+smp_trampoline_entry:
+    .long 0
+smp_trampoline_end:
+
+.section .note.GNU-stack,"",@progbits
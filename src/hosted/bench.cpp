@@ -0,0 +1,505 @@
+/*
+ * emudore, Commodore 64 emulator
+ * Copyright (c) 2016, Mario Ballano <mballano@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <hosted/platform.h>
+#include <c64/c64.h>
+#include <c64/romset.h>
+#include <c64/tokenizer.h>
+#include <lib/stdio.h>
+#include <lib/stdlib.h>
+#include <lib/string.h>
+
+using namespace myos::hosted;
+
+/**
+ * @brief headless benchmark of the emulator core
+ *
+ * Every workload boots a fresh machine, loads a small program and
+ * runs a fixed number of frames in warp, timed with the host clock.
+ * The frames are presented into a RAM framebuffer of the size GRUB
+ * sets, so the scaling path is part of the numbers.
+ *
+ *   os64bench [vic=cycle] [jit=off] [native[=N]] [verify] [turbo=N]
+ *             [phases] [frames=N] [workload ...]
+ *
+ * phases adds the FrameStats breakdown of where the host time went,
+ * native traps the ROM routines of Natives as the boot option does,
+ * native=N charges N percent of the ROM cycles for them. verify runs
+ * each workload with and without the natives, at full cost, and fails
+ * unless registers, cycles and memory come out the same, natives is
+ * the workload for it. turbo=N runs
+ * the cpu N times as fast as the chips, cycles are still chip ones.
+ */
+
+static const unsigned int kBootFrames = 150;
+static const unsigned int kSettleFrames = 10;
+static const unsigned int kDefaultFrames = 500;
+/* PAL cpu clock */
+static const unsigned int kClockKHz = 985;
+static const uint32_t kScreenWidth = 800;
+static const uint32_t kScreenHeight = 600;
+static const uint8_t kScreenBpp = 16;
+
+static const uint16_t kAddrKeyBuffer = 0x0277;
+static const uint16_t kAddrKeyCount = 0x00c6;
+static const uint16_t kAddrCode = 0xc000;
+
+// workloads ///////////////////////////////////////////////////////////////////
+
+/* spaces are kept in the program, these have none for CHRGET to skip */
+static const char kBasicLoop[] = "10 FORI=0TO255:POKE53280,IAND15:A=A+I*1.5:NEXT:GOTO10";
+static const char kBasicPrint[] = "10 PRINT\"HELLO WORLD \";I:I=I+1:GOTO10";
+static const char kFloat[] = "10 A=A+I*3.7/1.9:I=I+1:GOTO10";
+/* the trapped routines with the jiffy IRQ off, the run ends at READY */
+static const char kNatives[] = "10 POKE56333,127:FORI=1TO100:A=A*1.01+I/3.7:PRINTA;I*I/7:NEXT:POKE56333,129";
+
+/**
+ * eight expanded multicolor sprites, all moved once a frame at
+ * raster line $fa
+ */
+static const uint8_t kSprites[] =
+{
+  0xa9,0xff,            /* C000 LDA #$FF      */
+  0x8d,0x15,0xd0,       /*      STA $D015     */
+  0x8d,0x1c,0xd0,       /*      STA $D01C     */
+  0x8d,0x17,0xd0,       /*      STA $D017     */
+  0x8d,0x1d,0xd0,       /*      STA $D01D     */
+  0xa2,0x0e,            /*      LDX #$0E      */
+  0x8a,                 /* C010 TXA           */
+  0x0a,0x0a,0x0a,       /*      ASL ASL ASL   */
+  0x9d,0x00,0xd0,       /*      STA $D000,X   */
+  0x9d,0x01,0xd0,       /*      STA $D001,X   */
+  0xca,0xca,            /*      DEX DEX       */
+  0x10,0xf2,            /*      BPL $C010     */
+  0xad,0x12,0xd0,       /* C01E LDA $D012     */
+  0xc9,0xfa,            /*      CMP #$FA      */
+  0xd0,0xf9,            /*      BNE $C01E     */
+  0xa2,0x0e,            /*      LDX #$0E      */
+  0xfe,0x00,0xd0,       /* C027 INC $D000,X   */
+  0xfe,0x01,0xd0,       /*      INC $D001,X   */
+  0xca,0xca,            /*      DEX DEX       */
+  0x10,0xf6,            /*      BPL $C027     */
+  0xad,0x12,0xd0,       /* C031 LDA $D012     */
+  0xc9,0xfa,            /*      CMP #$FA      */
+  0xf0,0xf9,            /*      BEQ $C031     */
+  0x4c,0x1e,0xc0        /*      JMP $C01E     */
+};
+
+/**
+ * copies pages between RAM under BASIC, RAM under the KERNAL, the
+ * KERNAL ROM and I/O, switching $01 three times per byte
+ */
+static const uint8_t kBanks[] =
+{
+  0x78,                 /* C000 SEI           */
+  0xa2,0x00,            /* C001 LDX #$00      */
+  0xa9,0x34,            /* C003 LDA #$34      */
+  0x85,0x01,            /*      STA $01       */
+  0xbd,0x00,0xa0,       /*      LDA $A000,X   */
+  0x9d,0x00,0xe0,       /*      STA $E000,X   */
+  0xa9,0x37,            /*      LDA #$37      */
+  0x85,0x01,            /*      STA $01       */
+  0xbd,0x00,0xe0,       /*      LDA $E000,X   */
+  0x9d,0x00,0xc1,       /*      STA $C100,X   */
+  0xa9,0x35,            /*      LDA #$35      */
+  0x85,0x01,            /*      STA $01       */
+  0xbd,0x00,0xd0,       /*      LDA $D000,X   */
+  0x9d,0x00,0xc2,       /*      STA $C200,X   */
+  0xe8,                 /*      INX           */
+  0xd0,0xdf,            /*      BNE $C003     */
+  0xa9,0x37,            /*      LDA #$37      */
+  0x85,0x01,            /*      STA $01       */
+  0x4c,0x01,0xc0        /*      JMP $C001     */
+};
+
+/**
+ * a raster interrupt every 8 lines that changes the border color,
+ * the main program only spins
+ */
+static const uint8_t kRasterIrq[] =
+{
+  0x78,                 /* C000 SEI           */
+  0xa9,0x7f,            /*      LDA #$7F      */
+  0x8d,0x0d,0xdc,       /*      STA $DC0D     */
+  0xad,0x0d,0xdc,       /*      LDA $DC0D     */
+  0xa9,0x1b,            /*      LDA #$1B      */
+  0x8d,0x11,0xd0,       /*      STA $D011     */
+  0xa9,0x00,            /*      LDA #$00      */
+  0x8d,0x12,0xd0,       /*      STA $D012     */
+  0xa9,0x30,            /*      LDA #$30      */
+  0x8d,0x14,0x03,       /*      STA $0314     */
+  0xa9,0xc0,            /*      LDA #$C0      */
+  0x8d,0x15,0x03,       /*      STA $0315     */
+  0xa9,0x01,            /*      LDA #$01      */
+  0x8d,0x1a,0xd0,       /*      STA $D01A     */
+  0x58,                 /*      CLI           */
+  0x4c,0x23,0xc0,       /* C023 JMP $C023     */
+  0,0,0,0,0,0,0,0,0,0,
+  0xee,0x20,0xd0,       /* C030 INC $D020     */
+  0xad,0x12,0xd0,       /*      LDA $D012     */
+  0x18,                 /*      CLC           */
+  0x69,0x08,            /*      ADC #$08      */
+  0xc9,0xf8,            /*      CMP #$F8      */
+  0x90,0x02,            /*      BCC $C03F     */
+  0xa9,0x00,            /*      LDA #$00      */
+  0x8d,0x12,0xd0,       /* C03F STA $D012     */
+  0xa9,0x01,            /*      LDA #$01      */
+  0x8d,0x19,0xd0,       /*      STA $D019     */
+  0x4c,0x81,0xea        /*      JMP $EA81     */
+};
+
+/**
+ * REU DMA: stashes the BASIC ROM, fetches it to $2000 and verifies
+ * it, 24KB per loop with the registers autoloaded after each
+ */
+static const uint8_t kReu[] =
+{
+  0x78,                 /* C000 SEI           */
+  0xa9,0x00,            /*      LDA #$00      */
+  0x8d,0x02,0xdf,       /*      STA $DF02     */
+  0x8d,0x04,0xdf,       /*      STA $DF04     */
+  0x8d,0x05,0xdf,       /*      STA $DF05     */
+  0x8d,0x06,0xdf,       /*      STA $DF06     */
+  0x8d,0x07,0xdf,       /*      STA $DF07     */
+  0x8d,0x0a,0xdf,       /*      STA $DF0A     */
+  0xa9,0x20,            /*      LDA #$20      */
+  0x8d,0x08,0xdf,       /*      STA $DF08     */
+  0xa9,0xa0,            /* C01A LDA #$A0      */
+  0x8d,0x03,0xdf,       /*      STA $DF03     */
+  0xa9,0xb0,            /*      LDA #$B0      */
+  0x8d,0x01,0xdf,       /*      STA $DF01     */
+  0xa9,0x20,            /*      LDA #$20      */
+  0x8d,0x03,0xdf,       /*      STA $DF03     */
+  0xa9,0xb1,            /*      LDA #$B1      */
+  0x8d,0x01,0xdf,       /*      STA $DF01     */
+  0xa9,0xb3,            /*      LDA #$B3      */
+  0x8d,0x01,0xdf,       /*      STA $DF01     */
+  0xad,0x00,0xdf,       /*      LDA $DF00     */
+  0x4c,0x1a,0xc0        /*      JMP $C01A     */
+};
+
+/**
+ * @brief puts a command in the KERNAL keyboard buffer
+ */
+static void type(C64 *c64, const char *s)
+{
+  uint8_t n = 0;
+  for( ; s[n] != 0 && n < 10 ; n++)
+    c64->mem_->write_byte_no_io(kAddrKeyBuffer + n, s[n]);
+  c64->mem_->write_byte_no_io(kAddrKeyCount, n);
+}
+
+/**
+ * @brief puts a listing in as the program and runs it
+ */
+static void run_basic(C64 *c64, const char *listing)
+{
+  Tokenizer tokenizer(c64->mem_, Tokenizer::kAddrBasicStart);
+  tokenizer.text((const uint8_t *)listing, strlen(listing));
+  tokenizer.finish();
+  tokenizer.set_pointers();
+  type(c64, "RUN\r");
+}
+
+static void run_code(C64 *c64, const uint8_t *code, uint16_t length)
+{
+  c64->mem_->write_block_no_io(kAddrCode, code, length);
+  type(c64, "SYS49152\r");
+}
+
+static void setup_boot(C64 *c64)
+{
+}
+
+static void setup_basic(C64 *c64)
+{
+  run_basic(c64, kBasicLoop);
+}
+
+static void setup_print(C64 *c64)
+{
+  run_basic(c64, kBasicPrint);
+}
+
+static void setup_float(C64 *c64)
+{
+  run_basic(c64, kFloat);
+}
+
+static void setup_natives(C64 *c64)
+{
+  run_basic(c64, kNatives);
+}
+
+static void setup_sprites(C64 *c64)
+{
+  /* solid sprite at $3000, pointed to by all eight */
+  uint8_t block[64];
+  memset(block, 0xff, sizeof(block));
+  c64->mem_->write_block_no_io(0x3000, block, sizeof(block));
+  for(int i=0 ; i < 8 ; i++)
+    c64->mem_->write_byte_no_io(0x07f8 + i, 0x3000 / 64);
+  run_code(c64, kSprites, sizeof(kSprites));
+}
+
+static void setup_banks(C64 *c64)
+{
+  run_code(c64, kBanks, sizeof(kBanks));
+}
+
+static void setup_rasterirq(C64 *c64)
+{
+  run_code(c64, kRasterIrq, sizeof(kRasterIrq));
+}
+
+static void setup_reu(C64 *c64)
+{
+  c64->reu_->attach(8);
+  run_code(c64, kReu, sizeof(kReu));
+}
+
+struct Workload
+{
+  const char *name;
+  const char *description;
+  void (*setup)(C64 *c64);
+};
+
+static const Workload kWorkloads[] =
+{
+  {"boot",      "KERNAL reset to READY",          setup_boot},
+  {"basic",     "BASIC FOR loop with POKE",       setup_basic},
+  {"print",     "BASIC PRINT scrolling",          setup_print},
+  {"float",     "BASIC multiply and divide",      setup_float},
+  {"natives",   "BASIC float and scrolling",      setup_natives},
+  {"sprites",   "8 expanded sprites moving",      setup_sprites},
+  {"banks",     "$01 bank switching",             setup_banks},
+  {"rasterirq", "raster IRQ every 8 lines",       setup_rasterirq},
+  {"reu",       "REU stash, fetch and verify",    setup_reu},
+};
+static const unsigned int kNumWorkloads = sizeof(kWorkloads) / sizeof(kWorkloads[0]);
+
+// measurement /////////////////////////////////////////////////////////////////
+
+struct Timing
+{
+  unsigned int frames;
+  uint32_t cycles;
+  uint32_t micros;
+  uint32_t min_frame;
+  uint32_t max_frame;
+};
+
+/**
+ * @brief runs whole frames, false if the machine stopped
+ */
+static bool run_frames(C64 *c64, unsigned int frames, Timing *t)
+{
+  t->frames = 0;
+  t->cycles = c64->cpu_->cycles();
+  t->min_frame = 0xffffffff;
+  t->max_frame = 0;
+  uint32_t start = Host::Microseconds();
+  uint32_t last = start;
+  for(unsigned int i=0 ; i < frames ; i++)
+  {
+    unsigned int frame = c64->vic_->frames();
+    while(c64->vic_->frames() == frame)
+    {
+      if(!c64->emulate())
+	return false;
+      Host::Tick();
+    }
+    uint32_t now = Host::Microseconds();
+    uint32_t us = now - last;
+    last = now;
+    if(us < t->min_frame) t->min_frame = us;
+    if(us > t->max_frame) t->max_frame = us;
+    t->frames++;
+  }
+  t->micros = last - start;
+  t->cycles = c64->cpu_->cycles() - t->cycles;
+  return true;
+}
+
+static void report(const Workload *w, Timing *t, C64 *c64, bool phases)
+{
+  uint32_t ms = t->micros / 1000;
+  if(ms == 0)
+    ms = 1;
+  uint32_t khz = t->cycles / ms;
+  printf("\n%s: %s", w->name, w->description);
+  printf("\n  %u frames, %u cycles in %u ms", t->frames, t->cycles, ms);
+  printf("\n  %u kHz emulated, %u%% of PAL speed", khz, khz * 100 / kClockKHz);
+  printf("\n  frame min %u avg %u max %u us", t->min_frame,
+	 t->micros / t->frames, t->max_frame);
+  if(phases)
+    c64->stats_->report();
+  printf("\n");
+}
+
+/**
+ * @brief boots a machine and runs the workload on it, false if it stopped
+ */
+static bool run_workload(C64 *c64, const Workload *w, unsigned int frames, Timing *t)
+{
+  bool ok = run_frames(c64, kBootFrames, t);
+  if(w->setup == setup_boot)
+    return ok;
+  w->setup(c64);
+  ok = ok && run_frames(c64, kSettleFrames, t);
+  c64->stats_->clear();
+  return ok && run_frames(c64, frames, t);
+}
+
+/**
+ * @brief false, with the first difference printed, unless both
+ * machines ended in the same state
+ *
+ * The free stack below the stack pointer is left out, an interrupt
+ * taken inside a ROM routine leaves its bytes there at another depth.
+ */
+static bool same_state(const Workload *w, C64 *rom, C64 *native)
+{
+  Cpu *a = rom->cpu_, *b = native->cpu_;
+  if(a->cycles() != b->cycles() || a->pc() != b->pc() || a->sp() != b->sp() ||
+     a->a() != b->a() || a->x() != b->x() || a->y() != b->y())
+  {
+    printf("\n%s: cpu differs, rom pc %x a %x x %x y %x sp %x cycles %u,"
+	   " native pc %x a %x x %x y %x sp %x cycles %u\n", w->name,
+	   a->pc(), a->a(), a->x(), a->y(), a->sp(), a->cycles(),
+	   b->pc(), b->a(), b->x(), b->y(), b->sp(), b->cycles());
+    return false;
+  }
+  for(unsigned int addr=0 ; addr < 0x10000 ; addr++)
+  {
+    if(addr == 0x0100)
+      addr += a->sp() + 1;
+    uint8_t ra = rom->mem_->read_byte_no_io(addr);
+    uint8_t rb = native->mem_->read_byte_no_io(addr);
+    if(ra != rb)
+    {
+      printf("\n%s: memory differs at $%x, rom %x native %x\n", w->name, addr, ra, rb);
+      return false;
+    }
+  }
+  printf("\n%s: natives match the ROM, %u cycles\n", w->name, a->cycles());
+  return true;
+}
+
+// entry ///////////////////////////////////////////////////////////////////////
+
+extern "C" int hostMain(int argc, char **argv)
+{
+  Host::Init();
+  bool cycle_exact = false;
+  bool jit = true;
+  bool phases = false;
+  int native = -1;
+  bool verify = false;
+  unsigned int turbo = 1;
+  unsigned int frames = kDefaultFrames;
+  bool selected[kNumWorkloads];
+  bool any = false;
+  for(unsigned int i=0 ; i < kNumWorkloads ; i++)
+    selected[i] = false;
+  for(int a=1 ; a < argc ; a++)
+  {
+    if(strcmp(argv[a], "vic=cycle") == 0)
+      cycle_exact = true;
+    else if(strcmp(argv[a], "jit=off") == 0)
+      jit = false;
+    else if(strcmp(argv[a], "native") == 0)
+      native = 100;
+    else if(strncmp(argv[a], "native=", 7) == 0)
+      native = atoi(argv[a] + 7);
+    else if(strcmp(argv[a], "verify") == 0)
+      verify = true;
+    else if(strncmp(argv[a], "turbo=", 6) == 0 && atoi(argv[a] + 6) > 0)
+      turbo = atoi(argv[a] + 6);
+    else if(strcmp(argv[a], "phases") == 0)
+      phases = true;
+    else if(strncmp(argv[a], "frames=", 7) == 0 && atoi(argv[a] + 7) > 0)
+      frames = atoi(argv[a] + 7);
+    else
+    {
+      unsigned int i = 0;
+      while(i < kNumWorkloads && strcmp(argv[a], kWorkloads[i].name) != 0)
+	i++;
+      if(i == kNumWorkloads)
+      {
+	printf("unknown workload %s\n", argv[a]);
+	Host::Exit(2);
+      }
+      selected[i] = any = true;
+    }
+  }
+
+  printf("os64bench, tsc %u kHz, vic %s, recompiler %s\n", Host::TSCFrequencyKHz(),
+	 cycle_exact ? "cycle exact" : "line", jit ? "on" : "off");
+  if(verify)
+    native = 100;
+  if(native >= 0)
+    printf("native ROM routines, %d trapped, %d%% cycles\n",
+	   RomSet::shared()->install_natives(), native);
+  uint8_t *framebuffer = new uint8_t[kScreenWidth * kScreenHeight * (kScreenBpp / 8)];
+  int status = 0;
+  for(unsigned int i=0 ; i < kNumWorkloads ; i++)
+  {
+    if(any && !selected[i])
+      continue;
+    const Workload *w = &kWorkloads[i];
+    /* with verify the first run is the ROM one to compare against */
+    C64 *machines[2] = {0, 0};
+    bool ok = true;
+    for(int m=0 ; m < (verify ? 2 : 1) && ok ; m++)
+    {
+      bool natives = native >= 0 && (!verify || m == 1);
+      C64 *c64 = machines[m] = new C64();
+      c64->vic_->cycle_exact(cycle_exact);
+      c64->cpu_->jit_enabled(jit);
+      c64->natives_->enabled(natives);
+      if(natives)
+	c64->natives_->cost(native);
+      if(turbo > 1)
+      {
+	c64->cpu_->accelerator(turbo);
+	c64->cpu_->speed(turbo);
+      }
+      c64->io_->init_display((uint32_t*)framebuffer, kScreenWidth, kScreenHeight,
+			     kScreenWidth * (kScreenBpp / 8), kScreenBpp);
+      c64->io_->Warp = true;
+      c64->io_->HaltPacing = false;
+      Timing t;
+      ok = run_workload(c64, w, frames, &t);
+      if(ok && !verify)
+	report(w, &t, c64, phases);
+    }
+    if(!ok)
+    {
+      printf("\n%s: machine stopped\n", w->name);
+      status = 1;
+    }
+    else if(verify && !same_state(w, machines[0], machines[1]))
+      status = 1;
+    delete machines[0];
+    delete machines[1];
+  }
+  delete [] framebuffer;
+  Host::Flush();
+  return status;
+}
@@ -0,0 +1,244 @@
+#include <hosted/platform.h>
+#include <memorymanagement.h>
+#include <multitasking.h>
+#include <syscalls.h>
+#include <drivers/pit.h>
+#include <drivers/ac97.h>
+#include <drivers/bga.h>
+#include <drivers/serial.h>
+#include <hardwarecommunication/processor.h>
+#include <hardwarecommunication/smp.h>
+#include <hardwarecommunication/pci.h>
+#include <lib/vga.h>
+#include <lib/string.h>
+
+using namespace myos;
+using namespace myos::hosted;
+using namespace myos::drivers;
+using namespace myos::hardwarecommunication;
+
+// advanced by Host::Tick instead of the PIT interrupt
+uint32_t current_milli = 0;
+
+uint32_t Host::tscKHz = 0;
+uint32_t Host::tickTsc = 0;
+uint32_t Host::tickRemainder = 0;
+
+static uint8_t hostHeap[HOST_HEAP_SIZE];
+static MemoryManager* hostMemoryManager = 0;
+
+static char outBuffer[256];
+static uint32_t outLength = 0;
+
+struct HostTimespec
+{
+    int32_t seconds;
+    int32_t nanoseconds;
+};
+
+static int32_t Syscall(uint32_t number, uint32_t a, uint32_t b, uint32_t c)
+{
+    int32_t result;
+    __asm__ volatile("int $0x80" : "=a" (result) : "a" (number), "b" (a), "c" (b), "d" (c) : "memory");
+    return result;
+}
+
+typedef void (*constructor)();
+extern "C" constructor __init_array_start[];
+extern "C" constructor __init_array_end[];
+extern "C" void callConstructors()
+{
+    for(constructor* i = __init_array_start; i != __init_array_end; i++)
+        (*i)();
+}
+
+// Sets up the heap and calibrates the TSC against the monotonic clock
+void Host::Init()
+{
+    // static, so it outlives every machine
+    static uint8_t manager[sizeof(MemoryManager)];
+    hostMemoryManager = new(manager) MemoryManager((size_t)hostHeap, HOST_HEAP_SIZE);
+    mem_select(Processor::SSEEnabled());
+
+    uint32_t start = Microseconds();
+    while(Microseconds() == start)
+        ;
+    start = Microseconds();
+    uint32_t tsc = (uint32_t)PITDriver::ReadTSC();
+    while(Microseconds() - start < 20000)
+        ;
+    uint32_t elapsed = Microseconds() - start;
+    tscKHz = ((uint32_t)PITDriver::ReadTSC() - tsc) / (elapsed / 1000);
+    tickTsc = (uint32_t)PITDriver::ReadTSC();
+    tickRemainder = 0;
+}
+
+void Host::Write(const void* data, uint32_t length)
+{
+    Flush();
+    Syscall(HOST_SYSCALL_WRITE, HOST_STDOUT, (uint32_t)data, length);
+}
+
+void Host::Flush()
+{
+    if(outLength > 0)
+        Syscall(HOST_SYSCALL_WRITE, HOST_STDOUT, (uint32_t)outBuffer, outLength);
+    outLength = 0;
+}
+
+void Host::Exit(int status)
+{
+    Flush();
+    Syscall(HOST_SYSCALL_EXIT, status, 0, 0);
+}
+
+uint32_t Host::Microseconds()
+{
+    HostTimespec t;
+    Syscall(HOST_SYSCALL_CLOCK_GETTIME, HOST_CLOCK_MONOTONIC, (uint32_t)&t, 0);
+    return (uint32_t)t.seconds * 1000000 + (uint32_t)t.nanoseconds / 1000;
+}
+
+// Only 32 bit arithmetic, the TSC delta between two calls is far
+// below the wrap-around
+void Host::Tick()
+{
+    uint32_t now = (uint32_t)PITDriver::ReadTSC();
+    tickRemainder += now - tickTsc;
+    tickTsc = now;
+    if(tickRemainder >= tscKHz)
+    {
+        current_milli += tickRemainder / tscKHz;
+        tickRemainder %= tscKHz;
+    }
+}
+
+// text console, printf ends up here
+void putc(uint8_t c)
+{
+    if(c == 0x0E)
+        c = '\b';
+    outBuffer[outLength++] = c;
+    if(c == '\n' || outLength == sizeof(outBuffer))
+        Host::Flush();
+}
+
+void puts(char* string)
+{
+    while(*string != '\0')
+        putc(*string++);
+}
+
+void vga_clear()
+{
+}
+
+void vga_cursor_enable()
+{
+}
+
+void vga_invalidate()
+{
+}
+
+// Kernel services. There is one machine and no other task, it runs
+// in warp so it never has to sleep.
+void TaskManager::DisablePreemption()
+{
+}
+
+void TaskManager::EnablePreemption()
+{
+}
+
+bool SyscallHandler::SleepUntil(uint32_t wakeup, uint32_t deadline)
+{
+    return false;
+}
+
+bool Processor::SSEEnabled()
+{
+    // Linux enables SSE for user processes
+    return true;
+}
+
+bool MultiprocessorController::Submit(ProcessorJob job, void* arg)
+{
+    return false;
+}
+
+void MultiprocessorController::Wait()
+{
+}
+
+// Drivers, never attached to a hosted machine
+uint64_t PITDriver::ReadTSC()
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+uint32_t PITDriver::TSCFrequencyKHz()
+{
+    return Host::TSCFrequencyKHz();
+}
+
+uint32_t PITDriver::Microseconds()
+{
+    return Host::Microseconds();
+}
+
+void AC97Driver::Write(const int16_t* samples, uint32_t count)
+{
+}
+
+void BGADriver::ShowPage(uint8_t page)
+{
+}
+
+void SerialDriver::Send(uint8_t c)
+{
+}
+
+uint32_t SerialDriver::Receive(uint8_t* data, uint32_t length)
+{
+    return 0;
+}
+
+// PCI, there is no bus to find the bus master IDE controller on
+PeripheralComponentInterconnectDeviceDescriptor::PeripheralComponentInterconnectDeviceDescriptor()
+{
+}
+
+PeripheralComponentInterconnectDeviceDescriptor::~PeripheralComponentInterconnectDeviceDescriptor()
+{
+}
+
+bool PeripheralComponentInterconnectController::FindDevice(uint8_t class_id, uint8_t subclass_id,
+                                                           PeripheralComponentInterconnectDeviceDescriptor* dev)
+{
+    return false;
+}
+
+BaseAddressRegister PeripheralComponentInterconnectController::GetBaseAddressRegister(uint16_t bus, uint16_t device,
+                                                                                      uint16_t function, uint16_t bar)
+{
+    BaseAddressRegister result;
+    result.address = 0;
+    result.size = 0;
+    result.prefetchable = false;
+    result.type = InputOutput;
+    return result;
+}
+
+uint32_t PeripheralComponentInterconnectController::Read(uint16_t bus, uint16_t device, uint16_t function,
+                                                         uint32_t registeroffset)
+{
+    return 0xFFFFFFFF;
+}
+
+void PeripheralComponentInterconnectController::Write(uint16_t bus, uint16_t device, uint16_t function,
+                                                      uint32_t registeroffset, uint32_t value)
+{
+}
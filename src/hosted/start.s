@@ -0,0 +1,24 @@
+# Process entry of the hosted build. There is no C library, so the
+# stack is aligned here, the constructors are run and hostMain gets
+# argc and argv straight from the initial process stack.
+
+.section .text
+.extern hostMain
+.extern callConstructors
+.global _start
+
+_start:
+    xor %ebp, %ebp
+    mov %esp, %esi
+    and $-16, %esp
+    call callConstructors
+    lea 4(%esi), %eax
+    sub $8, %esp
+    push %eax
+    push (%esi)
+    call hostMain
+    mov %eax, %ebx
+    mov $1, %eax
+    int $0x80
+
+.section .note.GNU-stack,"",@progbits
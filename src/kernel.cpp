@@ -3,24 +3,32 @@
 #include <lib/stdint.h>
 #include <lib/vga.h>
 #include <lib/stdio.h>
+#include <lib/string.h>
 #include <gdt.h>
 #include <memorymanagement.h>
 #include <hardwarecommunication/interrupts.h>
 #include <syscalls.h>
 #include <hardwarecommunication/pci.h>
+#include <hardwarecommunication/processor.h>
 #include <drivers/driver.h>
 #include <drivers/keyscancodes.h>
 #include <drivers/keyboard.h>
 #include <drivers/mouse.h>
 #include <drivers/ata.h>
+#include <drivers/ahci.h>
 #include <drivers/serial.h>
 #include <drivers/speaker.h>
+#include <drivers/ac97.h>
+#include <drivers/bga.h>
+#include <hardwarecommunication/smp.h>
 #include <drivers/rtc.h>
 #include <drivers/pit.h>
+#include <drivers/apictimer.h>
 #include <multitasking.h>
 #include <filesystem/fat.h>
 #include <c64/c64.h>
 #include <c64/monitor.h>
+#include <c64/romset.h>
 
 uint32_t current_milli = 0;
 
@@ -41,30 +49,56 @@ using namespace myos::filesystem;
 C64* c64ptr;	
 uint32_t* framebuffer_addr;
 
+// machines running side by side as tasks, c64ptr is the one with focus
+#define MAX_MACHINES 4
+C64* machines[MAX_MACHINES];
+int numMachines = 1;
+int focusMachine = 0;
+
+// NUMLOCK passes the keyboard on to the next machine
+static void SwitchFocus()
+{
+    if(numMachines < 2)
+        return;
+    if(c64ptr != 0)
+        c64ptr->io_->init_keyboard();
+    for(int i = 1; i <= numMachines; i++)
+    {
+        int next = (focusMachine + i) % numMachines;
+        if(machines[next] != 0)
+        {
+            focusMachine = next;
+            c64ptr = machines[next];
+            return;
+        }
+    }
+}
+
 class IOKeyboardEventHandler : public KeyboardEventHandler
 {
-private:
-  uint8_t mode;  // 0 = emulation, 1 = terminal
 public:
     IOKeyboardEventHandler()
     {
-      mode = 0;
     }
 
     void OnKeyDown(uint8_t c)
     {
+      if(c64ptr == 0)
+	return;
+      // 0 = emulation, 1 = terminal, the machine also stops on its
+      // own at a breakpoint
+      uint8_t mode = c64ptr->stopped() ? 1 : 0;
+      
       // ESC key will toggle between text mode and emulation
       if(c == 0x01) 
       {
 	if (mode == 0) 
 	{ 
-	  mode = 1; 
 	  c64ptr->stop();
 	  return;
 	}
 	else 
 	{ 
-	  mode = 0; 
 	  c64ptr->mon_->Stop();
 	  return;
 	}
@@ -84,6 +118,24 @@ public:
 	  c64ptr->io_->SkipFrames = 10;
       }
       
+      if(c == 0x05) // toggle warp mode (F11)
+      {
+	c64ptr->io_->Warp = !c64ptr->io_->Warp;
+	return;
+      }
+      
+      if(c == 0x06 && mode == 0) // rewind a second (PAGE UP)
+      {
+	c64ptr->rewind_request = true;
+	return;
+      }
+      
+      if(c == 0x91 && mode == 0) // next machine (NUMLOCK)
+      {
+	SwitchFocus();
+	return;
+      }
+      
       switch(mode)
       {
 	case 0: c64ptr->io_->OnKeyDown(c); break;
@@ -93,6 +145,9 @@ public:
     
     void OnKeyUp(uint8_t c)
     {
+      if(c64ptr == 0)
+	return;
+      uint8_t mode = c64ptr->stopped() ? 1 : 0;
       switch(mode)
       {
 	case 0: c64ptr->io_->OnKeyUp(c); break;
@@ -117,6 +172,169 @@ public:
   }
 };
 
+// True if option is one of the space separated words on the multiboot
+// command line, e.g. "vic=cycle" from the second GRUB menu entry.
+static bool BootOption(const char* option)
+{
+    if((mboot_hdr->flags & (1<<2)) == 0)
+        return false;
+    const char* p = (const char*)mboot_hdr->cmdline;
+    unsigned length = strlen(option);
+    while(*p)
+    {
+        if(strncmp(p, option, length) == 0 && (p[length] == ' ' || p[length] == 0))
+            return true;
+        while(*p && *p != ' ')
+            p++;
+        while(*p == ' ')
+            p++;
+    }
+    return false;
+}
+
+// Value of a "name=number" option, fallback if it is not given
+static int BootNumber(const char* name, int fallback)
+{
+    if((mboot_hdr->flags & (1<<2)) == 0)
+        return fallback;
+    const char* p = (const char*)mboot_hdr->cmdline;
+    unsigned length = strlen(name);
+    while(*p)
+    {
+        if(strncmp(p, name, length) == 0 && p[length] == '='
+           && p[length + 1] >= '0' && p[length + 1] <= '9')
+        {
+            const char* digit = p + length + 1;
+            int value = 0;
+            while(*digit >= '0' && *digit <= '9' && value < 100000)
+                value = value * 10 + (*digit++ - '0');
+            if(*digit == ' ' || *digit == 0)
+                return value;
+        }
+        while(*p && *p != ' ')
+            p++;
+        while(*p == ' ')
+            p++;
+    }
+    return fallback;
+}
+
+// Everything the machines share, set up once by kernelMain
+struct MachineSetup
+{
+    Fat32* fat32;
+    SerialDriver* serial;
+    RTCDriver* rtc;
+    SpeakerDriver* speaker;
+    AC97Driver* audio;
+    BGADriver* bga;
+    MultiprocessorController* smp;
+    uint32_t* fbAddr;
+    uint32_t fbWidth;
+    uint32_t fbHeight;
+    uint32_t fbPitch;
+    uint8_t fbBpp;
+    bool cycleExactVic;
+    bool replay;
+    bool trace;
+    unsigned int reuBanks;
+    bool natives;
+    unsigned int nativeCost;	// percent of the ROM cycles
+};
+static MachineSetup machineSetup;
+static volatile int nextMachine = 0;
+
+// Runs machine index until the end of time, a reset builds it again.
+// With several machines the framebuffer is split in a 2x1 or 2x2 grid
+// and each draws its own tile. Sound, page flipping and the second
+// core belong to the first machine or a single one.
+static void RunMachine(int index)
+{
+    MachineSetup* m = &machineSetup;
+    uint32_t cols = numMachines > 1 ? 2 : 1;
+    uint32_t rows = numMachines > 2 ? 2 : 1;
+    uint32_t tileWidth = m->fbWidth / cols;
+    uint32_t tileHeight = m->fbHeight / rows;
+    uint8_t* tile = (uint8_t*)m->fbAddr
+        + (index / cols) * tileHeight * m->fbPitch
+        + (index % cols) * tileWidth * ((m->fbBpp + 7) / 8);
+    
+    // a RESUME.SNP snapshot picks up where it was taken, on the first boot only
+    bool resume = index == 0;
+    // an inserted cartridge stays in over resets
+    CartridgeImage* cartridge = 0;
+    
+    while(true)
+    {
+      C64* c64 = new C64();
+      c64->vic_->cycle_exact(m->cycleExactVic);
+      if(index == 0)
+      {
+        c64->sid_->speaker(m->speaker);
+        if(m->audio->Active())
+          c64->sid_->audio(m->audio);
+      }
+      c64->io_->init_display((uint32_t*)tile, tileWidth, tileHeight, m->fbPitch, m->fbBpp);
+      
+      if(numMachines == 1)
+      {
+        c64->io_->page_flip(m->bga);
+        if(m->smp->WorkerRunning())
+          c64->io_->worker(m->smp);
+      }
+      c64->io_->fat32(m->fat32);
+      c64->io_->serial(m->serial);
+      c64->io_->rtc(m->rtc);
+      c64->mon_->fat32(m->fat32);
+      if(m->reuBanks != 0)
+        c64->reu_->attach(m->reuBanks);
+      if(cartridge != 0)
+        c64->cartridge(cartridge);
+      c64->natives_->enabled(m->natives);
+      c64->natives_->cost(m->nativeCost);
+      if(m->trace)
+        c64->trace_->start(c64->cpu_->cycles());
+      
+      machines[index] = c64;
+      if(index == focusMachine)
+        c64ptr = c64;
+      
+      if(resume)
+      {
+        resume = false;
+        TaskManager::DisablePreemption();
+        if(m->replay)
+          c64->replay_input(m->fat32, (uint8_t*)"REPLAY.INP");
+        else
+          c64->load_snapshot(m->fat32, (uint8_t*)"RESUME.SNP");
+        TaskManager::EnablePreemption();
+      }
+      
+      c64->start();
+      
+      // releases the machine's arena before the next reset
+      TaskManager::DisablePreemption();
+      // not a reset, the cpu or a chip gave up: keep what led there
+      if(!c64->reset && c64->trace_->recording())
+        c64->trace_->save(m->fat32, (uint8_t*)"CRASH.TRC");
+      machines[index] = 0;
+      if(c64ptr == c64)
+        c64ptr = 0;
+      cartridge = c64->cart_->remove();
+      delete c64;
+      TaskManager::EnablePreemption();
+    }
+}
+
+// entry of the machine tasks, each takes the next index
+static void MachineTask()
+{
+    TaskManager::DisablePreemption();
+    int index = nextMachine++;
+    TaskManager::EnablePreemption();
+    RunMachine(index);
+}
+
 // Set up C++ object constructors.  This has to be set up and called manually
 typedef void (*constructor)();
 extern "C" constructor start_ctors;
@@ -172,7 +390,7 @@ extern "C" void kernelMain(const void* multiboot_structure, uint32_t /*multiboot
     TaskManager taskManager;
     
     InterruptManager interrupts(0x20, &gdt, &taskManager);
-    SyscallHandler syscalls(&interrupts, 0x80);
+    SyscallHandler syscalls(&interrupts, 0x80, &taskManager);
 
     DriverManager drvManager;
     
@@ -194,22 +412,46 @@ extern "C" void kernelMain(const void* multiboot_structure, uint32_t /*multiboot
        
     printf("Initializing interrupts..........[OK]\n");
     interrupts.Activate();
+    
+    if(Processor::EnableSSE())
+    {
+        mem_select(true);
+        printf("Enabling SSE2....................[OK]\n");
+    }
        
-    printf("\nATA pri master: ");
+    // all four positions are identified together, an absent drive
+    // costs at most ATA_IDENTIFY_TIMEOUT
     AdvancedTechnologyAttachment ata0m(true, _ATA_FIRST);  
-    ata0m.Identify();
+    AdvancedTechnologyAttachment ata0s(false, _ATA_FIRST);  
+    AdvancedTechnologyAttachment ata1m(true, _ATA_SECOND);  
+    AdvancedTechnologyAttachment ata1s(false, _ATA_SECOND);  
+    AdvancedTechnologyAttachment* drives[4] = { &ata0m, &ata0s, &ata1m, &ata1s };
+    AdvancedTechnologyAttachment::Probe(drives, 4);
+    
+    printf("\nATA pri master: ");
+    ata0m.PrintIdentify();
+    if(ata0m.Present() && ata0m.EnableDMA(&PCIController))
+      printf("\n          DMA : bus master");
     
     printf("\nATA pri slave : ");
-    AdvancedTechnologyAttachment ata0s(false, _ATA_FIRST);  
-    ata0s.Identify();
+    ata0s.PrintIdentify();
     
     printf("\nATA sec master: ");
-    AdvancedTechnologyAttachment ata1m(true, _ATA_SECOND);  
-    ata1m.Identify();
+    ata1m.PrintIdentify();
     
     printf("\nATA sec slave : ");
-    AdvancedTechnologyAttachment ata1s(false, _ATA_SECOND);  
-    ata1s.Identify();
+    ata1s.PrintIdentify();
+    
+    // drive 8 is the IDE primary master, or the first SATA disk on
+    // boards where the controller runs in AHCI mode
+    BlockDevice* disk = &ata0m;
+    AHCIDriver ahci;
+    if(!ata0m.Present() && !BootOption("ahci=off") && ahci.Initialize(&PCIController))
+    {
+        printf("\nAHCI          : ");
+        ahci.PrintIdentify();
+        disk = &ahci;
+    }
     
     //uint32_t s1 = 0x0FFFFFFE;
     //s1 = 0;
@@ -235,9 +477,19 @@ extern "C" void kernelMain(const void* multiboot_structure, uint32_t /*multiboot
     //displayMemory(sector, 512);
     
     printf("\n\nInitializing filesystem driver...");
-    Fat32 fat32(&ata0m,0);
+    Fat32 fat32(disk,0);
     printf("[OK]");
 
+    // BASIC.ROM, KERNAL.ROM and CHAR.ROM on the disk replace the
+    // built-in images for every machine
+    RomSet* roms = RomSet::shared();
+    printf("\nLoading ROM set..................[OK] %d from disk", roms->load(&fat32));
+    for(int r = 0; r < RomSet::kRoms; r++)
+        if(roms->from_disk((RomSet::kRom)r))
+            printf(" %s", RomSet::file_name((RomSet::kRom)r));
+    if(roms->kernal_skipped() != 0)
+        printf("\nKERNAL.ROM patches...............[OK] %d skipped, code not stock", roms->kernal_skipped());
+
     //fat32.ReadPartitions();
     //fat32.ReadDir();
     //fat32.WriteDir((uint8_t*)"12345678",(uint8_t*)"EXT", 32);
@@ -247,13 +499,60 @@ extern "C" void kernelMain(const void* multiboot_structure, uint32_t /*multiboot
     
     //while(1) {};
     
+    uint32_t* fbAddr = (uint32_t*)mboot_hdr->framebuffer_addr;
+    uint32_t fbWidth = (uint32_t)mboot_hdr->framebuffer_width;
+    uint32_t fbHeight = (uint32_t)mboot_hdr->framebuffer_height;
+    uint32_t fbPitch = (uint32_t)mboot_hdr->framebuffer_pitch;
+    uint8_t fbBpp = (uint8_t)mboot_hdr->framebuffer_bpp;
+    
+    // on a BGA device the mode becomes an integer multiple of the C64
+    // screen, at least as large as the one GRUB set so the console fits
+    BGADriver* bga = BGADriver::activeDriver;
+    if(bga != 0 && bga->SetScaledMode(VIRT_WIDTH, VIRT_HEIGHT, fbWidth, fbHeight, fbBpp))
+    {
+        if(bga->Framebuffer() != 0)
+            fbAddr = bga->Framebuffer();
+        fbWidth = bga->Width();
+        fbHeight = bga->Height();
+        fbPitch = bga->Pitch();
+        framebuffer_addr = fbAddr;
+        vga_init(fbAddr, fbWidth, fbHeight, fbPitch, fbBpp);
+        vga_clear();
+        printf("OS/64 Operating System Starting...\n");
+        printf("\nBGA integer scaled mode..........[OK]");
+    }
+    
     printf("\nObtaining video mode.............[OK]");
-    printf(" Screen %d X %d X %d - Pitch %d", (uint32_t)mboot_hdr->framebuffer_width,
-	   (uint32_t)mboot_hdr->framebuffer_height, (uint8_t)mboot_hdr->framebuffer_bpp,
-	   (uint32_t)mboot_hdr->framebuffer_pitch);
-    printf("\n                                      VGA Memory @ $%08X",(uint32_t)mboot_hdr->framebuffer_addr);
+    printf(" Screen %d X %d X %d - Pitch %d", fbWidth, fbHeight, fbBpp, fbPitch);
+    printf("\n                                      VGA Memory @ $%08X",(uint32_t)fbAddr);
+    
+    // a second page below the screen turns presenting into a page flip
+    uint32_t framebufferPages = 1;
+    if(bga != 0 && bga->EnablePageFlip(fbWidth, fbHeight))
+    {
+        framebufferPages = 2;
+        printf("\nFramebuffer page flipping........[OK]");
+    }
+    
+    if(Processor::SetWriteCombining((uint32_t)fbAddr, fbPitch * fbHeight * framebufferPages))
+        printf("\nFramebuffer write-combining......[OK]");
+
+    // a second core scales and presents frames while this one emulates
+    MultiprocessorController smp;
+    if(!BootOption("smp=off") && smp.Detect() && smp.StartWorker(mboot_hdr))
+        printf("\nPresenting on a second core......[OK] %d cores", smp.ProcessorCount());
+
+    // one-shot interrupts for what is due next, "tickless=off" keeps
+    // the 1kHz PIT tick
+    APICTimerDriver apicTimer(&interrupts);
+    if(!BootOption("tickless=off") && apicTimer.Initialize())
+        printf("\nTickless LAPIC timer.............[OK] %s",
+               apicTimer.DeadlineMode() ? "TSC deadline" : "one-shot");
 
     SpeakerDriver speaker;
+    AC97Driver audio;
+    if(audio.Initialize(&PCIController))
+        printf("\nAC'97 audio 48kHz stereo.........[OK]");
 
     RTCDriver rtc;
     struct datetime* curDateTime;
@@ -262,24 +561,57 @@ extern "C" void kernelMain(const void* multiboot_structure, uint32_t /*multiboot
     printf("\n\nGetting date: %d/%d/%d", curDateTime->month, curDateTime->day, curDateTime->year);
     printf("\nGetting time: %d:%d:%d", curDateTime->hour, curDateTime->minute, curDateTime->second);
 
-    while(true)
-    {
-      C64 c64;
-      c64ptr = &c64;
-      c64ptr->sid_->speaker(&speaker);
-      c64ptr->io_->init_display((uint32_t*)mboot_hdr->framebuffer_addr, (uint32_t)mboot_hdr->framebuffer_width,
-			  (uint32_t)mboot_hdr->framebuffer_height, (uint32_t)mboot_hdr->framebuffer_pitch, 
-			  (uint8_t)mboot_hdr->framebuffer_bpp);
-      
-      c64ptr->io_->fat32(&fat32);
-      c64ptr->io_->serial(&serial);
-      c64ptr->io_->rtc(&rtc);
-      c64ptr->mon_->fat32(&fat32);
-      
-      c64.start();
-      //TODO: Memory leak possible here.  Calling destructor at the moment causes freeze
-    }
+    // accuracy over throughput for titles with mid-line raster effects
+    bool cycleExactVic = BootOption("vic=cycle");
+    if(cycleExactVic)
+        printf("\nVIC-II cycle exact engine........[OK]");
+
+    machineSetup.fat32 = &fat32;
+    machineSetup.serial = &serial;
+    machineSetup.rtc = &rtc;
+    machineSetup.speaker = &speaker;
+    machineSetup.audio = &audio;
+    machineSetup.bga = bga;
+    machineSetup.smp = &smp;
+    machineSetup.fbAddr = fbAddr;
+    machineSetup.fbWidth = fbWidth;
+    machineSetup.fbHeight = fbHeight;
+    machineSetup.fbPitch = fbPitch;
+    machineSetup.fbBpp = fbBpp;
+    machineSetup.cycleExactVic = cycleExactVic;
+    // "replay" runs REPLAY.INP from its snapshot instead of resuming
+    machineSetup.replay = BootOption("replay");
+    // "trace" records every instruction, CRASH.TRC gets it on a crash
+    machineSetup.trace = BootOption("trace");
+    // "reu=N" plugs 64KB << N of REU into each machine, 3 is a 1750
+    int reu = BootNumber("reu", 0);
+    machineSetup.reuBanks = reu >= 1 && reu <= 8 ? 1 << reu : 0;
+    if(machineSetup.reuBanks != 0)
+        printf("\nRAM Expansion Unit at $DF00......[OK] %dKB", machineSetup.reuBanks * 64);
+    // "native" runs the hot float and screen routines on the host,
+    // "native=N" also charges only N percent of the ROM cycles
+    int native = BootNumber("native", BootOption("native") ? 100 : -1);
+    machineSetup.natives = native >= 0;
+    machineSetup.nativeCost = native >= 0 ? native : 100;
+    if(machineSetup.natives)
+        printf("\nNative ROM routines..............[OK] %d trapped, %d%% cycles",
+               roms->install_natives(), machineSetup.nativeCost);
     
+    // "c64=N" runs N machines as tasks, the timer switches between them
+    numMachines = BootNumber("c64", 1);
+    if(numMachines < 1)
+        numMachines = 1;
+    if(numMachines > MAX_MACHINES)
+        numMachines = MAX_MACHINES;
+    if(numMachines == 1)
+        RunMachine(0);
+    
+    printf("\n%d machines, NUMLOCK switches...[OK]", numMachines);
+    // equal 4ms slices, a few raster frames' worth of emulation each
+    for(int i = 0; i < numMachines; i++)
+        taskManager.AddTask(new Task(&gdt, MachineTask, 4));
+    
+    // the first timer tick leaves this stack for good
+    while(true)
+        __asm__ volatile("hlt");
 }
-
-
@@ -25,6 +25,15 @@ char* itoa(int value, char* result, int base)
   return result;
 }
 
+// digits upper case hex digits of value, not terminated, returns the
+// end of them
+char* utoh(unsigned int value, char* result, int digits)
+{
+  for (int i = digits - 1; i >= 0; i--)
+	  *result++ = "0123456789ABCDEF"[(value >> (i * 4)) & 0xf];
+  return result;
+}
+
 unsigned int htoi (const char *ptr)
 {
 unsigned int value = 0;
@@ -111,46 +111,185 @@ char * strtok ( char *s, const char *delim)
   return word;
 }
 
-void memset( void *vd, char value, unsigned length )
+// Bulk kernels. Destinations are aligned first, so the string moves
+// and stores run on whole dwords and the SSE2 loops on aligned 16 byte
+// stores. SSE2 takes over from MEM_SSE2_MIN bytes once mem_select()
+// was told the processor has it enabled. XMM state is only saved on
+// task switches, so with interrupts off, where this may run inside a
+// handler, the SSE2 kernels are not used.
+
+#define MEM_SSE2_MIN 64
+
+static bool mem_sse2 = false;
+
+void mem_select(bool sse2)
+{
+  mem_sse2 = sse2;
+}
+
+static inline bool mem_use_sse2(size_t num)
+{
+  if(!mem_sse2 || num < MEM_SSE2_MIN)
+    return false;
+  uint32_t flags;
+  __asm__ volatile("pushfl; popl %0" : "=r" (flags));
+  return (flags & 0x200) != 0;
+}
+
+// bytes up to dword alignment of d, dwords, then the bytes left
+static void copy_forward_rep(uint8_t *d, const uint8_t *s, size_t num)
+{
+  size_t head = (0 - (uint32_t)d) & 3;
+  if(head > num)
+    head = num;
+  size_t dwords = (num - head) >> 2;
+  size_t tail = (num - head) & 3;
+  __asm__ volatile("cld; rep movsb; movl %3, %%ecx; rep movsl; movl %4, %%ecx; rep movsb"
+		   : "+D" (d), "+S" (s), "+c" (head) : "r" (dwords), "r" (tail) : "memory");
+}
+
+// from the last dword down, for overlapping moves to a higher address
+static void copy_backward_rep(uint8_t *d, const uint8_t *s, size_t num)
+{
+  size_t dwords = num >> 2;
+  size_t tail = num & 3;
+  d += num - 4;
+  s += num - 4;
+  __asm__ volatile("std; rep movsl; addl $3, %%edi; addl $3, %%esi; movl %3, %%ecx; rep movsb; cld"
+		   : "+D" (d), "+S" (s), "+c" (dwords) : "r" (tail) : "memory");
+}
+
+__attribute__((target("sse2")))
+static void copy_forward_sse2(uint8_t *d, const uint8_t *s, size_t num)
+{
+  size_t head = (0 - (uint32_t)d) & 15;
+  copy_forward_rep(d, s, head);
+  d += head;
+  s += head;
+  num -= head;
+  size_t blocks = num >> 6;
+  if(blocks)
+    __asm__ volatile("1: movdqu (%1), %%xmm0; movdqu 16(%1), %%xmm1\n"
+		     "movdqu 32(%1), %%xmm2; movdqu 48(%1), %%xmm3\n"
+		     "movdqa %%xmm0, (%0); movdqa %%xmm1, 16(%0)\n"
+		     "movdqa %%xmm2, 32(%0); movdqa %%xmm3, 48(%0)\n"
+		     "addl $64, %0; addl $64, %1; decl %2; jnz 1b"
+		     : "+r" (d), "+r" (s), "+r" (blocks) : 
+		     : "xmm0", "xmm1", "xmm2", "xmm3", "memory");
+  copy_forward_rep(d, s, num & 63);
+}
+
+static void fill_rep(uint8_t *d, uint32_t pattern, size_t num)
+{
+  size_t head = (0 - (uint32_t)d) & 3;
+  if(head > num)
+    head = num;
+  size_t dwords = (num - head) >> 2;
+  size_t tail = (num - head) & 3;
+  __asm__ volatile("cld; rep stosb; movl %2, %%ecx; rep stosl; movl %3, %%ecx; rep stosb"
+		   : "+D" (d), "+c" (head) : "r" (dwords), "r" (tail), "a" (pattern) : "memory");
+}
+
+__attribute__((target("sse2")))
+static void fill_sse2(uint8_t *d, uint32_t pattern, size_t num)
+{
+  size_t head = (0 - (uint32_t)d) & 15;
+  fill_rep(d, pattern, head);
+  d += head;
+  num -= head;
+  size_t blocks = num >> 6;
+  if(blocks)
+    __asm__ volatile("movd %2, %%xmm0; pshufd $0, %%xmm0, %%xmm0\n"
+		     "1: movdqa %%xmm0, (%0); movdqa %%xmm0, 16(%0)\n"
+		     "movdqa %%xmm0, 32(%0); movdqa %%xmm0, 48(%0)\n"
+		     "addl $64, %0; decl %1; jnz 1b"
+		     : "+r" (d), "+r" (blocks) : "r" (pattern) : "xmm0", "memory");
+  fill_rep(d, pattern, num & 63);
+}
+
+// equal dwords are skipped, the first difference is found bytewise
+static int compare_words(const uint8_t *a, const uint8_t *b, size_t num)
 {
-  char *d = (char *)vd;
-  while(length) {
-    *d = value;
-    length--;
-    d++;
+  while(num >= 4 && *(const uint32_t*)a == *(const uint32_t*)b)
+  {
+    a += 4;
+    b += 4;
+    num -= 4;
+  }
+  for(size_t i = 0; i < num; i++)
+  {
+    if (a[i] != b[i])
+      return a[i] < b[i] ? -1 : 1;
   }
+  return 0;
 }
 
-void* memcpy(uint16_t* destination, const uint16_t* source, size_t num)
+__attribute__((target("sse2")))
+static int compare_sse2(const uint8_t *a, const uint8_t *b, size_t num)
 {
-  int i;
-  uint16_t* d = destination;
-  const uint16_t* s = source;
-  for (i = 0; i < num; i++) {
-    d[i] = s[i];
+  while(num >= 16)
+  {
+    uint32_t equal;
+    __asm__ volatile("movdqu (%1), %%xmm0; movdqu (%2), %%xmm1\n"
+		     "pcmpeqb %%xmm1, %%xmm0; pmovmskb %%xmm0, %0"
+		     : "=r" (equal) : "r" (a), "r" (b) : "xmm0", "xmm1", "memory");
+    if(equal != 0xffff)
+      break;
+    a += 16;
+    b += 16;
+    num -= 16;
   }
+  return compare_words(a, b, num);
+}
+
+void memset( void *vd, char value, unsigned length )
+{
+  uint32_t pattern = (uint8_t)value * 0x01010101;
+  if(mem_use_sse2(length))
+    fill_sse2((uint8_t*)vd, pattern, length);
+  else
+    fill_rep((uint8_t*)vd, pattern, length);
+}
+
+// num counts halfwords
+void* memcpy(uint16_t* destination, const uint16_t* source, size_t num)
+{
+  memcpy((void*)destination, (const void*)source, num * 2);
   return destination;
 }
 
 void* memcpy(uint8_t* destination, const uint8_t* source, size_t num)
 {
-  int i;
-  uint8_t* d = destination;
-  const uint8_t* s = source;
-  for (i = 0; i < num; i++) {
-    d[i] = s[i];
-  }
+  memcpy((void*)destination, (const void*)source, num);
   return destination;
 }
 
-void memcpy(void *dest, const void *source, size_t num) {
-  int i = 0;
-  // casting pointers
-  char *dest8 = (char *)dest;
-  char *source8 = (char *)source;
-  for (i = 0; i < num; i++) {
-    dest8[i] = source8[i];
-  }
+void memcpy(void *dest, const void *source, size_t num)
+{
+  if(mem_use_sse2(num))
+    copy_forward_sse2((uint8_t*)dest, (const uint8_t*)source, num);
+  else
+    copy_forward_rep((uint8_t*)dest, (const uint8_t*)source, num);
+}
+
+// A forward copy is safe unless dest starts inside source, only the
+// backward one is left to the string moves
+void* memmove(void *dest, const void *source, size_t num)
+{
+  uint8_t *d = (uint8_t*)dest;
+  const uint8_t *s = (const uint8_t*)source;
+  if(d <= s || d >= s + num)
+    memcpy(dest, source, num);
+  else
+    copy_backward_rep(d, s, num);
+  return dest;
+}
+
+int memcmp(const void *a, const void *b, size_t num)
+{
+  if(mem_use_sse2(num))
+    return compare_sse2((const uint8_t*)a, (const uint8_t*)b, num);
+  return compare_words((const uint8_t*)a, (const uint8_t*)b, num);
 }
 
 char tolower(char ch)
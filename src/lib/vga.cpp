@@ -25,30 +25,40 @@ void vga_init(uint32_t* videoMem, uint32_t width, uint32_t height, uint32_t pitc
     vga_mode_bpp = bpp;
     vga_pixel_width = bpp/8;
     
-    //vga_textRows = height/16;
-    //vga_textCols = pitch/8;
-       
-    /*vga_textscreen = new uint8_t*[vga_textCols];
-    for(int i = 0; i < vga_textCols; i++) {
-	vga_textscreen[i] = new uint8_t[vga_textRows];
-    }*/
+    vga_textRows = height/VGA_GLYPH_HEIGHT < VGA_MAX_ROWS ? height/VGA_GLYPH_HEIGHT : VGA_MAX_ROWS;
+    vga_textCols = width/8 < VGA_MAX_COLS ? width/8 : VGA_MAX_COLS;
     
     vga_set_color_palette();
 }
 
+// Fills n scanlines from y with color, a dword at a time
+static void vga_fill_rows(int y, int n, uint8_t color)
+{
+    uint32_t c = vga_color_palette[color];
+    uint32_t pattern = c | (c << 16);
+    for(int i = 0; i < n; i++)
+    {
+        uint32_t* dst = (uint32_t*)(vga_framebuffer + (y + i) * vga_pitch);
+        uint32_t dwords = vga_width * vga_pixel_width / 4;
+        __asm__ volatile("cld; rep stosl" : "+D" (dst), "+c" (dwords) : "a" (pattern) : "memory");
+    }
+}
+
 void vga_clear()
 {
-  int x,y;
-  for(x=0; x<vga_width;x++)
-    for(y=0; y<vga_height;y++)
-      vga_put_pixel(x,y,vga_backColor);
+  vga_fill_rows(0, vga_height, vga_backColor);
     
   vga_cursorRow=0;
   vga_cursorCol=0;
   
-  for(int c=0;c<vga_textCols;c++)
-    for(int r=0;r<vga_textRows;r++)
-      vga_textscreen[c][r] = ' ';
+  memset(vga_textscreen, ' ', sizeof(vga_textscreen));
+  memset(vga_drawn, ' ', sizeof(vga_drawn));
+}
+
+// The framebuffer was drawn over, the next restore repaints every cell
+void vga_invalidate()
+{
+  memset(vga_drawn, 0, sizeof(vga_drawn));
 }
 
 void vga_put_pixel(int x, int y, uint8_t color)
@@ -111,6 +121,13 @@ void vga_draw_line(int x1, int y1, int x2, int y2, uint8_t color)
   }
 }
 
+static void vga_build_glyph_rows()
+{
+  for(int b=0;b<256;b++)
+    for(int i=0;i<8;i++)
+      vga_glyph_rows[b][i] = vga_color_palette[(b & (0x80 >> i)) ? vga_foreColor : vga_backColor];
+}
+
 void vga_set_color_palette()
 {
   vga_color_palette[0] = ((0x00>>3)<<11) | ((0x00>>2)<<5) | (0x00>>3);
@@ -129,6 +146,7 @@ void vga_set_color_palette()
   vga_color_palette[13] = ((0x9a>>3)<<11) | ((0xd2>>2)<<5) | (0x84>>3);
   vga_color_palette[14] = ((0x6c>>3)<<11) | ((0x5e>>2)<<5) | (0xb5>>3);
   vga_color_palette[15] = ((0x95>>3)<<11) | ((0x95>>2)<<5) | (0x95>>3);
+  vga_build_glyph_rows();
 }
 
 void vga_cursor_enable()
@@ -149,34 +167,34 @@ void vga_cursor_update()
   }
 }
 
+// Moves the framebuffer and the cells up a text row and clears the
+// last one, the glyphs are not drawn again
 void vga_scroll()
 {
   if(vga_cursorRow >= vga_textRows)
   {
-    vga_cursorRow=0;
-    vga_cursorCol=0;
+    uint32_t line = VGA_GLYPH_HEIGHT * vga_pitch;
+    memmove(vga_framebuffer, vga_framebuffer + line, (vga_textRows - 1) * line);
+    memmove(vga_textscreen[0], vga_textscreen[1], (vga_textRows - 1) * VGA_MAX_COLS);
+    memmove(vga_drawn[0], vga_drawn[1], (vga_textRows - 1) * VGA_MAX_COLS);
     
-    for (int r=0;r<vga_textRows;r++)
-      for(int c=0;c<vga_textCols;c++)
-	vga_textscreen[c][r] = vga_textscreen[c][r+1];
-
-    for (int c=0;c<vga_textCols;c++)
-      vga_textscreen[c][vga_textRows-1] = ' ';
-
-    vga_restore_textscreen();
+    vga_fill_rows((vga_textRows-1) * VGA_GLYPH_HEIGHT, VGA_GLYPH_HEIGHT, vga_backColor);
+    memset(vga_textscreen[vga_textRows-1], ' ', VGA_MAX_COLS);
+    memset(vga_drawn[vga_textRows-1], ' ', VGA_MAX_COLS);
     
     // The cursor should now be on the last line.
     vga_cursorRow = vga_textRows-1;
-    
+    vga_cursorCol = 0;
   }
 }
 
+// Redraws the cells that do not show their glyph
 void vga_restore_textscreen()
 {
   for (int r=0;r<vga_textRows;r++)
   {
     for(int c=0;c<vga_textCols;c++)
-      putc_col_row(c,r, vga_textscreen[c][r]);
+      putc_col_row(c,r, vga_textscreen[r][c]);
   }
 }
 
@@ -189,23 +207,26 @@ void puts(char* string)
   }
 }
 
+// Draws glyph c in a cell unless it already shows it, a scanline
+// of the glyph is four dword stores from the glyph row table
 void putc_col_row(int8_t col, uint8_t row, uint8_t c)
 {
-  int y=row*16;
-  int x=col*8;
-    
-  for(int z=0;z<16;z++)
+  if(col < 0 || col >= vga_textCols || row >= vga_textRows)
+    return;
+  if(vga_drawn[row][col] == c)
+    return;
+  vga_drawn[row][col] = c;
+  
+  uint8_t* dst = vga_framebuffer + row * VGA_GLYPH_HEIGHT * vga_pitch + col * 8 * vga_pixel_width;
+  const unsigned char* glyph = &g_8x16_font[VGA_GLYPH_HEIGHT*c];
+  for(int z=0;z<VGA_GLYPH_HEIGHT;z++, dst += vga_pitch)
   {
-    uint8_t fdata = g_8x16_font[16*c+z];
-    
-    for (int bit = 8; bit > 0; bit--) {
-      if ((fdata & (1 << bit)))
-	vga_put_pixel(x++, y, vga_foreColor);
-      else
-	vga_put_pixel(x++, y, vga_backColor);
-    }
-    x=col*8;
-    y++;
+    const uint32_t* pixels = (const uint32_t*)vga_glyph_rows[glyph[z]];
+    uint32_t* d = (uint32_t*)dst;
+    d[0] = pixels[0];
+    d[1] = pixels[1];
+    d[2] = pixels[2];
+    d[3] = pixels[3];
   }
 }
 
@@ -220,7 +241,7 @@ void putc(uint8_t c)
 	if(vga_cursorOn == 1) putc_col_row(vga_cursorCol, vga_cursorRow, ' ');
 	vga_cursorCol--;
 	putc_col_row(vga_cursorCol,vga_cursorRow,' ');
-	vga_textscreen[vga_cursorCol][vga_cursorRow] = ' ';
+	vga_textscreen[vga_cursorRow][vga_cursorCol] = ' ';
 	vga_cursor_update();
 	return;
       }
@@ -230,7 +251,7 @@ void putc(uint8_t c)
 	vga_cursorCol = vga_textCols-1;
 	vga_cursorRow--;
 	putc_col_row(vga_cursorCol,vga_cursorRow,' ');
-	vga_textscreen[vga_cursorCol][vga_cursorRow] = ' ';
+	vga_textscreen[vga_cursorRow][vga_cursorCol] = ' ';
 	vga_cursor_update();
 	return;
       }
@@ -248,7 +269,7 @@ void putc(uint8_t c)
       break;
     default:
       putc_col_row(vga_cursorCol,vga_cursorRow,c);
-      vga_textscreen[vga_cursorCol][vga_cursorRow] = c;
+      vga_textscreen[vga_cursorRow][vga_cursorCol] = c;
       vga_cursorCol++;
       break;
   }
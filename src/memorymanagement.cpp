@@ -1,5 +1,6 @@
  
 #include <memorymanagement.h>
+#include <lib/stdio.h>
 
 using namespace myos;
 
@@ -10,6 +11,36 @@ MemoryManager::MemoryManager(size_t start, size_t size)
 {
     activeMemoryManager = this;
     
+    // a sixteenth of the heap goes to the slab pages
+    slabStart = (start + slabPageSize - 1) & ~(slabPageSize - 1);
+    size_t slabSize = (size / 16) & ~(slabPageSize - 1);
+    if(slabSize > slabMaxPages * slabPageSize)
+        slabSize = slabMaxPages * slabPageSize;
+    if(slabStart - start + slabSize > size)
+        slabSize = 0;
+    slabNext = slabStart;
+    slabEnd = slabStart + slabSize;
+    for(int i = 0; i < slabClasses; i++)
+        freeBlocks[i] = 0;
+    
+    usedBytes = 0;
+    peakBytes = 0;
+    allocations = 0;
+    failures = 0;
+    traceCount = 0;
+    tracing = false;
+    
+    if(slabSize > 0)
+    {
+        size -= slabEnd - start;
+        start = slabEnd;
+    }
+    
+    // chunk sizes are multiples of 16 from a 16 byte aligned start
+    size_t aligned = (start + 15) & ~15;
+    size = size > aligned - start ? (size - (aligned - start)) & ~15 : 0;
+    start = aligned;
+    
     if(size < sizeof(MemoryChunk))
     {
         first = 0;
@@ -31,9 +62,184 @@ MemoryManager::~MemoryManager()
         activeMemoryManager = 0;
 }
         
-void* MemoryManager::malloc(size_t size)
+// smallest class holding size bytes, -1 for large blocks
+int MemoryManager::SizeClass(size_t size)
+{
+    if(size > slabMaxSize)
+        return -1;
+    
+    int sizeClass = 0;
+    while(((size_t)16 << sizeClass) < size)
+        sizeClass++;
+    return sizeClass;
+}
+
+void* MemoryManager::SlabAlloc(int sizeClass)
+{
+    if(freeBlocks[sizeClass] == 0)
+    {
+        if(slabNext >= slabEnd)
+            return 0;
+        
+        // carve a fresh page into blocks of this class
+        size_t blockSize = (size_t)16 << sizeClass;
+        pageClass[(slabNext - slabStart) / slabPageSize] = sizeClass;
+        for(size_t offset = slabPageSize; offset >= blockSize; offset -= blockSize)
+        {
+            SlabBlock* block = (SlabBlock*)(slabNext + offset - blockSize);
+            block->next = freeBlocks[sizeClass];
+            freeBlocks[sizeClass] = block;
+        }
+        slabNext += slabPageSize;
+    }
+    
+    SlabBlock* block = freeBlocks[sizeClass];
+    freeBlocks[sizeClass] = block->next;
+    return (void*)block;
+}
+
+// Tasks and interrupt handlers share the heap, the lists and the trace
+// ring only change with interrupts off. The hosted build is a single
+// user process, it may not touch the interrupt flag.
+void* MemoryManager::malloc(size_t size, void* caller)
+{
+#ifndef OS64_HOSTED
+    uint32_t flags;
+    __asm__ volatile("pushf; pop %0; cli" : "=r" (flags));
+#endif
+    void* result = UnlockedMalloc(size);
+    if(caller != 0)
+        TraceEvent(caller, result, size);
+#ifndef OS64_HOSTED
+    __asm__ volatile("push %0; popf" : : "r" (flags));
+#endif
+    return result;
+}
+
+void MemoryManager::free(void* ptr, void* caller)
+{
+#ifndef OS64_HOSTED
+    uint32_t flags;
+    __asm__ volatile("pushf; pop %0; cli" : "=r" (flags));
+#endif
+    if(caller != 0)
+        TraceEvent(caller, ptr, 0);
+    UnlockedFree(ptr);
+#ifndef OS64_HOSTED
+    __asm__ volatile("push %0; popf" : : "r" (flags));
+#endif
+}
+
+void* MemoryManager::UnlockedMalloc(size_t size)
+{
+    void* result = 0;
+    size_t taken = 0;
+    
+    int sizeClass = SizeClass(size);
+    if(sizeClass >= 0)
+    {
+        result = SlabAlloc(sizeClass);
+        taken = (size_t)16 << sizeClass;
+    }
+    
+    // large block, or the slab pages ran out
+    if(result == 0)
+    {
+        result = ChunkAlloc(size);
+        if(result != 0)
+            taken = ((MemoryChunk*)((size_t)result - sizeof(MemoryChunk)))->size;
+    }
+    
+    if(result == 0)
+    {
+        failures++;
+        return 0;
+    }
+    
+    allocations++;
+    usedBytes += taken;
+    if(usedBytes > peakBytes)
+        peakBytes = usedBytes;
+    return result;
+}
+
+void MemoryManager::UnlockedFree(void* ptr)
+{
+    if(ptr == 0)
+        return;
+    
+    size_t address = (size_t)ptr;
+    if(address >= slabStart && address < slabNext)
+    {
+        int sizeClass = pageClass[(address - slabStart) / slabPageSize];
+        SlabBlock* block = (SlabBlock*)ptr;
+        block->next = freeBlocks[sizeClass];
+        freeBlocks[sizeClass] = block;
+        usedBytes -= (size_t)16 << sizeClass;
+        return;
+    }
+    
+    usedBytes -= ((MemoryChunk*)(address - sizeof(MemoryChunk)))->size;
+    ChunkFree(ptr);
+}
+
+void MemoryManager::GetStats(MemoryStats* stats)
+{
+    stats->used = usedBytes;
+    stats->peak = peakBytes;
+    stats->chunks = 0;
+    stats->freeBytes = 0;
+    stats->largestFree = 0;
+    for(MemoryChunk* chunk = first; chunk != 0; chunk = chunk->next)
+    {
+        stats->chunks++;
+        if(chunk->allocated)
+            continue;
+        stats->freeBytes += chunk->size;
+        if(chunk->size > stats->largestFree)
+            stats->largestFree = chunk->size;
+    }
+    
+    // percent without overflowing 32 bits on large heaps
+    stats->fragmentation = 0;
+    if(stats->freeBytes >= 100)
+        stats->fragmentation = (stats->freeBytes - stats->largestFree) / (stats->freeBytes / 100);
+    
+    stats->slabPages = (slabNext - slabStart) / slabPageSize;
+    stats->slabPagesTotal = (slabEnd - slabStart) / slabPageSize;
+    stats->allocations = allocations;
+    stats->failures = failures;
+}
+
+void MemoryManager::Trace(bool on)
+{
+    tracing = on;
+    traceCount = 0;
+}
+
+void MemoryManager::TraceEvent(void* caller, void* ptr, size_t size)
+{
+    if(!tracing)
+        return;
+    
+    MemoryTraceEntry* entry = &trace[traceCount % traceSize];
+    entry->caller = caller;
+    entry->ptr = ptr;
+    entry->size = size;
+    traceCount++;
+}
+
+MemoryTraceEntry* MemoryManager::GetTraceEntry(int age)
+{
+    if(age < 0 || age >= traceSize || (uint32_t)age >= traceCount)
+        return 0;
+    return &trace[(traceCount - 1 - age) % traceSize];
+}
+
+void* MemoryManager::ChunkAlloc(size_t size)
 {
     MemoryChunk *result = 0;
+    size = (size + 15) & ~15;
     
     for(MemoryChunk* chunk = first; chunk != 0 && result == 0; chunk = chunk->next)
         if(chunk->size > size && !chunk->allocated)
@@ -42,7 +248,7 @@ void* MemoryManager::malloc(size_t size)
     if(result == 0)
         return 0;
     
-    if(result->size >= size + sizeof(MemoryChunk) + 1)
+    if(result->size >= size + sizeof(MemoryChunk) + 16)
     {
         MemoryChunk* temp = (MemoryChunk*)((size_t)result + sizeof(MemoryChunk) + size);
         
@@ -61,7 +267,7 @@ void* MemoryManager::malloc(size_t size)
     return (void*)(((size_t)result) + sizeof(MemoryChunk));
 }
 
-void MemoryManager::free(void* ptr)
+void MemoryManager::ChunkFree(void* ptr)
 {
     MemoryChunk* chunk = (MemoryChunk*)((size_t)ptr - sizeof(MemoryChunk));
     
@@ -88,20 +294,91 @@ void MemoryManager::free(void* ptr)
 }
 
 
+MemoryArena::MemoryArena(size_t blockSize)
+{
+    blocks = 0;
+    this->blockSize = blockSize;
+}
 
+MemoryArena::~MemoryArena()
+{
+    Release();
+}
 
-void* operator new(unsigned size)
+void* MemoryArena::Allocate(size_t size)
+{
+    // keep allocations 16 byte aligned for SSE
+    size = (size + 15) & ~15;
+    
+    MemoryArenaBlock* block = blocks;
+    if(block == 0 || block->size - block->used < size)
+    {
+        if(MemoryManager::activeMemoryManager == 0)
+            return 0;
+        
+        size_t needed = size > blockSize ? size : blockSize;
+        block = (MemoryArenaBlock*)MemoryManager::activeMemoryManager->malloc(sizeof(MemoryArenaBlock) + 15 + needed);
+        if(block == 0)
+            return 0;
+        
+        block->size = needed;
+        block->used = 0;
+        if(blocks != 0 && needed > blockSize)
+        {
+            // oversized, keep filling the current block afterwards
+            block->next = blocks->next;
+            blocks->next = block;
+        }
+        else
+        {
+            block->next = blocks;
+            blocks = block;
+        }
+    }
+    
+    size_t data = ((size_t)block + sizeof(MemoryArenaBlock) + 15) & ~15;
+    void* result = (void*)(data + block->used);
+    block->used += size;
+    return result;
+}
+
+void MemoryArena::Release()
+{
+    while(blocks != 0)
+    {
+        MemoryArenaBlock* next = blocks->next;
+        MemoryManager::activeMemoryManager->free(blocks);
+        blocks = next;
+    }
+}
+
+
+// allocation through new, traced and reported when it fails
+static void* TracedNew(unsigned size, void* caller)
 {
     if(myos::MemoryManager::activeMemoryManager == 0)
         return 0;
-    return myos::MemoryManager::activeMemoryManager->malloc(size);
+    void* ptr = myos::MemoryManager::activeMemoryManager->malloc(size, caller);
+    if(ptr == 0)
+        printf("\nout of memory: %u bytes for %08X", size, (uint32_t)caller);
+    return ptr;
 }
 
-void* operator new[](unsigned size)
+static void TracedDelete(void* ptr, void* caller)
 {
     if(myos::MemoryManager::activeMemoryManager == 0)
-        return 0;
-    return myos::MemoryManager::activeMemoryManager->malloc(size);
+        return;
+    myos::MemoryManager::activeMemoryManager->free(ptr, caller);
+}
+
+void* operator new(unsigned size)
+{
+    return TracedNew(size, __builtin_return_address(0));
+}
+
+void* operator new[](unsigned size)
+{
+    return TracedNew(size, __builtin_return_address(0));
 }
 
 void* operator new(unsigned size, void* ptr)
@@ -114,14 +391,22 @@ void* operator new[](unsigned size, void* ptr)
     return ptr;
 }
 
+void* operator new(unsigned size, myos::MemoryArena* arena)
+{
+    return arena->Allocate(size);
+}
+
+void* operator new[](unsigned size, myos::MemoryArena* arena)
+{
+    return arena->Allocate(size);
+}
+
 void operator delete(void* ptr)
 {
-    if(myos::MemoryManager::activeMemoryManager != 0)
-        myos::MemoryManager::activeMemoryManager->free(ptr);
+    TracedDelete(ptr, __builtin_return_address(0));
 }
 
 void operator delete[](void* ptr)
 {
-    if(myos::MemoryManager::activeMemoryManager != 0)
-        myos::MemoryManager::activeMemoryManager->free(ptr);
+    TracedDelete(ptr, __builtin_return_address(0));
 }
\ No newline at end of file
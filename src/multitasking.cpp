@@ -1,12 +1,18 @@
 
 #include <multitasking.h>
+#include <hardwarecommunication/processor.h>
 
 using namespace myos;
+using namespace myos::hardwarecommunication;
 
+extern uint32_t current_milli;
 
-Task::Task(GlobalDescriptorTable *gdt, void entrypoint())
+volatile int TaskManager::preemptionLocks = 0;
+
+
+Task::Task(GlobalDescriptorTable *gdt, void entrypoint(), uint32_t timeslice, uint8_t priority)
 {
-    cpustate = (CPUState*)(stack + 4096 - sizeof(CPUState));
+    cpustate = (CPUState*)(stack + TASK_STACK_SIZE - sizeof(CPUState));
     
     cpustate -> eax = 0;
     cpustate -> ebx = 0;
@@ -32,6 +38,15 @@ Task::Task(GlobalDescriptorTable *gdt, void entrypoint())
     // cpustate -> ss = ;
     cpustate -> eflags = 0x202;
     
+    this->timeslice = timeslice ? timeslice : 1;
+    this->priority = priority;
+    sleeping = false;
+    wakeup = 0;
+    hasDeadline = false;
+    deadline = 0;
+    // starts from a valid register image, FXRSTOR faults on garbage
+    if(Processor::SSEEnabled())
+        __asm__ volatile("fxsave (%0)" : : "r" (fpustate) : "memory");
 }
 
 Task::~Task()
@@ -43,6 +58,10 @@ TaskManager::TaskManager()
 {
     numTasks = 0;
     currentTask = -1;
+    sliceEnd = 0;
+    idleState = 0;
+    waiting = false;
+    waitWakeup = 0;
 }
 
 TaskManager::~TaskManager()
@@ -57,17 +76,163 @@ bool TaskManager::AddTask(Task* task)
     return true;
 }
 
+bool TaskManager::Runnable(int task)
+{
+    Task* t = tasks[task];
+    if(t->sleeping && (int32_t)(current_milli - t->wakeup) >= 0)
+        t->sleeping = false;
+    return !t->sleeping;
+}
+
+// true if task a should run before task b
+bool TaskManager::Before(int a, int b)
+{
+    Task* ta = tasks[a];
+    Task* tb = tasks[b];
+    if(ta->priority != tb->priority)
+        return ta->priority < tb->priority;
+    if(ta->hasDeadline != tb->hasDeadline)
+        return ta->hasDeadline;
+    return ta->hasDeadline && (int32_t)(ta->deadline - tb->deadline) < 0;
+}
+
+// best runnable task, scanning from the one after the current so that
+// equals take turns, -1 if all sleep
+int TaskManager::Pick()
+{
+    int best = -1;
+    for(int i = 1; i <= numTasks; i++)
+    {
+        int task = (currentTask + i) % numTasks;
+        if(task < 0)
+            task += numTasks;
+        if(Runnable(task) && (best < 0 || Before(task, best)))
+            best = task;
+    }
+    return best;
+}
+
+CPUState* TaskManager::Switch(CPUState* cpustate, int next)
+{
+    if(currentTask >= 0)
+    {
+        tasks[currentTask]->cpustate = cpustate;
+        if(Processor::SSEEnabled())
+            __asm__ volatile("fxsave (%0)" : : "r" (tasks[currentTask]->fpustate) : "memory");
+    }
+    else
+        idleState = cpustate;
+    
+    currentTask = next;
+    if(next < 0)
+        return idleState;
+    sliceEnd = current_milli + tasks[next]->timeslice;
+    if(Processor::SSEEnabled())
+        __asm__ volatile("fxrstor (%0)" : : "r" (tasks[next]->fpustate) : "memory");
+    return tasks[next]->cpustate;
+}
+
+// timer tick, or the interrupt a one-shot timer armed
 CPUState* TaskManager::Schedule(CPUState* cpustate)
 {
-    if(numTasks <= 0)
+    if(numTasks <= 0 || preemptionLocks > 0)
         return cpustate;
     
-    if(currentTask >= 0)
-        tasks[currentTask]->cpustate = cpustate;
+    int next = Pick();
+    if(currentTask >= 0 && Runnable(currentTask))
+    {
+        // the slice runs out, or a better task woke up
+        bool turn = (int32_t)(current_milli - sliceEnd) < 0;
+        if(turn && (next < 0 || next == currentTask || !Before(next, currentTask)))
+            return cpustate;
+        if(next < 0 || Before(currentTask, next))
+            next = currentTask;
+    }
+    if(next == currentTask && currentTask >= 0)
+    {
+        sliceEnd = current_milli + tasks[currentTask]->timeslice;
+        return cpustate;
+    }
+    return Switch(cpustate, next);
+}
+
+// gives up the rest of the slice, an equal task goes next
+CPUState* TaskManager::Yield(CPUState* cpustate)
+{
+    if(numTasks <= 0 || preemptionLocks > 0 || currentTask < 0)
+        return cpustate;
+    int next = Pick();
+    if(next == currentTask)
+    {
+        sliceEnd = current_milli + tasks[currentTask]->timeslice;
+        return cpustate;
+    }
+    return Switch(cpustate, next);
+}
+
+// Marks the running task asleep until wakeup, with the deadline its
+// work is due by after that. The caller then yields. False when there
+// is no task to put to sleep, e.g. before the first switch, the timer
+// is still told to interrupt the caller's wait at wakeup.
+bool TaskManager::SleepUntil(uint32_t wakeup, bool hasDeadline, uint32_t deadline)
+{
+    if(numTasks <= 0 || preemptionLocks > 0 || currentTask < 0)
+    {
+        waiting = true;
+        waitWakeup = wakeup;
+        return false;
+    }
+    Task* t = tasks[currentTask];
+    t->wakeup = wakeup;
+    t->sleeping = (int32_t)(current_milli - wakeup) < 0;
+    t->hasDeadline = hasDeadline;
+    t->deadline = deadline;
+    return true;
+}
+
+// Earliest current_milli something is due at, latest if nothing is
+// before: a sleeping task waking up, the running slice ending while
+// another task could run, or the wakeup of a caller waiting itself.
+uint32_t TaskManager::NextEvent(uint32_t latest)
+{
+    uint32_t next = latest;
+    if(waiting && (int32_t)(current_milli - waitWakeup) >= 0)
+        waiting = false;
+    if(waiting && (int32_t)(waitWakeup - next) < 0)
+        next = waitWakeup;
     
-    if(++currentTask >= numTasks)
-        currentTask %= numTasks;
-    return tasks[currentTask]->cpustate;
+    bool others = false;
+    for(int i = 0; i < numTasks; i++)
+    {
+        if(!Runnable(i))
+        {
+            if((int32_t)(tasks[i]->wakeup - next) < 0)
+                next = tasks[i]->wakeup;
+        }
+        else if(i != currentTask)
+            others = true;
+    }
+    // before the first switch a runnable task is due right away
+    if(others && currentTask < 0)
+        next = current_milli;
+    else if(others && (int32_t)(sliceEnd - next) < 0)
+        next = sliceEnd;
+    return next;
+}
+
+// nests, every DisablePreemption() needs its EnablePreemption()
+void TaskManager::DisablePreemption()
+{
+    __asm__ volatile("" : : : "memory");
+    preemptionLocks++;
+    __asm__ volatile("" : : : "memory");
+}
+
+void TaskManager::EnablePreemption()
+{
+    __asm__ volatile("" : : : "memory");
+    preemptionLocks--;
+    __asm__ volatile("" : : : "memory");
 }
 
     
\ No newline at end of file
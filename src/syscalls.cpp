@@ -4,9 +4,11 @@
 using namespace myos;
 using namespace myos::hardwarecommunication;
  
-SyscallHandler::SyscallHandler(InterruptManager* interruptManager, uint8_t InterruptNumber)
+SyscallHandler::SyscallHandler(InterruptManager* interruptManager, uint8_t InterruptNumber,
+                               TaskManager* taskManager)
 :    InterruptHandler(interruptManager, InterruptNumber  + interruptManager->HardwareInterruptOffset())
 {
+    this->taskManager = taskManager;
 }
 
 SyscallHandler::~SyscallHandler()
@@ -21,10 +23,23 @@ uint32_t SyscallHandler::HandleInterrupt(uint32_t esp)
 
     switch(cpu->eax)
     {
-        case 4:
+        case SYSCALL_PRINT:
             printf((char*)cpu->ebx);
             break;
             
+        case SYSCALL_YIELD:
+            return (uint32_t)taskManager->Yield(cpu);
+            
+        case SYSCALL_SLEEP_UNTIL:
+            // eax tells the caller whether it slept or has to wait itself
+            if(!taskManager->SleepUntil(cpu->ebx, cpu->ecx != 0, cpu->edx))
+            {
+                cpu->eax = 0;
+                break;
+            }
+            cpu->eax = 1;
+            return (uint32_t)taskManager->Yield(cpu);
+            
         default:
             break;
     }
@@ -33,3 +48,24 @@ uint32_t SyscallHandler::HandleInterrupt(uint32_t esp)
     return esp;
 }
 
+void SyscallHandler::Yield()
+{
+    __asm__ volatile("int $0x80" : : "a" (SYSCALL_YIELD) : "memory");
+}
+
+// False if nothing slept, e.g. no tasks run yet, the caller waits itself
+bool SyscallHandler::SleepUntil(uint32_t wakeup)
+{
+    uint32_t slept;
+    __asm__ volatile("int $0x80" : "=a" (slept) : "a" (SYSCALL_SLEEP_UNTIL), "b" (wakeup), "c" (0), "d" (0) : "memory");
+    return slept != 0;
+}
+
+// Sleeps, then runs with the deadline in the earliest deadline order
+bool SyscallHandler::SleepUntil(uint32_t wakeup, uint32_t deadline)
+{
+    uint32_t slept;
+    __asm__ volatile("int $0x80" : "=a" (slept) : "a" (SYSCALL_SLEEP_UNTIL), "b" (wakeup), "c" (1), "d" (deadline) : "memory");
+    return slept != 0;
+}
+